@@ -0,0 +1,272 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <array>
+#include <cmath>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include "spline.hpp"
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "nn_index.h"
+#include "search_schedule.h"
+#include "estim_options.h"
+#include "contr_grid.h"
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion autotune.cpp -o autotune
+//
+// Sweeps contracting-grid schedules and warm-start settings on a sample of
+// events and writes the fastest configuration whose positions stay within
+// a given distance of a high-effort reference for a given fraction of the
+// events. The sample is taken from the acquired list-mode file by default;
+// the configurations that meet the budget are then checked, fastest first,
+// on as many held-out events of the file, and the first one that also
+// meets it there is written. The output file is loaded by the estimator
+// with --config=FILE.
+//
+// Without --budget, the budget is relative to the default schedule: the
+// events must stay within 0.10 mm of the reference for at least the
+// fraction that the default schedule reaches, on the sample and on the
+// held-out events. The default schedule itself always qualifies, so a
+// configuration is always written. An absolute budget such as 99.9%
+// within 0.10 mm is met by no schedule on the acquired file.
+//
+// Synthetic events (--synthetic) have the noise of the model but neither
+// scatter nor pile-up, so a budget met on them may not hold on acquired
+// data.
+//
+// Usage: ./autotune [--events=FILE | --synthetic] [--num-events=N] [--budget=MM,PERCENT] [--output=FILE]
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+struct tune_result_t {
+  estim_options_t estim_options;
+  double events_per_sec;
+  float within_budget;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+tune_result_t evaluate_estim_options(const estim_options_t & estim_options, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, const calibr_funct_t & calibr_funct, const nn_index_t & nn_index, const prefilter_t & prefilter, const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & ref_estim_event, float budget_dist);
+void write_tune_result(const tune_result_t & tune_result, float budget_dist, float budget_percent, const char *filename);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char **argv) {
+  const estim_mode_t modes[2] = {ESTIM_MODE_CONTR_GRID, ESTIM_MODE_NN_START};
+  const float refine_factors[2] = {1.50f, 2.00f};
+  const float first_factors[2] = {2.00f, 3.00f};
+  const int first_sizes[4] = {4, 6, 8, 12};
+  const int refine_sizes[3] = {3, 4, 6};
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> ref_estim_event, held_out_ref_estim_event;
+  std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data, held_out_PMT_data;
+  std::vector<tune_result_t> candidates;
+  std::string events_filename, output_filename, arg;
+  unsigned int num_events, num_refine, extra;
+  tune_result_t best_result, tune_result, held_out_result;
+  estim_options_t estim_options;
+  float budget_dist, budget_percent, held_out_percent, max_within;
+  calibr_funct_t calibr_funct;
+  calibr_data_t calibr_data;
+  float final_step, values[2];
+  int i_mode, i_first, i_refine;
+  int j_first, j_refine;
+  prefilter_t prefilter;
+  nn_index_t nn_index;
+  bool synthetic;
+  std::size_t n;
+  bool found;
+  int i;
+  
+  events_filename = "../data/ResPhantom022516-0mm_00.dat";
+  synthetic = false;
+  num_events = 2000;
+  budget_dist = 0.10f;
+  budget_percent = -1.0f;
+  output_filename = "../data/estim_options_CPU.cfg";
+  for(i = 1; i < argc; ++i) {
+    arg = argv[i];
+    if(arg.compare(0, 9, "--events=") == 0) {
+      events_filename = arg.substr(9);
+    } else if(arg == "--synthetic") {
+      synthetic = true;
+    } else if(arg.compare(0, 13, "--num-events=") == 0) {
+      num_events = parse_unsigned(arg.substr(13));
+    } else if(arg.compare(0, 9, "--budget=") == 0) {
+      parse_float_list(values, 2, arg.substr(9));
+      budget_dist = values[0];
+      budget_percent = values[1];
+    } else if(arg.compare(0, 9, "--output=") == 0) {
+      output_filename = arg.substr(9);
+    } else {
+      throw std::runtime_error("Unknown option " + arg);
+    }
+  }
+  calibr_data = get_calibration_data("../data/camera0_79x79_1.5mm_tc99m_mean", "../data/camera0_thresh.dat", "../data/camera0_79x79_1.5mm_tc99m_gains");
+  calibr_funct = get_calibration_funct(calibr_data);
+  // The held-out events follow the tuning sample in the file, or are drawn
+  // with another seed.
+  if(synthetic) {
+    std::cout << "Warning: synthetic events have no scatter or pile-up, the budget may not hold on acquired data." << std::endl;
+    PMT_data = get_synthetic_PMT_data(calibr_funct, num_events, 12345);
+    held_out_PMT_data = get_synthetic_PMT_data(calibr_funct, num_events, 54321);
+  } else {
+    PMT_data = get_PMT_data(events_filename.c_str(), 0, 2 * std::size_t(num_events));
+    n = std::min(std::size_t(num_events), (PMT_data.size() + 1) / 2);
+    held_out_PMT_data.assign(PMT_data.begin() + std::ptrdiff_t(n), PMT_data.end());
+    PMT_data.resize(n);
+  }
+  if(held_out_PMT_data.empty()) {
+    throw std::runtime_error("Not enough events for a held-out check!");
+  }
+  estim_options = get_default_estim_options();
+  estim_options.verbose = false;
+  prefilter = get_prefilter(calibr_funct, estim_options);
+  nn_index.build(calibr_funct, estim_options.nn_grid_size);
+  std::cout << "Computing the reference estimates for " << PMT_data.size() << " + " << held_out_PMT_data.size() << " held-out events..." << std::endl;
+  estim_options.search_schedule = parse_search_schedule("16x1.5*40");
+  ref_estim_event = contr_grid(PMT_data, calibr_funct, estim_options, nn_index, nullptr, prefilter);
+  held_out_ref_estim_event = contr_grid(held_out_PMT_data, calibr_funct, estim_options, nn_index, nullptr, prefilter);
+  estim_options = get_default_estim_options();
+  estim_options.verbose = false;
+  tune_result = evaluate_estim_options(estim_options, PMT_data, calibr_funct, nn_index, prefilter, ref_estim_event, budget_dist);
+  held_out_percent = budget_percent;
+  if(budget_percent < 0.00f) {
+    budget_percent = tune_result.within_budget;
+    held_out_percent = evaluate_estim_options(estim_options, held_out_PMT_data, calibr_funct, nn_index, prefilter, held_out_ref_estim_event, budget_dist).within_budget;
+    std::cout << "Budget relative to the default schedule: " << budget_percent << "% within " << budget_dist << " mm, " << held_out_percent << "% on the held-out events." << std::endl;
+  }
+  max_within = tune_result.within_budget;
+  if(tune_result.within_budget >= budget_percent) {
+    candidates.push_back(tune_result);
+  }
+  std::cout << "Default: " << format_search_schedule(estim_options.search_schedule) << ", " << tune_result.events_per_sec << " events/s, " << tune_result.within_budget << "% within budget." << std::endl;
+  for(i_mode = 0; i_mode < 2; ++i_mode) {
+    for(i_first = 0; i_first < 4; ++i_first) {
+      for(j_first = 0; j_first < 2; ++j_first) {
+        for(i_refine = 0; i_refine < 3; ++i_refine) {
+          for(j_refine = 0; j_refine < 2; ++j_refine) {
+            // Start from the number of refinements that brings the grid
+            // spacing below the distance budget, then add iterations until
+            // the budget is met.
+            final_step = (CAMERA_MAX_POS - CAMERA_MIN_POS) / float(first_sizes[i_first]) / first_factors[j_first];
+            for(num_refine = 0; final_step > budget_dist; ++num_refine) {
+              final_step /= refine_factors[j_refine];
+            }
+            for(extra = 0; extra < 4; ++extra) {
+              estim_options.mode = modes[i_mode];
+              estim_options.search_schedule = parse_search_schedule(std::to_string(first_sizes[i_first]) + "x" + std::to_string(first_factors[j_first]) + "," + std::to_string(refine_sizes[i_refine]) + "x" + std::to_string(refine_factors[j_refine]) + "*" + std::to_string(num_refine + extra));
+              tune_result = evaluate_estim_options(estim_options, PMT_data, calibr_funct, nn_index, prefilter, ref_estim_event, budget_dist);
+              if(tune_result.within_budget >= budget_percent) {
+                break;
+              }
+            }
+            max_within = std::max(max_within, tune_result.within_budget);
+            std::cout << ((modes[i_mode] == ESTIM_MODE_NN_START) ? "nn_start " : "contr_grid ") << format_search_schedule(estim_options.search_schedule) << ": ";
+            if(tune_result.events_per_sec > 0.0) {
+              std::cout << tune_result.events_per_sec << " events/s, " << tune_result.within_budget << "% within budget." << std::endl;
+            } else {
+              std::cout << "warm start refused by its check against the full search." << std::endl;
+            }
+            if(tune_result.within_budget >= budget_percent) {
+              candidates.push_back(tune_result);
+            }
+          }
+        }
+      }
+    }
+  }
+  if(candidates.empty()) {
+    std::ostringstream oss;
+    oss << "No configuration meets the accuracy budget, the best reaches " << max_within << "%!";
+    throw std::runtime_error(oss.str());
+  }
+  std::stable_sort(candidates.begin(), candidates.end(), [](const tune_result_t & a, const tune_result_t & b) {return(a.events_per_sec > b.events_per_sec);});
+  found = false;
+  for(n = 0; (n < candidates.size()) && !found; ++n) {
+    held_out_result = evaluate_estim_options(candidates[n].estim_options, held_out_PMT_data, calibr_funct, nn_index, prefilter, held_out_ref_estim_event, budget_dist);
+    std::cout << "Held-out check of " << ((candidates[n].estim_options.mode == ESTIM_MODE_NN_START) ? "nn_start " : "contr_grid ") << format_search_schedule(candidates[n].estim_options.search_schedule) << ": ";
+    if(held_out_result.events_per_sec > 0.0) {
+      std::cout << held_out_result.within_budget << "% within budget." << std::endl;
+    } else {
+      std::cout << "warm start refused by its check against the full search." << std::endl;
+    }
+    if(held_out_result.within_budget >= held_out_percent) {
+      best_result = candidates[n];
+      best_result.within_budget = held_out_result.within_budget;
+      found = true;
+    }
+  }
+  if(!found) {
+    throw std::runtime_error("No configuration meets the accuracy budget on the held-out events!");
+  }
+  std::cout << "Best: " << format_search_schedule(best_result.estim_options.search_schedule) << ", " << best_result.events_per_sec << " events/s." << std::endl;
+  write_tune_result(best_result, budget_dist, held_out_percent, output_filename.c_str());
+  return(0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+tune_result_t evaluate_estim_options(const estim_options_t & estim_options, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, const calibr_funct_t & calibr_funct, const nn_index_t & nn_index, const prefilter_t & prefilter, const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & ref_estim_event, float budget_dist) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+  std::chrono::time_point<std::chrono::steady_clock> start, end;
+  unsigned int event_index, num_within;
+  tune_result_t tune_result;
+  float dx, dy;
+  
+  // A warm start refused by its check against the full search scores
+  // nothing, so that it is never offered.
+  start = std::chrono::steady_clock::now();
+  try {
+    estim_event = contr_grid(PMT_data, calibr_funct, estim_options, nn_index, nullptr, prefilter);
+  } catch(const std::runtime_error & e) {
+    tune_result.estim_options = estim_options;
+    tune_result.events_per_sec = 0.0;
+    tune_result.within_budget = 0.00f;
+    return(tune_result);
+  }
+  end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> diff = end - start;
+  num_within = 0;
+  for(event_index = 0; event_index < estim_event.size(); ++event_index) {
+    dx = estim_event[event_index].x_pos - ref_estim_event[event_index].x_pos;
+    dy = estim_event[event_index].y_pos - ref_estim_event[event_index].y_pos;
+    num_within += ((dx * dx + dy * dy) <= (budget_dist * budget_dist)) ? 1 : 0;
+  }
+  tune_result.estim_options = estim_options;
+  tune_result.events_per_sec = double(estim_event.size()) / diff.count();
+  tune_result.within_budget = estim_event.empty() ? 100.00f : (100.00f * float(num_within) / float(estim_event.size()));
+  return(tune_result);
+}
+
+
+void write_tune_result(const tune_result_t & tune_result, float budget_dist, float budget_percent, const char *filename) {
+  std::ofstream ofs;
+  
+  ofs.open(filename, std::ofstream::out | std::ofstream::trunc);
+  if(!ofs) {
+    throw std::runtime_error(std::string("Cannot create file ") + std::string(filename));
+  }
+  ofs << "# Generated by autotune: " << tune_result.events_per_sec << " events/s, " << tune_result.within_budget << "% of the held-out events within ";
+  ofs << budget_dist << " mm of the reference (budget: " << budget_percent << "%)." << std::endl;
+  ofs << "mode=" << ((tune_result.estim_options.mode == ESTIM_MODE_NN_START) ? "nn_start" : "contr_grid") << std::endl;
+  ofs << "nn-grid=" << tune_result.estim_options.nn_grid_size << std::endl;
+  ofs << "schedule=" << format_search_schedule(tune_result.estim_options.search_schedule) << std::endl;
+  ofs.close();
+  std::cout << "Configuration written to " << filename << "." << std::endl;
+  return;
+}
@@ -0,0 +1,282 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "estimator.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+struct batch_job_t {
+  std::string input_filename;
+  std::string output_filename;
+  uint64_t file_size;
+};
+
+
+struct batch_result_t {
+  std::size_t num_events;
+  std::size_t num_valid;
+  double read_time;
+  double estim_time;
+  double write_time;
+};
+
+
+// Estimates many list-mode files with one estimator, so the calibration is
+// loaded and fitted once. The files are taken largest first, which bounds
+// the makespan on several workers by the longest-processing-time rule. A
+// reader thread loads up to BATCH_READ_AHEAD files ahead of the workers, and
+// every worker estimates and writes whole files, so that reads, estimation
+// and writes of different files overlap.
+class batch_t {
+  public:
+    batch_t(const std::vector<batch_job_t> & my_jobs, const estimator_t & my_estimator);
+    void run(unsigned int num_threads);
+    void print_stats(std::ostream & os) const;
+    
+  private:
+    struct loaded_job_t {
+      std::size_t job_index;
+      std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+    };
+    void read_jobs();
+    void work();
+    void set_error();
+    const estimator_t & estimator;
+    std::vector<batch_job_t> jobs;
+    std::vector<batch_result_t> results;
+    std::deque<std::unique_ptr<loaded_job_t>> loaded_jobs;
+    std::mutex mutex;
+    std::condition_variable loaded_cond;
+    std::condition_variable space_cond;
+    std::exception_ptr error;
+    bool done_reading;
+    unsigned int num_workers;
+    double elapsed_time;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+std::vector<batch_job_t> read_batch_manifest(const std::string & filename);
+uint64_t get_file_size(const std::string & filename);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+batch_t::batch_t(const std::vector<batch_job_t> & my_jobs, const estimator_t & my_estimator) : estimator(my_estimator), jobs(my_jobs), done_reading(false), num_workers(0), elapsed_time(0.0) {
+  std::stable_sort(jobs.begin(), jobs.end(), [](const batch_job_t & a, const batch_job_t & b) {return(a.file_size > b.file_size);});
+  results.resize(jobs.size());
+}
+
+
+// Runs all the jobs on num_threads workers (all the cores for 0) and the
+// reader thread. The first error of any thread is rethrown once all of
+// them are done.
+void batch_t::run(unsigned int num_threads) {
+  std::chrono::time_point<std::chrono::steady_clock> start;
+  std::vector<std::thread> workers;
+  std::thread reader;
+  unsigned int i;
+  
+  if(num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  num_workers = num_threads;
+  start = std::chrono::steady_clock::now();
+  reader = std::thread(& batch_t::read_jobs, this);
+  for(i = 1; i < num_threads; ++i) {
+    workers.push_back(std::thread(& batch_t::work, this));
+  }
+  work();
+  for(i = 0; i < workers.size(); ++i) {
+    workers[i].join();
+  }
+  reader.join();
+  elapsed_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if(error) {
+    std::rethrow_exception(error);
+  }
+  return;
+}
+
+
+void batch_t::print_stats(std::ostream & os) const {
+  std::size_t total_events, total_valid;
+  double estim_time;
+  std::size_t n;
+  
+  total_events = total_valid = 0;
+  estim_time = 0.0;
+  os << "Batch of " << jobs.size() << " files on " << num_workers << " workers." << std::endl;
+  for(n = 0; n < jobs.size(); ++n) {
+    os << jobs[n].input_filename << ": " << results[n].num_events << " events, " << results[n].num_valid << " valid, read " << results[n].read_time << " s, estimated in " << results[n].estim_time << " s (" << get_event_rate(results[n].num_events, results[n].estim_time) << " events/s), written " << results[n].write_time << " s." << std::endl;
+    total_events += results[n].num_events;
+    total_valid += results[n].num_valid;
+    estim_time += results[n].estim_time;
+  }
+  os << "Total: " << total_events << " events, " << total_valid << " valid, CPU time " << estim_time << " s." << std::endl;
+  os << "Elapsed time: " << elapsed_time << " s (" << get_event_rate(total_events, elapsed_time) << " events/s)." << std::endl;
+  return;
+}
+
+
+void batch_t::read_jobs() {
+  std::chrono::time_point<std::chrono::steady_clock> start, end;
+  std::size_t job_index;
+  
+  for(job_index = 0; job_index < jobs.size(); ++job_index) {
+    std::unique_ptr<loaded_job_t> loaded_job(new loaded_job_t);
+    loaded_job->job_index = job_index;
+    start = std::chrono::steady_clock::now();
+    try {
+      loaded_job->PMT_data = get_PMT_data(jobs[job_index].input_filename.c_str());
+    } catch(...) {
+      set_error();
+      break;
+    }
+    end = std::chrono::steady_clock::now();
+    results[job_index].read_time = std::chrono::duration<double>(end - start).count();
+    std::unique_lock<std::mutex> lock(mutex);
+    space_cond.wait(lock, [this]() {return((loaded_jobs.size() < BATCH_READ_AHEAD) || error);});
+    if(error) {
+      break;
+    }
+    loaded_jobs.push_back(std::move(loaded_job));
+    loaded_cond.notify_one();
+  }
+  std::lock_guard<std::mutex> guard(mutex);
+  done_reading = true;
+  loaded_cond.notify_all();
+  return;
+}
+
+
+void batch_t::work() {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+  std::chrono::time_point<std::chrono::steady_clock> start, mid, end;
+  std::unique_ptr<loaded_job_t> loaded_job;
+  std::size_t event_index;
+  
+  while(true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      loaded_cond.wait(lock, [this]() {return(!loaded_jobs.empty() || done_reading || error);});
+      if(loaded_jobs.empty() || error) {
+        return;
+      }
+      loaded_job = std::move(loaded_jobs.front());
+      loaded_jobs.pop_front();
+      space_cond.notify_one();
+    }
+    batch_result_t & result = results[loaded_job->job_index];
+    start = std::chrono::steady_clock::now();
+    estim_event.resize(loaded_job->PMT_data.size());
+    estimator.estimate_batch(loaded_job->PMT_data.data(), estim_event.data(), estim_event.size());
+    mid = std::chrono::steady_clock::now();
+    try {
+      write_estim_events(estim_event, jobs[loaded_job->job_index].output_filename.c_str());
+    } catch(...) {
+      set_error();
+      return;
+    }
+    end = std::chrono::steady_clock::now();
+    result.num_events = estim_event.size();
+    result.num_valid = 0;
+    for(event_index = 0; event_index < estim_event.size(); ++event_index) {
+      result.num_valid += estim_event[event_index].valid ? 1 : 0;
+    }
+    result.estim_time = std::chrono::duration<double>(mid - start).count();
+    result.write_time = std::chrono::duration<double>(end - mid).count();
+  }
+}
+
+
+// Keeps the first exception and wakes every thread up so that they stop.
+void batch_t::set_error() {
+  std::lock_guard<std::mutex> guard(mutex);
+  if(!error) {
+    error = std::current_exception();
+  }
+  loaded_cond.notify_all();
+  space_cond.notify_all();
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Reads a batch manifest with one "input output" pair of file names per
+// line. Empty lines and lines starting with '#' are ignored, and relative
+// file names are taken from the directory of the manifest.
+std::vector<batch_job_t> read_batch_manifest(const std::string & filename) {
+  std::vector<batch_job_t> jobs;
+  std::string line, dir, extra;
+  batch_job_t job;
+  std::ifstream ifs;
+  std::size_t pos;
+  
+  pos = filename.find_last_of('/');
+  dir = (pos == std::string::npos) ? std::string() : filename.substr(0, pos + 1);
+  ifs.open(filename.c_str(), std::ifstream::in);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open batch manifest " + filename);
+  }
+  while(std::getline(ifs, line)) {
+    line.erase(0, line.find_first_not_of(" \t"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if(line.empty() || (line[0] == '#')) {
+      continue;
+    }
+    std::istringstream iss(line);
+    if(!(iss >> job.input_filename >> job.output_filename) || (iss >> extra)) {
+      throw std::runtime_error("Expected an input and an output file in batch manifest: " + line);
+    }
+    job.input_filename = ((job.input_filename[0] == '/') ? std::string() : dir) + job.input_filename;
+    job.output_filename = ((job.output_filename[0] == '/') ? std::string() : dir) + job.output_filename;
+    job.file_size = get_file_size(job.input_filename);
+    jobs.push_back(job);
+  }
+  ifs.close();
+  return(jobs);
+}
+
+
+uint64_t get_file_size(const std::string & filename) {
+  std::ifstream ifs;
+  
+  ifs.open(filename.c_str(), std::ifstream::in | std::ifstream::binary | std::ifstream::ate);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open input LM file " + filename);
+  }
+  return(uint64_t(ifs.tellg()));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _BATCH_H
@@ -0,0 +1,431 @@
+#ifndef _CAMERA_H
+#define _CAMERA_H
+
+#include <stdexcept>
+#include <fstream>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include "spline.hpp"
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "estim_options.h"
+#include "estim_core.hpp"
+#include "dyn_spline.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Geometry of a camera and location of its calibration files, read at run
+// time instead of being fixed by my_defines.h. The calibration grid has
+// num_sampl x num_sampl points spaced by sampl_pitch mm, and the MDRFs and
+// the threshold are fitted with splines of order (mx, my) with (kx, ky)
+// interior knots.
+struct camera_desc_t {
+  std::string name;
+  int num_pmts;
+  int num_sampl;
+  float sampl_pitch;
+  int mx, my;
+  int kx, ky;
+  std::string mdrf_filename;
+  std::string thresh_filename;
+  std::string gain_filename;
+};
+
+
+struct camera_calibr_t {
+  camera_desc_t camera_desc;
+  std::vector<dyn_spline_2D_t> mdrf;
+  dyn_spline_2D_t thresh;
+  std::vector<float> gain;
+};
+
+
+// Float engine of estim_core.hpp for a geometry fixed at compile time. The
+// splines are copied from a camera_calibr_t into spline_2D objects, so the
+// MDRFs are evaluated with fully unrolled loops.
+template<int _P, int _MX, int _MY, int _KX, int _KY> class camera_engine_t : public spline_arith_t<float> {
+  public:
+    enum {
+      max_num_pmts = ((_P + 15) / 16) * 16
+    };
+    camera_engine_t(const camera_calibr_t & camera_calibr);
+    int get_num_pmts() const;
+    float get_camera_size() const;
+    void get_data(value_t data[_P], const int16_t values[_P]) const;
+    void eval_mdrf(value_t output[max_num_pmts], const coord_t & x, const coord_t & y) const;
+    value_t get_log_like(const value_t data[_P], const value_t mdrf[max_num_pmts]) const;
+    value_t get_thresh(const coord_t & x, const coord_t & y) const;
+    
+  private:
+    spline_2D<float, float, _MX, _MY, _KX, _KY> mdrf[_P];
+    spline_2D<float, float, _MX, _MY, _KX, _KY> thresh;
+    float gain[_P];
+    float camera_size;
+};
+
+
+// Generic fallback for the geometries without a specialized engine, with
+// the splines evaluated at run time. Up to MAX_NUM_PMTS PMTs.
+class dyn_camera_engine_t : public spline_arith_t<float> {
+  public:
+    enum {
+      max_num_pmts = MAX_NUM_PMTS
+    };
+    dyn_camera_engine_t(const camera_calibr_t & my_camera_calibr);
+    int get_num_pmts() const;
+    float get_camera_size() const;
+    void get_data(value_t data[MAX_NUM_PMTS], const int16_t *values) const;
+    void eval_mdrf(value_t output[MAX_NUM_PMTS], const coord_t & x, const coord_t & y) const;
+    value_t get_log_like(const value_t data[MAX_NUM_PMTS], const value_t mdrf[MAX_NUM_PMTS]) const;
+    value_t get_thresh(const coord_t & x, const coord_t & y) const;
+    
+  private:
+    const camera_calibr_t & camera_calibr;
+};
+
+
+// Estimator for one camera, chosen by get_camera_model() when the
+// calibration is loaded.
+class camera_model_t {
+  public:
+    virtual ~camera_model_t();
+    virtual std::string get_variant() const = 0;
+    virtual std::vector<estim_event_t, aligned_allocator<estim_event_t>> estimate(const std::vector<int16_t> & LM_values, bool verbose) const = 0;
+};
+
+
+template<class _E> class camera_model_impl_t : public camera_model_t {
+  public:
+    camera_model_impl_t(const camera_calibr_t & camera_calibr, const std::string & my_variant);
+    std::string get_variant() const;
+    std::vector<estim_event_t, aligned_allocator<estim_event_t>> estimate(const std::vector<int16_t> & LM_values, bool verbose) const;
+    
+  private:
+    _E engine;
+    std::string variant;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+camera_desc_t get_default_camera_desc();
+camera_desc_t read_camera_desc(const std::string & filename);
+camera_calibr_t get_camera_calibr(const camera_desc_t & camera_desc);
+std::unique_ptr<camera_model_t> get_camera_model(const camera_calibr_t & camera_calibr);
+template<int _P, int _MX, int _MY, int _KX, int _KY> bool is_camera_geometry(const camera_desc_t & camera_desc);
+std::vector<float> read_float_file(const std::string & filename, std::size_t num_values);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+template<int _P, int _MX, int _MY, int _KX, int _KY> camera_engine_t<_P, _MX, _MY, _KX, _KY>::camera_engine_t(const camera_calibr_t & camera_calibr) {
+  float tmp_spline_coefs[_MY + _KY][_MX + _KX];
+  int pmt;
+  
+  for(pmt = 0; pmt < _P; ++pmt) {
+    camera_calibr.mdrf[pmt].get_coefs(& tmp_spline_coefs[0][0]);
+    mdrf[pmt] = spline_2D<float, float, _MX, _MY, _KX, _KY>(tmp_spline_coefs);
+    gain[pmt] = camera_calibr.gain[pmt];
+  }
+  camera_calibr.thresh.get_coefs(& tmp_spline_coefs[0][0]);
+  thresh = spline_2D<float, float, _MX, _MY, _KX, _KY>(tmp_spline_coefs);
+  camera_size = float(camera_calibr.camera_desc.num_sampl) * camera_calibr.camera_desc.sampl_pitch;
+}
+
+
+template<int _P, int _MX, int _MY, int _KX, int _KY> int camera_engine_t<_P, _MX, _MY, _KX, _KY>::get_num_pmts() const {
+  return(_P);
+}
+
+
+template<int _P, int _MX, int _MY, int _KX, int _KY> float camera_engine_t<_P, _MX, _MY, _KX, _KY>::get_camera_size() const {
+  return(camera_size);
+}
+
+
+template<int _P, int _MX, int _MY, int _KX, int _KY> void camera_engine_t<_P, _MX, _MY, _KX, _KY>::get_data(value_t data[_P], const int16_t values[_P]) const {
+  int pmt;
+  
+  for(pmt = 0; pmt < _P; ++pmt) {
+    data[pmt] = values[pmt] / gain[pmt];
+  }
+  return;
+}
+
+
+template<int _P, int _MX, int _MY, int _KX, int _KY> void camera_engine_t<_P, _MX, _MY, _KX, _KY>::eval_mdrf(value_t output[max_num_pmts], const coord_t & x, const coord_t & y) const {
+  int pmt;
+  
+  for(pmt = 0; pmt < _P; ++pmt) {
+    output[pmt] = mdrf[pmt](x, y);
+  }
+  return;
+}
+
+
+template<int _P, int _MX, int _MY, int _KX, int _KY> float camera_engine_t<_P, _MX, _MY, _KX, _KY>::get_log_like(const value_t data[_P], const value_t mdrf[max_num_pmts]) const {
+  float log_like;
+  int pmt;
+  
+  log_like = float(0);
+  for(pmt = 0; pmt < _P; ++pmt) {
+    if((data[pmt] != float(0)) || (mdrf[pmt] != float(0))) {
+      log_like += data[pmt] * std::log(mdrf[pmt]) - mdrf[pmt];
+    }
+  }
+  return(log_like);
+}
+
+
+template<int _P, int _MX, int _MY, int _KX, int _KY> float camera_engine_t<_P, _MX, _MY, _KX, _KY>::get_thresh(const coord_t & x, const coord_t & y) const {
+  return(thresh(x, y));
+}
+
+
+dyn_camera_engine_t::dyn_camera_engine_t(const camera_calibr_t & my_camera_calibr) : camera_calibr(my_camera_calibr) {
+}
+
+
+int dyn_camera_engine_t::get_num_pmts() const {
+  return(camera_calibr.camera_desc.num_pmts);
+}
+
+
+float dyn_camera_engine_t::get_camera_size() const {
+  return(float(camera_calibr.camera_desc.num_sampl) * camera_calibr.camera_desc.sampl_pitch);
+}
+
+
+void dyn_camera_engine_t::get_data(value_t data[MAX_NUM_PMTS], const int16_t *values) const {
+  int pmt;
+  
+  for(pmt = 0; pmt < camera_calibr.camera_desc.num_pmts; ++pmt) {
+    data[pmt] = values[pmt] / camera_calibr.gain[pmt];
+  }
+  return;
+}
+
+
+void dyn_camera_engine_t::eval_mdrf(value_t output[MAX_NUM_PMTS], const coord_t & x, const coord_t & y) const {
+  int pmt;
+  
+  for(pmt = 0; pmt < camera_calibr.camera_desc.num_pmts; ++pmt) {
+    output[pmt] = camera_calibr.mdrf[pmt](x, y);
+  }
+  return;
+}
+
+
+float dyn_camera_engine_t::get_log_like(const value_t data[MAX_NUM_PMTS], const value_t mdrf[MAX_NUM_PMTS]) const {
+  float log_like;
+  int pmt;
+  
+  log_like = float(0);
+  for(pmt = 0; pmt < camera_calibr.camera_desc.num_pmts; ++pmt) {
+    if((data[pmt] != float(0)) || (mdrf[pmt] != float(0))) {
+      log_like += data[pmt] * std::log(mdrf[pmt]) - mdrf[pmt];
+    }
+  }
+  return(log_like);
+}
+
+
+float dyn_camera_engine_t::get_thresh(const coord_t & x, const coord_t & y) const {
+  return(camera_calibr.thresh(x, y));
+}
+
+
+camera_model_t::~camera_model_t() {
+}
+
+
+template<class _E> camera_model_impl_t<_E>::camera_model_impl_t(const camera_calibr_t & camera_calibr, const std::string & my_variant) : engine(camera_calibr), variant(my_variant) {
+}
+
+
+template<class _E> std::string camera_model_impl_t<_E>::get_variant() const {
+  return(variant);
+}
+
+
+template<class _E> std::vector<estim_event_t, aligned_allocator<estim_event_t>> camera_model_impl_t<_E>::estimate(const std::vector<int16_t> & LM_values, bool verbose) const {
+  return(estimate_events<_E, SIZE_CONTR_GRID>(LM_values, NUM_CONTR_GRID_ITER, CONTR_FACTOR, engine, verbose));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Camera described by my_defines.h.
+camera_desc_t get_default_camera_desc() {
+  camera_desc_t camera_desc;
+  
+  camera_desc.name = "camera0";
+  camera_desc.num_pmts = NUM_PMTS;
+  camera_desc.num_sampl = NUM_SAMPL;
+  camera_desc.sampl_pitch = SAMPL_PITCH;
+  camera_desc.mx = MX;
+  camera_desc.my = MY;
+  camera_desc.kx = KX;
+  camera_desc.ky = KY;
+  camera_desc.mdrf_filename = "../data/camera0_79x79_1.5mm_tc99m_mean";
+  camera_desc.thresh_filename = "../data/camera0_thresh.dat";
+  camera_desc.gain_filename = "../data/camera0_79x79_1.5mm_tc99m_gains";
+  return(camera_desc);
+}
+
+
+// Reads a camera description with one "key=value" pair per line. Empty
+// lines and lines starting with '#' are ignored, the keys not given keep
+// the values of the default camera, and relative file names are taken
+// from the directory of the description.
+camera_desc_t read_camera_desc(const std::string & filename) {
+  std::string line, key, value, dir;
+  camera_desc_t camera_desc;
+  std::size_t pos;
+  std::ifstream ifs;
+  float values[2];
+  
+  camera_desc = get_default_camera_desc();
+  pos = filename.find_last_of('/');
+  dir = (pos == std::string::npos) ? std::string() : filename.substr(0, pos + 1);
+  ifs.open(filename.c_str(), std::ifstream::in);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open camera description " + filename);
+  }
+  while(std::getline(ifs, line)) {
+    line.erase(0, line.find_first_not_of(" \t"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if(line.empty() || (line[0] == '#')) {
+      continue;
+    }
+    pos = line.find('=');
+    if(pos == std::string::npos) {
+      throw std::runtime_error("Expected key=value in camera description: " + line);
+    }
+    key = line.substr(0, pos);
+    value = line.substr(pos + 1);
+    if(key == "name") {
+      camera_desc.name = value;
+    } else if(key == "num-pmts") {
+      camera_desc.num_pmts = std::stoi(value);
+    } else if(key == "num-sampl") {
+      camera_desc.num_sampl = std::stoi(value);
+    } else if(key == "sampl-pitch") {
+      camera_desc.sampl_pitch = std::stof(value);
+    } else if(key == "order") {
+      parse_float_list(values, 2, value);
+      camera_desc.mx = int(values[0]);
+      camera_desc.my = int(values[1]);
+    } else if(key == "knots") {
+      parse_float_list(values, 2, value);
+      camera_desc.kx = int(values[0]);
+      camera_desc.ky = int(values[1]);
+    } else if((key == "mdrf") || (key == "thresh") || (key == "gain")) {
+      value = ((value[0] == '/') ? std::string() : dir) + value;
+      if(key == "mdrf") {
+        camera_desc.mdrf_filename = value;
+      } else if(key == "thresh") {
+        camera_desc.thresh_filename = value;
+      } else {
+        camera_desc.gain_filename = value;
+      }
+    } else {
+      throw std::runtime_error("Unknown camera description key " + key);
+    }
+  }
+  ifs.close();
+  if((camera_desc.num_pmts < 1) || (camera_desc.num_pmts > MAX_NUM_PMTS)) {
+    throw std::runtime_error("The number of PMTs must be between 1 and " + std::to_string(MAX_NUM_PMTS) + "!");
+  }
+  if((camera_desc.num_sampl < 2) || !(camera_desc.sampl_pitch > float(0))) {
+    throw std::runtime_error("Invalid calibration grid!");
+  }
+  if((camera_desc.mx < 1) || (camera_desc.my < 1) || (camera_desc.mx > MAX_SPLINE_ORDER) || (camera_desc.my > MAX_SPLINE_ORDER) || (camera_desc.kx < 0) || (camera_desc.ky < 0)) {
+    throw std::runtime_error("Invalid spline order or number of knots!");
+  }
+  return(camera_desc);
+}
+
+
+// Same file formats and fits as get_calibration_data() and
+// get_calibration_funct(), with the sizes of the camera description.
+camera_calibr_t get_camera_calibr(const camera_desc_t & camera_desc) {
+  std::vector<float> mdrf_values, thresh_values;
+  std::vector<float> pos, values;
+  camera_calibr_t camera_calibr;
+  std::size_t num_values;
+  std::size_t i;
+  int pmt;
+  
+  num_values = std::size_t(camera_desc.num_sampl) * std::size_t(camera_desc.num_sampl);
+  mdrf_values = read_float_file(camera_desc.mdrf_filename, num_values * std::size_t(camera_desc.num_pmts));
+  thresh_values = read_float_file(camera_desc.thresh_filename, num_values);
+  camera_calibr.camera_desc = camera_desc;
+  camera_calibr.gain = read_float_file(camera_desc.gain_filename, std::size_t(camera_desc.num_pmts));
+  pos.resize(std::size_t(camera_desc.num_sampl));
+  for(i = 0; i < pos.size(); ++i) {
+    pos[i] = float(i) / float(camera_desc.num_sampl - 1);
+  }
+  values.resize(num_values);
+  for(pmt = 0; pmt < camera_desc.num_pmts; ++pmt) {
+    for(i = 0; i < num_values; ++i) {
+      values[i] = mdrf_values[std::size_t(pmt) * num_values + i] / camera_calibr.gain[pmt];
+    }
+    camera_calibr.mdrf.push_back(dyn_spap2(camera_desc.mx, camera_desc.my, camera_desc.kx, camera_desc.ky, pos, pos, values));
+  }
+  camera_calibr.thresh = dyn_spap2(camera_desc.mx, camera_desc.my, camera_desc.kx, camera_desc.ky, pos, pos, thresh_values);
+  return(camera_calibr);
+}
+
+
+// Geometries with a pre-instantiated engine. Only the 9-PMT geometry of
+// the shipped camera (my_defines.h, ../data/camera0.cfg) is specialized;
+// every other PMT count, order or knot count runs on the generic engine.
+// Supporting a new camera at full speed only takes a new entry here.
+std::unique_ptr<camera_model_t> get_camera_model(const camera_calibr_t & camera_calibr) {
+  const camera_desc_t & camera_desc = camera_calibr.camera_desc;
+  std::string geometry;
+  
+  geometry = std::to_string(camera_desc.num_pmts) + " PMTs, order " + std::to_string(camera_desc.mx) + "x" + std::to_string(camera_desc.my) + ", " + std::to_string(camera_desc.kx) + "x" + std::to_string(camera_desc.ky) + " knots";
+  if(is_camera_geometry<9, 3, 3, 10, 10>(camera_desc)) {
+    return(std::unique_ptr<camera_model_t>(new camera_model_impl_t<camera_engine_t<9, 3, 3, 10, 10>>(camera_calibr, "specialized (" + geometry + ")")));
+  }
+  return(std::unique_ptr<camera_model_t>(new camera_model_impl_t<dyn_camera_engine_t>(camera_calibr, "generic (" + geometry + ")")));
+}
+
+
+template<int _P, int _MX, int _MY, int _KX, int _KY> bool is_camera_geometry(const camera_desc_t & camera_desc) {
+  return((camera_desc.num_pmts == _P) && (camera_desc.mx == _MX) && (camera_desc.my == _MY) && (camera_desc.kx == _KX) && (camera_desc.ky == _KY));
+}
+
+
+std::vector<float> read_float_file(const std::string & filename, std::size_t num_values) {
+  std::vector<float> values(num_values);
+  std::ifstream ifs;
+  
+  ifs.open(filename.c_str(), std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open calibration file " + filename);
+  }
+  ifs.read(reinterpret_cast<char *>(values.data()), std::streamsize(num_values * sizeof(float)));
+  if(!ifs) {
+    throw std::runtime_error("Calibration file " + filename + " is too short for the camera description!");
+  }
+  ifs.close();
+  return(values);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _CAMERA_H
@@ -0,0 +1,287 @@
+#ifndef _COMPACT_FORMAT_H
+#define _COMPACT_FORMAT_H
+
+#include <stdexcept>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Compact columnar format of the estimates (.ecf). The events are stored in
+// blocks of block_size events, each holding columns instead of records:
+//
+//   validity bitmap   (block_size + 63) / 64 uint64 words, bit n for event n
+//                     (absent in valid-only files)
+//   x positions       uint16 per event
+//   y positions       uint16 per event
+//   log-likelihoods   IEEE half per event (only with COMPACT_LOG_LIKE)
+//
+// padded to 8 bytes. Positions are quantized over the field of view, from
+// min_pos to max_pos in 65535 steps (1.8 um for camera0). A valid-only file
+// stores the valid events only, without bitmap. The block index at
+// index_offset gives, for each block, its offset, the index of its first
+// event in the original list, and its numbers of events and of stored
+// events, so that a reader can seek to any event. A file without
+// log-likelihoods takes 4.125 bytes per event, and 4 bytes per valid event
+// in valid-only mode, against 16 for estim_events files; the columns are
+// decoded by loops the compiler vectorizes.
+#define COMPACT_LOG_LIKE	0x1
+#define COMPACT_VALID_ONLY	0x2
+
+
+struct compact_header_t {
+  char magic[4];
+  uint32_t flags;
+  uint32_t block_size;
+  uint32_t num_blocks;
+  uint64_t num_events;
+  uint64_t index_offset;
+  float min_pos;
+  float max_pos;
+};
+
+
+struct compact_block_t {
+  uint64_t offset;
+  uint64_t first_event;
+  uint32_t num_events;
+  uint32_t num_stored;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void write_compact_events(const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const char *filename, uint32_t flags, uint32_t block_size = COMPACT_BLOCK_SIZE);
+std::vector<estim_event_t, aligned_allocator<estim_event_t>> read_compact_events(const char *filename);
+inline uint16_t quantize_pos(float pos, float min_pos, float scale);
+inline uint16_t float_to_half(float value);
+inline float half_to_float(uint16_t value);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void write_compact_events(const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const char *filename, uint32_t flags, uint32_t block_size) {
+  std::vector<compact_block_t> blocks;
+  std::vector<uint16_t> x_pos, y_pos, log_like;
+  std::vector<uint64_t> bitmap;
+  compact_header_t header;
+  compact_block_t block;
+  std::size_t event_index, last_event;
+  std::ofstream ofs;
+  uint64_t offset;
+  float scale;
+  uint32_t n;
+  
+  if(block_size == 0) {
+    throw std::runtime_error("The block size must be positive!");
+  }
+  ofs.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!ofs) {
+    throw std::runtime_error("Cannot create ML estimates file!");
+  }
+  std::memcpy(header.magic, "ECF1", 4);
+  header.flags = flags;
+  header.block_size = block_size;
+  header.num_blocks = uint32_t((estim_event.size() + block_size - 1) / block_size);
+  header.num_events = estim_event.size();
+  header.index_offset = 0;
+  header.min_pos = CAMERA_MIN_POS;
+  header.max_pos = CAMERA_MAX_POS;
+  scale = float(UINT16_MAX) / (header.max_pos - header.min_pos);
+  ofs.write(reinterpret_cast<const char *>(& header), sizeof(header));
+  offset = sizeof(header);
+  for(event_index = 0; event_index < estim_event.size(); event_index += block_size) {
+    last_event = std::min(event_index + block_size, estim_event.size());
+    block.offset = offset;
+    block.first_event = event_index;
+    block.num_events = uint32_t(last_event - event_index);
+    bitmap.assign((flags & COMPACT_VALID_ONLY) ? 0 : ((block.num_events + 63) / 64), 0);
+    x_pos.clear();
+    y_pos.clear();
+    log_like.clear();
+    for(n = 0; n < block.num_events; ++n) {
+      const estim_event_t & event = estim_event[event_index + n];
+      if(flags & COMPACT_VALID_ONLY) {
+        if(!event.valid) {
+          continue;
+        }
+      } else if(event.valid) {
+        bitmap[n / 64] |= uint64_t(1) << (n % 64);
+      }
+      x_pos.push_back(quantize_pos(event.x_pos, header.min_pos, scale));
+      y_pos.push_back(quantize_pos(event.y_pos, header.min_pos, scale));
+      if(flags & COMPACT_LOG_LIKE) {
+        log_like.push_back(float_to_half(event.log_like));
+      }
+    }
+    block.num_stored = uint32_t(x_pos.size());
+    ofs.write(reinterpret_cast<const char *>(bitmap.data()), std::streamsize(bitmap.size() * sizeof(uint64_t)));
+    ofs.write(reinterpret_cast<const char *>(x_pos.data()), std::streamsize(x_pos.size() * sizeof(uint16_t)));
+    ofs.write(reinterpret_cast<const char *>(y_pos.data()), std::streamsize(y_pos.size() * sizeof(uint16_t)));
+    ofs.write(reinterpret_cast<const char *>(log_like.data()), std::streamsize(log_like.size() * sizeof(uint16_t)));
+    offset += (bitmap.size() * sizeof(uint64_t)) + (x_pos.size() + y_pos.size() + log_like.size()) * sizeof(uint16_t);
+    while((offset % 8) != 0) {
+      ofs.put(0);
+      ++offset;
+    }
+    blocks.push_back(block);
+  }
+  header.index_offset = offset;
+  ofs.write(reinterpret_cast<const char *>(blocks.data()), std::streamsize(blocks.size() * sizeof(compact_block_t)));
+  ofs.seekp(0);
+  ofs.write(reinterpret_cast<const char *>(& header), sizeof(header));
+  ofs.close();
+  if(!ofs) {
+    throw std::runtime_error("Cannot write ML estimates file!");
+  }
+  return;
+}
+
+
+// Returns every event of a file with a bitmap, and the valid events only
+// of a valid-only file. Without stored log-likelihoods, log_like is zero.
+std::vector<estim_event_t, aligned_allocator<estim_event_t>> read_compact_events(const char *filename) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+  std::vector<compact_block_t> blocks;
+  std::vector<uint16_t> columns;
+  std::vector<uint64_t> bitmap;
+  compact_header_t header;
+  const uint16_t *x_pos, *y_pos, *log_like;
+  std::size_t num_words;
+  std::ifstream ifs;
+  std::size_t b, out;
+  float step;
+  uint32_t n;
+  
+  ifs.open(filename, std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open ML estimates file!");
+  }
+  ifs.read(reinterpret_cast<char *>(& header), sizeof(header));
+  if(!ifs || (std::memcmp(header.magic, "ECF1", 4) != 0)) {
+    throw std::runtime_error("Not a compact ML estimates file!");
+  }
+  blocks.resize(header.num_blocks);
+  ifs.seekg(std::streamoff(header.index_offset));
+  ifs.read(reinterpret_cast<char *>(blocks.data()), std::streamsize(blocks.size() * sizeof(compact_block_t)));
+  if(!ifs) {
+    throw std::runtime_error("Truncated compact ML estimates file!");
+  }
+  step = (header.max_pos - header.min_pos) / float(UINT16_MAX);
+  out = 0;
+  for(b = 0; b < blocks.size(); ++b) {
+    num_words = (header.flags & COMPACT_VALID_ONLY) ? 0 : ((blocks[b].num_events + 63) / 64);
+    bitmap.resize(num_words);
+    columns.resize(std::size_t(blocks[b].num_stored) * ((header.flags & COMPACT_LOG_LIKE) ? 3 : 2));
+    ifs.seekg(std::streamoff(blocks[b].offset));
+    ifs.read(reinterpret_cast<char *>(bitmap.data()), std::streamsize(num_words * sizeof(uint64_t)));
+    ifs.read(reinterpret_cast<char *>(columns.data()), std::streamsize(columns.size() * sizeof(uint16_t)));
+    if(!ifs) {
+      throw std::runtime_error("Truncated compact ML estimates file!");
+    }
+    x_pos = columns.data();
+    y_pos = x_pos + blocks[b].num_stored;
+    log_like = y_pos + blocks[b].num_stored;
+    estim_event.resize(out + blocks[b].num_stored);
+    estim_event_t *event = estim_event.data() + out;
+    for(n = 0; n < blocks[b].num_stored; ++n) {
+      event[n].x_pos = header.min_pos + float(x_pos[n]) * step;
+      event[n].y_pos = header.min_pos + float(y_pos[n]) * step;
+    }
+    for(n = 0; n < blocks[b].num_stored; ++n) {
+      event[n].log_like = (header.flags & COMPACT_LOG_LIKE) ? half_to_float(log_like[n]) : float(0);
+      event[n].valid = (header.flags & COMPACT_VALID_ONLY) ? 1 : uint32_t((bitmap[n / 64] >> (n % 64)) & 1);
+    }
+    out += blocks[b].num_stored;
+  }
+  return(estim_event);
+}
+
+
+// Positions outside the field of view are clamped to its border.
+inline uint16_t quantize_pos(float pos, float min_pos, float scale) {
+  float value;
+  
+  value = std::round((pos - min_pos) * scale);
+  return(uint16_t(std::min(std::max(value, float(0)), float(UINT16_MAX))));
+}
+
+
+// Rounds to nearest even, with overflow to infinity and gradual underflow.
+inline uint16_t float_to_half(float value) {
+  uint32_t bits, sign, mantissa;
+  int32_t exponent;
+  uint32_t half;
+  
+  std::memcpy(& bits, & value, sizeof(bits));
+  sign = (bits >> 16) & 0x8000;
+  exponent = int32_t((bits >> 23) & 0xFF) - 127 + 15;
+  mantissa = bits & 0x007FFFFF;
+  if(((bits >> 23) & 0xFF) == 0xFF) {
+    return(uint16_t(sign | 0x7C00 | ((mantissa != 0) ? 0x0200 : 0)));
+  }
+  if(exponent >= 31) {
+    return(uint16_t(sign | 0x7C00));
+  }
+  if(exponent <= 0) {
+    if(exponent < -10) {
+      return(uint16_t(sign));
+    }
+    mantissa |= 0x00800000;
+    half = mantissa >> (14 - exponent);
+    if(((mantissa >> (13 - exponent)) & 1) && ((mantissa & ((uint32_t(1) << (13 - exponent)) - 1)) || (half & 1))) {
+      ++half;
+    }
+    return(uint16_t(sign | half));
+  }
+  half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+  if((mantissa & 0x00001000) && ((mantissa & 0x00000FFF) || (half & 1))) {
+    ++half;
+  }
+  return(uint16_t(sign | half));
+}
+
+
+inline float half_to_float(uint16_t value) {
+  uint32_t sign, exponent, mantissa;
+  uint32_t bits;
+  float result;
+  
+  sign = uint32_t(value & 0x8000) << 16;
+  exponent = (value >> 10) & 0x1F;
+  mantissa = value & 0x03FF;
+  if(exponent == 0x1F) {
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  } else if(exponent != 0) {
+    bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  } else if(mantissa != 0) {
+    exponent = 127 - 15 + 1;
+    while((mantissa & 0x0400) == 0) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x03FF) << 13);
+  } else {
+    bits = sign;
+  }
+  std::memcpy(& result, & bits, sizeof(result));
+  return(result);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _COMPACT_FORMAT_H
@@ -0,0 +1,112 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <array>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion compare_estim.cpp -o compare_estim
+//
+// Compares two files of estimates written by write_estim_events(), event
+// by event, for checking an engine against a reference. Only the events
+// present in both files are compared, so that the fixed-point engine can
+// be checked against the C simulation of the FPGA kernel, whose test bench
+// (FPGA/contr_grid_test.cpp) only estimates the first events of the file:
+//
+//   (cd ../FPGA && vivado_hls -f contr_grid.tcl)
+//   ./main --engine=fixed
+//   ./compare_estim ../FPGA/proj_contr_grid/solution_U250/csim/build/estim_events_FPGA.dat ../data/estim_events_CPU.dat
+//
+// An event is identical when its four fields have the same bits in both
+// files. The comparison fails, with exit status 1, if a valid flag differs
+// or a position differs by more than the tolerance (0 by default, that is
+// bit for bit). The log-likelihoods are only reported, as the fixed-point
+// engine does not reproduce hls::log().
+//
+// Usage: ./compare_estim [--tolerance=MM] REFERENCE OUTPUT
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+bool is_same_estim_event(const estim_event_t & a, const estim_event_t & b);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char **argv) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> ref_event, estim_event;
+  std::size_t num_identical, num_flags, num_far;
+  std::vector<std::string> filenames;
+  double max_pos_diff, max_log_diff;
+  std::size_t event_index, num_events;
+  std::size_t first_diff;
+  double pos_diff;
+  float tolerance;
+  std::string arg;
+  int i;
+  
+  tolerance = float(0);
+  for(i = 1; i < argc; ++i) {
+    arg = argv[i];
+    if(arg.compare(0, 12, "--tolerance=") == 0) {
+      tolerance = std::stof(arg.substr(12));
+    } else if(arg.compare(0, 2, "--") == 0) {
+      throw std::runtime_error("Unknown option " + arg);
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+  if(filenames.size() != 2) {
+    std::cerr << "Usage: " << argv[0] << " [--tolerance=MM] REFERENCE OUTPUT" << std::endl;
+    return(1);
+  }
+  ref_event = read_estim_events(filenames[0].c_str());
+  estim_event = read_estim_events(filenames[1].c_str());
+  num_events = std::min(ref_event.size(), estim_event.size());
+  num_identical = num_flags = num_far = 0;
+  max_pos_diff = max_log_diff = 0.0;
+  first_diff = num_events;
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    const estim_event_t & a = ref_event[event_index];
+    const estim_event_t & b = estim_event[event_index];
+    if(is_same_estim_event(a, b)) {
+      ++num_identical;
+      continue;
+    }
+    pos_diff = std::max(std::fabs(double(a.x_pos) - double(b.x_pos)), std::fabs(double(a.y_pos) - double(b.y_pos)));
+    max_pos_diff = std::max(max_pos_diff, pos_diff);
+    max_log_diff = std::max(max_log_diff, std::fabs(double(a.log_like) - double(b.log_like)));
+    if(a.valid != b.valid) {
+      ++num_flags;
+    }
+    if(pos_diff > double(tolerance)) {
+      ++num_far;
+    }
+    if(((a.valid != b.valid) || (pos_diff > double(tolerance))) && (first_diff == num_events)) {
+      first_diff = event_index;
+    }
+  }
+  std::cout << "Compared " << num_events << " events (" << ref_event.size() << " in the reference, " << estim_event.size() << " in the output): " << num_identical << " identical, " << num_flags << " valid flags and " << num_far << " positions beyond " << tolerance << " mm differ." << std::endl;
+  std::cout << "Largest differences: " << max_pos_diff << " mm in position, " << max_log_diff << " in log-likelihood." << std::endl;
+  if(first_diff < num_events) {
+    std::cout << "First difference at event " << first_diff << ": (" << ref_event[first_diff].x_pos << ", " << ref_event[first_diff].y_pos << ", " << ref_event[first_diff].valid << ") against (" << estim_event[first_diff].x_pos << ", " << estim_event[first_diff].y_pos << ", " << estim_event[first_diff].valid << ")." << std::endl;
+    return(1);
+  }
+  return(0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+bool is_same_estim_event(const estim_event_t & a, const estim_event_t & b) {
+  return((a.valid == b.valid) && (std::memcmp(& a.x_pos, & b.x_pos, sizeof(float)) == 0) && (std::memcmp(& a.y_pos, & b.y_pos, sizeof(float)) == 0) && (std::memcmp(& a.log_like, & b.log_like, sizeof(float)) == 0));
+}
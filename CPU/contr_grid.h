@@ -0,0 +1,299 @@
+#ifndef _CONTR_GRID_H
+#define _CONTR_GRID_H
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "nn_index.h"
+#include "event_cache.h"
+#include "prefilter.h"
+#include "spatial_binning.h"
+#include "search_schedule.h"
+#include "image.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+
+// Warm start measured on a sample of events (see measure_nn_start()).
+struct nn_start_t {
+  unsigned int start_iter;
+  float window;
+  float agreement;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+std::vector<estim_event_t, aligned_allocator<estim_event_t>> contr_grid(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, const calibr_funct_t & calibr_funct, const estim_options_t & estim_options, const nn_index_t & nn_index, event_cache_t *event_cache, const prefilter_t & prefilter, image_t *image = nullptr);
+unsigned int get_start_iter(const estim_options_t & estim_options, const std::vector<float> & steps, const nn_index_t & nn_index, const calibr_funct_t & calibr_funct, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data);
+nn_start_t measure_nn_start(const estim_options_t & estim_options, const std::vector<float> & steps, const nn_index_t & nn_index, const calibr_funct_t & calibr_funct, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data);
+void contr_grid_event(estim_event_t & estim_event, const PMT_data_t & PMT_data, const calibr_funct_t & calibr_funct, const estim_options_t & estim_options, const std::vector<float> & steps, unsigned int start_iter, const nn_index_t & nn_index);
+void reject_event(estim_event_t & estim_event);
+std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> get_synthetic_PMT_data(const calibr_funct_t & calibr_funct, unsigned int num_events, unsigned int seed);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+std::vector<estim_event_t, aligned_allocator<estim_event_t>> contr_grid(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, const calibr_funct_t & calibr_funct, const estim_options_t & estim_options, const nn_index_t & nn_index, event_cache_t *event_cache, const prefilter_t & prefilter, image_t *image) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event(PMT_data.size());
+  std::chrono::time_point<std::chrono::steady_clock> start, end;
+  std::vector<float> centroid_x, centroid_y;
+  std::vector<unsigned int> order;
+  std::vector<uint8_t> accept;
+  std::vector<float> steps;
+  unsigned int num_rejected;
+  unsigned int event_index;
+  unsigned int num_events;
+  unsigned int start_iter;
+  unsigned int n;
+  
+  num_events = (unsigned int) PMT_data.size();
+  if(estim_options.verbose) {
+    std::cout << "Number of events: " << num_events << "." << std::endl;
+    std::cout << "Search schedule: " << format_search_schedule(estim_options.search_schedule) << "." << std::endl;
+  }
+  steps = get_search_steps(estim_options.search_schedule);
+  start_iter = get_start_iter(estim_options, steps, nn_index, calibr_funct, PMT_data);
+  start = std::chrono::steady_clock::now();
+  if(prefilter.use_energy_window || prefilter.use_roi || estim_options.spatial_binning) {
+    num_rejected = prefilter_events(accept, centroid_x, centroid_y, PMT_data, prefilter);
+    if(estim_options.verbose) {
+      std::cout << "Prefilter rejected " << num_rejected << " events." << std::endl;
+    }
+  }
+  // With spatial binning, the events are visited tile by tile according to
+  // their linearized centroid, so that consecutive searches touch the same
+  // spline coefficients; results are still stored at the original index.
+  if(estim_options.spatial_binning) {
+    get_binned_order(order, centroid_x, centroid_y, BINNING_GRID_SIZE_X, BINNING_GRID_SIZE_Y);
+  }
+  for(n = 0; n < num_events; ++n) {
+    event_index = order.empty() ? n : order[n];
+    if(!accept.empty() && !accept[event_index]) {
+      reject_event(estim_event[event_index]);
+      continue;
+    }
+    if((event_cache == nullptr) || !event_cache->find(PMT_data[event_index], estim_event[event_index])) {
+      contr_grid_event(estim_event[event_index], PMT_data[event_index], calibr_funct, estim_options, steps, start_iter, nn_index);
+      if(event_cache != nullptr) {
+        event_cache->insert(PMT_data[event_index], estim_event[event_index]);
+      }
+    }
+    if(image != nullptr) {
+      image->add(estim_event[event_index]);
+    }
+  }
+  end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> diff = end - start;
+  if(estim_options.verbose) {
+    std::cout << "Elapsed time: " << diff.count() << " s (" << double(num_events) / diff.count() << " events/s)." << std::endl;
+  }
+  return(estim_event);
+}
+
+
+// When the search is seeded by the nearest-neighbor index, skip the coarse
+// iterations whose grid is wider than needed to cover the distance from
+// the nearest-neighbor position to the result of the full search, as
+// measured on a sample of the events. The warm start is refused when it
+// does not reproduce the full search on that sample.
+unsigned int get_start_iter(const estim_options_t & estim_options, const std::vector<float> & steps, const nn_index_t & nn_index, const calibr_funct_t & calibr_funct, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data) {
+  nn_start_t nn_start;
+  
+  if(estim_options.mode != ESTIM_MODE_NN_START) {
+    return(0);
+  }
+  nn_start = measure_nn_start(estim_options, steps, nn_index, calibr_funct, PMT_data);
+  if(estim_options.verbose) {
+    std::cout << "Nearest-neighbor start: window " << nn_start.window << ", " << nn_start.start_iter << " iterations skipped, " << nn_start.agreement << "% of the sample in agreement with the full search." << std::endl;
+  }
+  if(nn_start.agreement < NN_START_MIN_AGREEMENT) {
+    std::ostringstream oss;
+    oss << "The nearest-neighbor start agrees with the full search for only " << nn_start.agreement << "% of the sample (" << NN_START_MIN_AGREEMENT << "% needed), use --mode=contr_grid!";
+    throw std::runtime_error(oss.str());
+  }
+  return(nn_start.start_iter);
+}
+
+
+// Runs the full search on up to NN_START_NUM_SAMPLES events spread over
+// PMT_data. The window is the NN_START_QUANTILE quantile of the distance
+// from the nearest-neighbor position to the full-search result, along the
+// worse axis and in units of the field of view; the first iteration kept
+// is the last one whose grid still spans the window on each side of the
+// starting point. Only the events that the full search accepts size the
+// window, unless their nearest-neighbor position is already more likely
+// than the full-search result, which then stopped on a local maximum. The
+// agreement is the percentage of the sample that the warm start then
+// estimates within NN_START_TOLERANCE mm of the full search, with a
+// log-likelihood at least as large, or rejects like the full search.
+nn_start_t measure_nn_start(const estim_options_t & estim_options, const std::vector<float> & steps, const nn_index_t & nn_index, const calibr_funct_t & calibr_funct, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data) {
+  std::vector<estim_event_t> full_estim_event;
+  estim_options_t full_options, nn_options;
+  std::vector<std::size_t> sample;
+  std::vector<float> distances;
+  estim_event_t estim_event;
+  estim_event_t nn_event;
+  std::size_t event_index;
+  unsigned int num_within;
+  unsigned int num_iter;
+  nn_start_t nn_start;
+  std::size_t stride;
+  float dx, dy;
+  std::size_t n;
+  
+  nn_start.start_iter = 0;
+  nn_start.window = float(0);
+  nn_start.agreement = float(100);
+  full_options = nn_options = estim_options;
+  full_options.mode = ESTIM_MODE_CONTR_GRID;
+  nn_options.mode = ESTIM_MODE_NN_ONLY;
+  stride = std::max(std::size_t(1), PMT_data.size() / NN_START_NUM_SAMPLES);
+  for(event_index = 0; event_index < PMT_data.size(); event_index += stride) {
+    contr_grid_event(nn_event, PMT_data[event_index], calibr_funct, nn_options, steps, 0, nn_index);
+    contr_grid_event(estim_event, PMT_data[event_index], calibr_funct, full_options, steps, 0, nn_index);
+    if(estim_event.valid && !(nn_event.log_like > estim_event.log_like)) {
+      dx = (estim_event.x_pos - nn_event.x_pos) / (CAMERA_MAX_POS - CAMERA_MIN_POS);
+      dy = (estim_event.y_pos - nn_event.y_pos) / (CAMERA_MAX_POS - CAMERA_MIN_POS);
+      distances.push_back(std::max(std::fabs(dx), std::fabs(dy)));
+    }
+    full_estim_event.push_back(estim_event);
+    sample.push_back(event_index);
+  }
+  if(distances.empty()) {
+    return(nn_start);
+  }
+  std::sort(distances.begin(), distances.end());
+  nn_start.window = distances[std::size_t(NN_START_QUANTILE * float(distances.size() - 1))];
+  num_iter = (unsigned int) estim_options.search_schedule.size();
+  while(((nn_start.start_iter + 1) < num_iter) && (steps[nn_start.start_iter + 1] * (float(estim_options.search_schedule[nn_start.start_iter + 1].grid_size - 1) / 2.00f) >= nn_start.window)) {
+    ++nn_start.start_iter;
+  }
+  num_within = 0;
+  for(n = 0; n < sample.size(); ++n) {
+    contr_grid_event(estim_event, PMT_data[sample[n]], calibr_funct, estim_options, steps, nn_start.start_iter, nn_index);
+    dx = estim_event.x_pos - full_estim_event[n].x_pos;
+    dy = estim_event.y_pos - full_estim_event[n].y_pos;
+    num_within += (((dx * dx + dy * dy) <= (NN_START_TOLERANCE * NN_START_TOLERANCE)) || !(estim_event.log_like < full_estim_event[n].log_like) || (!estim_event.valid && !full_estim_event[n].valid)) ? 1 : 0;
+  }
+  nn_start.agreement = float(100) * float(num_within) / float(sample.size());
+  return(nn_start);
+}
+
+
+// Estimates one event with the schedule of estim_options, whose grid
+// spacings (steps) and first iteration after a nearest-neighbor start
+// (start_iter) are computed once by the caller. Works on the stack only.
+void contr_grid_event(estim_event_t & estim_event, const PMT_data_t & PMT_data, const calibr_funct_t & calibr_funct, const estim_options_t & estim_options, const std::vector<float> & steps, unsigned int start_iter, const nn_index_t & nn_index) {
+  float current_x, current_y;
+  float tmp_data[NUM_PMTS];
+  unsigned int num_iter;
+  bool inside_x, inside_y;
+  float log_like, max_log_like;
+  float camera_MDRF;
+  unsigned int iter;
+  int node;
+  int pmt;
+  
+  num_iter = (unsigned int) estim_options.search_schedule.size();
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    tmp_data[pmt] = PMT_data.val[pmt] / calibr_funct.gain[pmt];
+  }
+  current_x = current_y = float(1) / float(2);
+  max_log_like = -HUGE_VALF;
+  iter = 0;
+  node = (estim_options.mode != ESTIM_MODE_CONTR_GRID) ? nn_index.find_best(tmp_data) : -1;
+  if(node >= 0) {
+    nn_index.get_pos(node, current_x, current_y);
+    iter = start_iter;
+  }
+  if(estim_options.mode == ESTIM_MODE_NN_ONLY) {
+    max_log_like = float(0);
+    for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+      camera_MDRF = calibr_funct.mdrf[pmt](current_x, current_y);
+      if((tmp_data[pmt] != float(0)) || (camera_MDRF != float(0))) {
+        max_log_like += tmp_data[pmt] * std::log(camera_MDRF) - camera_MDRF;
+      }
+    }
+    iter = num_iter;
+  }
+  for(; iter < num_iter; ++iter) {
+    estim_options.search_schedule[iter].kernel(current_x, current_y, max_log_like, steps[iter], estim_options.search_schedule[iter].grid_size, tmp_data, calibr_funct);
+  }
+  inside_x = (float(0) < current_x) && (current_x < float(1));
+  inside_y = (float(0) < current_y) && (current_y < float(1));
+  if(inside_x && inside_y) {
+    log_like = max_log_like;
+    for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+      if(tmp_data[pmt] > float(0)) {
+        log_like -= log_gamma(tmp_data[pmt] + float(1));
+      }
+    }
+    estim_event.valid = log_like > calibr_funct.thresh(current_x, current_y);
+    estim_event.log_like = log_like;
+  } else {
+    estim_event.valid = 0;
+    estim_event.log_like = float(0);
+  }
+  estim_event.x_pos = CAMERA_MIN_POS + current_x * (CAMERA_MAX_POS - CAMERA_MIN_POS);
+  estim_event.y_pos = CAMERA_MIN_POS + current_y * (CAMERA_MAX_POS - CAMERA_MIN_POS);
+  return;
+}
+
+
+// Result of an event rejected by the prefilter. The record does not depend
+// on the event, so that the events of the blocks skipped through an LM
+// index, which are never read, get the same one (see lm_index.h). The
+// corner of the field of view keeps it invalid under rethreshold_events().
+void reject_event(estim_event_t & estim_event) {
+  estim_event.valid = 0;
+  estim_event.log_like = -HUGE_VALF;
+  estim_event.x_pos = CAMERA_MIN_POS;
+  estim_event.y_pos = CAMERA_MIN_POS;
+  return;
+}
+
+
+// Draws events uniformly over the field of view with the noise of the
+// estimator's model: the counts divided by the gains are Poisson-distributed
+// with the MDRFs as means (the MDRFs of the calibration are already divided
+// by the gains).
+std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> get_synthetic_PMT_data(const calibr_funct_t & calibr_funct, unsigned int num_events, unsigned int seed) {
+  std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data(num_events);
+  std::uniform_real_distribution<float> uniform(0.00f, 1.00f);
+  std::mt19937 generator(seed);
+  unsigned int event_index;
+  double mean;
+  float x, y;
+  int pmt;
+  
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    x = uniform(generator);
+    y = uniform(generator);
+    for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+      mean = double(std::max(float(0), calibr_funct.mdrf[pmt](x, y)));
+      std::poisson_distribution<int> poisson(std::max(mean, 1e-6));
+      PMT_data[event_index].val[pmt] = int16_t(std::min(std::round(calibr_funct.gain[pmt] * float(poisson(generator))), 32767.0f));
+    }
+  }
+  return(PMT_data);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _CONTR_GRID_H
@@ -0,0 +1,83 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <string>
+#include <stdexcept>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "compact_format.h"
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion convert_estim.cpp -o convert_estim
+//
+// Converts estimates between the format of write_estim_events() (.dat) and
+// the compact columnar format of compact_format.h (.ecf). The direction is
+// given by the magic number of the input.
+//
+// Usage: ./convert_estim [--valid-only] [--no-log-like] [--block-size=N] INPUT OUTPUT
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+bool is_compact_file(const char *filename);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char **argv) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+  std::vector<std::string> filenames;
+  uint32_t block_size;
+  std::string arg;
+  uint32_t flags;
+  int i;
+  
+  flags = COMPACT_LOG_LIKE;
+  block_size = COMPACT_BLOCK_SIZE;
+  for(i = 1; i < argc; ++i) {
+    arg = argv[i];
+    if(arg == "--valid-only") {
+      flags |= COMPACT_VALID_ONLY;
+    } else if(arg == "--no-log-like") {
+      flags &= ~uint32_t(COMPACT_LOG_LIKE);
+    } else if(arg.compare(0, 13, "--block-size=") == 0) {
+      block_size = uint32_t(std::stoul(arg.substr(13)));
+    } else if(arg.compare(0, 2, "--") == 0) {
+      throw std::runtime_error("Unknown option " + arg);
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+  if(filenames.size() != 2) {
+    std::cerr << "Usage: " << argv[0] << " [--valid-only] [--no-log-like] [--block-size=N] INPUT OUTPUT" << std::endl;
+    return(1);
+  }
+  if(is_compact_file(filenames[0].c_str())) {
+    estim_event = read_compact_events(filenames[0].c_str());
+    write_estim_events(estim_event, filenames[1].c_str());
+  } else {
+    estim_event = read_estim_events(filenames[0].c_str());
+    write_compact_events(estim_event, filenames[1].c_str(), flags, block_size);
+  }
+  std::cout << "Converted " << estim_event.size() << " events." << std::endl;
+  return(0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+bool is_compact_file(const char *filename) {
+  std::ifstream ifs;
+  char magic[4];
+  
+  ifs.open(filename, std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    throw std::runtime_error(std::string("Cannot open ") + filename);
+  }
+  ifs.read(magic, sizeof(magic));
+  return(ifs && (std::string(magic, sizeof(magic)) == "ECF1"));
+}
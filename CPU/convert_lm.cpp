@@ -0,0 +1,114 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <string>
+#include <stdexcept>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "packed_lm.h"
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion convert_lm.cpp -o convert_lm
+//
+// Converts list-mode files between the big-endian format of the cameras and
+// the packed format of packed_lm.h (.plm). The direction is given by the
+// magic number of the input. Negative values are clamped at zero, as the
+// estimator reads them, so a file converted back differs from its original
+// only where these were negative.
+//
+// Usage: ./convert_lm [--pmts=N] [--block-size=N] INPUT OUTPUT
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void read_LM_header(const char *filename, int16_t LM_header[9]);
+void write_LM_values(const std::vector<int16_t> & LM_values, const int16_t LM_header[9], const char *filename);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char **argv) {
+  std::vector<std::string> filenames;
+  std::vector<int16_t> LM_values;
+  packed_lm_header_t header;
+  int16_t LM_header[9];
+  uint32_t block_size;
+  std::string arg;
+  int num_pmts;
+  int i;
+  
+  num_pmts = NUM_PMTS;
+  block_size = PACKED_LM_BLOCK_SIZE;
+  for(i = 1; i < argc; ++i) {
+    arg = argv[i];
+    if(arg.compare(0, 7, "--pmts=") == 0) {
+      num_pmts = std::stoi(arg.substr(7));
+    } else if(arg.compare(0, 13, "--block-size=") == 0) {
+      block_size = uint32_t(std::stoul(arg.substr(13)));
+    } else if(arg.compare(0, 2, "--") == 0) {
+      throw std::runtime_error("Unknown option " + arg);
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+  if(filenames.size() != 2) {
+    std::cerr << "Usage: " << argv[0] << " [--pmts=N] [--block-size=N] INPUT OUTPUT" << std::endl;
+    return(1);
+  }
+  if(is_packed_LM_file(filenames[0].c_str())) {
+    header = read_packed_LM_header(filenames[0].c_str());
+    LM_values = get_packed_LM_values(filenames[0].c_str(), int(header.num_pmts));
+    write_LM_values(LM_values, header.LM_header, filenames[1].c_str());
+    num_pmts = int(header.num_pmts);
+  } else {
+    read_LM_header(filenames[0].c_str(), LM_header);
+    LM_values = get_LM_values(filenames[0].c_str(), num_pmts);
+    write_packed_LM_values(LM_values, LM_header, num_pmts, filenames[1].c_str(), block_size);
+  }
+  std::cout << "Converted " << (LM_values.size() / std::size_t(num_pmts)) << " events." << std::endl;
+  return(0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// The header words are kept as stored, in big endian.
+void read_LM_header(const char *filename, int16_t LM_header[9]) {
+  std::ifstream ifs;
+  
+  ifs.open(filename, std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open input LM file!");
+  }
+  ifs.read(reinterpret_cast<char *>(LM_header), 9 * sizeof(LM_header[0]));
+  if(!ifs) {
+    throw std::runtime_error("Truncated input LM file!");
+  }
+  return;
+}
+
+
+void write_LM_values(const std::vector<int16_t> & LM_values, const int16_t LM_header[9], const char *filename) {
+  std::vector<uint16_t> words(LM_values.size());
+  std::ofstream ofs;
+  std::size_t n;
+  
+  ofs.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!ofs) {
+    throw std::runtime_error("Cannot create LM file!");
+  }
+  for(n = 0; n < words.size(); ++n) {
+    words[n] = __builtin_bswap16(uint16_t(LM_values[n]));
+  }
+  ofs.write(reinterpret_cast<const char *>(LM_header), 9 * sizeof(LM_header[0]));
+  ofs.write(reinterpret_cast<const char *>(words.data()), std::streamsize(words.size() * sizeof(words[0])));
+  ofs.close();
+  if(!ofs) {
+    throw std::runtime_error("Cannot write LM file!");
+  }
+  return;
+}
@@ -0,0 +1,779 @@
+#ifndef _CPU_DISPATCH_H
+#define _CPU_DISPATCH_H
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <cmath>
+#include <immintrin.h>
+#include "my_defines.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Hot kernels compiled for several instruction sets in the same binary. Each
+// variant is built with a GCC target attribute, so the build line stays at
+// baseline x86-64, and the best one supported by the CPU is selected once
+// at startup from the CPUID feature flags. All the variants perform the
+// same operations in the same order, without FMA contractions, so they
+// produce identical results.
+//
+// The spline kernels take the coefficients of the 3 x 3 support of a point
+// with the PMT index last (SIMD_PMT_STRIDE values per coefficient, padded
+// with zeros) and the products of the basis functions. The likelihood
+// kernel returns the sum over the PMTs of data * log(mdrf) - mdrf, skipping
+// the PMTs where both are zero. The byte-swap kernel converts big-endian
+// list-mode words and clamps them at zero. The unpacking kernel expands
+// values of 1 to 16 bits packed little-endian without gaps (see
+// packed_lm.h) and may read up to 16 bytes past the packed data.
+enum cpu_isa_t {
+  CPU_ISA_GENERIC,
+  CPU_ISA_SSE42,
+  CPU_ISA_AVX2,
+  CPU_ISA_AVX512
+};
+
+
+struct cpu_kernels_t {
+  cpu_isa_t isa;
+  const char *name;
+  void (*eval_spline)(float output[SIMD_PMT_STRIDE], const float *coefs, const float weight[MX][MY]);
+  void (*eval_spline_fixed)(int32_t output[SIMD_PMT_STRIDE], const int32_t *coefs, const int64_t weight[MX][MY]);
+  float (*get_log_like)(const float data[SIMD_PMT_STRIDE], const float mdrf[SIMD_PMT_STRIDE]);
+  void (*bswap_clamp)(int16_t *output, const int16_t *input, std::size_t num_values);
+  void (*unpack_bits)(int16_t *output, const uint8_t *input, std::size_t num_values, int bits);
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+cpu_kernels_t & get_cpu_kernels();
+cpu_kernels_t get_cpu_kernels(cpu_isa_t isa);
+cpu_isa_t detect_cpu_isa();
+cpu_isa_t parse_cpu_isa(const std::string & name);
+void select_cpu_kernels(const std::string & name);
+inline float log_approx(float x);
+float sum_log_like_terms(const float terms[SIMD_PMT_STRIDE]);
+void eval_spline_generic(float output[SIMD_PMT_STRIDE], const float *coefs, const float weight[MX][MY]);
+void eval_spline_fixed_generic(int32_t output[SIMD_PMT_STRIDE], const int32_t *coefs, const int64_t weight[MX][MY]);
+float get_log_like_generic(const float data[SIMD_PMT_STRIDE], const float mdrf[SIMD_PMT_STRIDE]);
+void bswap_clamp_generic(int16_t *output, const int16_t *input, std::size_t num_values);
+void unpack_bits_generic(int16_t *output, const uint8_t *input, std::size_t num_values, int bits);
+void get_unpack_tables(uint8_t shuffle[32], uint32_t shift[8], std::size_t base[2], int bits);
+__attribute__((target("sse4.2"))) void eval_spline_sse42(float output[SIMD_PMT_STRIDE], const float *coefs, const float weight[MX][MY]);
+__attribute__((target("sse4.2"))) void eval_spline_fixed_sse42(int32_t output[SIMD_PMT_STRIDE], const int32_t *coefs, const int64_t weight[MX][MY]);
+__attribute__((target("sse4.2"))) float get_log_like_sse42(const float data[SIMD_PMT_STRIDE], const float mdrf[SIMD_PMT_STRIDE]);
+__attribute__((target("sse4.2"))) void bswap_clamp_sse42(int16_t *output, const int16_t *input, std::size_t num_values);
+__attribute__((target("sse4.2"))) void unpack_bits_sse42(int16_t *output, const uint8_t *input, std::size_t num_values, int bits);
+__attribute__((target("avx2"))) void eval_spline_avx2(float output[SIMD_PMT_STRIDE], const float *coefs, const float weight[MX][MY]);
+__attribute__((target("avx2"))) void eval_spline_fixed_avx2(int32_t output[SIMD_PMT_STRIDE], const int32_t *coefs, const int64_t weight[MX][MY]);
+__attribute__((target("avx2"))) float get_log_like_avx2(const float data[SIMD_PMT_STRIDE], const float mdrf[SIMD_PMT_STRIDE]);
+__attribute__((target("avx2"))) void bswap_clamp_avx2(int16_t *output, const int16_t *input, std::size_t num_values);
+__attribute__((target("avx2"))) void unpack_bits_avx2(int16_t *output, const uint8_t *input, std::size_t num_values, int bits);
+__attribute__((target("avx512f,avx512bw"))) void eval_spline_avx512(float output[SIMD_PMT_STRIDE], const float *coefs, const float weight[MX][MY]);
+__attribute__((target("avx512f,avx512bw"))) void eval_spline_fixed_avx512(int32_t output[SIMD_PMT_STRIDE], const int32_t *coefs, const int64_t weight[MX][MY]);
+__attribute__((target("avx512f,avx512bw"))) float get_log_like_avx512(const float data[SIMD_PMT_STRIDE], const float mdrf[SIMD_PMT_STRIDE]);
+__attribute__((target("avx512f,avx512bw"))) void bswap_clamp_avx512(int16_t *output, const int16_t *input, std::size_t num_values);
+__attribute__((target("avx512f,avx512bw"))) void unpack_bits_avx512(int16_t *output, const uint8_t *input, std::size_t num_values, int bits);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Kernels in use. They are chosen on the first call, and can be replaced
+// with select_cpu_kernels() before the estimation starts.
+cpu_kernels_t & get_cpu_kernels() {
+  static cpu_kernels_t cpu_kernels = get_cpu_kernels(detect_cpu_isa());
+  
+  return(cpu_kernels);
+}
+
+
+cpu_kernels_t get_cpu_kernels(cpu_isa_t isa) {
+  cpu_kernels_t cpu_kernels;
+  
+  switch(isa) {
+    case CPU_ISA_AVX512:
+      cpu_kernels = {isa, "avx512", eval_spline_avx512, eval_spline_fixed_avx512, get_log_like_avx512, bswap_clamp_avx512, unpack_bits_avx512};
+      break;
+    case CPU_ISA_AVX2:
+      cpu_kernels = {isa, "avx2", eval_spline_avx2, eval_spline_fixed_avx2, get_log_like_avx2, bswap_clamp_avx2, unpack_bits_avx2};
+      break;
+    case CPU_ISA_SSE42:
+      cpu_kernels = {isa, "sse4.2", eval_spline_sse42, eval_spline_fixed_sse42, get_log_like_sse42, bswap_clamp_sse42, unpack_bits_sse42};
+      break;
+    default:
+      cpu_kernels = {CPU_ISA_GENERIC, "generic", eval_spline_generic, eval_spline_fixed_generic, get_log_like_generic, bswap_clamp_generic, unpack_bits_generic};
+      break;
+  }
+  return(cpu_kernels);
+}
+
+
+cpu_isa_t detect_cpu_isa() {
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    return(CPU_ISA_AVX512);
+  }
+  if(__builtin_cpu_supports("avx2")) {
+    return(CPU_ISA_AVX2);
+  }
+  if(__builtin_cpu_supports("sse4.2")) {
+    return(CPU_ISA_SSE42);
+  }
+  return(CPU_ISA_GENERIC);
+}
+
+
+// Instruction set of a name ("auto", "generic", "sse4.2", "avx2" or
+// "avx512"). Variants the CPU does not support are refused.
+cpu_isa_t parse_cpu_isa(const std::string & name) {
+  cpu_isa_t isa, max_isa;
+  
+  max_isa = detect_cpu_isa();
+  if(name == "auto") {
+    isa = max_isa;
+  } else if(name == "generic") {
+    isa = CPU_ISA_GENERIC;
+  } else if(name == "sse4.2") {
+    isa = CPU_ISA_SSE42;
+  } else if(name == "avx2") {
+    isa = CPU_ISA_AVX2;
+  } else if(name == "avx512") {
+    isa = CPU_ISA_AVX512;
+  } else {
+    throw std::runtime_error("Unknown instruction set " + name);
+  }
+  if(isa > max_isa) {
+    throw std::runtime_error("Instruction set " + name + " not supported by this CPU!");
+  }
+  return(isa);
+}
+
+
+// Selects the kernels in use by name (see parse_cpu_isa()).
+void select_cpu_kernels(const std::string & name) {
+  get_cpu_kernels() = get_cpu_kernels(parse_cpu_isa(name));
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Natural log with the Cephes single-precision algorithm: the argument is
+// split into a mantissa in [sqrt(0.5), sqrt(2)) and an exponent, and the
+// log of the mantissa is a degree-9 polynomial. Denormals are flushed to
+// the smallest normal value, log(0) is -inf and negative arguments give a
+// NaN. The vector kernels below repeat these operations lane by lane.
+inline float log_approx(float x) {
+  float e, m, y, z;
+  uint32_t bits;
+  
+  if(!(x > float(0))) {
+    return((x == float(0)) ? -HUGE_VALF : std::nanf(""));
+  }
+  if(x == HUGE_VALF) {
+    return(x);
+  }
+  x = std::max(x, 1.17549435e-38f);
+  std::memcpy(& bits, & x, sizeof(bits));
+  e = float(int((bits >> 23) & 0xFF) - 126);
+  bits = (bits & 0x807FFFFF) | 0x3F000000;
+  std::memcpy(& m, & bits, sizeof(m));
+  if(m < 0.707106781186547524f) {
+    e = e - 1.0f;
+    m = m + m - 1.0f;
+  } else {
+    m = m - 1.0f;
+  }
+  z = m * m;
+  y = 7.0376836292e-2f;
+  y = y * m - 1.1514610310e-1f;
+  y = y * m + 1.1676998740e-1f;
+  y = y * m - 1.2420140846e-1f;
+  y = y * m + 1.4249322787e-1f;
+  y = y * m - 1.6668057665e-1f;
+  y = y * m + 2.0000714765e-1f;
+  y = y * m - 2.4999993993e-1f;
+  y = y * m + 3.3333331174e-1f;
+  y = y * m * z;
+  y = y + e * -2.12194440e-4f;
+  y = y - 0.5f * z;
+  m = m + y;
+  m = m + e * 0.693359375f;
+  return(m);
+}
+
+
+// The terms are always added in PMT order, so that the sum does not depend
+// on the vector width.
+float sum_log_like_terms(const float terms[SIMD_PMT_STRIDE]) {
+  float log_like;
+  int pmt;
+  
+  log_like = float(0);
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    log_like += terms[pmt];
+  }
+  return(log_like);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void eval_spline_generic(float output[SIMD_PMT_STRIDE], const float *coefs, const float weight[MX][MY]) {
+  const float *ptr;
+  int i_x, i_y;
+  int pmt;
+  
+  for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+    output[pmt] = float(0);
+  }
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      ptr = coefs + (i_y * (MX + KX) + i_x) * SIMD_PMT_STRIDE;
+      for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+        output[pmt] += ptr[pmt] * weight[i_x][i_y];
+      }
+    }
+  }
+  return;
+}
+
+
+void eval_spline_fixed_generic(int32_t output[SIMD_PMT_STRIDE], const int32_t *coefs, const int64_t weight[MX][MY]) {
+  int64_t acc[SIMD_PMT_STRIDE];
+  const int32_t *ptr;
+  int i_x, i_y;
+  int pmt;
+  
+  for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+    acc[pmt] = 0;
+  }
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      ptr = coefs + (i_y * (MX + KX) + i_x) * SIMD_PMT_STRIDE;
+      for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+        acc[pmt] += int64_t(uint64_t(int64_t(ptr[pmt]) * weight[i_x][i_y]) >> MDRF_FRAC_BITS);
+      }
+    }
+  }
+  for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+    output[pmt] = int32_t(uint32_t(uint64_t(acc[pmt])));
+  }
+  return;
+}
+
+
+float get_log_like_generic(const float data[SIMD_PMT_STRIDE], const float mdrf[SIMD_PMT_STRIDE]) {
+  float terms[SIMD_PMT_STRIDE];
+  int pmt;
+  
+  for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+    terms[pmt] = ((data[pmt] != float(0)) || (mdrf[pmt] != float(0))) ? (data[pmt] * log_approx(mdrf[pmt]) - mdrf[pmt]) : float(0);
+  }
+  return(sum_log_like_terms(terms));
+}
+
+
+void bswap_clamp_generic(int16_t *output, const int16_t *input, std::size_t num_values) {
+  std::size_t n;
+  
+  for(n = 0; n < num_values; ++n) {
+    output[n] = std::max(int16_t(0), int16_t(__builtin_bswap16(uint16_t(input[n]))));
+  }
+  return;
+}
+
+
+void unpack_bits_generic(int16_t *output, const uint8_t *input, std::size_t num_values, int bits) {
+  const uint32_t mask = (uint32_t(1) << bits) - 1;
+  std::size_t n, bit;
+  uint32_t word;
+  
+  for(n = 0; n < num_values; ++n) {
+    bit = n * std::size_t(bits);
+    word = uint32_t(input[bit / 8]) | (uint32_t(input[bit / 8 + 1]) << 8) | (uint32_t(input[bit / 8 + 2]) << 16);
+    output[n] = int16_t((word >> (bit % 8)) & mask);
+  }
+  return;
+}
+
+
+// The vector kernels unpack groups of 8 values, which take bits bytes. The
+// values 4h to 4h + 3 of a group are gathered from the 16 bytes at base[h]
+// into 32-bit lanes by the byte shuffle, and shifted right by shift. Each
+// value spans at most 3 bytes, and base[1] is at most 8 bytes into the
+// group.
+void get_unpack_tables(uint8_t shuffle[32], uint32_t shift[8], std::size_t base[2], int bits) {
+  std::size_t bit;
+  int h, k, j;
+  
+  for(h = 0; h < 2; ++h) {
+    base[h] = std::size_t(4 * h * bits) / 8;
+    for(k = 0; k < 4; ++k) {
+      bit = std::size_t((4 * h + k) * bits) - 8 * base[h];
+      for(j = 0; j < 3; ++j) {
+        shuffle[16 * h + 4 * k + j] = uint8_t(bit / 8 + std::size_t(j));
+      }
+      shuffle[16 * h + 4 * k + 3] = 0x80;
+      shift[4 * h + k] = uint32_t(bit % 8);
+    }
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+__attribute__((target("sse4.2"))) void eval_spline_sse42(float output[SIMD_PMT_STRIDE], const float *coefs, const float weight[MX][MY]) {
+  __m128 acc[SIMD_PMT_STRIDE / 4];
+  const float *ptr;
+  int i_x, i_y;
+  __m128 w;
+  int g;
+  
+  for(g = 0; g < (SIMD_PMT_STRIDE / 4); ++g) {
+    acc[g] = _mm_setzero_ps();
+  }
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      ptr = coefs + (i_y * (MX + KX) + i_x) * SIMD_PMT_STRIDE;
+      w = _mm_set1_ps(weight[i_x][i_y]);
+      for(g = 0; g < (SIMD_PMT_STRIDE / 4); ++g) {
+        acc[g] = _mm_add_ps(acc[g], _mm_mul_ps(_mm_loadu_ps(ptr + 4 * g), w));
+      }
+    }
+  }
+  for(g = 0; g < (SIMD_PMT_STRIDE / 4); ++g) {
+    _mm_storeu_ps(output + 4 * g, acc[g]);
+  }
+  return;
+}
+
+
+__attribute__((target("sse4.2"))) void eval_spline_fixed_sse42(int32_t output[SIMD_PMT_STRIDE], const int32_t *coefs, const int64_t weight[MX][MY]) {
+  __m128i acc[SIMD_PMT_STRIDE / 2];
+  alignas(16) int64_t lanes[2];
+  const int32_t *ptr;
+  int i_x, i_y;
+  __m128i w, c;
+  int g;
+  
+  for(g = 0; g < (SIMD_PMT_STRIDE / 2); ++g) {
+    acc[g] = _mm_setzero_si128();
+  }
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      ptr = coefs + (i_y * (MX + KX) + i_x) * SIMD_PMT_STRIDE;
+      w = _mm_set1_epi64x(weight[i_x][i_y]);
+      for(g = 0; g < (SIMD_PMT_STRIDE / 2); ++g) {
+        c = _mm_cvtepi32_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(ptr + 2 * g)));
+        acc[g] = _mm_add_epi64(acc[g], _mm_srli_epi64(_mm_mul_epi32(c, w), MDRF_FRAC_BITS));
+      }
+    }
+  }
+  for(g = 0; g < (SIMD_PMT_STRIDE / 2); ++g) {
+    _mm_store_si128(reinterpret_cast<__m128i *>(lanes), acc[g]);
+    output[2 * g] = int32_t(uint32_t(uint64_t(lanes[0])));
+    output[2 * g + 1] = int32_t(uint32_t(uint64_t(lanes[1])));
+  }
+  return;
+}
+
+
+__attribute__((target("sse4.2"))) float get_log_like_sse42(const float data[SIMD_PMT_STRIDE], const float mdrf[SIMD_PMT_STRIDE]) {
+  alignas(16) float terms[SIMD_PMT_STRIDE];
+  __m128 d, x, m, e, y, z, lg, mask;
+  __m128i bits;
+  int g;
+  
+  for(g = 0; g < (SIMD_PMT_STRIDE / 4); ++g) {
+    d = _mm_loadu_ps(data + 4 * g);
+    x = _mm_loadu_ps(mdrf + 4 * g);
+    bits = _mm_castps_si128(_mm_max_ps(x, _mm_set1_ps(1.17549435e-38f)));
+    e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xFF)), _mm_set1_epi32(126)));
+    m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(int(0x807FFFFF))), _mm_set1_epi32(0x3F000000)));
+    mask = _mm_cmplt_ps(m, _mm_set1_ps(0.707106781186547524f));
+    e = _mm_sub_ps(e, _mm_and_ps(mask, _mm_set1_ps(1.0f)));
+    m = _mm_sub_ps(_mm_add_ps(m, _mm_and_ps(mask, m)), _mm_set1_ps(1.0f));
+    z = _mm_mul_ps(m, m);
+    y = _mm_set1_ps(7.0376836292e-2f);
+    y = _mm_sub_ps(_mm_mul_ps(y, m), _mm_set1_ps(1.1514610310e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(1.1676998740e-1f));
+    y = _mm_sub_ps(_mm_mul_ps(y, m), _mm_set1_ps(1.2420140846e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(1.4249322787e-1f));
+    y = _mm_sub_ps(_mm_mul_ps(y, m), _mm_set1_ps(1.6668057665e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(2.0000714765e-1f));
+    y = _mm_sub_ps(_mm_mul_ps(y, m), _mm_set1_ps(2.4999993993e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(3.3333331174e-1f));
+    y = _mm_mul_ps(_mm_mul_ps(y, m), z);
+    y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+    y = _mm_sub_ps(y, _mm_mul_ps(_mm_set1_ps(0.5f), z));
+    m = _mm_add_ps(m, y);
+    lg = _mm_add_ps(m, _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+    lg = _mm_blendv_ps(lg, x, _mm_cmpeq_ps(x, _mm_set1_ps(HUGE_VALF)));
+    lg = _mm_blendv_ps(lg, _mm_set1_ps(-HUGE_VALF), _mm_cmpeq_ps(x, _mm_setzero_ps()));
+    lg = _mm_blendv_ps(lg, _mm_set1_ps(std::nanf("")), _mm_cmplt_ps(x, _mm_setzero_ps()));
+    lg = _mm_blendv_ps(lg, x, _mm_cmpunord_ps(x, x));
+    y = _mm_sub_ps(_mm_mul_ps(d, lg), x);
+    mask = _mm_and_ps(_mm_cmpeq_ps(d, _mm_setzero_ps()), _mm_cmpeq_ps(x, _mm_setzero_ps()));
+    _mm_store_ps(terms + 4 * g, _mm_andnot_ps(mask, y));
+  }
+  return(sum_log_like_terms(terms));
+}
+
+
+__attribute__((target("sse4.2"))) void bswap_clamp_sse42(int16_t *output, const int16_t *input, std::size_t num_values) {
+  const __m128i shuffle = _mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+  __m128i v;
+  std::size_t n;
+  
+  for(n = 0; (n + 8) <= num_values; n += 8) {
+    v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(input + n)), shuffle);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + n), _mm_max_epi16(v, _mm_setzero_si128()));
+  }
+  bswap_clamp_generic(output + n, input + n, num_values - n);
+  return;
+}
+
+
+// Without variable shifts, the lanes are multiplied by 2^(7 - shift) and
+// shifted right by 7: a value and its shift fit in 24 + 7 bits.
+__attribute__((target("sse4.2"))) void unpack_bits_sse42(int16_t *output, const uint8_t *input, std::size_t num_values, int bits) {
+  const __m128i mask = _mm_set1_epi32((1 << bits) - 1);
+  __m128i shuffle_lo, shuffle_hi, scale_lo, scale_hi;
+  alignas(16) uint8_t shuffle[32];
+  alignas(16) uint32_t shift[8];
+  const uint8_t *group;
+  std::size_t base[2];
+  __m128i lo, hi;
+  std::size_t n;
+  
+  get_unpack_tables(shuffle, shift, base, bits);
+  shuffle_lo = _mm_load_si128(reinterpret_cast<const __m128i *>(shuffle));
+  shuffle_hi = _mm_load_si128(reinterpret_cast<const __m128i *>(shuffle + 16));
+  scale_lo = _mm_set_epi32(1 << (7 - shift[3]), 1 << (7 - shift[2]), 1 << (7 - shift[1]), 1 << (7 - shift[0]));
+  scale_hi = _mm_set_epi32(1 << (7 - shift[7]), 1 << (7 - shift[6]), 1 << (7 - shift[5]), 1 << (7 - shift[4]));
+  for(n = 0; (n + 8) <= num_values; n += 8) {
+    group = input + (n / 8) * std::size_t(bits);
+    lo = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group + base[0])), shuffle_lo);
+    hi = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group + base[1])), shuffle_hi);
+    lo = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(lo, scale_lo), 7), mask);
+    hi = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(hi, scale_hi), 7), mask);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + n), _mm_packus_epi32(lo, hi));
+  }
+  unpack_bits_generic(output + n, input + (n / 8) * std::size_t(bits), num_values - n, bits);
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+__attribute__((target("avx2"))) void eval_spline_avx2(float output[SIMD_PMT_STRIDE], const float *coefs, const float weight[MX][MY]) {
+  __m256 acc[SIMD_PMT_STRIDE / 8];
+  const float *ptr;
+  int i_x, i_y;
+  __m256 w;
+  int g;
+  
+  for(g = 0; g < (SIMD_PMT_STRIDE / 8); ++g) {
+    acc[g] = _mm256_setzero_ps();
+  }
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      ptr = coefs + (i_y * (MX + KX) + i_x) * SIMD_PMT_STRIDE;
+      w = _mm256_set1_ps(weight[i_x][i_y]);
+      for(g = 0; g < (SIMD_PMT_STRIDE / 8); ++g) {
+        acc[g] = _mm256_add_ps(acc[g], _mm256_mul_ps(_mm256_loadu_ps(ptr + 8 * g), w));
+      }
+    }
+  }
+  for(g = 0; g < (SIMD_PMT_STRIDE / 8); ++g) {
+    _mm256_storeu_ps(output + 8 * g, acc[g]);
+  }
+  return;
+}
+
+
+__attribute__((target("avx2"))) void eval_spline_fixed_avx2(int32_t output[SIMD_PMT_STRIDE], const int32_t *coefs, const int64_t weight[MX][MY]) {
+  __m256i acc[SIMD_PMT_STRIDE / 4];
+  alignas(32) int64_t lanes[4];
+  const int32_t *ptr;
+  int i_x, i_y;
+  __m256i w, c;
+  int g, lane;
+  
+  for(g = 0; g < (SIMD_PMT_STRIDE / 4); ++g) {
+    acc[g] = _mm256_setzero_si256();
+  }
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      ptr = coefs + (i_y * (MX + KX) + i_x) * SIMD_PMT_STRIDE;
+      w = _mm256_set1_epi64x(weight[i_x][i_y]);
+      for(g = 0; g < (SIMD_PMT_STRIDE / 4); ++g) {
+        c = _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 4 * g)));
+        acc[g] = _mm256_add_epi64(acc[g], _mm256_srli_epi64(_mm256_mul_epi32(c, w), MDRF_FRAC_BITS));
+      }
+    }
+  }
+  for(g = 0; g < (SIMD_PMT_STRIDE / 4); ++g) {
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), acc[g]);
+    for(lane = 0; lane < 4; ++lane) {
+      output[4 * g + lane] = int32_t(uint32_t(uint64_t(lanes[lane])));
+    }
+  }
+  return;
+}
+
+
+__attribute__((target("avx2"))) float get_log_like_avx2(const float data[SIMD_PMT_STRIDE], const float mdrf[SIMD_PMT_STRIDE]) {
+  alignas(32) float terms[SIMD_PMT_STRIDE];
+  __m256 d, x, m, e, y, z, lg, mask;
+  __m256i bits;
+  int g;
+  
+  for(g = 0; g < (SIMD_PMT_STRIDE / 8); ++g) {
+    d = _mm256_loadu_ps(data + 8 * g);
+    x = _mm256_loadu_ps(mdrf + 8 * g);
+    bits = _mm256_castps_si256(_mm256_max_ps(x, _mm256_set1_ps(1.17549435e-38f)));
+    e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(0xFF)), _mm256_set1_epi32(126)));
+    m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(int(0x807FFFFF))), _mm256_set1_epi32(0x3F000000)));
+    mask = _mm256_cmp_ps(m, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+    e = _mm256_sub_ps(e, _mm256_and_ps(mask, _mm256_set1_ps(1.0f)));
+    m = _mm256_sub_ps(_mm256_add_ps(m, _mm256_and_ps(mask, m)), _mm256_set1_ps(1.0f));
+    z = _mm256_mul_ps(m, m);
+    y = _mm256_set1_ps(7.0376836292e-2f);
+    y = _mm256_sub_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.1514610310e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.1676998740e-1f));
+    y = _mm256_sub_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.2420140846e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.4249322787e-1f));
+    y = _mm256_sub_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.6668057665e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(2.0000714765e-1f));
+    y = _mm256_sub_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(2.4999993993e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(3.3333331174e-1f));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+    y = _mm256_add_ps(y, _mm256_mul_ps(e, _mm256_set1_ps(-2.12194440e-4f)));
+    y = _mm256_sub_ps(y, _mm256_mul_ps(_mm256_set1_ps(0.5f), z));
+    m = _mm256_add_ps(m, y);
+    lg = _mm256_add_ps(m, _mm256_mul_ps(e, _mm256_set1_ps(0.693359375f)));
+    lg = _mm256_blendv_ps(lg, x, _mm256_cmp_ps(x, _mm256_set1_ps(HUGE_VALF), _CMP_EQ_OQ));
+    lg = _mm256_blendv_ps(lg, _mm256_set1_ps(-HUGE_VALF), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_EQ_OQ));
+    lg = _mm256_blendv_ps(lg, _mm256_set1_ps(std::nanf("")), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+    lg = _mm256_blendv_ps(lg, x, _mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+    y = _mm256_sub_ps(_mm256_mul_ps(d, lg), x);
+    mask = _mm256_and_ps(_mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_EQ_OQ), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_EQ_OQ));
+    _mm256_store_ps(terms + 8 * g, _mm256_andnot_ps(mask, y));
+  }
+  return(sum_log_like_terms(terms));
+}
+
+
+__attribute__((target("avx2"))) void bswap_clamp_avx2(int16_t *output, const int16_t *input, std::size_t num_values) {
+  const __m256i shuffle = _mm256_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1, 14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+  __m256i v;
+  std::size_t n;
+  
+  for(n = 0; (n + 16) <= num_values; n += 16) {
+    v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + n)), shuffle);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + n), _mm256_max_epi16(v, _mm256_setzero_si256()));
+  }
+  bswap_clamp_generic(output + n, input + n, num_values - n);
+  return;
+}
+
+
+__attribute__((target("avx2"))) void unpack_bits_avx2(int16_t *output, const uint8_t *input, std::size_t num_values, int bits) {
+  const __m256i mask = _mm256_set1_epi32((1 << bits) - 1);
+  alignas(32) uint8_t shuffle[32];
+  alignas(32) uint32_t shift[8];
+  __m256i shuffle_v, shift_v;
+  const uint8_t *group;
+  std::size_t base[2];
+  std::size_t n;
+  __m256i v;
+  
+  get_unpack_tables(shuffle, shift, base, bits);
+  shuffle_v = _mm256_load_si256(reinterpret_cast<const __m256i *>(shuffle));
+  shift_v = _mm256_load_si256(reinterpret_cast<const __m256i *>(shift));
+  for(n = 0; (n + 8) <= num_values; n += 8) {
+    group = input + (n / 8) * std::size_t(bits);
+    v = _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group + base[0])));
+    v = _mm256_inserti128_si256(v, _mm_loadu_si128(reinterpret_cast<const __m128i *>(group + base[1])), 1);
+    v = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(v, shuffle_v), shift_v), mask);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + n), _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+  }
+  unpack_bits_generic(output + n, input + (n / 8) * std::size_t(bits), num_values - n, bits);
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// AVX-512F implies FMA, and g++ contracts multiplications and additions
+// into FMAs by default, which would round differently from the other
+// variants. The AVX-512 headers of GCC 12 also initialize their undefined
+// vectors with themselves, which -Wall reports as uninitialized or maybe
+// uninitialized when they are inlined.
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+
+__attribute__((target("avx512f,avx512bw"))) void eval_spline_avx512(float output[SIMD_PMT_STRIDE], const float *coefs, const float weight[MX][MY]) {
+  __m512 acc[SIMD_PMT_STRIDE / 16];
+  const float *ptr;
+  int i_x, i_y;
+  __m512 w;
+  int g;
+  
+  for(g = 0; g < (SIMD_PMT_STRIDE / 16); ++g) {
+    acc[g] = _mm512_setzero_ps();
+  }
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      ptr = coefs + (i_y * (MX + KX) + i_x) * SIMD_PMT_STRIDE;
+      w = _mm512_set1_ps(weight[i_x][i_y]);
+      for(g = 0; g < (SIMD_PMT_STRIDE / 16); ++g) {
+        acc[g] = _mm512_add_ps(acc[g], _mm512_mul_ps(_mm512_loadu_ps(ptr + 16 * g), w));
+      }
+    }
+  }
+  for(g = 0; g < (SIMD_PMT_STRIDE / 16); ++g) {
+    _mm512_storeu_ps(output + 16 * g, acc[g]);
+  }
+  return;
+}
+
+
+__attribute__((target("avx512f,avx512bw"))) void eval_spline_fixed_avx512(int32_t output[SIMD_PMT_STRIDE], const int32_t *coefs, const int64_t weight[MX][MY]) {
+  __m512i acc[SIMD_PMT_STRIDE / 8];
+  const int32_t *ptr;
+  int i_x, i_y;
+  __m512i w, c;
+  int g;
+  
+  for(g = 0; g < (SIMD_PMT_STRIDE / 8); ++g) {
+    acc[g] = _mm512_setzero_si512();
+  }
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      ptr = coefs + (i_y * (MX + KX) + i_x) * SIMD_PMT_STRIDE;
+      w = _mm512_set1_epi64(weight[i_x][i_y]);
+      for(g = 0; g < (SIMD_PMT_STRIDE / 8); ++g) {
+        c = _mm512_cvtepi32_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + 8 * g)));
+        acc[g] = _mm512_add_epi64(acc[g], _mm512_srli_epi64(_mm512_mul_epi32(c, w), MDRF_FRAC_BITS));
+      }
+    }
+  }
+  for(g = 0; g < (SIMD_PMT_STRIDE / 8); ++g) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + 8 * g), _mm512_cvtepi64_epi32(acc[g]));
+  }
+  return;
+}
+
+
+__attribute__((target("avx512f,avx512bw"))) float get_log_like_avx512(const float data[SIMD_PMT_STRIDE], const float mdrf[SIMD_PMT_STRIDE]) {
+  alignas(64) float terms[SIMD_PMT_STRIDE];
+  __m512 d, x, m, e, y, z, lg;
+  __mmask16 mask;
+  __m512i bits;
+  int g;
+  
+  for(g = 0; g < (SIMD_PMT_STRIDE / 16); ++g) {
+    d = _mm512_loadu_ps(data + 16 * g);
+    x = _mm512_loadu_ps(mdrf + 16 * g);
+    bits = _mm512_castps_si512(_mm512_max_ps(x, _mm512_set1_ps(1.17549435e-38f)));
+    e = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_and_si512(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(0xFF)), _mm512_set1_epi32(126)));
+    m = _mm512_castsi512_ps(_mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi32(int(0x807FFFFF))), _mm512_set1_epi32(0x3F000000)));
+    mask = _mm512_cmp_ps_mask(m, _mm512_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+    e = _mm512_mask_sub_ps(e, mask, e, _mm512_set1_ps(1.0f));
+    m = _mm512_sub_ps(_mm512_mask_add_ps(m, mask, m, m), _mm512_set1_ps(1.0f));
+    z = _mm512_mul_ps(m, m);
+    y = _mm512_set1_ps(7.0376836292e-2f);
+    y = _mm512_sub_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(1.1514610310e-1f));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(1.1676998740e-1f));
+    y = _mm512_sub_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(1.2420140846e-1f));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(1.4249322787e-1f));
+    y = _mm512_sub_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(1.6668057665e-1f));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(2.0000714765e-1f));
+    y = _mm512_sub_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(2.4999993993e-1f));
+    y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(3.3333331174e-1f));
+    y = _mm512_mul_ps(_mm512_mul_ps(y, m), z);
+    y = _mm512_add_ps(y, _mm512_mul_ps(e, _mm512_set1_ps(-2.12194440e-4f)));
+    y = _mm512_sub_ps(y, _mm512_mul_ps(_mm512_set1_ps(0.5f), z));
+    m = _mm512_add_ps(m, y);
+    lg = _mm512_add_ps(m, _mm512_mul_ps(e, _mm512_set1_ps(0.693359375f)));
+    lg = _mm512_mask_mov_ps(lg, _mm512_cmp_ps_mask(x, _mm512_set1_ps(HUGE_VALF), _CMP_EQ_OQ), x);
+    lg = _mm512_mask_mov_ps(lg, _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_EQ_OQ), _mm512_set1_ps(-HUGE_VALF));
+    lg = _mm512_mask_mov_ps(lg, _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_LT_OQ), _mm512_set1_ps(std::nanf("")));
+    lg = _mm512_mask_mov_ps(lg, _mm512_cmp_ps_mask(x, x, _CMP_UNORD_Q), x);
+    y = _mm512_sub_ps(_mm512_mul_ps(d, lg), x);
+    mask = _mm512_cmp_ps_mask(d, _mm512_setzero_ps(), _CMP_NEQ_UQ) | _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_NEQ_UQ);
+    _mm512_store_ps(terms + 16 * g, _mm512_maskz_mov_ps(mask, y));
+  }
+  return(sum_log_like_terms(terms));
+}
+
+
+__attribute__((target("avx512f,avx512bw"))) void bswap_clamp_avx512(int16_t *output, const int16_t *input, std::size_t num_values) {
+  const __m512i shuffle = _mm512_broadcast_i32x4(_mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1));
+  __m512i v;
+  std::size_t n;
+  
+  for(n = 0; (n + 32) <= num_values; n += 32) {
+    v = _mm512_shuffle_epi8(_mm512_loadu_si512(input + n), shuffle);
+    _mm512_storeu_si512(output + n, _mm512_max_epi16(v, _mm512_setzero_si512()));
+  }
+  bswap_clamp_generic(output + n, input + n, num_values - n);
+  return;
+}
+
+
+// Two groups per iteration, one in each half of the vector.
+__attribute__((target("avx512f,avx512bw"))) void unpack_bits_avx512(int16_t *output, const uint8_t *input, std::size_t num_values, int bits) {
+  const __m512i mask = _mm512_set1_epi32((1 << bits) - 1);
+  alignas(32) uint8_t shuffle[32];
+  alignas(32) uint32_t shift[8];
+  __m512i shuffle_v, shift_v;
+  const uint8_t *group;
+  std::size_t base[2];
+  std::size_t n;
+  __m512i v;
+  
+  get_unpack_tables(shuffle, shift, base, bits);
+  shuffle_v = _mm512_broadcast_i64x4(_mm256_load_si256(reinterpret_cast<const __m256i *>(shuffle)));
+  shift_v = _mm512_broadcast_i64x4(_mm256_load_si256(reinterpret_cast<const __m256i *>(shift)));
+  for(n = 0; (n + 16) <= num_values; n += 16) {
+    group = input + (n / 8) * std::size_t(bits);
+    v = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group + base[0])));
+    v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i *>(group + base[1])), 1);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i *>(group + bits + base[0])), 2);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128(reinterpret_cast<const __m128i *>(group + bits + base[1])), 3);
+    v = _mm512_and_si512(_mm512_srlv_epi32(_mm512_shuffle_epi8(v, shuffle_v), shift_v), mask);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + n), _mm512_cvtepi32_epi16(v));
+  }
+  unpack_bits_generic(output + n, input + (n / 8) * std::size_t(bits), num_values - n, bits);
+  return;
+}
+
+
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _CPU_DISPATCH_H
@@ -0,0 +1,522 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "cpu_dispatch.h"
+#include "estimator.h"
+#include "image.h"
+#include "numa_estimator.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Estimation server on a UNIX domain stream socket, which keeps the
+// calibration loaded from one acquisition to the next. A client sends a
+// list-mode file as stored, the 18-byte header then the big-endian events,
+// and shuts its side of the connection down for writing at the end. The
+// daemon answers with a 4-byte tag, then:
+//  - "EST1": the estimates of the events in order, 16 bytes each as in
+//    write_estim_events() without the count;
+//  - "IMG1" when it bins an image: an update every DAEMON_IMAGE_INTERVAL
+//    events and one at the end, each the number of events so far as a
+//    uint64_t followed by the image as written by image_t::write().
+// When the stream cannot be read to its end (a truncated record, a read
+// error), the estimates of the events received whole are still sent, then
+// the error: a 16-byte estimate whose valid field is 0xFFFFFFFF and whose
+// x field holds the length of the message as a uint32_t, or an image
+// update of UINT64_MAX events followed by that length, then the message.
+//
+// Clients are served one at a time. A reader thread cuts the stream into
+// chunks of at most DAEMON_CHUNK_SIZE events, as they arrive, in a ring of
+// DAEMON_QUEUE_CHUNKS chunks; workers pinned to one CPU each estimate them,
+// and the serving thread sends them back in order. A client that does not
+// read its estimates blocks the sends, the ring fills up and the reader
+// stops reading the socket, so the client is in turn blocked in its own
+// sends instead of the daemon buffering without bound. A client that sends
+// nothing or reads nothing for DAEMON_TIMEOUT_MSEC has its stream ended
+// with an error, so that a stalled client holds up neither the clients
+// waiting behind it nor the exit of the daemon for longer than that.
+class daemon_t {
+  public:
+    daemon_t(const std::string & my_socket_path, const estimator_t & my_estimator, float my_image_pixel_size);
+    ~daemon_t();
+    void run(unsigned int num_threads, bool verbose);
+    
+  private:
+    struct chunk_t {
+      std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+      std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+      std::size_t num_events;
+      bool done;
+    };
+    void serve(int fd, std::size_t stream_index, bool verbose);
+    void read_stream(int fd);
+    void write_stream(int fd);
+    void work(int cpu);
+    void set_stream_error(int fd, const std::string & message, int how);
+    const estimator_t & estimator;
+    std::string socket_path;
+    float image_pixel_size;
+    int listen_fd;
+    std::vector<chunk_t> chunks;
+    uint64_t num_read, num_taken, num_sent;
+    std::mutex mutex;
+    std::condition_variable work_cond;
+    std::condition_variable done_cond;
+    std::condition_variable space_cond;
+    bool end_of_stream;
+    bool stopping;
+    std::string stream_error;
+    std::size_t stream_events, stream_valid;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void handle_daemon_signal(int signal_number);
+std::size_t recv_bytes(int fd, char *data, std::size_t size, bool fill);
+void send_bytes(int fd, const char *data, std::size_t size);
+void send_image_update(int fd, const image_t & image, uint64_t num_events);
+void send_stream_error(int fd, bool image, const std::string & message);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+volatile std::sig_atomic_t daemon_signal = 0;
+
+
+// Binds the socket, replacing a socket file left by a daemon that did not
+// exit cleanly. Any other file at the path is left alone.
+daemon_t::daemon_t(const std::string & my_socket_path, const estimator_t & my_estimator, float my_image_pixel_size) : estimator(my_estimator), socket_path(my_socket_path), image_pixel_size(my_image_pixel_size), listen_fd(-1), num_read(0), num_taken(0), num_sent(0), end_of_stream(false), stopping(false), stream_events(0), stream_valid(0) {
+  struct sockaddr_un address;
+  struct stat status;
+  std::size_t n;
+  
+  if(socket_path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + socket_path);
+  }
+  if(lstat(socket_path.c_str(), & status) == 0) {
+    if(!S_ISSOCK(status.st_mode)) {
+      throw std::runtime_error("Not a socket: " + socket_path);
+    }
+    unlink(socket_path.c_str());
+  }
+  std::memset(& address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listen_fd < 0) {
+    throw std::runtime_error(std::string("Cannot create socket: ") + std::strerror(errno));
+  }
+  if((bind(listen_fd, reinterpret_cast<struct sockaddr *>(& address), sizeof(address)) != 0) || (listen(listen_fd, 4) != 0)) {
+    close(listen_fd);
+    throw std::runtime_error("Cannot listen on socket " + socket_path + ": " + std::strerror(errno));
+  }
+  chunks.resize(DAEMON_QUEUE_CHUNKS);
+  for(n = 0; n < chunks.size(); ++n) {
+    chunks[n].PMT_data.resize(DAEMON_CHUNK_SIZE);
+    chunks[n].estim_event.resize(DAEMON_CHUNK_SIZE);
+    chunks[n].num_events = 0;
+    chunks[n].done = false;
+  }
+}
+
+
+daemon_t::~daemon_t() {
+  close(listen_fd);
+  unlink(socket_path.c_str());
+}
+
+
+// Serves clients until SIGINT or SIGTERM, with num_threads workers (all the
+// cores for 0) pinned to the CPUs in turn. A stream being served when the
+// signal comes is finished first, or ends when its client times out.
+void daemon_t::run(unsigned int num_threads, bool verbose) {
+  std::vector<std::thread> workers;
+  std::vector<numa_node_t> numa_nodes;
+  std::vector<int> cpus;
+  struct sigaction action;
+  struct pollfd poll_fd;
+  std::size_t stream_index;
+  unsigned int i;
+  std::size_t n;
+  int fd;
+  
+  if(num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  numa_nodes = get_numa_nodes();
+  for(n = 0; n < numa_nodes.size(); ++n) {
+    cpus.insert(cpus.end(), numa_nodes[n].cpus.begin(), numa_nodes[n].cpus.end());
+  }
+  // The handler only sets a flag, which the accept loop checks at least
+  // every DAEMON_POLL_MSEC whichever thread the signal interrupts.
+  std::memset(& action, 0, sizeof(action));
+  action.sa_handler = handle_daemon_signal;
+  sigemptyset(& action.sa_mask);
+  action.sa_flags = 0;
+  sigaction(SIGINT, & action, nullptr);
+  sigaction(SIGTERM, & action, nullptr);
+  for(i = 0; i < num_threads; ++i) {
+    workers.push_back(std::thread(& daemon_t::work, this, cpus.empty() ? -1 : cpus[i % cpus.size()]));
+  }
+  if(verbose) {
+    std::cout << "Listening on " << socket_path << " with " << num_threads << " workers." << std::endl;
+  }
+  poll_fd.fd = listen_fd;
+  poll_fd.events = POLLIN;
+  stream_index = 0;
+  while(daemon_signal == 0) {
+    if(poll(& poll_fd, 1, DAEMON_POLL_MSEC) <= 0) {
+      continue;
+    }
+    fd = accept(listen_fd, nullptr, nullptr);
+    if(fd < 0) {
+      continue;
+    }
+    serve(fd, stream_index++, verbose);
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    stopping = true;
+    work_cond.notify_all();
+  }
+  for(i = 0; i < workers.size(); ++i) {
+    workers[i].join();
+  }
+  if(verbose) {
+    std::cout << "Served " << stream_index << " streams." << std::endl;
+  }
+  return;
+}
+
+
+// Errors of a stream are reported and end that stream only. The reads and
+// writes of the socket time out, which recv_bytes() and send_bytes()
+// report as errors.
+void daemon_t::serve(int fd, std::size_t stream_index, bool verbose) {
+  std::chrono::time_point<std::chrono::steady_clock> start;
+  struct timeval timeout;
+  std::thread reader;
+  double elapsed;
+  
+  start = std::chrono::steady_clock::now();
+  timeout.tv_sec = DAEMON_TIMEOUT_MSEC / 1000;
+  timeout.tv_usec = (DAEMON_TIMEOUT_MSEC % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, & timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, & timeout, sizeof(timeout));
+  end_of_stream = false;
+  stream_error.clear();
+  stream_events = stream_valid = 0;
+  reader = std::thread(& daemon_t::read_stream, this, fd);
+  write_stream(fd);
+  reader.join();
+  close(fd);
+  elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if(!stream_error.empty()) {
+    std::cerr << "Stream " << stream_index << ": " << stream_error << std::endl;
+  }
+  if(verbose) {
+    std::cout << "Stream " << stream_index << ": " << stream_events << " events, " << stream_valid << " valid in " << elapsed << " s (" << double(stream_events) / elapsed << " events/s)." << std::endl;
+  }
+  return;
+}
+
+
+// Hands over the events as they arrive, so that a slow acquisition gets
+// its estimates without waiting for a full chunk.
+void daemon_t::read_stream(int fd) {
+  const std::size_t record_size = NUM_PMTS * sizeof(int16_t);
+  std::vector<int16_t> words(DAEMON_CHUNK_SIZE * NUM_PMTS);
+  std::vector<int16_t> LM_values(DAEMON_CHUNK_SIZE * NUM_PMTS);
+  char LM_header[9 * sizeof(int16_t)];
+  std::size_t num_bytes, num_received, num_events;
+  std::size_t event_index;
+  chunk_t *chunk;
+  
+  try {
+    if(recv_bytes(fd, LM_header, sizeof(LM_header), true) != sizeof(LM_header)) {
+      throw std::runtime_error("Truncated list-mode header!");
+    }
+    num_bytes = 0;
+    while((num_received = recv_bytes(fd, reinterpret_cast<char *>(words.data()) + num_bytes, words.size() * sizeof(words[0]) - num_bytes, false)) > 0) {
+      num_bytes += num_received;
+      num_events = num_bytes / record_size;
+      if(num_events == 0) {
+        continue;
+      }
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        space_cond.wait(lock, [this]() {return(num_read - num_sent < DAEMON_QUEUE_CHUNKS);});
+        chunk = & chunks[num_read % DAEMON_QUEUE_CHUNKS];
+      }
+      get_cpu_kernels().bswap_clamp(LM_values.data(), words.data(), num_events * NUM_PMTS);
+      for(event_index = 0; event_index < num_events; ++event_index) {
+        std::memcpy(chunk->PMT_data[event_index].val, & LM_values[event_index * NUM_PMTS], record_size);
+      }
+      chunk->num_events = num_events;
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        ++num_read;
+        work_cond.notify_one();
+      }
+      num_bytes -= num_events * record_size;
+      std::memmove(words.data(), words.data() + num_events * NUM_PMTS, num_bytes);
+    }
+    if(num_bytes != 0) {
+      throw std::runtime_error("Truncated list-mode stream!");
+    }
+  } catch(const std::exception & e) {
+    set_stream_error(fd, e.what(), SHUT_RD);
+  }
+  std::lock_guard<std::mutex> guard(mutex);
+  end_of_stream = true;
+  done_cond.notify_all();
+  return;
+}
+
+
+// Sends the chunks in order, then the error of the reader if any. Once a
+// send has failed, the remaining chunks are only drained.
+void daemon_t::write_stream(int fd) {
+  std::unique_ptr<image_t> image;
+  const std::size_t record_size = 4 * sizeof(float);
+  std::vector<char> records(DAEMON_CHUNK_SIZE * record_size);
+  std::string read_error;
+  std::size_t event_index;
+  uint64_t num_events, next_update;
+  uint32_t valid;
+  chunk_t *chunk;
+  bool failed;
+  
+  failed = false;
+  num_events = 0;
+  next_update = DAEMON_IMAGE_INTERVAL;
+  if(image_pixel_size > float(0)) {
+    image.reset(new image_t(image_pixel_size));
+  }
+  try {
+    send_bytes(fd, image ? "IMG1" : "EST1", 4);
+  } catch(const std::exception & e) {
+    set_stream_error(fd, e.what(), SHUT_RDWR);
+    failed = true;
+  }
+  while(true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      done_cond.wait(lock, [this]() {return(chunks[num_sent % DAEMON_QUEUE_CHUNKS].done || (end_of_stream && (num_sent == num_read)));});
+      if(!chunks[num_sent % DAEMON_QUEUE_CHUNKS].done) {
+        break;
+      }
+      chunk = & chunks[num_sent % DAEMON_QUEUE_CHUNKS];
+    }
+    for(event_index = 0; event_index < chunk->num_events; ++event_index) {
+      const estim_event_t & estim_event = chunk->estim_event[event_index];
+      valid = estim_event.valid ? 1 : 0;
+      std::memcpy(& records[event_index * record_size], & valid, sizeof(valid));
+      std::memcpy(& records[event_index * record_size + 4], & estim_event.x_pos, sizeof(float));
+      std::memcpy(& records[event_index * record_size + 8], & estim_event.y_pos, sizeof(float));
+      std::memcpy(& records[event_index * record_size + 12], & estim_event.log_like, sizeof(float));
+      stream_valid += valid;
+      if(image) {
+        image->add(estim_event);
+      }
+    }
+    stream_events += chunk->num_events;
+    num_events += chunk->num_events;
+    try {
+      if(!failed && !image) {
+        send_bytes(fd, records.data(), chunk->num_events * record_size);
+      } else if(!failed && (num_events >= next_update)) {
+        send_image_update(fd, *image, num_events);
+        next_update = num_events + DAEMON_IMAGE_INTERVAL;
+      }
+    } catch(const std::exception & e) {
+      set_stream_error(fd, e.what(), SHUT_RDWR);
+      failed = true;
+    }
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      chunk->done = false;
+      ++num_sent;
+      space_cond.notify_one();
+    }
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    read_error = stream_error;
+  }
+  try {
+    if(image && !failed) {
+      send_image_update(fd, *image, num_events);
+    }
+    if(!failed && !read_error.empty()) {
+      send_stream_error(fd, bool(image), read_error);
+    }
+  } catch(const std::exception & e) {
+    set_stream_error(fd, e.what(), SHUT_RDWR);
+  }
+  return;
+}
+
+
+void daemon_t::work(int cpu) {
+  chunk_t *chunk;
+  
+  if(cpu >= 0) {
+    pin_thread(std::vector<int>(1, cpu));
+  }
+  while(true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      work_cond.wait(lock, [this]() {return((num_taken < num_read) || stopping);});
+      if(num_taken == num_read) {
+        return;
+      }
+      chunk = & chunks[num_taken % DAEMON_QUEUE_CHUNKS];
+      ++num_taken;
+    }
+    estimator.estimate_batch(chunk->PMT_data.data(), chunk->estim_event.data(), chunk->num_events);
+    std::lock_guard<std::mutex> guard(mutex);
+    chunk->done = true;
+    done_cond.notify_all();
+  }
+}
+
+
+// Keeps the first error of the stream and shuts the connection down: for
+// reading only after an error of the reader, so that the estimates already
+// computed and the error still reach the client, for both after an error
+// of the serving thread, which ends the reads of the reader.
+void daemon_t::set_stream_error(int fd, const std::string & message, int how) {
+  std::lock_guard<std::mutex> guard(mutex);
+  if(stream_error.empty()) {
+    stream_error = message;
+  }
+  shutdown(fd, how);
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void handle_daemon_signal(int signal_number) {
+  daemon_signal = signal_number;
+  return;
+}
+
+
+// Reads up to size bytes, all of them if fill is set, and returns fewer
+// only at the end of the stream.
+std::size_t recv_bytes(int fd, char *data, std::size_t size, bool fill) {
+  std::size_t num_bytes;
+  ssize_t result;
+  
+  num_bytes = 0;
+  while(num_bytes < size) {
+    result = recv(fd, data + num_bytes, size - num_bytes, 0);
+    if(result < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        throw std::runtime_error("Timed out reading from socket!");
+      }
+      throw std::runtime_error(std::string("Cannot read from socket: ") + std::strerror(errno));
+    }
+    if(result == 0) {
+      break;
+    }
+    num_bytes += std::size_t(result);
+    if(!fill) {
+      break;
+    }
+  }
+  return(num_bytes);
+}
+
+
+// MSG_NOSIGNAL turns the SIGPIPE of a closed peer into an error.
+void send_bytes(int fd, const char *data, std::size_t size) {
+  std::size_t num_bytes;
+  ssize_t result;
+  
+  num_bytes = 0;
+  while(num_bytes < size) {
+    result = send(fd, data + num_bytes, size - num_bytes, MSG_NOSIGNAL);
+    if(result < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        throw std::runtime_error("Timed out writing to socket!");
+      }
+      throw std::runtime_error(std::string("Cannot write to socket: ") + std::strerror(errno));
+    }
+    num_bytes += std::size_t(result);
+  }
+  return;
+}
+
+
+void send_image_update(int fd, const image_t & image, uint64_t num_events) {
+  std::ostringstream oss;
+  std::string update;
+  
+  oss.write(reinterpret_cast<const char *>(& num_events), sizeof(num_events));
+  image.write(oss);
+  update = oss.str();
+  send_bytes(fd, update.data(), update.size());
+  return;
+}
+
+
+void send_stream_error(int fd, bool image, const std::string & message) {
+  char mark[16];
+  uint32_t length;
+  
+  std::memset(mark, 0xFF, sizeof(mark));
+  length = uint32_t(message.size());
+  send_bytes(fd, mark, image ? sizeof(uint64_t) : sizeof(uint32_t));
+  send_bytes(fd, reinterpret_cast<const char *>(& length), sizeof(length));
+  if(!image) {
+    std::memset(mark, 0, sizeof(mark));
+    send_bytes(fd, mark, 2 * sizeof(uint32_t));
+  }
+  send_bytes(fd, message.data(), message.size());
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _DAEMON_H
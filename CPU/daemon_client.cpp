@@ -0,0 +1,242 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <array>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "daemon.h"
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion daemon_client.cpp -o daemon_client -pthread
+//
+// Replays a list-mode file to "main --daemon=SOCKET" as an acquisition
+// would stream it, for testing the daemon of daemon.h. A sender thread
+// writes the file in batches, at a given rate or as fast as the daemon
+// takes them; the main thread reads the answer back and writes the
+// estimates, or the last image update with "main --image=MM", to OUTPUT.
+// For estimates, it prints the latency from the send of each batch to the
+// arrival of its last estimate. An error reported by the daemon after the
+// estimates it could compute is printed, and the client exits with 2 once
+// they are written.
+//
+//   ./main --daemon=/tmp/estim.sock &
+//   ./daemon_client --rate=2000 /tmp/estim.sock ../data/ResPhantom022516-0mm_00.dat ../data/estim_events_daemon.dat
+//
+// Usage: ./daemon_client [--batch=N] [--rate=EVENTS_PER_S] SOCKET INPUT OUTPUT
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int connect_daemon(const std::string & socket_path);
+std::string recv_stream_error(int fd, uint32_t length);
+void send_stream(int fd, const std::vector<char> & LM_file, std::size_t batch_size, double rate, std::vector<int64_t> & send_nsec);
+int64_t get_nsec();
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char **argv) {
+  const std::size_t record_size = NUM_PMTS * sizeof(int16_t);
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+  std::vector<int64_t> send_nsec;
+  std::vector<std::string> args;
+  std::vector<double> latency;
+  std::vector<char> LM_file;
+  std::vector<char> image;
+  std::size_t batch_size, num_events;
+  std::size_t num_updates;
+  uint64_t num_image_events;
+  uint32_t num_pixels[2];
+  std::ifstream ifs;
+  std::string stream_error;
+  std::ofstream ofs;
+  int64_t start_nsec;
+  std::thread sender;
+  double rate, elapsed;
+  estim_event_t record;
+  char tag[4], bytes[16];
+  std::string arg;
+  uint32_t valid, length;
+  int fd;
+  int i;
+  
+  batch_size = SHM_BATCH_SIZE;
+  rate = 0;
+  for(i = 1; i < argc; ++i) {
+    arg = argv[i];
+    if(arg.compare(0, 8, "--batch=") == 0) {
+      batch_size = std::max(std::size_t(1), std::size_t(std::stoul(arg.substr(8))));
+    } else if(arg.compare(0, 7, "--rate=") == 0) {
+      rate = std::stod(arg.substr(7));
+    } else if(arg.compare(0, 2, "--") == 0) {
+      throw std::runtime_error("Unknown option " + arg);
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if(args.size() != 3) {
+    std::cerr << "Usage: " << argv[0] << " [--batch=N] [--rate=EVENTS_PER_S] SOCKET INPUT OUTPUT" << std::endl;
+    return(1);
+  }
+  ifs.open(args[1].c_str(), std::ifstream::in | std::ifstream::binary | std::ifstream::ate);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open input LM file!");
+  }
+  LM_file.resize(std::size_t(ifs.tellg()));
+  ifs.seekg(0);
+  ifs.read(LM_file.data(), std::streamsize(LM_file.size()));
+  if(!ifs || (LM_file.size() < 9 * sizeof(int16_t))) {
+    throw std::runtime_error("Cannot read input LM file!");
+  }
+  num_events = (LM_file.size() - 9 * sizeof(int16_t)) / record_size;
+  fd = connect_daemon(args[0]);
+  send_nsec.resize((num_events + batch_size - 1) / batch_size);
+  estim_event.reserve(num_events);
+  num_updates = 0;
+  num_image_events = 0;
+  start_nsec = get_nsec();
+  sender = std::thread(send_stream, fd, std::cref(LM_file), batch_size, rate, std::ref(send_nsec));
+  if(recv_bytes(fd, tag, sizeof(tag), true) != sizeof(tag)) {
+    throw std::runtime_error("No answer from the daemon!");
+  }
+  if(std::memcmp(tag, "EST1", 4) == 0) {
+    while(recv_bytes(fd, bytes, sizeof(bytes), true) == sizeof(bytes)) {
+      std::memcpy(& valid, bytes, sizeof(valid));
+      if(valid == UINT32_MAX) {
+        std::memcpy(& length, bytes + 4, sizeof(length));
+        stream_error = recv_stream_error(fd, length);
+        break;
+      }
+      std::memcpy(& record.x_pos, bytes + 4, sizeof(float));
+      std::memcpy(& record.y_pos, bytes + 8, sizeof(float));
+      std::memcpy(& record.log_like, bytes + 12, sizeof(float));
+      record.valid = valid;
+      estim_event.push_back(record);
+      while(((latency.size() + 1) * batch_size <= estim_event.size()) || ((estim_event.size() == num_events) && (latency.size() < send_nsec.size()))) {
+        latency.push_back(double(get_nsec() - send_nsec[latency.size()]) * 1e-3);
+      }
+    }
+  } else if(std::memcmp(tag, "IMG1", 4) == 0) {
+    while(recv_bytes(fd, reinterpret_cast<char *>(& num_image_events), sizeof(num_image_events), true) == sizeof(num_image_events)) {
+      if(num_image_events == UINT64_MAX) {
+        if(recv_bytes(fd, reinterpret_cast<char *>(& length), sizeof(length), true) != sizeof(length)) {
+          throw std::runtime_error("Truncated error message!");
+        }
+        stream_error = recv_stream_error(fd, length);
+        break;
+      }
+      if(recv_bytes(fd, reinterpret_cast<char *>(num_pixels), sizeof(num_pixels), true) != sizeof(num_pixels)) {
+        throw std::runtime_error("Truncated image update!");
+      }
+      image.resize(sizeof(num_pixels) + std::size_t(num_pixels[0]) * std::size_t(num_pixels[1]) * sizeof(float));
+      std::memcpy(image.data(), num_pixels, sizeof(num_pixels));
+      if(recv_bytes(fd, image.data() + sizeof(num_pixels), image.size() - sizeof(num_pixels), true) != image.size() - sizeof(num_pixels)) {
+        throw std::runtime_error("Truncated image update!");
+      }
+      ++num_updates;
+    }
+  } else {
+    throw std::runtime_error("Unknown answer from the daemon!");
+  }
+  elapsed = double(get_nsec() - start_nsec) * 1e-9;
+  sender.join();
+  close(fd);
+  if(num_updates == 0) {
+    write_estim_events(estim_event, args[2].c_str());
+    std::cout << "Received " << estim_event.size() << " of " << num_events << " estimates in " << elapsed << " s (" << (double(estim_event.size()) / elapsed) << " events/s)." << std::endl;
+  } else {
+    ofs.open(args[2].c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    if(!ofs) {
+      throw std::runtime_error("Cannot create image file!");
+    }
+    ofs.write(image.data(), std::streamsize(image.size()));
+    ofs.close();
+    std::cout << "Received " << num_updates << " image updates of " << num_image_events << " events in " << elapsed << " s (" << (double(num_image_events) / elapsed) << " events/s)." << std::endl;
+  }
+  if(!latency.empty()) {
+    std::sort(latency.begin(), latency.end());
+    std::cout << "Batch latency: median " << latency[latency.size() / 2] << " us, 99th percentile " << latency[(latency.size() * 99) / 100] << " us, max " << latency.back() << " us." << std::endl;
+  }
+  if(!stream_error.empty()) {
+    std::cerr << "Daemon error: " << stream_error << std::endl;
+    return(2);
+  }
+  return(0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int connect_daemon(const std::string & socket_path) {
+  struct sockaddr_un address;
+  int fd;
+  
+  if(socket_path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + socket_path);
+  }
+  std::memset(& address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if((fd < 0) || (connect(fd, reinterpret_cast<struct sockaddr *>(& address), sizeof(address)) != 0)) {
+    throw std::runtime_error("Cannot connect to " + socket_path + ": " + std::strerror(errno));
+  }
+  return(fd);
+}
+
+
+std::string recv_stream_error(int fd, uint32_t length) {
+  std::string message(length, ' ');
+  
+  if(recv_bytes(fd, & message[0], message.size(), true) != message.size()) {
+    throw std::runtime_error("Truncated error message!");
+  }
+  return(message);
+}
+
+
+// Sends the header, then the batches, each at its time in the given rate
+// if any, stamped just before they are sent. The end of the stream is
+// marked by shutting down the writing side of the connection.
+void send_stream(int fd, const std::vector<char> & LM_file, std::size_t batch_size, double rate, std::vector<int64_t> & send_nsec) {
+  const std::size_t record_size = NUM_PMTS * sizeof(int16_t);
+  const std::size_t header_size = 9 * sizeof(int16_t);
+  std::size_t batch_index, first_event, num_events;
+  int64_t start_nsec, due_nsec;
+  
+  try {
+    send_bytes(fd, LM_file.data(), header_size);
+    start_nsec = get_nsec();
+    for(batch_index = 0; batch_index < send_nsec.size(); ++batch_index) {
+      first_event = batch_index * batch_size;
+      num_events = std::min(batch_size, (LM_file.size() - header_size) / record_size - first_event);
+      if(rate > 0) {
+        due_nsec = start_nsec + int64_t(double(first_event) / rate * 1e9);
+        while(get_nsec() < due_nsec) {
+          std::this_thread::sleep_for(std::chrono::nanoseconds(due_nsec - get_nsec()));
+        }
+      }
+      send_nsec[batch_index] = get_nsec();
+      send_bytes(fd, LM_file.data() + header_size + first_event * record_size, num_events * record_size);
+    }
+  } catch(const std::exception & e) {
+    std::cerr << e.what() << std::endl;
+  }
+  shutdown(fd, SHUT_WR);
+  return;
+}
+
+
+int64_t get_nsec() {
+  return(int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()));
+}
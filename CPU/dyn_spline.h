@@ -0,0 +1,280 @@
+#ifndef _DYN_SPLINE_H
+#define _DYN_SPLINE_H
+
+#include <stdexcept>
+#include <vector>
+#include "my_defines.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Float 2-D spline whose order (mx, my) and number of interior knots
+// (kx, ky) are given at run time. The algorithms are those of spline.hpp,
+// step for step, so that a spline fitted here has the same coefficients
+// and values as the spline_2D fitted on the same samples. The orders are
+// limited to MAX_SPLINE_ORDER.
+class dyn_spline_2D_t {
+  public:
+    dyn_spline_2D_t();
+    dyn_spline_2D_t(int my_mx, int my_my, int my_kx, int my_ky, const std::vector<float> & my_coefs);
+    float operator()(const float & x, const float & y) const;
+    void get_coefs(float *output) const;
+    
+  private:
+    int mx, my;
+    int kx, ky;
+    std::vector<float> coefs;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+dyn_spline_2D_t dyn_spap2(int mx, int my, int kx, int ky, const std::vector<float> & x, const std::vector<float> & y, const std::vector<float> & v);
+int dyn_find_span(const float & x, int k);
+void dyn_evaluate_basis(float *basis, const float & x, int ell, int m, int k);
+void dyn_get_inv(float *inv, const float *matr, int n);
+void dyn_get_inv_approx_matr(float *inv, const float *colmat, const int *t, int m, int k, int l);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+dyn_spline_2D_t::dyn_spline_2D_t() : mx(1), my(1), kx(0), ky(0), coefs(1, float(0)) {
+}
+
+
+// The coefficients are stored row by row, (my + ky) rows of (mx + kx).
+dyn_spline_2D_t::dyn_spline_2D_t(int my_mx, int my_my, int my_kx, int my_ky, const std::vector<float> & my_coefs) : mx(my_mx), my(my_my), kx(my_kx), ky(my_ky), coefs(my_coefs) {
+  if((mx < 1) || (my < 1) || (mx > MAX_SPLINE_ORDER) || (my > MAX_SPLINE_ORDER) || (kx < 0) || (ky < 0)) {
+    throw std::runtime_error("Invalid spline geometry!");
+  }
+  if(coefs.size() != std::size_t((my + ky) * (mx + kx))) {
+    throw std::runtime_error("Invalid number of spline coefficients!");
+  }
+}
+
+
+float dyn_spline_2D_t::operator()(const float & x, const float & y) const {
+  float basis_x[MAX_SPLINE_ORDER];
+  float basis_y[MAX_SPLINE_ORDER];
+  int ell_x, ell_y;
+  int i_x, i_y;
+  float s;
+  
+  s = float(0);
+  ell_x = dyn_find_span(x, kx);
+  ell_y = dyn_find_span(y, ky);
+  if((ell_x >= 0) && (ell_y >= 0)) {
+    dyn_evaluate_basis(basis_x, x, ell_x, mx, kx);
+    dyn_evaluate_basis(basis_y, y, ell_y, my, ky);
+    for(i_x = 0; i_x < mx; ++i_x) {
+      for(i_y = 0; i_y < my; ++i_y) {
+        s += coefs[std::size_t((i_y + ell_y) * (mx + kx) + i_x + ell_x)] * (basis_x[i_x] * basis_y[i_y]);
+      }
+    }
+  }
+  return(s);
+}
+
+
+void dyn_spline_2D_t::get_coefs(float *output) const {
+  std::size_t i;
+  
+  for(i = 0; i < coefs.size(); ++i) {
+    output[i] = coefs[i];
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Least-squares fit of the samples v[ell_y][ell_x] taken at (x[ell_x],
+// y[ell_y]), as spap2() of spline.hpp.
+dyn_spline_2D_t dyn_spap2(int mx, int my, int kx, int ky, const std::vector<float> & x, const std::vector<float> & y, const std::vector<float> & v) {
+  std::vector<float> inv_x((mx + kx) * (mx + kx));
+  std::vector<float> inv_y((my + ky) * (my + ky));
+  std::vector<float> new_c((my + ky) * (mx + kx));
+  std::vector<float> coefs((my + ky) * (mx + kx));
+  std::vector<float> new_v((my + ky) * x.size(), float(0));
+  std::vector<float> colmat_x(x.size() * std::size_t(mx));
+  std::vector<float> colmat_y(y.size() * std::size_t(my));
+  std::vector<float> vectB(mx + kx);
+  std::vector<int> t_x(x.size());
+  std::vector<int> t_y(y.size());
+  int ell_x, ell_y;
+  int lx, ly;
+  int i_x, i_y;
+  int j_x, j_y;
+  float sum;
+  
+  if((mx < 1) || (my < 1) || (mx > MAX_SPLINE_ORDER) || (my > MAX_SPLINE_ORDER) || (kx < 0) || (ky < 0)) {
+    throw std::runtime_error("Invalid spline geometry!");
+  }
+  lx = int(x.size());
+  ly = int(y.size());
+  for(ell_y = 0; ell_y < ly; ++ell_y) {
+    t_y[ell_y] = dyn_find_span(y[ell_y], ky);
+    dyn_evaluate_basis(& colmat_y[ell_y * my], y[ell_y], t_y[ell_y], my, ky);
+  }
+  for(ell_y = 0; ell_y < ly; ++ell_y) {
+    for(i_y = 0; i_y < my; ++i_y) {
+      for(ell_x = 0; ell_x < lx; ++ell_x) {
+        new_v[(i_y + t_y[ell_y]) * lx + ell_x] += colmat_y[ell_y * my + i_y] * v[ell_y * lx + ell_x];
+      }
+    }
+  }
+  for(ell_x = 0; ell_x < lx; ++ell_x) {
+    t_x[ell_x] = dyn_find_span(x[ell_x], kx);
+    dyn_evaluate_basis(& colmat_x[ell_x * mx], x[ell_x], t_x[ell_x], mx, kx);
+  }
+  dyn_get_inv_approx_matr(inv_x.data(), colmat_x.data(), t_x.data(), mx, kx, lx);
+  for(i_y = 0; i_y < (my + ky); ++i_y) {
+    for(i_x = 0; i_x < (mx + kx); ++i_x) {
+      vectB[i_x] = float(0);
+    }
+    for(ell_x = 0; ell_x < lx; ++ell_x) {
+      for(i_x = 0; i_x < mx; ++i_x) {
+        vectB[i_x + t_x[ell_x]] += colmat_x[ell_x * mx + i_x] * new_v[i_y * lx + ell_x];
+      }
+    }
+    for(j_x = 0; j_x < (mx + kx); ++j_x) {
+      sum = float(0);
+      for(i_x = 0; i_x < (mx + kx); ++i_x) {
+        sum += inv_x[j_x * (mx + kx) + i_x] * vectB[i_x];
+      }
+      new_c[i_y * (mx + kx) + j_x] = sum;
+    }
+  }
+  dyn_get_inv_approx_matr(inv_y.data(), colmat_y.data(), t_y.data(), my, ky, ly);
+  for(j_x = 0; j_x < (mx + kx); ++j_x) {
+    for(j_y = 0; j_y < (my + ky); ++j_y) {
+      sum = float(0);
+      for(i_y = 0; i_y < (my + ky); ++i_y) {
+        sum += inv_y[j_y * (my + ky) + i_y] * new_c[i_y * (mx + kx) + j_x];
+      }
+      coefs[j_y * (mx + kx) + j_x] = sum;
+    }
+  }
+  return(dyn_spline_2D_t(mx, my, kx, ky, coefs));
+}
+
+
+int dyn_find_span(const float & x, int k) {
+  return(((x < float(0)) || (x > float(1))) ? -1 : ((x != float(1)) ? int(x * float(k + 1)) : k));
+}
+
+
+void dyn_evaluate_basis(float *basis, const float & x, int ell, int m, int k) {
+  float saved, tmp;
+  int i, j;
+  
+  if(ell >= 0) {
+    basis[0] = float(1);
+    for(i = 1; i < m; ++i) {
+      saved = float(0);
+      for(j = 0; j < i; ++j) {
+        tmp = basis[j] / (float(i) / float(k + 1));
+        basis[j] = saved + (float(ell + j + 1) / float(k + 1) - x) * tmp;
+        saved = (x - float(ell + j - i + 1) / float(k + 1)) * tmp;
+      }
+      basis[i] = saved;
+    }
+  }
+  return;
+}
+
+
+// LU decomposition with partial pivoting of the n x n matrix matr, followed
+// by one triangular solve per column of the inverse.
+void dyn_get_inv(float *inv, const float *matr, int n) {
+  std::vector<float> tmp_matr(matr, matr + n * n);
+  std::vector<float> tmp_col(n);
+  std::vector<int> perm(n);
+  float pivot, coeff;
+  int i, j, k;
+  
+  for(i = 0; i < (n * n); ++i) {
+    inv[i] = float(0);
+  }
+  for(i = 0; i < n; ++i) {
+    perm[i] = i;
+  }
+  for(j = 0; j < (n - 1); ++j) {
+    pivot = float(0);
+    k = j;
+    for(i = j; i < n; ++i) {
+      coeff = tmp_matr[i * n + j];
+      if(coeff < float(0)) {
+        coeff = -coeff;
+      }
+      if(coeff > pivot) {
+        pivot = coeff;
+        k = i;
+      }
+    }
+    if(k != j) {
+      i = perm[k];
+      perm[k] = perm[j];
+      perm[j] = i;
+      for(i = 0; i < n; ++i) {
+        coeff = tmp_matr[k * n + i];
+        tmp_matr[k * n + i] = tmp_matr[j * n + i];
+        tmp_matr[j * n + i] = coeff;
+      }
+    }
+    for(i = (j + 1); i < n; ++i) {
+      tmp_matr[i * n + j] /= tmp_matr[j * n + j];
+      for(k = (j + 1); k < n; ++k) {
+        tmp_matr[i * n + k] -= tmp_matr[j * n + k] * tmp_matr[i * n + j];
+      }
+    }
+  }
+  for(k = 0; k < n; ++k) {
+    for(i = 0; i < n; ++i) {
+      tmp_col[i] = (k == perm[i]) ? float(1) : float(0);
+      for(j = 0; j < i; ++j) {
+        tmp_col[i] -= tmp_col[j] * tmp_matr[i * n + j];
+      }
+    }
+    for(i = (n - 1); i >= 0; --i) {
+      for(j = (i + 1); j < n; ++j) {
+        tmp_col[i] -= inv[j * n + k] * tmp_matr[i * n + j];
+      }
+      inv[i * n + k] = tmp_col[i] / tmp_matr[i * n + i];
+    }
+  }
+  return;
+}
+
+
+void dyn_get_inv_approx_matr(float *inv, const float *colmat, const int *t, int m, int k, int l) {
+  std::vector<float> mat((m + k) * (m + k), float(0));
+  int ell, i, j;
+  float tmp;
+  
+  for(ell = 0; ell < l; ++ell) {
+    for(i = 0; i < m; ++i) {
+      for(j = 0; j <= i; ++j) {
+        tmp = colmat[ell * m + i] * colmat[ell * m + j];
+        mat[(i + t[ell]) * (m + k) + j + t[ell]] += tmp;
+      }
+    }
+  }
+  for(i = 0; i < (m + k); ++i) {
+    for(j = (i + 1); j < (m + k); ++j) {
+      mat[i * (m + k) + j] = mat[j * (m + k) + i];
+    }
+  }
+  dyn_get_inv(inv, mat.data(), m + k);
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _DYN_SPLINE_H
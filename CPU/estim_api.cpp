@@ -0,0 +1,202 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include "spline.hpp"
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "search_schedule.h"
+#include "estim_options.h"
+#include "estimator.h"
+#include "estim_api.h"
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion -shared -fPIC -fvisibility=hidden estim_api.cpp -o libestim.so
+//
+// Implementation of the C interface of estim_api.h. Only the functions of
+// the interface are exported; no exception crosses it.
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// The kernels are chosen per handle, so that handles with different
+// instruction sets neither replace each other's kernels nor the ones of
+// threads estimating at the same time.
+struct estim_handle {
+  std::unique_ptr<estimator_t> estimator;
+  cpu_kernels_t cpu_kernels;
+  std::atomic<uint64_t> num_calls;
+  std::atomic<uint64_t> num_events;
+  std::atomic<uint64_t> num_valid;
+  std::atomic<uint64_t> busy_nsec;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+static thread_local std::string last_error;
+
+
+void set_last_error(const std::string & message);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int estim_get_api_version(void) {
+  return(ESTIM_API_VERSION);
+}
+
+
+int estim_get_num_pmts(void) {
+  return(NUM_PMTS);
+}
+
+
+estim_handle_t *estim_create(const char *mdrf_filename, const char *thresh_filename, const char *gain_filename, const char *options) {
+  std::unique_ptr<estim_handle_t> handle;
+  estim_options_t estim_options;
+  calibr_funct_t calibr_funct;
+  calibr_data_t calibr_data;
+  std::string option;
+  
+  try {
+    if((mdrf_filename == nullptr) || (thresh_filename == nullptr) || (gain_filename == nullptr)) {
+      throw std::runtime_error("Missing calibration file name!");
+    }
+    estim_options = get_default_estim_options();
+    if(options != nullptr) {
+      std::istringstream iss(options);
+      while(iss >> option) {
+        set_estim_option(estim_options, option);
+      }
+    }
+    estim_options.verbose = false;
+    calibr_data = get_calibration_data(mdrf_filename, thresh_filename, gain_filename);
+    calibr_funct = get_calibration_funct(calibr_data);
+    handle.reset(new estim_handle_t);
+    handle->estimator.reset(new estimator_t(calibr_funct, estim_options));
+    handle->cpu_kernels = get_cpu_kernels(parse_cpu_isa(estim_options.isa));
+    handle->num_calls = 0;
+    handle->num_events = 0;
+    handle->num_valid = 0;
+    handle->busy_nsec = 0;
+  } catch(const std::exception & e) {
+    set_last_error(e.what());
+    return(nullptr);
+  }
+  return(handle.release());
+}
+
+
+void estim_destroy(estim_handle_t *handle) {
+  delete handle;
+  return;
+}
+
+
+// Every record is staged on the stack, byte-swapped if needed and clamped
+// to non-negative values as by get_PMT_data(); the buffer itself is only
+// read.
+int estim_estimate(estim_handle_t *handle, const void *records, size_t num_events, size_t record_stride, int byte_order, estim_result_t *results) {
+  std::chrono::time_point<std::chrono::steady_clock> start, end;
+  const unsigned char *record;
+  estim_event_t estim_event;
+  uint64_t num_valid;
+  PMT_data_t PMT_data;
+  size_t event_index;
+  int pmt;
+  
+  if((handle == nullptr) || ((records == nullptr) && (num_events > 0)) || ((results == nullptr) && (num_events > 0))) {
+    set_last_error("Invalid handle or buffer!");
+    return(ESTIM_ERROR);
+  }
+  if((byte_order != ESTIM_BIG_ENDIAN) && (byte_order != ESTIM_NATIVE_ENDIAN)) {
+    set_last_error("Invalid byte order!");
+    return(ESTIM_ERROR);
+  }
+  if(record_stride == 0) {
+    record_stride = NUM_PMTS * sizeof(int16_t);
+  } else if(record_stride < (NUM_PMTS * sizeof(int16_t))) {
+    set_last_error("The record stride is smaller than a record!");
+    return(ESTIM_ERROR);
+  }
+  const cpu_kernels_t & cpu_kernels = handle->cpu_kernels;
+  start = std::chrono::steady_clock::now();
+  num_valid = 0;
+  record = static_cast<const unsigned char *>(records);
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    std::memcpy(PMT_data.val, record, NUM_PMTS * sizeof(int16_t));
+    if(byte_order == ESTIM_BIG_ENDIAN) {
+      cpu_kernels.bswap_clamp(PMT_data.val, PMT_data.val, NUM_PMTS);
+    } else {
+      for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+        PMT_data.val[pmt] = std::max(int16_t(0), PMT_data.val[pmt]);
+      }
+    }
+    handle->estimator->estimate(PMT_data, estim_event);
+    results[event_index].valid = estim_event.valid ? 1 : 0;
+    results[event_index].x_pos = estim_event.x_pos;
+    results[event_index].y_pos = estim_event.y_pos;
+    results[event_index].log_like = estim_event.log_like;
+    num_valid += estim_event.valid ? 1 : 0;
+    record += record_stride;
+  }
+  end = std::chrono::steady_clock::now();
+  handle->num_calls += 1;
+  handle->num_events += num_events;
+  handle->num_valid += num_valid;
+  handle->busy_nsec += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+  return(ESTIM_OK);
+}
+
+
+int estim_get_stats(const estim_handle_t *handle, estim_stats_t *stats) {
+  if((handle == nullptr) || (stats == nullptr)) {
+    set_last_error("Invalid handle or stats!");
+    return(ESTIM_ERROR);
+  }
+  stats->num_calls = handle->num_calls;
+  stats->num_events = handle->num_events;
+  stats->num_valid = handle->num_valid;
+  stats->busy_time = double(handle->busy_nsec) * 1e-9;
+  return(ESTIM_OK);
+}
+
+
+int estim_reset_stats(estim_handle_t *handle) {
+  if(handle == nullptr) {
+    set_last_error("Invalid handle!");
+    return(ESTIM_ERROR);
+  }
+  handle->num_calls = 0;
+  handle->num_events = 0;
+  handle->num_valid = 0;
+  handle->busy_nsec = 0;
+  return(ESTIM_OK);
+}
+
+
+const char *estim_get_last_error(void) {
+  return(last_error.c_str());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void set_last_error(const std::string & message) {
+  last_error = message;
+  return;
+}
@@ -0,0 +1,98 @@
+#ifndef _ESTIM_API_H
+#define _ESTIM_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// C interface of the CPU estimator, built as a shared library from
+// estim_api.cpp. The events are read in place from the caller's buffer and
+// the estimates are written to the caller's array, so acquisition software
+// can estimate straight from its DMA buffers without going through files.
+//
+//   estim_handle_t *handle = estim_create(mdrf, thresh, gain, "--schedule=6x1.75*10");
+//   if(handle == NULL) fprintf(stderr, "%s\n", estim_get_last_error());
+//   estim_estimate(handle, buffer, num_events, 0, ESTIM_BIG_ENDIAN, results);
+//   estim_destroy(handle);
+//
+// A handle can be used by several threads at the same time. The functions
+// returning int return ESTIM_OK or ESTIM_ERROR; the message of the last
+// error of the calling thread is given by estim_get_last_error().
+#define ESTIM_API_VERSION	1
+
+#define ESTIM_OK		0
+#define ESTIM_ERROR		(-1)
+
+#define ESTIM_BIG_ENDIAN	0
+#define ESTIM_NATIVE_ENDIAN	1
+
+#if defined(__GNUC__)
+#define ESTIM_API		__attribute__((visibility("default")))
+#else
+#define ESTIM_API
+#endif
+
+
+typedef struct estim_handle estim_handle_t;
+
+
+// Same layout as the records of estim_events_CPU.dat.
+typedef struct {
+  uint32_t valid;
+  float x_pos;
+  float y_pos;
+  float log_like;
+} estim_result_t;
+
+
+typedef struct {
+  uint64_t num_calls;
+  uint64_t num_events;
+  uint64_t num_valid;
+  double busy_time;
+} estim_stats_t;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Version of this interface and number of PMTs of an event record.
+ESTIM_API int estim_get_api_version(void);
+ESTIM_API int estim_get_num_pmts(void);
+
+// Loads and fits the calibration, and prepares an estimator with the
+// options of the command line of main.cpp given in one string separated by
+// spaces (NULL for the defaults); only the float engine is available.
+// Returns NULL on error.
+ESTIM_API estim_handle_t *estim_create(const char *mdrf_filename, const char *thresh_filename, const char *gain_filename, const char *options);
+ESTIM_API void estim_destroy(estim_handle_t *handle);
+
+// Estimates num_events records of estim_get_num_pmts() signed 16-bit
+// values each, in the given byte order, from records spaced by
+// record_stride bytes (0 for back-to-back records). results must hold
+// num_events entries.
+ESTIM_API int estim_estimate(estim_handle_t *handle, const void *records, size_t num_events, size_t record_stride, int byte_order, estim_result_t *results);
+
+// Totals since the creation of the handle or the last reset; busy_time is
+// the time spent in estim_estimate(), in seconds, summed over the threads.
+ESTIM_API int estim_get_stats(const estim_handle_t *handle, estim_stats_t *stats);
+ESTIM_API int estim_reset_stats(estim_handle_t *handle);
+
+ESTIM_API const char *estim_get_last_error(void);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _ESTIM_API_H
@@ -0,0 +1,362 @@
+#ifndef _ESTIM_CORE_HPP
+#define _ESTIM_CORE_HPP
+
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include "spline.hpp"
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Contracting-grid estimator written once for every number format. The
+// arithmetic is supplied by an engine class _E, which defines the value
+// type (value_t) used for the data, the MDRFs and the log-likelihoods, the
+// coordinate type (coord_t) used for the positions, the size max_num_pmts
+// of the per-PMT arrays, and the following operations:
+//
+//   get_num_pmts()                     number of PMTs of the camera
+//   get_camera_size()                  side of the field of view in mm
+//   get_data(data, values)             gain-corrected PMT signals
+//   eval_mdrf(output, x, y)            MDRFs of all the PMTs at (x, y)
+//   get_log_like(data, mdrf)           sum of data * log(mdrf) - mdrf
+//   add(a, b)                          sum of two log-likelihood values
+//   get_lgamma(data)                   lgamma(data + 1)
+//   get_thresh(x, y)                   threshold of the log-likelihood
+//   get_start(), get_first_step(size)  initial position and spacing
+//   get_offset(index, size, step)      offset of a grid point
+//   contract(step, factor)             spacing of the next iteration
+//   is_inside(x)                       test for the field of view
+//   get_zero(), get_outside()          log-likelihood constants
+//   value_to_float(value)              conversion of a log-likelihood
+//   coord_to_float(x)                  conversion of a position in [0, 1]
+//
+// The grid size _N is a template parameter, so that every engine gets
+// fully unrolled loops for the sizes it instantiates. _N = 0 selects the
+// grid size given at run time. The data arrays of estimate_core() are
+// padded with zeros up to max_num_pmts. The static operations of the
+// floating-point engines are shared through spline_arith_t.
+//
+// The core is shared by the CPU engines only. It is host code (the engines
+// evaluate spline_2D and the drivers use the standard library), so the
+// CUDA kernel of GPU/main.cu and the HLS kernel of FPGA/contr_grid.cpp keep
+// their own search.
+template<class _T> class spline_arith_t {
+  public:
+    typedef _T value_t;
+    typedef _T coord_t;
+    static value_t add(const value_t & a, const value_t & b);
+    static value_t get_lgamma(const value_t & data);
+    static coord_t get_start();
+    static coord_t get_first_step(int grid_size);
+    static coord_t get_offset(int index, int grid_size, const coord_t & step);
+    static coord_t contract(const coord_t & step, float contr_factor);
+    static bool is_inside(const coord_t & x);
+    static value_t get_zero();
+    static value_t get_outside();
+    static float value_to_float(const value_t & value);
+    static float coord_to_float(const coord_t & x);
+};
+
+
+template<class _T> class spline_engine_t : public spline_arith_t<_T> {
+  public:
+    typedef _T value_t;
+    typedef _T coord_t;
+    enum {
+      max_num_pmts = SIMD_PMT_STRIDE
+    };
+    spline_engine_t(const calibr_funct_base_t<_T> & my_calibr_funct);
+    int get_num_pmts() const;
+    float get_camera_size() const;
+    void get_data(value_t data[NUM_PMTS], const int16_t values[NUM_PMTS]) const;
+    void eval_mdrf(value_t output[SIMD_PMT_STRIDE], const coord_t & x, const coord_t & y) const;
+    value_t get_log_like(const value_t data[NUM_PMTS], const value_t mdrf[SIMD_PMT_STRIDE]) const;
+    value_t get_thresh(const coord_t & x, const coord_t & y) const;
+    
+  private:
+    const calibr_funct_base_t<_T> & calibr_funct;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+template<class _E, int _N> void contr_grid_core(typename _E::coord_t & current_x, typename _E::coord_t & current_y, typename _E::value_t & max_log_like, const typename _E::coord_t & step, int grid_size, const typename _E::value_t *tmp_data, const _E & engine);
+template<class _E, int _N> void search_core(typename _E::coord_t & current_x, typename _E::coord_t & current_y, typename _E::value_t & max_log_like, int num_iter, float contr_factor, const typename _E::value_t *tmp_data, const _E & engine);
+template<class _E> void finalize_core(estim_event_t & estim_event, const typename _E::coord_t & current_x, const typename _E::coord_t & current_y, const typename _E::value_t & max_log_like, const typename _E::value_t *tmp_data, const _E & engine);
+template<class _E, int _N> void estimate_core(estim_event_t & estim_event, const int16_t *values, int num_iter, float contr_factor, const _E & engine);
+template<class _E, int _N> std::vector<estim_event_t, aligned_allocator<estim_event_t>> estimate_events(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, int num_iter, float contr_factor, const _E & engine, bool verbose);
+template<class _E, int _N> std::vector<estim_event_t, aligned_allocator<estim_event_t>> estimate_events(const std::vector<int16_t> & LM_values, int num_iter, float contr_factor, const _E & engine, bool verbose);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+template<class _T> spline_engine_t<_T>::spline_engine_t(const calibr_funct_base_t<_T> & my_calibr_funct) : calibr_funct(my_calibr_funct) {
+}
+
+
+template<class _T> int spline_engine_t<_T>::get_num_pmts() const {
+  return(NUM_PMTS);
+}
+
+
+template<class _T> float spline_engine_t<_T>::get_camera_size() const {
+  return(CAMERA_SIZE);
+}
+
+
+template<class _T> void spline_engine_t<_T>::get_data(value_t data[NUM_PMTS], const int16_t values[NUM_PMTS]) const {
+  int pmt;
+  
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    data[pmt] = values[pmt] / calibr_funct.gain[pmt];
+  }
+  return;
+}
+
+
+template<class _T> void spline_engine_t<_T>::eval_mdrf(value_t output[SIMD_PMT_STRIDE], const coord_t & x, const coord_t & y) const {
+  int pmt;
+  
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    output[pmt] = calibr_funct.mdrf[pmt](x, y);
+  }
+  return;
+}
+
+
+template<class _T> _T spline_engine_t<_T>::get_log_like(const value_t data[NUM_PMTS], const value_t mdrf[SIMD_PMT_STRIDE]) const {
+  _T log_like;
+  int pmt;
+  
+  log_like = _T(0);
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    if((data[pmt] != _T(0)) || (mdrf[pmt] != _T(0))) {
+      log_like += data[pmt] * std::log(mdrf[pmt]) - mdrf[pmt];
+    }
+  }
+  return(log_like);
+}
+
+
+template<class _T> _T spline_engine_t<_T>::get_thresh(const coord_t & x, const coord_t & y) const {
+  return(calibr_funct.thresh(x, y));
+}
+
+
+template<class _T> _T spline_arith_t<_T>::add(const value_t & a, const value_t & b) {
+  return(a + b);
+}
+
+
+template<class _T> _T spline_arith_t<_T>::get_lgamma(const value_t & data) {
+  return(log_gamma(data + _T(1)));
+}
+
+
+template<class _T> _T spline_arith_t<_T>::get_start() {
+  return(_T(1) / _T(2));
+}
+
+
+template<class _T> _T spline_arith_t<_T>::get_first_step(int grid_size) {
+  return((_T(1) - _T(0)) / _T(grid_size));
+}
+
+
+template<class _T> _T spline_arith_t<_T>::get_offset(int index, int grid_size, const coord_t & step) {
+  return((_T(index) - (_T(grid_size - 1) / _T(2))) * step);
+}
+
+
+template<class _T> _T spline_arith_t<_T>::contract(const coord_t & step, float contr_factor) {
+  return(step / _T(contr_factor));
+}
+
+
+template<class _T> bool spline_arith_t<_T>::is_inside(const coord_t & x) {
+  return((_T(0) < x) && (x < _T(1)));
+}
+
+
+template<class _T> _T spline_arith_t<_T>::get_zero() {
+  return(_T(0));
+}
+
+
+template<class _T> _T spline_arith_t<_T>::get_outside() {
+  return(-_T(HUGE_VAL));
+}
+
+
+template<class _T> float spline_arith_t<_T>::value_to_float(const value_t & value) {
+  return(float(value));
+}
+
+
+template<class _T> float spline_arith_t<_T>::coord_to_float(const coord_t & x) {
+  return(float(x));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Evaluates the log-likelihood on a grid of spacing step centered on
+// (current_x, current_y) and moves the current point to the maximum. Ties
+// are resolved in favour of the first point in row-major order, and points
+// outside the field of view get engine.get_outside().
+template<class _E, int _N> void contr_grid_core(typename _E::coord_t & current_x, typename _E::coord_t & current_y, typename _E::value_t & max_log_like, const typename _E::coord_t & step, int grid_size, const typename _E::value_t *tmp_data, const _E & engine) {
+  typename _E::value_t camera_MDRF[_E::max_num_pmts];
+  typename _E::coord_t test_x, test_y;
+  typename _E::value_t log_like;
+  int max_index_x, max_index_y;
+  int index_x, index_y;
+  int size;
+  
+  size = (_N > 0) ? _N : grid_size;
+  max_log_like = engine.get_outside();
+  max_index_x = max_index_y = 0;
+  for(index_x = 0; index_x < size; ++index_x) {
+    test_x = current_x + _E::get_offset(index_x, size, step);
+    for(index_y = 0; index_y < size; ++index_y) {
+      test_y = current_y + _E::get_offset(index_y, size, step);
+      if(_E::is_inside(test_x) && _E::is_inside(test_y)) {
+        engine.eval_mdrf(camera_MDRF, test_x, test_y);
+        log_like = engine.get_log_like(tmp_data, camera_MDRF);
+      } else {
+        log_like = _E::get_outside();
+      }
+      if(((index_x == 0) && (index_y == 0)) || (max_log_like < log_like)) {
+        max_log_like = log_like;
+        max_index_x = index_x;
+        max_index_y = index_y;
+      }
+    }
+  }
+  current_x = current_x + _E::get_offset(max_index_x, size, step);
+  current_y = current_y + _E::get_offset(max_index_y, size, step);
+  return;
+}
+
+
+// Runs num_iter iterations of size _N starting from the center of the field
+// of view, contracting the grid by contr_factor after each of them.
+template<class _E, int _N> void search_core(typename _E::coord_t & current_x, typename _E::coord_t & current_y, typename _E::value_t & max_log_like, int num_iter, float contr_factor, const typename _E::value_t *tmp_data, const _E & engine) {
+  typename _E::coord_t step;
+  int iter;
+  
+  current_x = current_y = _E::get_start();
+  step = _E::get_first_step(_N);
+  max_log_like = _E::get_outside();
+  for(iter = 0; iter < num_iter; ++iter) {
+    contr_grid_core<_E, _N>(current_x, current_y, max_log_like, step, _N, tmp_data, engine);
+    step = _E::contract(step, contr_factor);
+  }
+  return;
+}
+
+
+// Completes the log-likelihood with the data-only terms, compares it to
+// the threshold and converts the position to mm.
+template<class _E> void finalize_core(estim_event_t & estim_event, const typename _E::coord_t & current_x, const typename _E::coord_t & current_y, const typename _E::value_t & max_log_like, const typename _E::value_t *tmp_data, const _E & engine) {
+  typename _E::value_t log_like;
+  float min_pos, max_pos;
+  int pmt;
+  
+  min_pos = -engine.get_camera_size() / 2.00f;
+  max_pos = +engine.get_camera_size() / 2.00f;
+  if(_E::is_inside(current_x) && _E::is_inside(current_y)) {
+    log_like = max_log_like;
+    for(pmt = 0; pmt < engine.get_num_pmts(); ++pmt) {
+      if(tmp_data[pmt] > _E::get_zero()) {
+        log_like = _E::add(log_like, -_E::get_lgamma(tmp_data[pmt]));
+      }
+    }
+    estim_event.valid = log_like > engine.get_thresh(current_x, current_y);
+    estim_event.log_like = _E::value_to_float(log_like);
+  } else {
+    estim_event.valid = 0;
+  }
+  estim_event.x_pos = min_pos + _E::coord_to_float(current_x) * (max_pos - min_pos);
+  estim_event.y_pos = min_pos + _E::coord_to_float(current_y) * (max_pos - min_pos);
+  return;
+}
+
+
+template<class _E, int _N> void estimate_core(estim_event_t & estim_event, const int16_t *values, int num_iter, float contr_factor, const _E & engine) {
+  typename _E::coord_t current_x, current_y;
+  typename _E::value_t tmp_data[_E::max_num_pmts];
+  typename _E::value_t max_log_like;
+  int pmt;
+  
+  engine.get_data(tmp_data, values);
+  for(pmt = engine.get_num_pmts(); pmt < _E::max_num_pmts; ++pmt) {
+    tmp_data[pmt] = _E::get_zero();
+  }
+  search_core<_E, _N>(current_x, current_y, max_log_like, num_iter, contr_factor, tmp_data, engine);
+  finalize_core<_E>(estim_event, current_x, current_y, max_log_like, tmp_data, engine);
+  return;
+}
+
+
+template<class _E, int _N> std::vector<estim_event_t, aligned_allocator<estim_event_t>> estimate_events(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, int num_iter, float contr_factor, const _E & engine, bool verbose) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event(PMT_data.size());
+  std::chrono::time_point<std::chrono::steady_clock> start, end;
+  unsigned int event_index;
+  unsigned int num_events;
+  
+  num_events = (unsigned int) PMT_data.size();
+  if(verbose) {
+    std::cout << "Number of events: " << num_events << "." << std::endl;
+  }
+  start = std::chrono::steady_clock::now();
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    estimate_core<_E, _N>(estim_event[event_index], PMT_data[event_index].val, num_iter, contr_factor, engine);
+  }
+  end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> diff = end - start;
+  if(verbose) {
+    std::cout << "Elapsed time: " << diff.count() << " s (" << double(num_events) / diff.count() << " events/s)." << std::endl;
+  }
+  return(estim_event);
+}
+
+
+// Same as above for events stored back to back with engine.get_num_pmts()
+// values each, as read by get_LM_values() for a camera known at run time.
+template<class _E, int _N> std::vector<estim_event_t, aligned_allocator<estim_event_t>> estimate_events(const std::vector<int16_t> & LM_values, int num_iter, float contr_factor, const _E & engine, bool verbose) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event(LM_values.size() / std::size_t(engine.get_num_pmts()));
+  std::chrono::time_point<std::chrono::steady_clock> start, end;
+  unsigned int event_index;
+  unsigned int num_events;
+  
+  num_events = (unsigned int) estim_event.size();
+  if(verbose) {
+    std::cout << "Number of events: " << num_events << "." << std::endl;
+  }
+  start = std::chrono::steady_clock::now();
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    estimate_core<_E, _N>(estim_event[event_index], & LM_values[std::size_t(event_index) * std::size_t(engine.get_num_pmts())], num_iter, contr_factor, engine);
+  }
+  end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> diff = end - start;
+  if(verbose) {
+    std::cout << "Elapsed time: " << diff.count() << " s (" << double(num_events) / diff.count() << " events/s)." << std::endl;
+  }
+  return(estim_event);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _ESTIM_CORE_HPP
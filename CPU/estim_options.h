@@ -0,0 +1,269 @@
+#ifndef _ESTIM_OPTIONS_H
+#define _ESTIM_OPTIONS_H
+
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cmath>
+#include <climits>
+#include "my_defines.h"
+#include "my_types.h"
+#include "search_schedule.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+estim_options_t get_default_estim_options();
+estim_options_t get_estim_options(int argc, char **argv);
+void set_estim_option(estim_options_t & estim_options, const std::string & arg);
+void read_estim_options_file(estim_options_t & estim_options, const std::string & filename);
+void parse_float_list(float *values, int num_values, const std::string & str);
+unsigned int parse_unsigned(const std::string & str);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+estim_options_t get_default_estim_options() {
+  estim_options_t estim_options;
+  
+  estim_options.engine = ESTIM_ENGINE_FLOAT;
+  estim_options.mode = ESTIM_MODE_CONTR_GRID;
+  estim_options.nn_grid_size = NN_GRID_SIZE;
+  estim_options.cache_size = 0;
+  estim_options.use_energy_window = false;
+  estim_options.energy_window_min = float(0);
+  estim_options.energy_window_max = HUGE_VALF;
+  estim_options.use_roi = false;
+  estim_options.roi_min_x = estim_options.roi_min_y = CAMERA_MIN_POS;
+  estim_options.roi_max_x = estim_options.roi_max_y = CAMERA_MAX_POS;
+  estim_options.spatial_binning = false;
+  estim_options.search_schedule = get_default_search_schedule();
+  estim_options.isa = "auto";
+  estim_options.camera_filename = "";
+  estim_options.pmt_subset_bound = float(0);
+  estim_options.result_cache_dir = "";
+  estim_options.session_filename = "";
+  estim_options.manifest_filename = "";
+  estim_options.num_threads = 0;
+  estim_options.numa = false;
+  estim_options.shard_begin = 0;
+  estim_options.shard_end = SIZE_MAX;
+  estim_options.image_pixel_size = float(0);
+  estim_options.keep_event_list = false;
+  estim_options.compact_output = false;
+  estim_options.compact_valid_only = false;
+  estim_options.compact_log_like = true;
+  estim_options.lm_index = false;
+  estim_options.shm_name = "";
+  estim_options.shm_output = SHM_OUTPUT_BLOCK;
+  estim_options.daemon_path = "";
+  estim_options.pipeline = false;
+  estim_options.verbose = true;
+  return(estim_options);
+}
+
+
+estim_options_t get_estim_options(int argc, char **argv) {
+  estim_options_t estim_options;
+  int i;
+  
+  estim_options = get_default_estim_options();
+  for(i = 1; i < argc; ++i) {
+    set_estim_option(estim_options, argv[i]);
+  }
+  return(estim_options);
+}
+
+
+void set_estim_option(estim_options_t & estim_options, const std::string & arg) {
+  std::string value;
+  float values[4];
+  
+  if(arg.compare(0, 9, "--engine=") == 0) {
+    value = arg.substr(9);
+    if(value == "float") {
+      estim_options.engine = ESTIM_ENGINE_FLOAT;
+    } else if(value == "double") {
+      estim_options.engine = ESTIM_ENGINE_DOUBLE;
+    } else if(value == "simd") {
+      estim_options.engine = ESTIM_ENGINE_SIMD;
+    } else if(value == "fixed") {
+      estim_options.engine = ESTIM_ENGINE_FIXED;
+    } else {
+      throw std::runtime_error("Unknown estimation engine " + value);
+    }
+  } else if(arg.compare(0, 7, "--mode=") == 0) {
+    value = arg.substr(7);
+    if(value == "contr_grid") {
+      estim_options.mode = ESTIM_MODE_CONTR_GRID;
+    } else if(value == "nn_start") {
+      estim_options.mode = ESTIM_MODE_NN_START;
+    } else if(value == "nn_only") {
+      estim_options.mode = ESTIM_MODE_NN_ONLY;
+    } else {
+      throw std::runtime_error("Unknown estimation mode " + value);
+    }
+  } else if(arg.compare(0, 10, "--nn-grid=") == 0) {
+    estim_options.nn_grid_size = std::stoi(arg.substr(10));
+    if(estim_options.nn_grid_size < 2) {
+      throw std::runtime_error("Invalid nearest-neighbor grid size!");
+    }
+  } else if(arg.compare(0, 8, "--cache=") == 0) {
+    estim_options.cache_size = parse_unsigned(arg.substr(8));
+  } else if(arg.compare(0, 16, "--energy-window=") == 0) {
+    parse_float_list(values, 2, arg.substr(16));
+    estim_options.use_energy_window = true;
+    estim_options.energy_window_min = values[0];
+    estim_options.energy_window_max = values[1];
+  } else if(arg.compare(0, 6, "--roi=") == 0) {
+    parse_float_list(values, 4, arg.substr(6));
+    estim_options.use_roi = true;
+    estim_options.roi_min_x = values[0];
+    estim_options.roi_max_x = values[1];
+    estim_options.roi_min_y = values[2];
+    estim_options.roi_max_y = values[3];
+  } else if(arg.compare(0, 11, "--schedule=") == 0) {
+    estim_options.search_schedule = parse_search_schedule(arg.substr(11));
+  } else if(arg == "--spatial-binning") {
+    estim_options.spatial_binning = true;
+  } else if(arg.compare(0, 6, "--isa=") == 0) {
+    estim_options.isa = arg.substr(6);
+  } else if(arg.compare(0, 9, "--camera=") == 0) {
+    estim_options.camera_filename = arg.substr(9);
+  } else if(arg.compare(0, 13, "--pmt-subset=") == 0) {
+    estim_options.pmt_subset_bound = std::stof(arg.substr(13));
+    if(!(estim_options.pmt_subset_bound > float(0))) {
+      throw std::runtime_error("The error bound of the PMT subset must be positive!");
+    }
+  } else if(arg.compare(0, 15, "--result-cache=") == 0) {
+    estim_options.result_cache_dir = arg.substr(15);
+  } else if(arg.compare(0, 10, "--session=") == 0) {
+    estim_options.session_filename = arg.substr(10);
+  } else if(arg.compare(0, 11, "--manifest=") == 0) {
+    estim_options.manifest_filename = arg.substr(11);
+  } else if(arg.compare(0, 10, "--threads=") == 0) {
+    estim_options.num_threads = parse_unsigned(arg.substr(10));
+  } else if(arg == "--numa") {
+    estim_options.numa = true;
+  } else if(arg.compare(0, 8, "--shard=") == 0) {
+    value = arg.substr(8);
+    if(value.find(',') == std::string::npos) {
+      throw std::runtime_error("Expected --shard=BEGIN,END");
+    }
+    estim_options.shard_begin = std::stoull(value.substr(0, value.find(',')));
+    estim_options.shard_end = std::stoull(value.substr(value.find(',') + 1));
+    if(estim_options.shard_end <= estim_options.shard_begin) {
+      throw std::runtime_error("The shard must contain at least one event!");
+    }
+  } else if(arg.compare(0, 8, "--image=") == 0) {
+    estim_options.image_pixel_size = std::stof(arg.substr(8));
+    if(!(estim_options.image_pixel_size > float(0))) {
+      throw std::runtime_error("The pixel size of the image must be positive!");
+    }
+  } else if(arg == "--event-list") {
+    estim_options.keep_event_list = true;
+  } else if((arg == "--compact") || (arg.compare(0, 10, "--compact=") == 0)) {
+    estim_options.compact_output = true;
+    std::istringstream iss((arg.size() > 10) ? arg.substr(10) : std::string());
+    while(std::getline(iss, value, ',')) {
+      if(value == "valid-only") {
+        estim_options.compact_valid_only = true;
+      } else if(value == "no-log-like") {
+        estim_options.compact_log_like = false;
+      } else {
+        throw std::runtime_error("Unknown compact format setting " + value);
+      }
+    }
+  } else if(arg == "--index") {
+    estim_options.lm_index = true;
+  } else if(arg.compare(0, 6, "--shm=") == 0) {
+    estim_options.shm_name = arg.substr(6);
+  } else if(arg.compare(0, 13, "--shm-output=") == 0) {
+    value = arg.substr(13);
+    if(value == "block") {
+      estim_options.shm_output = SHM_OUTPUT_BLOCK;
+    } else if(value == "drop") {
+      estim_options.shm_output = SHM_OUTPUT_DROP;
+    } else if(value == "none") {
+      estim_options.shm_output = SHM_OUTPUT_NONE;
+    } else {
+      throw std::runtime_error("Unknown shared-memory output " + value);
+    }
+  } else if(arg.compare(0, 9, "--daemon=") == 0) {
+    estim_options.daemon_path = arg.substr(9);
+  } else if(arg == "--pipeline") {
+    estim_options.pipeline = true;
+  } else if(arg == "--quiet") {
+    estim_options.verbose = false;
+  } else if(arg.compare(0, 9, "--config=") == 0) {
+    read_estim_options_file(estim_options, arg.substr(9));
+  } else {
+    throw std::runtime_error("Unknown option " + arg);
+  }
+  return;
+}
+
+
+// Reads options from a text file with one option per line, written as on
+// the command line with or without the leading "--". Empty lines and lines
+// starting with '#' are ignored.
+void read_estim_options_file(estim_options_t & estim_options, const std::string & filename) {
+  std::ifstream ifs;
+  std::string line;
+  
+  ifs.open(filename.c_str(), std::ifstream::in);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open options file " + filename);
+  }
+  while(std::getline(ifs, line)) {
+    line.erase(0, line.find_first_not_of(" \t"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if(line.empty() || (line[0] == '#')) {
+      continue;
+    }
+    set_estim_option(estim_options, (line.compare(0, 2, "--") == 0) ? line : ("--" + line));
+  }
+  ifs.close();
+  return;
+}
+
+
+void parse_float_list(float *values, int num_values, const std::string & str) {
+  std::istringstream iss(str);
+  std::string token;
+  int i;
+  
+  for(i = 0; i < num_values; ++i) {
+    if(!std::getline(iss, token, ',') || token.empty()) {
+      throw std::runtime_error("Expected " + std::to_string(num_values) + " comma-separated values in " + str);
+    }
+    values[i] = std::stof(token);
+  }
+  if(std::getline(iss, token, ',')) {
+    throw std::runtime_error("Too many values in " + str);
+  }
+  return;
+}
+
+
+// std::stoul() accepts a minus sign, trailing characters and values beyond
+// unsigned int, which a cast would silently wrap or truncate.
+unsigned int parse_unsigned(const std::string & str) {
+  unsigned long value;
+  std::size_t pos;
+  
+  value = std::stoul(str, & pos);
+  if((pos != str.size()) || (str.find('-') != std::string::npos) || (value > UINT_MAX)) {
+    throw std::runtime_error("Invalid unsigned integer " + str);
+  }
+  return((unsigned int) value);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _ESTIM_OPTIONS_H
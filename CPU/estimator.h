@@ -0,0 +1,111 @@
+#ifndef _ESTIMATOR_H
+#define _ESTIMATOR_H
+
+#include <stdexcept>
+#include <cstdint>
+#include <vector>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "nn_index.h"
+#include "prefilter.h"
+#include "search_schedule.h"
+#include "contr_grid.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Reusable estimator for per-event and small-batch use. Everything derived
+// from the calibration and the options (the nearest-neighbor index, the
+// prefilter tables and the grid spacings of the schedule) is built once by
+// the constructor; estimate() and estimate_batch() then work on the stack
+// only and never allocate. Both are const, so one estimator can serve
+// several threads. The event cache and the spatial binning of contr_grid()
+// are not available: the first allocates on insertion and the second
+// needs a whole batch to reorder. Only the float engine is available per
+// event. The constructor refuses these options rather than silently
+// running without them, which covers every user of the estimator.
+class estimator_t {
+  public:
+    estimator_t(const calibr_funct_t & my_calibr_funct, const estim_options_t & my_estim_options);
+    void estimate(const PMT_data_t & PMT_data, estim_event_t & estim_event) const;
+    void estimate_batch(const PMT_data_t *PMT_data, estim_event_t *estim_event, std::size_t num_events) const;
+    const calibr_funct_t & get_calibr_funct() const;
+    const estim_options_t & get_estim_options() const;
+    
+  private:
+    calibr_funct_t calibr_funct;
+    estim_options_t estim_options;
+    nn_index_t nn_index;
+    prefilter_t prefilter;
+    std::vector<float> steps;
+    unsigned int start_iter;
+    bool use_prefilter;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+estimator_t::estimator_t(const calibr_funct_t & my_calibr_funct, const estim_options_t & my_estim_options) : calibr_funct(my_calibr_funct), estim_options(my_estim_options) {
+  if(estim_options.engine != ESTIM_ENGINE_FLOAT) {
+    throw std::runtime_error("This estimator only supports the float engine!");
+  }
+  if(estim_options.cache_size > 0) {
+    throw std::runtime_error("This estimator does not support the event cache!");
+  }
+  if(estim_options.spatial_binning) {
+    throw std::runtime_error("This estimator does not support the spatial binning!");
+  }
+  if(estim_options.mode != ESTIM_MODE_CONTR_GRID) {
+    nn_index.build(calibr_funct, estim_options.nn_grid_size);
+  }
+  prefilter = get_prefilter(calibr_funct, estim_options);
+  use_prefilter = prefilter.use_energy_window || prefilter.use_roi;
+  steps = get_search_steps(estim_options.search_schedule);
+  // Without events at hand, the warm start is checked on synthetic ones.
+  if(estim_options.mode == ESTIM_MODE_NN_START) {
+    start_iter = get_start_iter(estim_options, steps, nn_index, calibr_funct, get_synthetic_PMT_data(calibr_funct, NN_START_NUM_SAMPLES, 12345));
+  } else {
+    start_iter = 0;
+  }
+}
+
+
+void estimator_t::estimate(const PMT_data_t & PMT_data, estim_event_t & estim_event) const {
+  float centroid_x, centroid_y;
+  
+  if(use_prefilter && !prefilter_event(centroid_x, centroid_y, PMT_data, prefilter)) {
+    reject_event(estim_event);
+    return;
+  }
+  contr_grid_event(estim_event, PMT_data, calibr_funct, estim_options, steps, start_iter, nn_index);
+  return;
+}
+
+
+void estimator_t::estimate_batch(const PMT_data_t *PMT_data, estim_event_t *estim_event, std::size_t num_events) const {
+  std::size_t event_index;
+  
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    estimate(PMT_data[event_index], estim_event[event_index]);
+  }
+  return;
+}
+
+
+const calibr_funct_t & estimator_t::get_calibr_funct() const {
+  return(calibr_funct);
+}
+
+
+const estim_options_t & estimator_t::get_estim_options() const {
+  return(estim_options);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _ESTIMATOR_H
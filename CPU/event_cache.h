@@ -0,0 +1,179 @@
+#ifndef _EVENT_CACHE_H
+#define _EVENT_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include "my_defines.h"
+#include "my_types.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Memoization cache mapping raw PMT signal vectors to their estimates. The
+// table is set-associative with CACHE_WAYS entries per set, and the least
+// recently used way of a set is evicted when a new vector is inserted, so
+// the memory footprint stays bounded by the requested capacity. Sets are
+// guarded by a pool of striped locks and the statistics are atomic, so a
+// single cache can be shared by concurrent estimators.
+class event_cache_t {
+  public:
+    event_cache_t(std::size_t capacity);
+    bool find(const PMT_data_t & PMT_data, estim_event_t & estim_event);
+    void insert(const PMT_data_t & PMT_data, const estim_event_t & estim_event);
+    std::size_t get_capacity() const;
+    uint64_t get_num_hits() const;
+    uint64_t get_num_misses() const;
+    uint64_t get_num_evictions() const;
+    void print_stats(std::ostream & os) const;
+    
+  private:
+    struct entry_t {
+      int16_t key[NUM_PMTS];
+      uint16_t used;
+      uint32_t age;
+      estim_event_t value;
+    };
+    static uint64_t get_hash(const int16_t key[NUM_PMTS]);
+    std::vector<entry_t> entries;
+    std::vector<uint32_t> clock;
+    std::mutex locks[CACHE_NUM_LOCKS];
+    std::atomic<uint64_t> num_hits;
+    std::atomic<uint64_t> num_misses;
+    std::atomic<uint64_t> num_evictions;
+    std::size_t num_sets;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+event_cache_t::event_cache_t(std::size_t capacity) : num_hits(0), num_misses(0), num_evictions(0) {
+  std::size_t n;
+  
+  num_sets = 1;
+  while((num_sets * CACHE_WAYS) < capacity) {
+    num_sets *= 2;
+  }
+  entries.resize(num_sets * CACHE_WAYS);
+  clock.assign(num_sets, 0);
+  for(n = 0; n < entries.size(); ++n) {
+    entries[n].used = 0;
+  }
+}
+
+
+bool event_cache_t::find(const PMT_data_t & PMT_data, estim_event_t & estim_event) {
+  std::size_t set, way;
+  uint64_t hash;
+  entry_t *ptr;
+  
+  hash = get_hash(PMT_data.val);
+  set = std::size_t(hash) & (num_sets - 1);
+  ptr = & entries[set * CACHE_WAYS];
+  std::lock_guard<std::mutex> guard(locks[set % CACHE_NUM_LOCKS]);
+  for(way = 0; way < CACHE_WAYS; ++way) {
+    if(ptr[way].used && (std::memcmp(ptr[way].key, PMT_data.val, sizeof(ptr[way].key)) == 0)) {
+      ptr[way].age = ++clock[set];
+      estim_event = ptr[way].value;
+      ++num_hits;
+      return(true);
+    }
+  }
+  ++num_misses;
+  return(false);
+}
+
+
+void event_cache_t::insert(const PMT_data_t & PMT_data, const estim_event_t & estim_event) {
+  std::size_t set, way, victim;
+  uint64_t hash;
+  entry_t *ptr;
+  
+  hash = get_hash(PMT_data.val);
+  set = std::size_t(hash) & (num_sets - 1);
+  ptr = & entries[set * CACHE_WAYS];
+  std::lock_guard<std::mutex> guard(locks[set % CACHE_NUM_LOCKS]);
+  victim = 0;
+  for(way = 0; way < CACHE_WAYS; ++way) {
+    if(!ptr[way].used) {
+      victim = way;
+      break;
+    }
+    if(std::memcmp(ptr[way].key, PMT_data.val, sizeof(ptr[way].key)) == 0) {
+      victim = way;
+      break;
+    }
+    if(ptr[way].age < ptr[victim].age) {
+      victim = way;
+    }
+  }
+  if((way == CACHE_WAYS) && ptr[victim].used) {
+    ++num_evictions;
+  }
+  std::memcpy(ptr[victim].key, PMT_data.val, sizeof(ptr[victim].key));
+  ptr[victim].used = 1;
+  ptr[victim].age = ++clock[set];
+  ptr[victim].value = estim_event;
+  return;
+}
+
+
+std::size_t event_cache_t::get_capacity() const {
+  return(entries.size());
+}
+
+
+uint64_t event_cache_t::get_num_hits() const {
+  return(num_hits.load());
+}
+
+
+uint64_t event_cache_t::get_num_misses() const {
+  return(num_misses.load());
+}
+
+
+uint64_t event_cache_t::get_num_evictions() const {
+  return(num_evictions.load());
+}
+
+
+void event_cache_t::print_stats(std::ostream & os) const {
+  uint64_t hits, misses;
+  
+  hits = get_num_hits();
+  misses = get_num_misses();
+  os << "Event cache: " << hits << " hits, " << misses << " misses (";
+  os << ((hits + misses) > 0 ? 100.0 * double(hits) / double(hits + misses) : 0.0) << "% hit rate), ";
+  os << get_num_evictions() << " evictions, " << get_capacity() << " entries." << std::endl;
+  return;
+}
+
+
+// 64-bit FNV-1a over the raw bytes of the signal vector, followed by a
+// final avalanche so that the low bits used to pick the set are well mixed.
+uint64_t event_cache_t::get_hash(const int16_t key[NUM_PMTS]) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(key);
+  uint64_t hash;
+  std::size_t i;
+  
+  hash = UINT64_C(0xCBF29CE484222325);
+  for(i = 0; i < (NUM_PMTS * sizeof(key[0])); ++i) {
+    hash ^= bytes[i];
+    hash *= UINT64_C(0x00000100000001B3);
+  }
+  hash ^= hash >> 33;
+  hash *= UINT64_C(0xFF51AFD7ED558CCD);
+  hash ^= hash >> 33;
+  return(hash);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _EVENT_CACHE_H
@@ -0,0 +1,397 @@
+#ifndef _FIXED_POINT_H
+#define _FIXED_POINT_H
+
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include <cmath>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "estim_core.hpp"
+#include "cpu_dispatch.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Integer model of the FPGA kernel in FPGA/contr_grid.cpp. Values are kept
+// as raw two's complement integers in the Q-formats of the ap_fixed types
+// used there: MDRF values, data and log-likelihoods as ap_fixed<32, 12>
+// (mdrf_value_t), positions as ap_fixed<24, 6> (pos_value_t) and the
+// threshold spline as ap_fixed<16, 6> (thresh_value_t). Each operation
+// follows the ap_fixed rules for the default AP_TRN/AP_WRAP modes: full
+// precision products and sums, truncation towards minus infinity on
+// assignment and integer divisions truncated towards zero.
+//
+// The spline evaluation, the search and the final test follow the FPGA
+// arithmetic step by step, but they have not been checked bit by bit
+// against the C simulation of the kernel; compare_estim.cpp makes that
+// comparison. hls::log() and my_lgamma() cannot be reproduced without the
+// Vivado libraries, so the log is computed with an integer table (accurate
+// to one LSB of mdrf_value_t) and the log-gamma of the data in floating
+// point before being truncated to mdrf_value_t. The log-likelihoods, and
+// the positions where two grid points are within the error of the log,
+// may therefore differ from those of the kernel.
+struct fixed_calibr_t {
+  int32_t mdrf_coefs[MY + KY][MX + KX][SIMD_PMT_STRIDE];
+  int32_t thresh_coefs[MY + KY][MX + KX];
+  int32_t gain[NUM_PMTS];
+  int64_t log2_table[(1 << FIXED_LOG_TABLE_BITS) + 1];
+};
+
+
+// Engine of the fixed-point model for the generic estimator core (see
+// estim_core.hpp). Values and coordinates are raw integers held in int64_t,
+// wrapped to the width of their ap_fixed type after every assignment.
+class fixed_engine_t {
+  public:
+    typedef int64_t value_t;
+    typedef int64_t coord_t;
+    enum {
+      max_num_pmts = SIMD_PMT_STRIDE
+    };
+    fixed_engine_t(const fixed_calibr_t & my_fixed_calibr);
+    int get_num_pmts() const;
+    float get_camera_size() const;
+    void get_data(value_t data[NUM_PMTS], const int16_t values[NUM_PMTS]) const;
+    void eval_mdrf(value_t output[SIMD_PMT_STRIDE], const coord_t & x, const coord_t & y) const;
+    value_t get_log_like(const value_t data[SIMD_PMT_STRIDE], const value_t mdrf[SIMD_PMT_STRIDE]) const;
+    value_t get_thresh(const coord_t & x, const coord_t & y) const;
+    static value_t add(const value_t & a, const value_t & b);
+    static value_t get_lgamma(const value_t & data);
+    static coord_t get_start();
+    static coord_t get_first_step(int grid_size);
+    static coord_t get_offset(int index, int grid_size, const coord_t & step);
+    static coord_t contract(const coord_t & step, float contr_factor);
+    static bool is_inside(const coord_t & x);
+    static value_t get_zero();
+    static value_t get_outside();
+    static float value_to_float(const value_t & value);
+    static float coord_to_float(const coord_t & x);
+    
+  private:
+    const fixed_calibr_t & fixed_calibr;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+template<int _W> inline int64_t wrap_fixed(int64_t value);
+inline int64_t shift_fixed(int64_t value, int bits);
+inline int64_t to_fixed(double value, int frac_bits);
+template<int _K> inline int find_span_fixed(int64_t x);
+template<int _M, int _K> void evaluate_basis_fixed(int64_t basis[_M], int64_t x, int ell);
+void eval_mdrf_fixed(int32_t output[SIMD_PMT_STRIDE], const fixed_calibr_t & fixed_calibr, int64_t x, int64_t y);
+int32_t eval_thresh_fixed(const fixed_calibr_t & fixed_calibr, int64_t x, int64_t y);
+int32_t log_fixed(const fixed_calibr_t & fixed_calibr, int32_t x);
+fixed_calibr_t get_fixed_calibr(const calibr_funct_t & calibr_funct);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Keeps the _W least significant bits of value, sign-extended (AP_WRAP).
+template<int _W> inline int64_t wrap_fixed(int64_t value) {
+  return(int64_t(uint64_t(value) << (64 - _W)) >> (64 - _W));
+}
+
+
+// Left shift of a raw value that may be negative, written as a product
+// because shifting a negative value left is undefined in C++11.
+inline int64_t shift_fixed(int64_t value, int bits) {
+  return(value * (int64_t(1) << bits));
+}
+
+
+// Conversion of a floating-point value to a fixed-point raw value (AP_TRN).
+inline int64_t to_fixed(double value, int frac_bits) {
+  return(int64_t(std::floor(std::ldexp(value, frac_bits))));
+}
+
+
+template<int _K> inline int find_span_fixed(int64_t x) {
+  const int64_t one = int64_t(1) << POS_FRAC_BITS;
+  
+  return(((x < 0) || (x > one)) ? -1 : ((x != one) ? int((x * (_K + 1)) >> POS_FRAC_BITS) : _K));
+}
+
+
+// Same recurrence as evaluate_basis() in FPGA/spline.hpp, with positions
+// and basis functions in pos_value_t.
+template<int _M, int _K> void evaluate_basis_fixed(int64_t basis[_M], int64_t x, int ell) {
+  const int64_t knot_scale = int64_t(_K + 1) << POS_FRAC_BITS;
+  int64_t saved, tmp, t;
+  int64_t buff[2][_M];
+  int m, j;
+  
+  if(ell >= 0) {
+    buff[0][0] = int64_t(1) << POS_FRAC_BITS;
+    for(m = 1; m < (_M - 1); ++m) {
+      saved = 0;
+      for(j = 0; j < m; ++j) {
+        tmp = (shift_fixed(buff[(~m) & 1][j] * knot_scale, POS_FRAC_BITS) / (int64_t(m) << POS_FRAC_BITS)) >> POS_FRAC_BITS;
+        t = (int64_t(ell + j + 1) << (2 * POS_FRAC_BITS)) / knot_scale;
+        buff[m & 1][j] = (shift_fixed(saved, POS_FRAC_BITS) + (t - x) * tmp) >> POS_FRAC_BITS;
+        t = (int64_t(ell + j - m + 1) * (int64_t(1) << (2 * POS_FRAC_BITS))) / knot_scale;
+        saved = ((x - t) * tmp) >> POS_FRAC_BITS;
+      }
+      buff[m & 1][m] = saved;
+    }
+    saved = 0;
+    for(j = 0; j < (_M - 1); ++j) {
+      tmp = (shift_fixed(buff[_M & 1][j] * knot_scale, POS_FRAC_BITS) / (int64_t(_M - 1) << POS_FRAC_BITS)) >> POS_FRAC_BITS;
+      t = (int64_t(ell + j + 1) << (2 * POS_FRAC_BITS)) / knot_scale;
+      basis[j] = (shift_fixed(saved, POS_FRAC_BITS) + (t - x) * tmp) >> POS_FRAC_BITS;
+      t = (int64_t(ell + j - _M + 2) * (int64_t(1) << (2 * POS_FRAC_BITS))) / knot_scale;
+      saved = ((x - t) * tmp) >> POS_FRAC_BITS;
+    }
+    basis[_M - 1] = saved;
+  }
+  return;
+}
+
+
+// Evaluates the MDRFs of all the PMTs at (x, y). The coefficients are
+// stored with the PMT index last, so that the kernels of cpu_dispatch.h
+// process several PMTs per instruction with 32 x 32 -> 64-bit products. Only bits
+// [MDRF_FRAC_BITS, MDRF_FRAC_BITS + 32) of each product survive the
+// truncation and the wrap-around to 32 bits, so a logical shift gives the
+// same result as the arithmetic one.
+void eval_mdrf_fixed(int32_t output[SIMD_PMT_STRIDE], const fixed_calibr_t & fixed_calibr, int64_t x, int64_t y) {
+  int64_t weight[MX][MY];
+  int64_t basis_x[MX];
+  int64_t basis_y[MY];
+  int ell_x, ell_y;
+  int i_x, i_y;
+  int pmt;
+  
+  ell_x = find_span_fixed<KX>(x);
+  ell_y = find_span_fixed<KY>(y);
+  if((ell_x < 0) || (ell_y < 0)) {
+    for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+      output[pmt] = 0;
+    }
+    return;
+  }
+  evaluate_basis_fixed<MX, KX>(basis_x, x, ell_x);
+  evaluate_basis_fixed<MY, KY>(basis_y, y, ell_y);
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      weight[i_x][i_y] = wrap_fixed<MDRF_WIDTH>((basis_x[i_x] * basis_y[i_y]) >> (2 * POS_FRAC_BITS - MDRF_FRAC_BITS));
+    }
+  }
+  get_cpu_kernels().eval_spline_fixed(output, & fixed_calibr.mdrf_coefs[ell_y][ell_x][0], weight);
+  return;
+}
+
+
+int32_t eval_thresh_fixed(const fixed_calibr_t & fixed_calibr, int64_t x, int64_t y) {
+  int64_t basis_x[MX];
+  int64_t basis_y[MY];
+  int ell_x, ell_y;
+  int i_x, i_y;
+  int64_t s;
+  
+  s = 0;
+  ell_x = find_span_fixed<KX>(x);
+  ell_y = find_span_fixed<KY>(y);
+  if((ell_x >= 0) && (ell_y >= 0)) {
+    evaluate_basis_fixed<MX, KX>(basis_x, x, ell_x);
+    evaluate_basis_fixed<MY, KY>(basis_y, y, ell_y);
+    for(i_x = 0; i_x < MX; ++i_x) {
+      for(i_y = 0; i_y < MY; ++i_y) {
+        s += (int64_t(fixed_calibr.thresh_coefs[ell_y + i_y][ell_x + i_x]) * wrap_fixed<THRESH_WIDTH>((basis_x[i_x] * basis_y[i_y]) >> (2 * POS_FRAC_BITS - THRESH_FRAC_BITS))) >> THRESH_FRAC_BITS;
+        s = wrap_fixed<THRESH_WIDTH>(s);
+      }
+    }
+  }
+  return(int32_t(s));
+}
+
+
+// Natural log of a positive mdrf_value_t: the argument is normalized to
+// [1, 2) with a count of leading zeros, log2 of the mantissa is linearly
+// interpolated in a table and the result is scaled by ln(2). Non-positive
+// arguments return the most negative representable value.
+int32_t log_fixed(const fixed_calibr_t & fixed_calibr, int32_t x) {
+  const int64_t ln2 = to_fixed(std::log(2.0), LOG2_TABLE_FRAC_BITS);
+  const int ln2_split = 15;
+  int64_t log2_value, frac, lo, hi;
+  int msb, index, shift;
+  uint32_t mantissa;
+  
+  if(x <= 0) {
+    return(INT32_MIN);
+  }
+  msb = 31 - __builtin_clz(uint32_t(x));
+  mantissa = uint32_t(x) << (31 - msb);
+  shift = 31 - FIXED_LOG_TABLE_BITS;
+  index = int((mantissa >> shift) & ((1u << FIXED_LOG_TABLE_BITS) - 1));
+  frac = int64_t(mantissa & ((1u << shift) - 1));
+  lo = fixed_calibr.log2_table[index];
+  hi = fixed_calibr.log2_table[index + 1];
+  log2_value = shift_fixed(msb - MDRF_FRAC_BITS, LOG2_TABLE_FRAC_BITS) + lo + (((hi - lo) * frac) >> shift);
+  // |log2_value| < 2^(5 + LOG2_TABLE_FRAC_BITS), so log2_value * ln2 does
+  // not fit in 64 bits for the arguments below 2^9 (log2_value < -11.5).
+  // ln2 is split in two halves whose products fit, and the floor of the
+  // scaled product is rebuilt from them exactly.
+  static_assert((MDRF_WIDTH <= 32) && ((5 + LOG2_TABLE_FRAC_BITS) + (LOG2_TABLE_FRAC_BITS - ln2_split) <= 62) && ((5 + LOG2_TABLE_FRAC_BITS) + ln2_split <= 62) && (2 * LOG2_TABLE_FRAC_BITS - MDRF_FRAC_BITS >= ln2_split), "The product of log_fixed() does not fit in 64 bits");
+  return(int32_t(wrap_fixed<MDRF_WIDTH>((log2_value * (ln2 >> ln2_split) + ((log2_value * (ln2 & ((int64_t(1) << ln2_split) - 1))) >> ln2_split)) >> (2 * LOG2_TABLE_FRAC_BITS - MDRF_FRAC_BITS - ln2_split))));
+}
+
+
+fixed_calibr_t get_fixed_calibr(const calibr_funct_t & calibr_funct) {
+  float tmp_spline_coefs[MY + KY][MX + KX];
+  fixed_calibr_t fixed_calibr;
+  int i_x, i_y, pmt, n;
+  
+  for(i_y = 0; i_y < (MY + KY); ++i_y) {
+    for(i_x = 0; i_x < (MX + KX); ++i_x) {
+      for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+        fixed_calibr.mdrf_coefs[i_y][i_x][pmt] = 0;
+      }
+    }
+  }
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    calibr_funct.mdrf[pmt].get_coefs(tmp_spline_coefs);
+    for(i_y = 0; i_y < (MY + KY); ++i_y) {
+      for(i_x = 0; i_x < (MX + KX); ++i_x) {
+        fixed_calibr.mdrf_coefs[i_y][i_x][pmt] = int32_t(wrap_fixed<MDRF_WIDTH>(to_fixed(double(tmp_spline_coefs[i_y][i_x]), MDRF_FRAC_BITS)));
+      }
+    }
+    fixed_calibr.gain[pmt] = int32_t(wrap_fixed<MDRF_WIDTH>(to_fixed(double(calibr_funct.gain[pmt]), MDRF_FRAC_BITS)));
+  }
+  calibr_funct.thresh.get_coefs(tmp_spline_coefs);
+  for(i_y = 0; i_y < (MY + KY); ++i_y) {
+    for(i_x = 0; i_x < (MX + KX); ++i_x) {
+      fixed_calibr.thresh_coefs[i_y][i_x] = int32_t(wrap_fixed<THRESH_WIDTH>(to_fixed(double(tmp_spline_coefs[i_y][i_x]), THRESH_FRAC_BITS)));
+    }
+  }
+  for(n = 0; n <= (1 << FIXED_LOG_TABLE_BITS); ++n) {
+    fixed_calibr.log2_table[n] = to_fixed(std::log2(1.0 + double(n) / double(1 << FIXED_LOG_TABLE_BITS)), LOG2_TABLE_FRAC_BITS);
+  }
+  return(fixed_calibr);
+}
+
+
+fixed_engine_t::fixed_engine_t(const fixed_calibr_t & my_fixed_calibr) : fixed_calibr(my_fixed_calibr) {
+}
+
+
+int fixed_engine_t::get_num_pmts() const {
+  return(NUM_PMTS);
+}
+
+
+float fixed_engine_t::get_camera_size() const {
+  return(CAMERA_SIZE);
+}
+
+
+void fixed_engine_t::get_data(value_t data[NUM_PMTS], const int16_t values[NUM_PMTS]) const {
+  int pmt;
+  
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    data[pmt] = wrap_fixed<MDRF_WIDTH>(shift_fixed(values[pmt], 2 * MDRF_FRAC_BITS) / fixed_calibr.gain[pmt]);
+  }
+  return;
+}
+
+
+void fixed_engine_t::eval_mdrf(value_t output[SIMD_PMT_STRIDE], const coord_t & x, const coord_t & y) const {
+  int32_t camera_MDRF[SIMD_PMT_STRIDE];
+  int pmt;
+  
+  eval_mdrf_fixed(camera_MDRF, fixed_calibr, x, y);
+  for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+    output[pmt] = camera_MDRF[pmt];
+  }
+  return;
+}
+
+
+int64_t fixed_engine_t::get_log_like(const value_t data[SIMD_PMT_STRIDE], const value_t mdrf[SIMD_PMT_STRIDE]) const {
+  int64_t log_like;
+  int pmt;
+  
+  log_like = 0;
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    if((data[pmt] != 0) || (mdrf[pmt] != 0)) {
+      log_like += (data[pmt] * int64_t(log_fixed(fixed_calibr, int32_t(mdrf[pmt]))) - shift_fixed(mdrf[pmt], MDRF_FRAC_BITS)) >> MDRF_FRAC_BITS;
+      log_like = wrap_fixed<MDRF_WIDTH>(log_like);
+    }
+  }
+  return(log_like);
+}
+
+
+int64_t fixed_engine_t::get_thresh(const coord_t & x, const coord_t & y) const {
+  return(shift_fixed(eval_thresh_fixed(fixed_calibr, x, y), MDRF_FRAC_BITS - THRESH_FRAC_BITS));
+}
+
+
+int64_t fixed_engine_t::add(const value_t & a, const value_t & b) {
+  return(wrap_fixed<MDRF_WIDTH>(a + b));
+}
+
+
+int64_t fixed_engine_t::get_lgamma(const value_t & data) {
+  return(to_fixed(log_gamma(std::ldexp(double(data), -MDRF_FRAC_BITS) + 1.0), MDRF_FRAC_BITS));
+}
+
+
+int64_t fixed_engine_t::get_start() {
+  return(((int64_t(1) << POS_FRAC_BITS) << POS_FRAC_BITS) / (int64_t(2) << POS_FRAC_BITS));
+}
+
+
+int64_t fixed_engine_t::get_first_step(int grid_size) {
+  return(((int64_t(1) << POS_FRAC_BITS) << POS_FRAC_BITS) / (int64_t(grid_size) << POS_FRAC_BITS));
+}
+
+
+int64_t fixed_engine_t::get_offset(int index, int grid_size, const coord_t & step) {
+  const int64_t center = (int64_t(grid_size - 1) << (2 * POS_FRAC_BITS)) / (int64_t(2) << POS_FRAC_BITS);
+  
+  return((((int64_t(index) << POS_FRAC_BITS) - center) * step) >> POS_FRAC_BITS);
+}
+
+
+int64_t fixed_engine_t::contract(const coord_t & step, float contr_factor) {
+  return((step << POS_FRAC_BITS) / to_fixed(double(contr_factor), POS_FRAC_BITS));
+}
+
+
+bool fixed_engine_t::is_inside(const coord_t & x) {
+  return((0 < x) && (x < (int64_t(1) << POS_FRAC_BITS)));
+}
+
+
+int64_t fixed_engine_t::get_zero() {
+  return(0);
+}
+
+
+// compute() in FPGA/contr_grid.cpp marks the grid points outside the
+// field of view with -1000 rather than with the most negative value.
+int64_t fixed_engine_t::get_outside() {
+  return(shift_fixed(-1000, MDRF_FRAC_BITS));
+}
+
+
+float fixed_engine_t::value_to_float(const value_t & value) {
+  return(std::ldexp(float(value), -MDRF_FRAC_BITS));
+}
+
+
+float fixed_engine_t::coord_to_float(const coord_t & x) {
+  return(std::ldexp(float(x), -POS_FRAC_BITS));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _FIXED_POINT_H
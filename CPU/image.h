@@ -0,0 +1,151 @@
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include <stdexcept>
+#include <fstream>
+#include <cstdint>
+#include <vector>
+#include <cmath>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Planar image of the valid events, binned while they are estimated instead
+// of in a later pass over the event list. The square pixels of pixel_size
+// mm tile the field of view from CAMERA_MIN_POS to CAMERA_MAX_POS, the last
+// row and column being cut by its border. Images are not shared between
+// threads: every thread bins into its own and the images are merged at the
+// end.
+class image_t {
+  public:
+    image_t(float my_pixel_size);
+    void add(const estim_event_t & estim_event);
+    void add(const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event);
+    void merge(const image_t & image);
+    float get_pixel_size() const;
+    int get_num_pixels() const;
+    uint64_t get_num_counts() const;
+    void write(std::ostream & os) const;
+    void write(const char *filename) const;
+    
+  private:
+    std::vector<uint32_t> counts;
+    float pixel_size;
+    int num_pixels;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+image_t::image_t(float my_pixel_size) : pixel_size(my_pixel_size) {
+  if(!(pixel_size > float(0))) {
+    throw std::runtime_error("The pixel size must be positive!");
+  }
+  num_pixels = int(std::ceil((CAMERA_MAX_POS - CAMERA_MIN_POS) / pixel_size));
+  counts.resize(std::size_t(num_pixels) * std::size_t(num_pixels), 0);
+}
+
+
+inline void image_t::add(const estim_event_t & estim_event) {
+  int pixel_x, pixel_y;
+  
+  if(!estim_event.valid) {
+    return;
+  }
+  pixel_x = int(std::floor((estim_event.x_pos - CAMERA_MIN_POS) / pixel_size));
+  pixel_y = int(std::floor((estim_event.y_pos - CAMERA_MIN_POS) / pixel_size));
+  if((pixel_x >= 0) && (pixel_x < num_pixels) && (pixel_y >= 0) && (pixel_y < num_pixels)) {
+    ++counts[std::size_t(pixel_x) * std::size_t(num_pixels) + std::size_t(pixel_y)];
+  }
+  return;
+}
+
+
+void image_t::add(const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event) {
+  std::size_t event_index;
+  
+  for(event_index = 0; event_index < estim_event.size(); ++event_index) {
+    add(estim_event[event_index]);
+  }
+  return;
+}
+
+
+void image_t::merge(const image_t & image) {
+  std::size_t i;
+  
+  if((image.num_pixels != num_pixels) || (image.pixel_size != pixel_size)) {
+    throw std::runtime_error("Cannot merge images of different pixel sizes!");
+  }
+  for(i = 0; i < counts.size(); ++i) {
+    counts[i] += image.counts[i];
+  }
+  return;
+}
+
+
+float image_t::get_pixel_size() const {
+  return(pixel_size);
+}
+
+
+int image_t::get_num_pixels() const {
+  return(num_pixels);
+}
+
+
+uint64_t image_t::get_num_counts() const {
+  uint64_t num_counts;
+  std::size_t i;
+  
+  num_counts = 0;
+  for(i = 0; i < counts.size(); ++i) {
+    num_counts += counts[i];
+  }
+  return(num_counts);
+}
+
+
+// Same format as write_dat_2d(): the numbers of pixels along x and y, then
+// the counts as floats with x as the slow index.
+void image_t::write(std::ostream & os) const {
+  const uint32_t num_x = uint32_t(num_pixels);
+  const uint32_t num_y = uint32_t(num_pixels);
+  std::vector<float> values(counts.size());
+  std::size_t i;
+  
+  for(i = 0; i < counts.size(); ++i) {
+    values[i] = float(counts[i]);
+  }
+  os.write(reinterpret_cast<const char *>(& num_x), sizeof(num_x));
+  os.write(reinterpret_cast<const char *>(& num_y), sizeof(num_y));
+  os.write(reinterpret_cast<const char *>(values.data()), std::streamsize(values.size() * sizeof(values[0])));
+  return;
+}
+
+
+void image_t::write(const char *filename) const {
+  std::ofstream ofs;
+  
+  ofs.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!ofs) {
+    throw std::runtime_error(std::string("Cannot create file ") + std::string(filename));
+  }
+  write(ofs);
+  ofs.close();
+  if(!ofs) {
+    throw std::runtime_error(std::string("Cannot write image file ") + std::string(filename));
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _IMAGE_H
@@ -0,0 +1,142 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <chrono>
+#include <array>
+#include <cmath>
+#include <string>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include "spline.hpp"
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "search_schedule.h"
+#include "estim_options.h"
+#include "estimator.h"
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion latency_bench.cpp -o latency_bench
+//
+// Measures the latency of estimator_t::estimate_batch() as seen by an
+// acquisition loop: every call is timed on its own, after a warm-up pass,
+// and the percentiles of the per-call times are reported. The heap
+// allocations made during the timed calls are counted by replacing the
+// global operator new, and must be zero.
+//
+// Usage: ./latency_bench [--events=FILE] [--batch=N] [estimator options]
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+static unsigned long num_allocs = 0;
+
+
+void *operator new(std::size_t size) {
+  void *ptr;
+  
+  ++num_allocs;
+  ptr = std::malloc((size > 0) ? size : 1);
+  if(ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return(ptr);
+}
+
+
+// GCC cannot tell that the replaced operator new allocates with malloc().
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+  return;
+}
+#pragma GCC diagnostic pop
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+double get_percentile(const std::vector<double> & sorted_values, double percent);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char **argv) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+  std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+  std::chrono::time_point<std::chrono::steady_clock> start, end;
+  std::unique_ptr<estimator_t> estimator;
+  std::vector<double> latency;
+  unsigned long allocs_before;
+  std::string events_filename;
+  estim_options_t estim_options;
+  calibr_funct_t calibr_funct;
+  calibr_data_t calibr_data;
+  std::size_t batch_size;
+  std::size_t num_batches;
+  std::size_t n, count;
+  std::string arg;
+  int i;
+  
+  events_filename = "../data/ResPhantom022516-0mm_00.dat";
+  batch_size = 1;
+  estim_options = get_default_estim_options();
+  for(i = 1; i < argc; ++i) {
+    arg = argv[i];
+    if(arg.compare(0, 9, "--events=") == 0) {
+      events_filename = arg.substr(9);
+    } else if(arg.compare(0, 8, "--batch=") == 0) {
+      batch_size = std::stoul(arg.substr(8));
+      if(batch_size == 0) {
+        throw std::runtime_error("The batch size must be positive!");
+      }
+    } else {
+      set_estim_option(estim_options, arg);
+    }
+  }
+  calibr_data = get_calibration_data("../data/camera0_79x79_1.5mm_tc99m_mean", "../data/camera0_thresh.dat", "../data/camera0_79x79_1.5mm_tc99m_gains");
+  calibr_funct = get_calibration_funct(calibr_data);
+  estimator.reset(new estimator_t(calibr_funct, estim_options));
+  PMT_data = get_PMT_data(events_filename.c_str());
+  estim_event.resize(PMT_data.size());
+  num_batches = PMT_data.size() / batch_size;
+  latency.resize(num_batches);
+  estimator->estimate_batch(PMT_data.data(), estim_event.data(), num_batches * batch_size);
+  allocs_before = num_allocs;
+  for(n = 0; n < num_batches; ++n) {
+    start = std::chrono::steady_clock::now();
+    estimator->estimate_batch(& PMT_data[n * batch_size], & estim_event[n * batch_size], batch_size);
+    end = std::chrono::steady_clock::now();
+    latency[n] = std::chrono::duration<double, std::micro>(end - start).count();
+  }
+  count = num_allocs - allocs_before;
+  std::sort(latency.begin(), latency.end());
+  std::cout << "Batches of " << batch_size << " events: " << num_batches << ", search schedule: " << format_search_schedule(estim_options.search_schedule) << "." << std::endl;
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "Latency (us): p50 " << get_percentile(latency, 50.0) << ", p90 " << get_percentile(latency, 90.0) << ", p99 " << get_percentile(latency, 99.0);
+  std::cout << ", p99.9 " << get_percentile(latency, 99.9) << ", max " << (latency.empty() ? 0.0 : latency.back()) << "." << std::endl;
+  std::cout << "Heap allocations during the timed calls: " << count << "." << std::endl;
+  return((count == 0) ? 0 : 1);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Nearest-rank percentile of sorted values.
+double get_percentile(const std::vector<double> & sorted_values, double percent) {
+  std::size_t rank;
+  
+  if(sorted_values.empty()) {
+    return(0.0);
+  }
+  rank = std::size_t(std::ceil(percent / 100.0 * double(sorted_values.size())));
+  rank = std::min(std::max(rank, std::size_t(1)), sorted_values.size());
+  return(sorted_values[rank - 1]);
+}
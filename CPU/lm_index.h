@@ -0,0 +1,357 @@
+#ifndef _LM_INDEX_H
+#define _LM_INDEX_H
+
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <utility>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <sys/stat.h>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "packed_lm.h"
+#include "prefilter.h"
+#include "contr_grid.h"
+#include "result_cache.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Sidecar index of a list-mode file, stored next to it as FILE.idx. Every
+// stride events, an entry gives the byte offset of the first event (of the
+// block holding it in packed files) and a summary of its events: the range
+// of their energies, in units of the local photopeak, and the bounding box
+// of their linearized centroids, both computed by get_event_energy(). A
+// block whose summary falls entirely outside the energy window or the ROI
+// only holds events the prefilter would reject, so it need not be read.
+//
+// The summaries depend on the calibration through the prefilter, whose key
+// is stored with them; with another calibration only the offsets are used.
+// The size and modification time (in nanoseconds) of the list-mode file
+// detect a stale index.
+struct lm_index_header_t {
+  char magic[4];
+  uint32_t num_pmts;
+  uint32_t stride;
+  uint32_t num_entries;
+  uint64_t num_events;
+  uint64_t file_size;
+  int64_t file_mtime;
+  uint64_t prefilter_key;
+};
+
+
+struct lm_index_entry_t {
+  uint64_t offset;
+  uint64_t first_event;
+  uint32_t num_events;
+  float min_energy, max_energy;
+  float min_x, max_x;
+  float min_y, max_y;
+  uint32_t reserved;
+};
+
+
+struct lm_index_t {
+  lm_index_header_t header;
+  std::vector<lm_index_entry_t> entries;
+};
+
+
+typedef std::vector<std::pair<std::size_t, std::size_t>> event_ranges_t;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+std::string get_LM_index_filename(const std::string & LM_filename);
+void get_LM_file_stat(const std::string & LM_filename, uint64_t & size, int64_t & mtime);
+uint64_t get_prefilter_key(const prefilter_t & prefilter);
+lm_index_t build_LM_index(const std::string & LM_filename, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, const prefilter_t & prefilter, uint32_t stride = LM_INDEX_STRIDE);
+void write_LM_index(const lm_index_t & index, const std::string & LM_filename);
+bool read_LM_index(lm_index_t & index, const std::string & LM_filename);
+bool is_LM_index_entry_rejected(const lm_index_entry_t & entry, const prefilter_t & prefilter);
+event_ranges_t get_LM_index_ranges(const lm_index_t & index, std::size_t first_event, std::size_t last_event, const prefilter_t & prefilter);
+std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> get_PMT_data_ranges(const std::string & LM_filename, const lm_index_t & index, const event_ranges_t & ranges);
+void expand_LM_index_ranges(std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const lm_index_t & index, const event_ranges_t & ranges, std::size_t first_event, std::size_t last_event);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+std::string get_LM_index_filename(const std::string & LM_filename) {
+  return(LM_filename + ".idx");
+}
+
+
+void get_LM_file_stat(const std::string & LM_filename, uint64_t & size, int64_t & mtime) {
+  struct stat st;
+  
+  if(stat(LM_filename.c_str(), & st) != 0) {
+    throw std::runtime_error("Cannot stat LM file " + LM_filename);
+  }
+  size = uint64_t(st.st_size);
+  mtime = int64_t(st.st_mtim.tv_sec) * INT64_C(1000000000) + int64_t(st.st_mtim.tv_nsec);
+  return;
+}
+
+
+// The window and the ROI are left out, as the summaries do not depend on
+// them.
+uint64_t get_prefilter_key(const prefilter_t & prefilter) {
+  uint64_t hash;
+  
+  hash = UINT64_C(0xCBF29CE484222325);
+  hash = hash_bytes(hash, prefilter.photopeak, sizeof(prefilter.photopeak));
+  hash = hash_bytes(hash, prefilter.lin_x, sizeof(prefilter.lin_x));
+  hash = hash_bytes(hash, prefilter.lin_y, sizeof(prefilter.lin_y));
+  hash = hash_bytes(hash, prefilter.inv_gain, sizeof(prefilter.inv_gain));
+  hash = hash_bytes(hash, prefilter.pmt_x, sizeof(prefilter.pmt_x));
+  hash = hash_bytes(hash, prefilter.pmt_y, sizeof(prefilter.pmt_y));
+  return(hash);
+}
+
+
+// PMT_data must hold every event of the file.
+lm_index_t build_LM_index(const std::string & LM_filename, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, const prefilter_t & prefilter, uint32_t stride) {
+  std::vector<uint64_t> packed_offsets;
+  packed_lm_header_t packed_header;
+  float energy, centroid_x, centroid_y;
+  std::size_t event_index, last_event, n;
+  lm_index_entry_t entry;
+  lm_index_t index;
+  bool packed;
+  
+  if(stride == 0) {
+    throw std::runtime_error("The index stride must be positive!");
+  }
+  packed = is_packed_LM_file(LM_filename.c_str());
+  if(packed) {
+    packed_header = read_packed_LM_header(LM_filename.c_str());
+    packed_offsets = read_packed_LM_offsets(LM_filename.c_str());
+  }
+  std::memset(& index.header, 0, sizeof(index.header));
+  std::memcpy(index.header.magic, "LMI1", 4);
+  index.header.num_pmts = NUM_PMTS;
+  index.header.stride = stride;
+  index.header.num_events = PMT_data.size();
+  get_LM_file_stat(LM_filename, index.header.file_size, index.header.file_mtime);
+  index.header.prefilter_key = get_prefilter_key(prefilter);
+  for(event_index = 0; event_index < PMT_data.size(); event_index += stride) {
+    last_event = std::min(event_index + stride, PMT_data.size());
+    std::memset(& entry, 0, sizeof(entry));
+    entry.offset = packed ? packed_offsets[event_index / packed_header.block_size] : (9 * sizeof(int16_t) + event_index * NUM_PMTS * sizeof(int16_t));
+    entry.first_event = event_index;
+    entry.num_events = uint32_t(last_event - event_index);
+    entry.min_energy = entry.min_x = entry.min_y = HUGE_VALF;
+    entry.max_energy = entry.max_x = entry.max_y = -HUGE_VALF;
+    for(n = event_index; n < last_event; ++n) {
+      energy = get_event_energy(centroid_x, centroid_y, PMT_data[n], prefilter);
+      entry.min_energy = std::min(entry.min_energy, energy);
+      entry.max_energy = std::max(entry.max_energy, energy);
+      entry.min_x = std::min(entry.min_x, centroid_x);
+      entry.max_x = std::max(entry.max_x, centroid_x);
+      entry.min_y = std::min(entry.min_y, centroid_y);
+      entry.max_y = std::max(entry.max_y, centroid_y);
+    }
+    index.entries.push_back(entry);
+  }
+  index.header.num_entries = uint32_t(index.entries.size());
+  return(index);
+}
+
+
+// Written to a temporary file then renamed, so that a reader never sees a
+// partial index.
+void write_LM_index(const lm_index_t & index, const std::string & LM_filename) {
+  std::string filename, tmp_filename;
+  std::ofstream ofs;
+  
+  filename = get_LM_index_filename(LM_filename);
+  tmp_filename = filename + ".tmp";
+  ofs.open(tmp_filename.c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!ofs) {
+    throw std::runtime_error("Cannot create LM index " + tmp_filename);
+  }
+  ofs.write(reinterpret_cast<const char *>(& index.header), sizeof(index.header));
+  ofs.write(reinterpret_cast<const char *>(index.entries.data()), std::streamsize(index.entries.size() * sizeof(lm_index_entry_t)));
+  ofs.close();
+  if(!ofs || (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)) {
+    throw std::runtime_error("Cannot write LM index " + filename);
+  }
+  return;
+}
+
+
+// Returns false when the index is missing or does not match the list-mode
+// file any more.
+bool read_LM_index(lm_index_t & index, const std::string & LM_filename) {
+  uint64_t file_size;
+  int64_t file_mtime;
+  std::ifstream ifs;
+  
+  ifs.open(get_LM_index_filename(LM_filename).c_str(), std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    return(false);
+  }
+  ifs.read(reinterpret_cast<char *>(& index.header), sizeof(index.header));
+  if(!ifs || (std::memcmp(index.header.magic, "LMI1", 4) != 0) || (index.header.num_pmts != NUM_PMTS)) {
+    return(false);
+  }
+  get_LM_file_stat(LM_filename, file_size, file_mtime);
+  if((file_size != index.header.file_size) || (file_mtime != index.header.file_mtime)) {
+    return(false);
+  }
+  index.entries.resize(index.header.num_entries);
+  ifs.read(reinterpret_cast<char *>(index.entries.data()), std::streamsize(index.entries.size() * sizeof(lm_index_entry_t)));
+  return(bool(ifs));
+}
+
+
+// Same tests as prefilter_event(), on the bounds of the block.
+bool is_LM_index_entry_rejected(const lm_index_entry_t & entry, const prefilter_t & prefilter) {
+  bool rejected;
+  
+  rejected = false;
+  if(prefilter.use_energy_window) {
+    rejected = rejected || (entry.max_energy < prefilter.energy_min) || (entry.min_energy > prefilter.energy_max);
+  }
+  if(prefilter.use_roi) {
+    rejected = rejected || (entry.max_x < prefilter.roi_min_x) || (entry.min_x > prefilter.roi_max_x);
+    rejected = rejected || (entry.max_y < prefilter.roi_min_y) || (entry.min_y > prefilter.roi_max_y);
+  }
+  return(rejected);
+}
+
+
+// Ranges of the events of [first_event, last_event) to read, in order and
+// without the blocks rejected as a whole. The summaries of an index built
+// with another calibration are not used.
+event_ranges_t get_LM_index_ranges(const lm_index_t & index, std::size_t first_event, std::size_t last_event, const prefilter_t & prefilter) {
+  std::size_t begin, end;
+  event_ranges_t ranges;
+  std::size_t i;
+  
+  last_event = std::min(last_event, std::size_t(index.header.num_events));
+  first_event = std::min(first_event, last_event);
+  if(index.header.prefilter_key != get_prefilter_key(prefilter)) {
+    ranges.push_back(std::make_pair(first_event, last_event));
+    return(ranges);
+  }
+  for(i = 0; i < index.entries.size(); ++i) {
+    begin = std::max(first_event, std::size_t(index.entries[i].first_event));
+    end = std::min(last_event, std::size_t(index.entries[i].first_event + index.entries[i].num_events));
+    if((begin >= end) || is_LM_index_entry_rejected(index.entries[i], prefilter)) {
+      continue;
+    }
+    if(!ranges.empty() && (ranges.back().second == begin)) {
+      ranges.back().second = end;
+    } else {
+      ranges.push_back(std::make_pair(begin, end));
+    }
+  }
+  return(ranges);
+}
+
+
+// The ranges are read from one opening of the file, at the offsets of the
+// index. In packed files, a range starts at the block holding the first
+// event of its entry and goes on through the blocks that follow; a block
+// shared by two ranges is decoded once.
+std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> get_PMT_data_ranges(const std::string & LM_filename, const lm_index_t & index, const event_ranges_t & ranges) {
+  const cpu_kernels_t & cpu_kernels = get_cpu_kernels();
+  std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+  std::size_t event_index, block_first, num_events, n;
+  std::vector<int16_t> LM_values, block_values;
+  packed_lm_header_t packed_header;
+  std::vector<uint8_t> packed;
+  packed_lm_block_t block;
+  uint64_t offset;
+  std::ifstream ifs;
+  bool packed_file;
+  std::size_t r;
+  
+  std::memset(& packed_header, 0, sizeof(packed_header));
+  packed_file = is_packed_LM_file(LM_filename.c_str());
+  if(packed_file) {
+    packed_header = read_packed_LM_header(LM_filename.c_str());
+  }
+  ifs.open(LM_filename.c_str(), std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open input LM file!");
+  }
+  block_first = SIZE_MAX;
+  block.num_events = 0;
+  offset = 0;
+  for(r = 0; r < ranges.size(); ++r) {
+    const lm_index_entry_t & entry = index.entries[ranges[r].first / index.header.stride];
+    num_events = ranges[r].second - ranges[r].first;
+    LM_values.resize(num_events * NUM_PMTS);
+    if(!packed_file) {
+      ifs.seekg(std::streamoff(entry.offset + (ranges[r].first - entry.first_event) * NUM_PMTS * sizeof(int16_t)));
+      ifs.read(reinterpret_cast<char *>(LM_values.data()), std::streamsize(LM_values.size() * sizeof(int16_t)));
+      if(!ifs) {
+        throw std::runtime_error("Truncated LM file!");
+      }
+      cpu_kernels.bswap_clamp(LM_values.data(), LM_values.data(), LM_values.size());
+    } else {
+      if((block_first == SIZE_MAX) || (ranges[r].first < block_first) || (ranges[r].first >= (block_first + block.num_events))) {
+        block_first = std::size_t(entry.first_event / packed_header.block_size) * packed_header.block_size;
+        block.num_events = 0;
+        offset = entry.offset;
+      }
+      for(event_index = ranges[r].first; event_index < ranges[r].second; ++event_index) {
+        if(event_index >= (block_first + block.num_events)) {
+          block_first += block.num_events;
+          offset = read_packed_LM_block(ifs, offset, packed_header.num_pmts, block, packed);
+          block_values.resize(std::size_t(block.num_events) * NUM_PMTS);
+          cpu_kernels.unpack_bits(block_values.data(), packed.data(), block_values.size(), int(block.bits));
+        }
+        std::copy(block_values.begin() + std::ptrdiff_t((event_index - block_first) * NUM_PMTS), block_values.begin() + std::ptrdiff_t((event_index - block_first + 1) * NUM_PMTS), LM_values.begin() + std::ptrdiff_t((event_index - ranges[r].first) * NUM_PMTS));
+      }
+    }
+    PMT_data.resize(PMT_data.size() + num_events);
+    for(n = 0; n < num_events; ++n) {
+      std::memcpy(PMT_data[PMT_data.size() - num_events + n].val, & LM_values[n * NUM_PMTS], NUM_PMTS * sizeof(int16_t));
+    }
+  }
+  return(PMT_data);
+}
+
+
+// Spreads the estimates of the events read back to their place among the
+// events of [first_event, last_event). The events of the skipped blocks get
+// the record of the events rejected by the prefilter, so that the output
+// does not depend on the index.
+void expand_LM_index_ranges(std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const lm_index_t & index, const event_ranges_t & ranges, std::size_t first_event, std::size_t last_event) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> all_events;
+  std::size_t event_index, in, r;
+  
+  last_event = std::min(last_event, std::size_t(index.header.num_events));
+  first_event = std::min(first_event, last_event);
+  all_events.resize(last_event - first_event);
+  for(event_index = first_event; event_index < last_event; ++event_index) {
+    reject_event(all_events[event_index - first_event]);
+  }
+  in = 0;
+  for(r = 0; r < ranges.size(); ++r) {
+    for(event_index = ranges[r].first; event_index < ranges[r].second; ++event_index) {
+      all_events[event_index - first_event] = estim_event[in++];
+    }
+  }
+  estim_event.swap(all_events);
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _LM_INDEX_H
@@ -7,18 +7,44 @@
 #include <chrono>
 #include <array>
 #include <cmath>
+#include <string>
+#include <memory>
 #include "spline.hpp"
 #include "my_defines.h"
 #include "my_types.h"
 #include "my_utils.h"
+#include "nn_index.h"
+#include "event_cache.h"
+#include "prefilter.h"
+#include "spatial_binning.h"
+#include "search_schedule.h"
+#include "estim_options.h"
+#include "estim_core.hpp"
+#include "contr_grid.h"
+#include "fixed_point.h"
+#include "simd_engine.h"
+#include "camera.h"
+#include "pmt_subset.h"
+#include "result_cache.h"
+#include "session.h"
+#include "batch.h"
+#include "numa_estimator.h"
+#include "image.h"
+#include "compact_format.h"
+#include "lm_index.h"
+#include "shm_ring.h"
+#include "daemon.h"
+#include "pipeline.h"
 
 // To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion main.cpp -o main
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
+std::string get_output_filename(const estim_options_t & estim_options, const std::string & name, const std::string & extension = ".dat");
+void write_outputs(const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const image_t *image, const estim_options_t & estim_options, const std::string & LM_filename);
+void write_shard_info(const estim_options_t & estim_options, const std::string & LM_filename);
 void sample_calibr_funct(const calibr_funct_t & calibr_funct);
-std::vector<estim_event_t, aligned_allocator<estim_event_t>> contr_grid(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, calibr_funct_t calibr_funct);
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -27,21 +53,429 @@ std::vector<estim_event_t, aligned_allocator<estim_event_t>> contr_grid(const st
 int main(int argc, char **argv) {
   std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
   std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+  const std::string LM_filename = "../data/ResPhantom022516-0mm_00.dat";
+  std::unique_ptr<event_cache_t> event_cache;
+  std::unique_ptr<calibr_funct_base_t<double>> calibr_funct_double;
+  std::unique_ptr<fixed_calibr_t> fixed_calibr;
+  std::unique_ptr<simd_calibr_t> simd_calibr;
+  std::unique_ptr<camera_model_t> camera_model;
+  std::unique_ptr<session_t> session;
+  std::unique_ptr<estimator_t> estimator;
+  std::unique_ptr<batch_t> batch;
+  std::unique_ptr<numa_estimator_t> numa_estimator;
+  std::unique_ptr<image_t> image;
+  std::unique_ptr<shm_ring_t<PMT_data_t>> shm_input;
+  std::unique_ptr<shm_ring_t<estim_event_t>> shm_output;
+  std::unique_ptr<daemon_t> estim_daemon;
+  std::unique_ptr<pipeline_t> pipeline;
+  image_t *fused_image;
+  std::string result_cache_filename;
+  camera_calibr_t camera_calibr;
+  estim_options_t estim_options;
   calibr_funct_t calibr_funct;
+  prefilter_t prefilter;
   calibr_data_t calibr_data;
+  nn_index_t nn_index;
+  event_ranges_t LM_ranges;
+  lm_index_t LM_index;
+  uint64_t result_cache_key;
+  std::size_t num_dropped;
+  std::size_t num_valid;
+  std::size_t num_events;
+  bool has_LM_index;
+  bool skip_blocks;
   
+  estim_options = get_estim_options(argc, argv);
+  result_cache_key = 0;
+  has_LM_index = skip_blocks = false;
+  select_cpu_kernels(estim_options.isa);
+  if(estim_options.verbose) {
+    std::cout << "CPU kernels: " << get_cpu_kernels().name << "." << std::endl;
+  }
+  // A session estimates the streams of several heads, each with its own
+  // calibration and output, on one pool of worker threads, so the options
+  // of the single-head paths are refused.
+  if(!estim_options.session_filename.empty()) {
+    if(estim_options.image_pixel_size > float(0)) {
+      throw std::runtime_error("The image is not supported with a session!");
+    }
+    if((estim_options.shard_begin != 0) || (estim_options.shard_end != SIZE_MAX)) {
+      throw std::runtime_error("Shards are not supported with a session!");
+    }
+    if(estim_options.compact_output) {
+      throw std::runtime_error("The compact output is not supported with a session!");
+    }
+    if(estim_options.lm_index) {
+      throw std::runtime_error("The LM index is not supported with a session!");
+    }
+    if((estim_options.cache_size > 0) || !estim_options.result_cache_dir.empty()) {
+      throw std::runtime_error("The caches are not supported with a session!");
+    }
+    if(estim_options.spatial_binning) {
+      throw std::runtime_error("The spatial binning is not supported with a session!");
+    }
+    if(estim_options.numa) {
+      throw std::runtime_error("NUMA is not supported with a session!");
+    }
+    if(!estim_options.camera_filename.empty()) {
+      throw std::runtime_error("A camera given at run time is not supported with a session!");
+    }
+    session.reset(new session_t(read_session(estim_options.session_filename), estim_options));
+    session->run(estim_options.num_threads);
+    if(estim_options.verbose) {
+      session->print_stats(std::cout);
+    }
+    session->write_outputs();
+    return(0);
+  }
+  // The partials of shards are joined by merge_shards, which reads the
+  // estim_events format only.
+  if(((estim_options.shard_begin != 0) || (estim_options.shard_end != SIZE_MAX)) && estim_options.compact_output) {
+    throw std::runtime_error("The compact output is not supported with shards!");
+  }
+  // A camera given at run time goes through the engine selected for its
+  // geometry when the calibration is loaded, with the default schedule, so
+  // the options of the built-in camera's estimator are refused. Only the
+  // 9-PMT geometry of the shipped camera has a specialized engine, the
+  // others run on the generic one (see get_camera_model()).
+  if(!estim_options.camera_filename.empty()) {
+    if(estim_options.image_pixel_size > float(0)) {
+      throw std::runtime_error("The image is not supported with a camera given at run time!");
+    }
+    if(estim_options.engine != ESTIM_ENGINE_FLOAT) {
+      throw std::runtime_error("The engine cannot be chosen with a camera given at run time!");
+    }
+    if(format_search_schedule(estim_options.search_schedule) != format_search_schedule(get_default_search_schedule())) {
+      throw std::runtime_error("The schedule cannot be chosen with a camera given at run time!");
+    }
+    if((estim_options.mode != ESTIM_MODE_CONTR_GRID) || (estim_options.nn_grid_size != NN_GRID_SIZE)) {
+      throw std::runtime_error("The nearest-neighbor modes are not supported with a camera given at run time!");
+    }
+    if(estim_options.use_energy_window || estim_options.use_roi || estim_options.spatial_binning) {
+      throw std::runtime_error("The prefilter and the spatial binning are not supported with a camera given at run time!");
+    }
+    if((estim_options.cache_size > 0) || !estim_options.result_cache_dir.empty()) {
+      throw std::runtime_error("The caches are not supported with a camera given at run time!");
+    }
+    if(estim_options.numa) {
+      throw std::runtime_error("NUMA is not supported with a camera given at run time!");
+    }
+    if(estim_options.compact_output) {
+      throw std::runtime_error("The compact output is not supported with a camera given at run time!");
+    }
+    if(estim_options.lm_index) {
+      throw std::runtime_error("The LM index is not supported with a camera given at run time!");
+    }
+    if(estim_options.pipeline) {
+      throw std::runtime_error("The pipeline is not supported with a camera given at run time!");
+    }
+    if(!estim_options.shm_name.empty() || !estim_options.daemon_path.empty()) {
+      throw std::runtime_error("Shared memory and the daemon are not supported with a camera given at run time!");
+    }
+    if(!estim_options.manifest_filename.empty()) {
+      throw std::runtime_error("A manifest is not supported with a camera given at run time!");
+    }
+    camera_calibr = get_camera_calibr(read_camera_desc(estim_options.camera_filename));
+    if(estim_options.pmt_subset_bound > float(0)) {
+      camera_model.reset(new subset_camera_model_t(camera_calibr, estim_options.pmt_subset_bound));
+    } else {
+      camera_model = get_camera_model(camera_calibr);
+    }
+    if(estim_options.verbose) {
+      std::cout << "Camera " << camera_calibr.camera_desc.name << ": " << camera_model->get_variant() << " engine." << std::endl;
+    }
+    estim_event = camera_model->estimate(get_LM_values(LM_filename.c_str(), camera_calibr.camera_desc.num_pmts, estim_options.shard_begin, estim_options.shard_end), estim_options.verbose);
+    write_estim_events(estim_event, get_output_filename(estim_options, "estim_events_CPU").c_str());
+    write_shard_info(estim_options, LM_filename);
+    return(0);
+  }
   calibr_data = get_calibration_data("../data/camera0_79x79_1.5mm_tc99m_mean", "../data/camera0_thresh.dat", "../data/camera0_79x79_1.5mm_tc99m_gains");
   calibr_funct = get_calibration_funct(calibr_data);
+  // A batch reuses the calibration for every file of its manifest and
+  // skips the diagnostic samples. Every file is estimated whole into its
+  // own output, so the options of the single-file path are refused.
+  if(!estim_options.manifest_filename.empty()) {
+    if(estim_options.image_pixel_size > float(0)) {
+      throw std::runtime_error("The image is not supported with a manifest!");
+    }
+    if((estim_options.shard_begin != 0) || (estim_options.shard_end != SIZE_MAX)) {
+      throw std::runtime_error("Shards are not supported with a manifest!");
+    }
+    if(estim_options.compact_output) {
+      throw std::runtime_error("The compact output is not supported with a manifest!");
+    }
+    if(estim_options.lm_index) {
+      throw std::runtime_error("The LM index is not supported with a manifest!");
+    }
+    if((estim_options.cache_size > 0) || !estim_options.result_cache_dir.empty()) {
+      throw std::runtime_error("The caches are not supported with a manifest!");
+    }
+    if(estim_options.spatial_binning) {
+      throw std::runtime_error("The spatial binning is not supported with a manifest!");
+    }
+    if(estim_options.numa) {
+      throw std::runtime_error("NUMA is not supported with a manifest!");
+    }
+    estimator.reset(new estimator_t(calibr_funct, estim_options));
+    batch.reset(new batch_t(read_batch_manifest(estim_options.manifest_filename), *estimator));
+    batch->run(estim_options.num_threads);
+    if(estim_options.verbose) {
+      batch->print_stats(std::cout);
+    }
+    return(0);
+  }
+  // With shared memory, an acquisition process on the same host writes the
+  // events into one ring and viewers read their estimates from another
+  // (see shm_ring.h), until the acquisition closes its ring. Without a
+  // viewer, --shm-output=drop keeps the acquisition going and none only
+  // makes the image.
+  if(!estim_options.shm_name.empty()) {
+    if((estim_options.shm_output == SHM_OUTPUT_NONE) && (estim_options.image_pixel_size <= float(0))) {
+      throw std::runtime_error("Without an output ring, shared memory needs an image!");
+    }
+    estimator.reset(new estimator_t(calibr_funct, estim_options));
+    shm_input.reset(new shm_ring_t<PMT_data_t>(get_shm_ring_name(estim_options.shm_name, "events"), SHM_RING_CAPACITY));
+    if(estim_options.shm_output != SHM_OUTPUT_NONE) {
+      shm_output.reset(new shm_ring_t<estim_event_t>(get_shm_ring_name(estim_options.shm_name, "estimates"), SHM_RING_CAPACITY));
+    }
+    if(estim_options.image_pixel_size > float(0)) {
+      image.reset(new image_t(estim_options.image_pixel_size));
+    }
+    if(estim_options.verbose) {
+      std::cout << "Waiting for events on " << shm_input->get_name() << "." << std::endl;
+    }
+    num_events = run_shm_estimator(*estimator, *shm_input, shm_output.get(), estim_options.shm_output == SHM_OUTPUT_DROP, image.get(), num_dropped);
+    if(estim_options.verbose) {
+      std::cout << "Estimated " << num_events << " events from shared memory, " << num_dropped << " estimates dropped." << std::endl;
+    }
+    if(image) {
+      image->write(get_output_filename(estim_options, "image_CPU").c_str());
+    }
+    return(0);
+  }
+  // A daemon keeps the calibration loaded and estimates the list-mode
+  // streams of its clients on a UNIX domain socket (see daemon.h), until
+  // it is interrupted.
+  if(!estim_options.daemon_path.empty()) {
+    estimator.reset(new estimator_t(calibr_funct, estim_options));
+    estim_daemon.reset(new daemon_t(estim_options.daemon_path, *estimator, estim_options.image_pixel_size));
+    estim_daemon->run(estim_options.num_threads, estim_options.verbose);
+    return(0);
+  }
   sample_calibr_funct(calibr_funct);
-  PMT_data = get_PMT_data("../data/ResPhantom022516-0mm_00.dat");
-  estim_event = contr_grid(PMT_data, calibr_funct);
-  write_estim_events(estim_event, "../data/estim_events_CPU.dat");
+  // The pipeline reads, estimates and writes the file in chunks that go
+  // through the three stages at the same time (see pipeline.h).
+  if(estim_options.pipeline) {
+    if((estim_options.engine != ESTIM_ENGINE_FLOAT) || estim_options.numa || (estim_options.cache_size > 0) || !estim_options.result_cache_dir.empty() || estim_options.spatial_binning || estim_options.lm_index || estim_options.compact_output) {
+      throw std::runtime_error("The pipeline only supports the float engine, without NUMA, caches, spatial binning, LM index or compact output!");
+    }
+    estimator.reset(new estimator_t(calibr_funct, estim_options));
+    if(estim_options.image_pixel_size > float(0)) {
+      image.reset(new image_t(estim_options.image_pixel_size));
+    }
+    pipeline.reset(new pipeline_t(LM_filename, estim_options.shard_begin, estim_options.shard_end, *estimator, (!image || estim_options.keep_event_list) ? get_output_filename(estim_options, "estim_events_CPU") : std::string(), image.get()));
+    pipeline->run(estim_options.num_threads);
+    if(estim_options.verbose) {
+      pipeline->print_stats(std::cout);
+    }
+    if(image) {
+      image->write(get_output_filename(estim_options, "image_CPU").c_str());
+    }
+    if(!image || estim_options.keep_event_list) {
+      write_shard_info(estim_options, LM_filename);
+    }
+    return(0);
+  }
+  // The NUMA estimator runs the float engine only, and its workers share
+  // no event cache.
+  if(estim_options.numa && (estim_options.engine != ESTIM_ENGINE_FLOAT)) {
+    throw std::runtime_error("NUMA only supports the float engine!");
+  }
+  if(estim_options.numa && (estim_options.cache_size > 0)) {
+    throw std::runtime_error("The event cache is not supported with NUMA!");
+  }
+  // The double, SIMD and fixed-point engines run the estimator core with
+  // the default schedule, in plain contracting-grid mode and on every
+  // event, so the options of the float search are refused.
+  if(estim_options.engine != ESTIM_ENGINE_FLOAT) {
+    if(format_search_schedule(estim_options.search_schedule) != format_search_schedule(get_default_search_schedule())) {
+      throw std::runtime_error("The schedule can only be chosen with the float engine!");
+    }
+    if((estim_options.mode != ESTIM_MODE_CONTR_GRID) || (estim_options.nn_grid_size != NN_GRID_SIZE)) {
+      throw std::runtime_error("The nearest-neighbor modes are only supported by the float engine!");
+    }
+    if(estim_options.use_energy_window || estim_options.use_roi || estim_options.spatial_binning) {
+      throw std::runtime_error("The prefilter and the spatial binning are only supported by the float engine!");
+    }
+    if(estim_options.cache_size > 0) {
+      throw std::runtime_error("The event cache is only supported by the float engine!");
+    }
+  }
+  prefilter = get_prefilter(calibr_funct, estim_options);
+  // With a sidecar index, the float engine does not read the blocks of the
+  // file whose events the prefilter would all reject. A missing or stale
+  // index is built from a pass over the whole file.
+  if(estim_options.lm_index) {
+    has_LM_index = read_LM_index(LM_index, LM_filename);
+  }
+  skip_blocks = has_LM_index && (estim_options.engine == ESTIM_ENGINE_FLOAT) && (prefilter.use_energy_window || prefilter.use_roi);
+  if(skip_blocks) {
+    LM_ranges = get_LM_index_ranges(LM_index, estim_options.shard_begin, estim_options.shard_end, prefilter);
+    PMT_data = get_PMT_data_ranges(LM_filename, LM_index, LM_ranges);
+    if(estim_options.verbose) {
+      std::cout << "LM index: reading " << PMT_data.size() << " of " << LM_index.header.num_events << " events in " << LM_ranges.size() << " ranges." << std::endl;
+    }
+  } else {
+    PMT_data = get_PMT_data(LM_filename.c_str(), estim_options.shard_begin, estim_options.shard_end);
+  }
+  if(estim_options.lm_index && !has_LM_index && (estim_options.shard_begin == 0) && (estim_options.shard_end == SIZE_MAX)) {
+    write_LM_index(build_LM_index(LM_filename, PMT_data, prefilter), LM_filename);
+    if(estim_options.verbose) {
+      std::cout << "LM index written to " << get_LM_index_filename(LM_filename) << "." << std::endl;
+    }
+  }
+  if(estim_options.image_pixel_size > float(0)) {
+    image.reset(new image_t(estim_options.image_pixel_size));
+  }
+  // With a result cache, estimates already computed with the same events,
+  // MDRFs and settings are only re-thresholded. The fixed-point engine
+  // compares with its own quantized threshold, which the float
+  // re-thresholding would not reproduce.
+  if(!estim_options.result_cache_dir.empty()) {
+    if(estim_options.engine == ESTIM_ENGINE_FIXED) {
+      throw std::runtime_error("The result cache is not supported by the fixed-point engine!");
+    }
+    result_cache_key = get_result_cache_key(PMT_data, calibr_data, estim_options);
+    result_cache_filename = get_result_cache_filename(estim_options.result_cache_dir, result_cache_key);
+    if(read_result_cache(estim_event, result_cache_filename, result_cache_key, PMT_data.size())) {
+      num_valid = rethreshold_events(estim_event, calibr_funct);
+      if(estim_options.verbose) {
+        std::cout << "Re-thresholded " << estim_event.size() << " cached estimates of " << result_cache_filename << ": " << num_valid << " valid." << std::endl;
+      }
+      if(image) {
+        image->add(estim_event);
+      }
+      if(skip_blocks) {
+        expand_LM_index_ranges(estim_event, LM_index, LM_ranges, estim_options.shard_begin, estim_options.shard_end);
+      }
+      write_outputs(estim_event, image.get(), estim_options, LM_filename);
+      return(0);
+    }
+  }
+  if(estim_options.mode != ESTIM_MODE_CONTR_GRID) {
+    nn_index.build(calibr_funct, estim_options.nn_grid_size);
+  }
+  if(estim_options.cache_size > 0) {
+    event_cache.reset(new event_cache_t(estim_options.cache_size));
+  }
+  // The float engine bins the events into the image as they are estimated,
+  // unless their flags are still to be re-thresholded.
+  fused_image = (result_cache_filename.empty() && (estim_options.engine == ESTIM_ENGINE_FLOAT)) ? image.get() : nullptr;
+  // The double, SIMD and fixed-point engines instantiate the same estimator
+  // core as the float one, with the default schedule of the FPGA kernel.
+  if(estim_options.engine == ESTIM_ENGINE_DOUBLE) {
+    calibr_funct_double.reset(new calibr_funct_base_t<double>(get_calibration_funct<double>(calibr_data)));
+    estim_event = estimate_events<spline_engine_t<double>, SIZE_CONTR_GRID>(PMT_data, NUM_CONTR_GRID_ITER, CONTR_FACTOR, spline_engine_t<double>(*calibr_funct_double), estim_options.verbose);
+  } else if(estim_options.engine == ESTIM_ENGINE_SIMD) {
+    simd_calibr.reset(new simd_calibr_t(get_simd_calibr(calibr_funct)));
+    estim_event = estimate_events<simd_engine_t, SIZE_CONTR_GRID>(PMT_data, NUM_CONTR_GRID_ITER, CONTR_FACTOR, simd_engine_t(calibr_funct, *simd_calibr), estim_options.verbose);
+  } else if(estim_options.engine == ESTIM_ENGINE_FIXED) {
+    fixed_calibr.reset(new fixed_calibr_t(get_fixed_calibr(calibr_funct)));
+    estim_event = estimate_events<fixed_engine_t, SIZE_CONTR_GRID>(PMT_data, NUM_CONTR_GRID_ITER, CONTR_FACTOR, fixed_engine_t(*fixed_calibr), estim_options.verbose);
+  } else if(estim_options.numa) {
+    numa_estimator.reset(new numa_estimator_t(calibr_funct, estim_options, estim_options.num_threads));
+    estim_event = numa_estimator->estimate(PMT_data, fused_image);
+    if(estim_options.verbose) {
+      numa_estimator->print_stats(std::cout);
+    }
+  } else {
+    estim_event = contr_grid(PMT_data, calibr_funct, estim_options, nn_index, event_cache.get(), prefilter, fused_image);
+  }
+  if(event_cache) {
+    event_cache->print_stats(std::cout);
+  }
+  if(!result_cache_filename.empty()) {
+    write_result_cache(estim_event, result_cache_filename, result_cache_key);
+    rethreshold_events(estim_event, calibr_funct);
+  }
+  if(image && (fused_image == nullptr)) {
+    image->add(estim_event);
+  }
+  if(skip_blocks) {
+    expand_LM_index_ranges(estim_event, LM_index, LM_ranges, estim_options.shard_begin, estim_options.shard_end);
+  }
+  write_outputs(estim_event, image.get(), estim_options, LM_filename);
   return(0);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
+// A shard writes the estimates of its events to a partial file named after
+// its first event, so that the partials of a file list in event order and
+// can be joined by merge_shards.
+std::string get_output_filename(const estim_options_t & estim_options, const std::string & name, const std::string & extension) {
+  std::ostringstream ss;
+  
+  if((estim_options.shard_begin == 0) && (estim_options.shard_end == SIZE_MAX)) {
+    return("../data/" + name + extension);
+  }
+  ss << "../data/" << name << "_shard_" << std::setw(10) << std::setfill('0') << estim_options.shard_begin << extension;
+  return(ss.str());
+}
+
+
+// With an image, the event list is only written on request, in the
+// format of write_estim_events() or in the compact format.
+void write_outputs(const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const image_t *image, const estim_options_t & estim_options, const std::string & LM_filename) {
+  if(image != nullptr) {
+    image->write(get_output_filename(estim_options, "image_CPU").c_str());
+    if(estim_options.verbose) {
+      std::cout << "Image: " << image->get_num_pixels() << "x" << image->get_num_pixels() << " pixels of " << image->get_pixel_size() << " mm, " << image->get_num_counts() << " counts." << std::endl;
+    }
+  }
+  if(((image == nullptr) || estim_options.keep_event_list) && estim_options.compact_output) {
+    write_compact_events(estim_event, get_output_filename(estim_options, "estim_events_CPU", ".ecf").c_str(), (estim_options.compact_log_like ? COMPACT_LOG_LIKE : 0) | (estim_options.compact_valid_only ? COMPACT_VALID_ONLY : 0));
+  } else if((image == nullptr) || estim_options.keep_event_list) {
+    write_estim_events(estim_event, get_output_filename(estim_options, "estim_events_CPU").c_str());
+    write_shard_info(estim_options, LM_filename);
+  }
+  return;
+}
+
+
+// Next to the partial estimates of a shard, FILE.shard gives the events
+// they cover, [begin, end) after clamping to the file, and the list-mode
+// file they come from with its number of events, so that merge_shards can
+// check that the partials tile the whole file.
+void write_shard_info(const estim_options_t & estim_options, const std::string & LM_filename) {
+  std::size_t num_events, begin, end;
+  std::string filename;
+  std::ofstream ofs;
+  
+  if((estim_options.shard_begin == 0) && (estim_options.shard_end == SIZE_MAX)) {
+    return;
+  }
+  num_events = get_LM_num_events(LM_filename.c_str());
+  end = std::min(estim_options.shard_end, num_events);
+  begin = std::min(estim_options.shard_begin, end);
+  filename = get_output_filename(estim_options, "estim_events_CPU") + ".shard";
+  ofs.open(filename.c_str(), std::ofstream::out | std::ofstream::trunc);
+  if(!ofs) {
+    throw std::runtime_error("Cannot create shard file " + filename);
+  }
+  ofs << "source=" << LM_filename << std::endl;
+  ofs << "source-events=" << num_events << std::endl;
+  ofs << "begin=" << begin << std::endl;
+  ofs << "end=" << end << std::endl;
+  ofs.close();
+  if(!ofs) {
+    throw std::runtime_error("Cannot write shard file " + filename);
+  }
+  return;
+}
+
+
 void sample_calibr_funct(const calibr_funct_t & calibr_funct) {
   const int num_sampl_x = 128;
   const int num_sampl_y = 128;
@@ -77,89 +511,3 @@ void sample_calibr_funct(const calibr_funct_t & calibr_funct) {
   write_dat_2d<float, num_sampl_x, num_sampl_y>(data, "../data/thresh_samples_CPU.dat");
   return;
 }
-
-
-std::vector<estim_event_t, aligned_allocator<estim_event_t>> contr_grid(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, calibr_funct_t calibr_funct) {
-  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event(PMT_data.size());
-  std::chrono::time_point<std::chrono::steady_clock> start, end;
-  float log_like_values[SIZE_CONTR_GRID][SIZE_CONTR_GRID];
-  float log_like, max_log_like;
-  int max_index_x, max_index_y;
-  float current_x, current_y;
-  float tmp_data[NUM_PMTS];
-  unsigned int event_index;
-  unsigned int num_events;
-  bool inside_x, inside_y;
-  int index_x, index_y;
-  float test_x, test_y;
-  float camera_MDRF;
-  int pmt, iter;
-  float step;
-  
-  num_events = (unsigned int) PMT_data.size();
-  std::cout << "Number of events: " << num_events << "." << std::endl;
-  start = std::chrono::steady_clock::now();
-  for(event_index = 0; event_index < num_events; ++event_index) {
-    for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
-      tmp_data[pmt] = PMT_data[event_index].val[pmt] / calibr_funct.gain[pmt];
-    }
-    current_x = current_y = float(1) / float(2);
-    step = (float(1) - float(0)) / float(SIZE_CONTR_GRID);
-    for(iter = 0; iter < NUM_CONTR_GRID_ITER; ++iter) {
-      for(index_x = 0; index_x < SIZE_CONTR_GRID; ++index_x) {
-        test_x = current_x + (float(index_x) - (float(SIZE_CONTR_GRID - 1) / 2.00f)) * step;
-        for(index_y = 0; index_y < SIZE_CONTR_GRID; ++index_y) {
-          test_y = current_y + (float(index_y) - (float(SIZE_CONTR_GRID - 1) / 2.00f)) * step;
-          inside_x = (float(0) < test_x) && (test_x < float(1));
-          inside_y = (float(0) < test_y) && (test_y < float(1));
-          if(inside_x && inside_y) {
-            log_like = float(0);
-            for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
-              camera_MDRF = calibr_funct.mdrf[pmt](test_x, test_y);
-              if((tmp_data[pmt] != float(0)) || (camera_MDRF != float(0))) {
-                log_like += tmp_data[pmt] * std::log(camera_MDRF) - camera_MDRF;
-              }
-            }
-            log_like_values[index_x][index_y] = log_like;
-          } else {
-            log_like_values[index_x][index_y] = -HUGE_VALF;
-          }
-        }
-      }
-      max_log_like = log_like_values[0][0];
-      max_index_x = max_index_y = 0;
-      for(index_x = 0; index_x < SIZE_CONTR_GRID; ++index_x) {
-        for(index_y = 0; index_y < SIZE_CONTR_GRID; ++index_y) {
-          if(max_log_like < log_like_values[index_x][index_y]) {
-            max_log_like = log_like_values[index_x][index_y];
-            max_index_x = index_x;
-            max_index_y = index_y;
-          }
-        }
-      }
-      current_x = current_x + (float(max_index_x) - (float(SIZE_CONTR_GRID - 1) / 2.00f)) * step;
-      current_y = current_y + (float(max_index_y) - (float(SIZE_CONTR_GRID - 1) / 2.00f)) * step;
-      step /= CONTR_FACTOR;
-    }
-    inside_x = (float(0) < current_x) && (current_x < float(1));
-    inside_y = (float(0) < current_y) && (current_y < float(1));
-    if(inside_x && inside_y) {
-      log_like = max_log_like;
-      for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
-        if(tmp_data[pmt] > float(0)) {
-          log_like -= std::lgamma(tmp_data[pmt] + float(1));
-        }
-      }
-      estim_event[event_index].valid = log_like > calibr_funct.thresh(current_x, current_y);
-      estim_event[event_index].log_like = log_like;
-    } else {
-      estim_event[event_index].valid = 0;
-    }
-    estim_event[event_index].x_pos = CAMERA_MIN_POS + current_x * (CAMERA_MAX_POS - CAMERA_MIN_POS);
-    estim_event[event_index].y_pos = CAMERA_MIN_POS + current_y * (CAMERA_MAX_POS - CAMERA_MIN_POS);
-  }
-  end = std::chrono::steady_clock::now();
-  std::chrono::duration<double> diff = end - start;
-  std::cout << "Elapsed time: " << diff.count() << " s (" << double(num_events) / diff.count() << " events/s)." << std::endl;
-  return(estim_event);
-}
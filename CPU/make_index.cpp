@@ -0,0 +1,76 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <array>
+#include <cmath>
+#include <string>
+#include <stdexcept>
+#include "spline.hpp"
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "estim_options.h"
+#include "prefilter.h"
+#include "lm_index.h"
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion make_index.cpp -o make_index
+//
+// Writes the sidecar index of lm_index.h next to each list-mode file given,
+// big-endian or packed, with the summaries of the default calibration, and
+// prints the range of the energies of its blocks. "main --index" builds the
+// same index on its first pass over a file.
+//
+// Usage: ./make_index [--stride=N] FILE...
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char **argv) {
+  std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+  std::vector<std::string> filenames;
+  estim_options_t estim_options;
+  calibr_funct_t calibr_funct;
+  calibr_data_t calibr_data;
+  float min_energy, max_energy;
+  prefilter_t prefilter;
+  lm_index_t index;
+  uint32_t stride;
+  std::string arg;
+  std::size_t f, e;
+  int i;
+  
+  stride = LM_INDEX_STRIDE;
+  for(i = 1; i < argc; ++i) {
+    arg = argv[i];
+    if(arg.compare(0, 9, "--stride=") == 0) {
+      stride = uint32_t(std::stoul(arg.substr(9)));
+    } else if(arg.compare(0, 2, "--") == 0) {
+      throw std::runtime_error("Unknown option " + arg);
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+  if(filenames.empty()) {
+    std::cerr << "Usage: " << argv[0] << " [--stride=N] FILE..." << std::endl;
+    return(1);
+  }
+  estim_options = get_default_estim_options();
+  calibr_data = get_calibration_data("../data/camera0_79x79_1.5mm_tc99m_mean", "../data/camera0_thresh.dat", "../data/camera0_79x79_1.5mm_tc99m_gains");
+  calibr_funct = get_calibration_funct(calibr_data);
+  prefilter = get_prefilter(calibr_funct, estim_options);
+  for(f = 0; f < filenames.size(); ++f) {
+    PMT_data = get_PMT_data(filenames[f].c_str());
+    index = build_LM_index(filenames[f], PMT_data, prefilter, stride);
+    write_LM_index(index, filenames[f]);
+    min_energy = HUGE_VALF;
+    max_energy = -HUGE_VALF;
+    for(e = 0; e < index.entries.size(); ++e) {
+      min_energy = std::min(min_energy, index.entries[e].min_energy);
+      max_energy = std::max(max_energy, index.entries[e].max_energy);
+    }
+    std::cout << get_LM_index_filename(filenames[f]) << ": " << index.header.num_events << " events, " << index.entries.size() << " blocks, energies " << min_energy << " to " << max_energy << "." << std::endl;
+  }
+  return(0);
+}
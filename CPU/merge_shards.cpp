@@ -0,0 +1,152 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <set>
+#include <stdexcept>
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion merge_shards.cpp -o merge_shards
+//
+// Joins the partial estimates written by "main --shard=BEGIN,END" into one
+// estim_events file, in the order given, with the total number of events
+// in its header. The partials are named after their first event, so a
+// shell glob lists them in event order. The FILE.shard written next to
+// every partial gives its range of events and its list-mode file; the
+// ranges must follow each other from the first event of that file to its
+// last, and the partials must hold as many events as their ranges:
+//
+//   ./merge_shards ../data/estim_events_CPU.dat ../data/estim_events_CPU_shard_*.dat
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+struct shard_info_t {
+  std::string source;
+  uint64_t source_events;
+  uint64_t begin, end;
+};
+
+
+const std::size_t estim_record_size = 4 * sizeof(uint32_t);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+shard_info_t read_shard_info(const std::string & filename);
+uint32_t append_partial(std::ofstream & ofs, const std::string & filename);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char **argv) {
+  shard_info_t first_info, shard_info;
+  uint32_t num_events, num_partial;
+  std::ofstream ofs;
+  int i;
+  
+  if(argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " OUTPUT PARTIAL..." << std::endl;
+    return(1);
+  }
+  ofs.open(argv[1], std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!ofs) {
+    throw std::runtime_error("Cannot create ML estimates file!");
+  }
+  num_events = 0;
+  ofs.write(reinterpret_cast<const char *>(& num_events), sizeof(num_events));
+  for(i = 2; i < argc; ++i) {
+    shard_info = read_shard_info(std::string(argv[i]) + ".shard");
+    if(i == 2) {
+      first_info = shard_info;
+    }
+    if((shard_info.source != first_info.source) || (shard_info.source_events != first_info.source_events)) {
+      throw std::runtime_error(std::string("The partial ") + argv[i] + " comes from another list-mode file!");
+    }
+    if(shard_info.begin != num_events) {
+      throw std::runtime_error(std::string("The partial ") + argv[i] + " starts at event " + std::to_string(shard_info.begin) + " instead of " + std::to_string(num_events) + "!");
+    }
+    num_partial = append_partial(ofs, argv[i]);
+    if(num_partial != (shard_info.end - shard_info.begin)) {
+      throw std::runtime_error(std::string("The partial ") + argv[i] + " holds " + std::to_string(num_partial) + " events instead of " + std::to_string(shard_info.end - shard_info.begin) + "!");
+    }
+    num_events += num_partial;
+  }
+  if(num_events != first_info.source_events) {
+    throw std::runtime_error("The partials end at event " + std::to_string(num_events) + " of the " + std::to_string(first_info.source_events) + " of " + first_info.source + "!");
+  }
+  ofs.seekp(0);
+  ofs.write(reinterpret_cast<const char *>(& num_events), sizeof(num_events));
+  ofs.close();
+  if(!ofs) {
+    throw std::runtime_error("Cannot write ML estimates file!");
+  }
+  std::cout << "Merged " << (argc - 2) << " partials: " << num_events << " events." << std::endl;
+  return(0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Lines KEY=VALUE as written by main, each key once.
+shard_info_t read_shard_info(const std::string & filename) {
+  std::string line, key, value;
+  std::set<std::string> keys;
+  shard_info_t shard_info;
+  std::ifstream ifs;
+  
+  ifs.open(filename.c_str(), std::ifstream::in);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open shard file " + filename);
+  }
+  while(std::getline(ifs, line)) {
+    key = line.substr(0, line.find('='));
+    value = (line.find('=') == std::string::npos) ? std::string() : line.substr(line.find('=') + 1);
+    if(!keys.insert(key).second) {
+      throw std::runtime_error("Duplicate key " + key + " in shard file " + filename);
+    }
+    if(key == "source") {
+      shard_info.source = value;
+    } else if(key == "source-events") {
+      shard_info.source_events = std::stoull(value);
+    } else if(key == "begin") {
+      shard_info.begin = std::stoull(value);
+    } else if(key == "end") {
+      shard_info.end = std::stoull(value);
+    } else {
+      throw std::runtime_error("Unknown key " + key + " in shard file " + filename);
+    }
+  }
+  if((keys.size() != 4) || (shard_info.end < shard_info.begin) || (shard_info.end > shard_info.source_events)) {
+    throw std::runtime_error("Incomplete or inconsistent shard file " + filename);
+  }
+  return(shard_info);
+}
+
+
+// Copies the records of a partial and returns their number, after checking
+// it against the size of the file.
+uint32_t append_partial(std::ofstream & ofs, const std::string & filename) {
+  std::vector<char> records;
+  uint32_t num_events;
+  std::ifstream ifs;
+  uint64_t size;
+  
+  ifs.open(filename.c_str(), std::ifstream::in | std::ifstream::binary | std::ifstream::ate);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open partial estimates " + filename);
+  }
+  size = uint64_t(ifs.tellg());
+  ifs.seekg(0);
+  ifs.read(reinterpret_cast<char *>(& num_events), sizeof(num_events));
+  if(!ifs || (size != (sizeof(num_events) + uint64_t(num_events) * estim_record_size))) {
+    throw std::runtime_error("Truncated or corrupted partial estimates " + filename);
+  }
+  records.resize(std::size_t(num_events) * estim_record_size);
+  ifs.read(records.data(), std::streamsize(records.size()));
+  ofs.write(records.data(), std::streamsize(records.size()));
+  return(num_events);
+}
@@ -16,6 +16,69 @@
 #define SIZE_CONTR_GRID		6
 #define CONTR_FACTOR		((float) 1.75)
 #define NUM_CONTR_GRID_ITER	12
+#define MAX_SIZE_CONTR_GRID	32
+
+#define NN_GRID_SIZE		128
+#define NN_NUM_CANDIDATES	16
+#define NN_MIN_MDRF		((float) 1.00e-6)
+#define NN_START_NUM_SAMPLES	1000
+#define NN_START_QUANTILE	((float) 0.999)
+#define NN_START_TOLERANCE	((float) 0.10)
+#define NN_START_MIN_AGREEMENT	((float) 99.9)
+
+#define CACHE_WAYS		4
+#define CACHE_NUM_LOCKS		64
+
+#define PREFILTER_GRID_SIZE	32
+
+#define RESULT_CACHE_VERSION	1
+
+#define SESSION_CHUNK_SIZE	256
+#define BATCH_READ_AHEAD	2
+#define NUMA_CHUNK_SIZE		256
+
+#define COMPACT_BLOCK_SIZE	4096
+#define PACKED_LM_BLOCK_SIZE	4096
+#define LM_INDEX_STRIDE		1024
+
+#define SHM_RING_CAPACITY	65536
+#define SHM_BATCH_SIZE		64
+#define SHM_SPIN_COUNT		4096
+#define SHM_WAIT_TIMEOUT_MSEC	100
+#define SHM_OPEN_TIMEOUT_MSEC	10000
+
+#define DAEMON_CHUNK_SIZE	256
+#define DAEMON_QUEUE_CHUNKS	16
+#define DAEMON_IMAGE_INTERVAL	65536
+#define DAEMON_POLL_MSEC	200
+#define DAEMON_TIMEOUT_MSEC	10000
+
+#define PIPELINE_CHUNK_SIZE	1024
+#define PIPELINE_NUM_CHUNKS	16
+#define PIPELINE_SPIN_COUNT	1024
+#define PIPELINE_SLEEP_USEC	50
+
+#define BINNING_GRID_SIZE_X	(KX + 1)
+#define BINNING_GRID_SIZE_Y	(KY + 1)
+
+#define SIMD_PMT_STRIDE		(((NUM_PMTS + 15) / 16) * 16)
+
+#define MDRF_WIDTH		32
+#define MDRF_FRAC_BITS		20
+#define POS_WIDTH		24
+#define POS_FRAC_BITS		18
+#define THRESH_WIDTH		16
+#define THRESH_FRAC_BITS	10
+#define FIXED_LOG_TABLE_BITS	10
+#define LOG2_TABLE_FRAC_BITS	30
+
+#define MAX_NUM_PMTS		64
+#define MAX_SPLINE_ORDER	8
+
+#define PMT_SUBSET_GRID_SIZE	16
+#define PMT_SUBSET_TILE_SAMPL	4
+#define PMT_SUBSET_MIN_MDRF	((float) 1.00e-6)
+#define PMT_SUBSET_PROBE_EVENTS	256
 
 #define MX			3
 #define MY			3
@@ -1,6 +1,8 @@
 #ifndef _MY_TYPES_H
 #define _MY_TYPES_H
 
+#include <vector>
+#include <string>
 #include "spline.hpp"
 #include "my_defines.h"
 
@@ -73,10 +75,80 @@ typedef spline_2D<float, float, MX, MY, KX, KY> mdrf_spline_t;
 typedef spline_2D<float, float, MX, MY, KX, KY> thresh_spline_t;
 
 
-struct calibr_funct_t {
-  mdrf_spline_t mdrf[NUM_PMTS];
-  thresh_spline_t thresh;
-  float gain[NUM_PMTS];
+template<class _T> struct calibr_funct_base_t {
+  spline_2D<_T, _T, MX, MY, KX, KY> mdrf[NUM_PMTS];
+  spline_2D<_T, _T, MX, MY, KX, KY> thresh;
+  _T gain[NUM_PMTS];
+};
+
+
+typedef calibr_funct_base_t<float> calibr_funct_t;
+
+
+typedef void (*contr_grid_stage_t)(float & current_x, float & current_y, float & max_log_like, float step, int grid_size, const float tmp_data[NUM_PMTS], const calibr_funct_t & calibr_funct);
+
+
+struct search_stage_t {
+  int grid_size;
+  float contr_factor;
+  contr_grid_stage_t kernel;
+};
+
+
+enum estim_mode_t {
+  ESTIM_MODE_CONTR_GRID,
+  ESTIM_MODE_NN_START,
+  ESTIM_MODE_NN_ONLY
+};
+
+
+enum estim_engine_t {
+  ESTIM_ENGINE_FLOAT,
+  ESTIM_ENGINE_DOUBLE,
+  ESTIM_ENGINE_SIMD,
+  ESTIM_ENGINE_FIXED
+};
+
+
+enum shm_output_t {
+  SHM_OUTPUT_BLOCK,
+  SHM_OUTPUT_DROP,
+  SHM_OUTPUT_NONE
+};
+
+
+struct estim_options_t {
+  estim_engine_t engine;
+  estim_mode_t mode;
+  int nn_grid_size;
+  unsigned int cache_size;
+  bool use_energy_window;
+  float energy_window_min, energy_window_max;
+  bool use_roi;
+  float roi_min_x, roi_max_x;
+  float roi_min_y, roi_max_y;
+  bool spatial_binning;
+  std::vector<search_stage_t> search_schedule;
+  std::string isa;
+  std::string camera_filename;
+  float pmt_subset_bound;
+  std::string result_cache_dir;
+  std::string session_filename;
+  std::string manifest_filename;
+  unsigned int num_threads;
+  bool numa;
+  std::size_t shard_begin, shard_end;
+  float image_pixel_size;
+  bool keep_event_list;
+  bool compact_output;
+  bool compact_valid_only;
+  bool compact_log_like;
+  bool lm_index;
+  std::string shm_name;
+  shm_output_t shm_output;
+  std::string daemon_path;
+  bool pipeline;
+  bool verbose;
 };
 
 
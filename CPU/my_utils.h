@@ -1,7 +1,11 @@
 #ifndef _MY_UTILS_H
 #define _MY_UTILS_H
 
+#include <cstring>
+#include <cmath>
 #include "my_types.h"
+#include "cpu_dispatch.h"
+#include "packed_lm.h"
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -74,6 +78,30 @@ template<class _T, int _NX, int _NY> void write_dat_2d(std::array<std::array<_T,
 }
 
 
+// lgamma() through the reentrant lgammaf_r() and lgamma_r(): std::lgamma()
+// stores the sign of the result in the global signgam, which is a data race
+// as soon as several threads share an estimator.
+inline float log_gamma(float x) {
+  int sign;
+  
+  return(lgammaf_r(x, & sign));
+}
+
+
+inline double log_gamma(double x) {
+  int sign;
+  
+  return(lgamma_r(x, & sign));
+}
+
+
+// Events per second for the statistics, 0 when nothing was estimated so
+// that an empty input does not print nan.
+inline double get_event_rate(std::size_t num_events, double seconds) {
+  return(((num_events > 0) && (seconds > 0.0)) ? double(num_events) / seconds : 0.0);
+}
+
+
 void write_estim_events(const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_events, const char *filename) {
   uint32_t event_index, num_events;
   float x_pos, y_pos;
@@ -102,14 +130,51 @@ void write_estim_events(const std::vector<estim_event_t, aligned_allocator<estim
 }
 
 
-std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> get_PMT_data(const char *filename) {
-  std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
-  int event_index, num_events;
-  PMT_data_t tmp_PMT_data;
+std::vector<estim_event_t, aligned_allocator<estim_event_t>> read_estim_events(const char *filename) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+  uint32_t event_index, num_events;
+  std::ifstream ifs;
+  uint32_t valid;
+  float values[3];
+  
+  ifs.open(filename, std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open ML estimates file!");
+  }
+  ifs.read(reinterpret_cast<char *>(& num_events), sizeof(num_events));
+  estim_event.resize(num_events);
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    ifs.read(reinterpret_cast<char *>(& valid), sizeof(valid));
+    ifs.read(reinterpret_cast<char *>(values), sizeof(values));
+    estim_event[event_index].valid = valid;
+    estim_event[event_index].x_pos = values[0];
+    estim_event[event_index].y_pos = values[1];
+    estim_event[event_index].log_like = values[2];
+  }
+  if(!ifs) {
+    throw std::runtime_error("Truncated ML estimates file!");
+  }
+  return(estim_event);
+}
+
+
+// The events are read in one block and converted from big endian by the
+// byte-swap kernel selected at startup (see cpu_dispatch.h). The number of
+// PMTs is given at run time, so that the same reader serves every camera.
+// Only the events of [first_event, last_event) are read, the others being
+// skipped by seeking past their 18-byte records. Packed files (see
+// packed_lm.h) are recognized by their magic number and read by
+// get_packed_LM_values().
+std::vector<int16_t> get_LM_values(const char *filename, int num_pmts, std::size_t first_event = 0, std::size_t last_event = SIZE_MAX) {
+  std::vector<int16_t> LM_values;
   std::ifstream LM_file;
   int16_t LM_header[9];
-  int i, pmt;
+  std::size_t num_events;
+  int i;
   
+  if(is_packed_LM_file(filename)) {
+    return(get_packed_LM_values(filename, num_pmts, first_event, last_event));
+  }
   LM_file.open(filename, std::ifstream::in | std::ifstream::binary);
   if(!LM_file) {
     throw std::runtime_error("Cannot open input LM file!");
@@ -118,16 +183,49 @@ std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> get_PMT_data(const char *
   for(i = 0; i < 9; ++i) {
     LM_header[i] = __builtin_bswap16(LM_header[i]);
   }
-  num_events = LM_header[3] * 1000 + LM_header[4];
-  PMT_data.resize(num_events);
-  for(event_index = 0; event_index < num_events; ++event_index) {
-    LM_file.read(reinterpret_cast<char *>(tmp_PMT_data.val), NUM_PMTS * sizeof(tmp_PMT_data.val[0]));
-    for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
-      tmp_PMT_data.val[pmt] = __builtin_bswap16(tmp_PMT_data.val[pmt]);
-      PMT_data[event_index].val[pmt] = std::max(int16_t(0), tmp_PMT_data.val[pmt]);
-    }
-  }
+  num_events = std::size_t(LM_header[3] * 1000 + LM_header[4]);
+  last_event = std::min(last_event, num_events);
+  first_event = std::min(first_event, last_event);
+  LM_file.seekg(std::streamoff(first_event * std::size_t(num_pmts) * sizeof(int16_t)), std::ifstream::cur);
+  LM_values.resize((last_event - first_event) * std::size_t(num_pmts));
+  LM_file.read(reinterpret_cast<char *>(LM_values.data()), std::streamsize(LM_values.size() * sizeof(LM_values[0])));
+  get_cpu_kernels().bswap_clamp(LM_values.data(), LM_values.data(), LM_values.size());
   LM_file.close();
+  return(LM_values);
+}
+
+
+// Number of events of a list-mode file, from its header.
+std::size_t get_LM_num_events(const char *filename) {
+  std::ifstream LM_file;
+  int16_t LM_header[9];
+  int i;
+  
+  if(is_packed_LM_file(filename)) {
+    return(std::size_t(read_packed_LM_header(filename).num_events));
+  }
+  LM_file.open(filename, std::ifstream::in | std::ifstream::binary);
+  LM_file.read(reinterpret_cast<char *>(LM_header), 9 * sizeof(LM_header[0]));
+  if(!LM_file) {
+    throw std::runtime_error("Cannot read input LM file!");
+  }
+  for(i = 0; i < 9; ++i) {
+    LM_header[i] = __builtin_bswap16(LM_header[i]);
+  }
+  return(std::size_t(LM_header[3] * 1000 + LM_header[4]));
+}
+
+
+std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> get_PMT_data(const char *filename, std::size_t first_event = 0, std::size_t last_event = SIZE_MAX) {
+  std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+  std::vector<int16_t> LM_values;
+  std::size_t event_index;
+  
+  LM_values = get_LM_values(filename, NUM_PMTS, first_event, last_event);
+  PMT_data.resize(LM_values.size() / NUM_PMTS);
+  for(event_index = 0; event_index < PMT_data.size(); ++event_index) {
+    std::memcpy(PMT_data[event_index].val, & LM_values[event_index * NUM_PMTS], NUM_PMTS * sizeof(LM_values[0]));
+  }
   return(PMT_data);
 }
 
@@ -182,20 +280,33 @@ calibr_data_t get_calibration_data(const char *mdrf_filename, const char *thresh
 }
 
 
-calibr_funct_t get_calibration_funct(const calibr_data_t & calibr_data) {
-  calibr_funct_t calibr_funct;
-  float pos[NUM_SAMPL];
-  int i, pmt;
+// The splines are fitted in the precision of _T, so that the double
+// engine does not inherit the rounding of a float fit.
+template<class _T = float> calibr_funct_base_t<_T> get_calibration_funct(const calibr_data_t & calibr_data) {
+  _T values[NUM_SAMPL][NUM_SAMPL];
+  calibr_funct_base_t<_T> calibr_funct;
+  int row, col, i, pmt;
+  _T pos[NUM_SAMPL];
   
   for(i = 0; i < NUM_SAMPL; ++i) {
-    pos[i] = float(i) / float(NUM_SAMPL - 1);
+    pos[i] = _T(i) / _T(NUM_SAMPL - 1);
   }
   for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
-    calibr_funct.mdrf[pmt] = spap2<float, float, MX, MY, KX, KY, NUM_SAMPL, NUM_SAMPL>(pos, pos, calibr_data.mdrf[pmt]);
+    for(row = 0; row < NUM_SAMPL; ++row) {
+      for(col = 0; col < NUM_SAMPL; ++col) {
+        values[row][col] = _T(calibr_data.mdrf[pmt][row][col]);
+      }
+    }
+    calibr_funct.mdrf[pmt] = spap2<_T, _T, MX, MY, KX, KY, NUM_SAMPL, NUM_SAMPL>(pos, pos, values);
+  }
+  for(row = 0; row < NUM_SAMPL; ++row) {
+    for(col = 0; col < NUM_SAMPL; ++col) {
+      values[row][col] = _T(calibr_data.thresh[row][col]);
+    }
   }
-  calibr_funct.thresh = spap2<float, float, MX, MY, KX, KY, NUM_SAMPL, NUM_SAMPL>(pos, pos, calibr_data.thresh);
+  calibr_funct.thresh = spap2<_T, _T, MX, MY, KX, KY, NUM_SAMPL, NUM_SAMPL>(pos, pos, values);
   for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
-    calibr_funct.gain[pmt] = calibr_data.gain[pmt];
+    calibr_funct.gain[pmt] = _T(calibr_data.gain[pmt]);
   }
   return(calibr_funct);
 }
@@ -0,0 +1,270 @@
+#ifndef _NN_INDEX_H
+#define _NN_INDEX_H
+
+#include <algorithm>
+#include <vector>
+#include <array>
+#include <cmath>
+#include "my_defines.h"
+#include "my_types.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Nearest-neighbor index over the expected PMT signals. The MDRFs are
+// sampled on a fine grid and each 9-vector is square-rooted, so that the
+// squared Euclidean distance to the square-rooted signals of an event is
+// twice the Hellinger distance between the Poisson distributions, which
+// follows the Poisson deviance of the search closely. The signals are not
+// normalized: their sum, the energy of the event, is what tells apart the
+// positions near the edge of the field of view, where the shape of the
+// MDRFs barely changes. The points are arranged in an implicit balanced
+// k-d tree: the node of range [b, e) is stored at (b + e) / 2 and splits
+// along the dimension of largest spread. find_best() ranks the
+// NN_NUM_CANDIDATES nearest nodes by the Poisson log-likelihood of the
+// event at their position.
+class nn_index_t {
+  public:
+    nn_index_t();
+    void build(const calibr_funct_t & calibr_funct, int num_grid);
+    bool empty() const;
+    int get_num_grid() const;
+    float get_pitch() const;
+    int find_best(const float signal[NUM_PMTS]) const;
+    void get_pos(int node, float & x, float & y) const;
+    static bool get_sqrt_signal(float output[NUM_PMTS], const float signal[NUM_PMTS]);
+    
+  private:
+    void build_tree(std::vector<int> & perm, int begin, int end);
+    void search(const float query[NUM_PMTS], int begin, int end, int num_best, int best_node[], float best_dist[]) const;
+    std::vector<std::array<float, NUM_PMTS>> points;
+    std::vector<std::array<float, NUM_PMTS>> mdrf, log_mdrf;
+    std::vector<unsigned char> split_dim;
+    std::vector<float> pos_x, pos_y;
+    int num_grid;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+nn_index_t::nn_index_t() {
+  num_grid = 0;
+}
+
+
+void nn_index_t::build(const calibr_funct_t & calibr_funct, int my_num_grid) {
+  std::vector<std::array<float, NUM_PMTS>> tmp_points, tmp_mdrf;
+  std::vector<float> tmp_pos_x, tmp_pos_y;
+  std::vector<int> perm;
+  float signal[NUM_PMTS];
+  int nx, ny, n, pmt;
+  float x, y;
+  
+  num_grid = my_num_grid;
+  tmp_points.reserve(num_grid * num_grid);
+  for(nx = 0; nx < num_grid; ++nx) {
+    x = (float(nx) + 0.50f) / float(num_grid);
+    for(ny = 0; ny < num_grid; ++ny) {
+      y = (float(ny) + 0.50f) / float(num_grid);
+      for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+        signal[pmt] = std::max(float(0), calibr_funct.mdrf[pmt](x, y));
+      }
+      tmp_points.push_back(std::array<float, NUM_PMTS>());
+      if(!get_sqrt_signal(tmp_points.back().data(), signal)) {
+        tmp_points.pop_back();
+        continue;
+      }
+      tmp_mdrf.push_back(std::array<float, NUM_PMTS>());
+      for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+        tmp_mdrf.back()[pmt] = std::max(signal[pmt], NN_MIN_MDRF);
+      }
+      tmp_pos_x.push_back(x);
+      tmp_pos_y.push_back(y);
+    }
+  }
+  perm.resize(tmp_points.size());
+  for(n = 0; n < int(perm.size()); ++n) {
+    perm[n] = n;
+  }
+  points = tmp_points;
+  split_dim.assign(points.size(), 0);
+  build_tree(perm, 0, int(perm.size()));
+  pos_x.resize(perm.size());
+  pos_y.resize(perm.size());
+  mdrf.resize(perm.size());
+  log_mdrf.resize(perm.size());
+  for(n = 0; n < int(perm.size()); ++n) {
+    points[n] = tmp_points[perm[n]];
+    mdrf[n] = tmp_mdrf[perm[n]];
+    for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+      log_mdrf[n][pmt] = std::log(mdrf[n][pmt]);
+    }
+    pos_x[n] = tmp_pos_x[perm[n]];
+    pos_y[n] = tmp_pos_y[perm[n]];
+  }
+  return;
+}
+
+
+bool nn_index_t::empty() const {
+  return(points.empty());
+}
+
+
+int nn_index_t::get_num_grid() const {
+  return(num_grid);
+}
+
+
+float nn_index_t::get_pitch() const {
+  return((num_grid > 0) ? (float(1) / float(num_grid)) : float(1));
+}
+
+
+// Node of largest Poisson log-likelihood, sum of signal * log(mdrf) - mdrf,
+// among the NN_NUM_CANDIDATES nearest ones.
+int nn_index_t::find_best(const float signal[NUM_PMTS]) const {
+  float best_dist[NN_NUM_CANDIDATES];
+  int best_node[NN_NUM_CANDIDATES];
+  float log_like, max_log_like;
+  float query[NUM_PMTS];
+  int node, n, pmt;
+  
+  node = -1;
+  if(points.empty() || !get_sqrt_signal(query, signal)) {
+    return(node);
+  }
+  for(n = 0; n < NN_NUM_CANDIDATES; ++n) {
+    best_node[n] = -1;
+    best_dist[n] = HUGE_VALF;
+  }
+  search(query, 0, int(points.size()), NN_NUM_CANDIDATES, best_node, best_dist);
+  max_log_like = -HUGE_VALF;
+  for(n = 0; (n < NN_NUM_CANDIDATES) && (best_node[n] >= 0); ++n) {
+    log_like = float(0);
+    for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+      log_like += signal[pmt] * log_mdrf[best_node[n]][pmt] - mdrf[best_node[n]][pmt];
+    }
+    if((node < 0) || (log_like > max_log_like)) {
+      max_log_like = log_like;
+      node = best_node[n];
+    }
+  }
+  return(node);
+}
+
+
+void nn_index_t::get_pos(int node, float & x, float & y) const {
+  x = pos_x[node];
+  y = pos_y[node];
+  return;
+}
+
+
+// Square roots of the signals, false for an event without signal.
+bool nn_index_t::get_sqrt_signal(float output[NUM_PMTS], const float signal[NUM_PMTS]) {
+  float sum;
+  int pmt;
+  
+  sum = float(0);
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    sum += signal[pmt];
+  }
+  if(!(sum > float(0))) {
+    return(false);
+  }
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    output[pmt] = std::sqrt(std::max(float(0), signal[pmt]));
+  }
+  return(true);
+}
+
+
+void nn_index_t::build_tree(std::vector<int> & perm, int begin, int end) {
+  float min_val[NUM_PMTS], max_val[NUM_PMTS];
+  float spread, max_spread;
+  int n, pmt, dim, mid;
+  
+  if((end - begin) <= 1) {
+    return;
+  }
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    min_val[pmt] = +HUGE_VALF;
+    max_val[pmt] = -HUGE_VALF;
+  }
+  for(n = begin; n < end; ++n) {
+    for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+      min_val[pmt] = std::min(min_val[pmt], points[perm[n]][pmt]);
+      max_val[pmt] = std::max(max_val[pmt], points[perm[n]][pmt]);
+    }
+  }
+  dim = 0;
+  max_spread = -HUGE_VALF;
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    spread = max_val[pmt] - min_val[pmt];
+    if(spread > max_spread) {
+      max_spread = spread;
+      dim = pmt;
+    }
+  }
+  mid = (begin + end) / 2;
+  std::nth_element(perm.begin() + begin, perm.begin() + mid, perm.begin() + end, [this, dim](int a, int b) {
+    return(points[a][dim] < points[b][dim]);
+  });
+  split_dim[mid] = (unsigned char) dim;
+  build_tree(perm, begin, mid);
+  build_tree(perm, mid + 1, end);
+  return;
+}
+
+
+// Keeps the num_best nearest nodes found so far in best_node, sorted by
+// increasing distance, with the unused entries at distance HUGE_VALF.
+void nn_index_t::search(const float query[NUM_PMTS], int begin, int end, int num_best, int best_node[], float best_dist[]) const {
+  float dist, diff, tmp;
+  int mid, dim, pmt;
+  int n;
+  
+  if(begin >= end) {
+    return;
+  }
+  mid = (begin + end) / 2;
+  dist = float(0);
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    tmp = query[pmt] - points[mid][pmt];
+    dist += tmp * tmp;
+  }
+  if(dist < best_dist[num_best - 1]) {
+    for(n = num_best - 1; (n > 0) && (dist < best_dist[n - 1]); --n) {
+      best_dist[n] = best_dist[n - 1];
+      best_node[n] = best_node[n - 1];
+    }
+    best_dist[n] = dist;
+    best_node[n] = mid;
+  }
+  if((end - begin) <= 1) {
+    return;
+  }
+  dim = split_dim[mid];
+  diff = query[dim] - points[mid][dim];
+  if(diff < float(0)) {
+    search(query, begin, mid, num_best, best_node, best_dist);
+    if(diff * diff < best_dist[num_best - 1]) {
+      search(query, mid + 1, end, num_best, best_node, best_dist);
+    }
+  } else {
+    search(query, mid + 1, end, num_best, best_node, best_dist);
+    if(diff * diff < best_dist[num_best - 1]) {
+      search(query, begin, mid, num_best, best_node, best_dist);
+    }
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _NN_INDEX_H
@@ -0,0 +1,322 @@
+#ifndef _NUMA_ESTIMATOR_H
+#define _NUMA_ESTIMATOR_H
+
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <sched.h>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "estimator.h"
+#include "image.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+struct numa_node_t {
+  int node;
+  std::vector<int> cpus;
+};
+
+
+// Parallel estimator for multi-socket machines. The events are split in
+// contiguous ranges, one per NUMA node, in proportion to the workers of the
+// node. For every node, a thread pinned to its CPUs builds a replica of the
+// estimator (calibration, nearest-neighbor index and prefilter tables) and
+// copies the range of events into a buffer of the node, so that both are
+// first touched, and therefore allocated, in its local memory. The workers
+// of a node are pinned to its CPUs and only claim chunks of its range.
+//
+// The nodes are read from /sys/devices/system/node and the threads pinned
+// with sched_setaffinity(), so no NUMA library is needed; without sysfs, all
+// the CPUs make up a single node.
+class numa_estimator_t {
+  public:
+    numa_estimator_t(const calibr_funct_t & my_calibr_funct, const estim_options_t & my_estim_options, unsigned int num_threads);
+    std::vector<estim_event_t, aligned_allocator<estim_event_t>> estimate(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, image_t *image = nullptr);
+    void print_stats(std::ostream & os) const;
+    
+  private:
+    struct node_state_t {
+      numa_node_t numa_node;
+      unsigned int num_workers;
+      std::unique_ptr<estimator_t> estimator;
+      std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+      std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+      std::size_t first_event;
+      std::atomic<std::size_t> next_chunk;
+      std::atomic<uint64_t> busy_nsec;
+      std::atomic<uint64_t> finish_nsec;
+    };
+    void prepare_node(node_state_t & node_state, const PMT_data_t *PMT_data, std::size_t num_events);
+    void work(node_state_t & node_state, image_t *image);
+    calibr_funct_t calibr_funct;
+    estim_options_t estim_options;
+    std::vector<std::unique_ptr<node_state_t>> node_states;
+    std::mutex image_mutex;
+    std::chrono::time_point<std::chrono::steady_clock> start;
+    double elapsed_time;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+std::vector<numa_node_t> get_numa_nodes();
+std::vector<int> parse_cpu_list(const std::string & str);
+bool pin_thread(const std::vector<int> & cpus);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Spreads num_threads workers (one per CPU for 0) over the nodes in
+// proportion to their number of CPUs, at least one per node; the last node
+// gets the workers left. The rounded cumulative share of a node can be
+// below the workers already given to the nodes before it, hence the signed
+// arithmetic, and is capped to leave one worker to each following node.
+numa_estimator_t::numa_estimator_t(const calibr_funct_t & my_calibr_funct, const estim_options_t & my_estim_options, unsigned int num_threads) : calibr_funct(my_calibr_funct), estim_options(my_estim_options), elapsed_time(0.0) {
+  std::vector<numa_node_t> numa_nodes;
+  std::size_t num_cpus, cpus_before;
+  unsigned int workers_before;
+  int64_t target;
+  std::size_t n;
+  
+  if(estim_options.engine != ESTIM_ENGINE_FLOAT) {
+    throw std::runtime_error("NUMA only supports the float engine!");
+  }
+  numa_nodes = get_numa_nodes();
+  num_cpus = 0;
+  for(n = 0; n < numa_nodes.size(); ++n) {
+    num_cpus += numa_nodes[n].cpus.size();
+  }
+  if(num_threads == 0) {
+    num_threads = (unsigned int) num_cpus;
+  }
+  num_threads = std::max(num_threads, (unsigned int) numa_nodes.size());
+  cpus_before = 0;
+  workers_before = 0;
+  for(n = 0; n < numa_nodes.size(); ++n) {
+    std::unique_ptr<node_state_t> node_state(new node_state_t);
+    node_state->numa_node = numa_nodes[n];
+    cpus_before += numa_nodes[n].cpus.size();
+    if((n + 1) == numa_nodes.size()) {
+      target = int64_t(num_threads);
+    } else {
+      target = int64_t((std::size_t(num_threads) * cpus_before + num_cpus / 2) / num_cpus);
+      target = std::min(target, int64_t(num_threads) - int64_t(numa_nodes.size() - n - 1));
+    }
+    node_state->num_workers = (unsigned int) std::max(target - int64_t(workers_before), int64_t(1));
+    workers_before += node_state->num_workers;
+    node_states.push_back(std::move(node_state));
+  }
+}
+
+
+// With an image, every worker bins its events into a private image, which
+// is merged into the given one when the worker is done.
+std::vector<estim_event_t, aligned_allocator<estim_event_t>> numa_estimator_t::estimate(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, image_t *image) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event(PMT_data.size());
+  std::vector<std::thread> threads;
+  unsigned int total_workers;
+  std::size_t first_event;
+  std::size_t n;
+  unsigned int i;
+  
+  total_workers = 0;
+  for(n = 0; n < node_states.size(); ++n) {
+    total_workers += node_states[n]->num_workers;
+  }
+  first_event = 0;
+  for(n = 0; n < node_states.size(); ++n) {
+    node_states[n]->first_event = first_event;
+    first_event = ((n + 1) == node_states.size()) ? PMT_data.size() : (first_event + PMT_data.size() * node_states[n]->num_workers / total_workers);
+    threads.push_back(std::thread(& numa_estimator_t::prepare_node, this, std::ref(*node_states[n]), PMT_data.data() + node_states[n]->first_event, first_event - node_states[n]->first_event));
+  }
+  for(n = 0; n < threads.size(); ++n) {
+    threads[n].join();
+  }
+  threads.clear();
+  start = std::chrono::steady_clock::now();
+  for(n = 0; n < node_states.size(); ++n) {
+    for(i = 0; i < node_states[n]->num_workers; ++i) {
+      threads.push_back(std::thread(& numa_estimator_t::work, this, std::ref(*node_states[n]), image));
+    }
+  }
+  for(n = 0; n < threads.size(); ++n) {
+    threads[n].join();
+  }
+  elapsed_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for(n = 0; n < node_states.size(); ++n) {
+    std::copy(node_states[n]->estim_event.begin(), node_states[n]->estim_event.end(), estim_event.begin() + std::ptrdiff_t(node_states[n]->first_event));
+  }
+  return(estim_event);
+}
+
+
+void numa_estimator_t::print_stats(std::ostream & os) const {
+  const node_state_t *node_state;
+  std::size_t num_events;
+  std::size_t n;
+  
+  for(n = 0; n < node_states.size(); ++n) {
+    node_state = node_states[n].get();
+    num_events = node_state->PMT_data.size();
+    os << "Node " << node_state->numa_node.node << ": " << node_state->numa_node.cpus.size() << " CPUs, " << node_state->num_workers << " workers, " << num_events << " events in " << double(node_state->finish_nsec) * 1e-9 << " s (" << double(num_events) / (double(node_state->finish_nsec) * 1e-9) << " events/s, " << double(num_events) / (double(node_state->busy_nsec) * 1e-9) << " per worker)." << std::endl;
+  }
+  os << "Elapsed time: " << elapsed_time << " s." << std::endl;
+  return;
+}
+
+
+// Runs pinned to the node, so that the replica and the buffers it allocates
+// are first touched there.
+void numa_estimator_t::prepare_node(node_state_t & node_state, const PMT_data_t *PMT_data, std::size_t num_events) {
+  pin_thread(node_state.numa_node.cpus);
+  node_state.estimator.reset(new estimator_t(calibr_funct, estim_options));
+  node_state.PMT_data.assign(PMT_data, PMT_data + num_events);
+  node_state.estim_event.resize(num_events);
+  node_state.next_chunk = 0;
+  node_state.busy_nsec = 0;
+  node_state.finish_nsec = 0;
+  return;
+}
+
+
+void numa_estimator_t::work(node_state_t & node_state, image_t *image) {
+  std::chrono::time_point<std::chrono::steady_clock> chunk_start, chunk_end;
+  std::unique_ptr<image_t> local_image;
+  std::size_t first_event, num_events;
+  uint64_t finish_nsec, last_nsec;
+  std::size_t n;
+  
+  pin_thread(node_state.numa_node.cpus);
+  if(image != nullptr) {
+    local_image.reset(new image_t(image->get_pixel_size()));
+  }
+  while((first_event = NUMA_CHUNK_SIZE * node_state.next_chunk++) < node_state.PMT_data.size()) {
+    num_events = std::min(std::size_t(NUMA_CHUNK_SIZE), node_state.PMT_data.size() - first_event);
+    chunk_start = std::chrono::steady_clock::now();
+    node_state.estimator->estimate_batch(& node_state.PMT_data[first_event], & node_state.estim_event[first_event], num_events);
+    if(local_image) {
+      for(n = first_event; n < (first_event + num_events); ++n) {
+        local_image->add(node_state.estim_event[n]);
+      }
+    }
+    chunk_end = std::chrono::steady_clock::now();
+    node_state.busy_nsec += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(chunk_end - chunk_start).count());
+    finish_nsec = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(chunk_end - start).count());
+    last_nsec = node_state.finish_nsec;
+    while((last_nsec < finish_nsec) && !node_state.finish_nsec.compare_exchange_weak(last_nsec, finish_nsec)) {
+    }
+  }
+  if(local_image) {
+    std::lock_guard<std::mutex> guard(image_mutex);
+    image->merge(*local_image);
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Nodes with at least one CPU, or a single node with all the CPUs when the
+// topology is not available.
+std::vector<numa_node_t> get_numa_nodes() {
+  std::vector<numa_node_t> numa_nodes;
+  std::string online, line;
+  numa_node_t numa_node;
+  std::vector<int> nodes;
+  std::ifstream ifs;
+  unsigned int i;
+  std::size_t n;
+  
+  ifs.open("/sys/devices/system/node/online", std::ifstream::in);
+  if(ifs && std::getline(ifs, online)) {
+    nodes = parse_cpu_list(online);
+  }
+  ifs.close();
+  for(n = 0; n < nodes.size(); ++n) {
+    ifs.open("/sys/devices/system/node/node" + std::to_string(nodes[n]) + "/cpulist", std::ifstream::in);
+    line.clear();
+    if(ifs) {
+      std::getline(ifs, line);
+    }
+    ifs.close();
+    numa_node.node = nodes[n];
+    numa_node.cpus = parse_cpu_list(line);
+    if(!numa_node.cpus.empty()) {
+      numa_nodes.push_back(numa_node);
+    }
+  }
+  if(numa_nodes.empty()) {
+    numa_node.node = 0;
+    numa_node.cpus.clear();
+    for(i = 0; i < std::max(std::thread::hardware_concurrency(), 1U); ++i) {
+      numa_node.cpus.push_back(int(i));
+    }
+    numa_nodes.push_back(numa_node);
+  }
+  return(numa_nodes);
+}
+
+
+// Parses a list of CPUs or nodes in the format of sysfs, such as "0-3,8".
+std::vector<int> parse_cpu_list(const std::string & str) {
+  std::vector<int> values;
+  std::string item;
+  std::size_t pos;
+  int first, last;
+  int value;
+  
+  std::istringstream iss(str);
+  while(std::getline(iss, item, ',')) {
+    item.erase(0, item.find_first_not_of(" \t"));
+    item.erase(item.find_last_not_of(" \t\r\n") + 1);
+    if(item.empty()) {
+      continue;
+    }
+    pos = item.find('-');
+    first = std::stoi(item.substr(0, pos));
+    last = (pos == std::string::npos) ? first : std::stoi(item.substr(pos + 1));
+    for(value = first; value <= last; ++value) {
+      values.push_back(value);
+    }
+  }
+  return(values);
+}
+
+
+// Restricts the calling thread to the given CPUs. Returns false if the
+// system refuses, in which case the thread runs unpinned.
+bool pin_thread(const std::vector<int> & cpus) {
+  cpu_set_t cpu_set;
+  std::size_t n;
+  
+  CPU_ZERO(& cpu_set);
+  for(n = 0; n < cpus.size(); ++n) {
+    if(cpus[n] < CPU_SETSIZE) {
+      CPU_SET(cpus[n], & cpu_set);
+    }
+  }
+  return(sched_setaffinity(0, sizeof(cpu_set), & cpu_set) == 0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _NUMA_ESTIMATOR_H
@@ -0,0 +1,279 @@
+#ifndef _PACKED_LM_H
+#define _PACKED_LM_H
+
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include "my_defines.h"
+#include "cpu_dispatch.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Packed list-mode format (.plm). The PMT values, clamped at zero as by
+// get_LM_values(), are stored in blocks of block_size events, event by
+// event as in the original files, but with as many bits per value as the
+// largest value of the block needs instead of 16. Each block starts with
+// its own header giving its number of events, its number of bits and the
+// size of its packed data, padded to 8 bytes. The values are packed
+// little-endian without gaps, so that a group of 8 values always takes
+// bits bytes, and are expanded by the unpacking kernel of cpu_dispatch.h.
+// The index at index_offset gives the offset of every block, so that a
+// range of events is read without decoding the blocks before it. The
+// header of the original file is kept for the conversion back.
+struct packed_lm_header_t {
+  char magic[4];
+  uint32_t num_pmts;
+  uint32_t block_size;
+  uint32_t num_blocks;
+  uint64_t num_events;
+  uint64_t index_offset;
+  int16_t LM_header[9];
+  int16_t reserved[3];
+};
+
+
+struct packed_lm_block_t {
+  uint32_t num_events;
+  uint32_t bits;
+  uint64_t num_bytes;
+};
+
+
+// Bytes readable past the packed data of a block, as the unpacking kernels
+// require.
+const std::size_t packed_lm_padding = 16;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void write_packed_LM_values(const std::vector<int16_t> & LM_values, const int16_t LM_header[9], int num_pmts, const char *filename, uint32_t block_size = PACKED_LM_BLOCK_SIZE);
+std::vector<int16_t> get_packed_LM_values(const char *filename, int num_pmts, std::size_t first_event = 0, std::size_t last_event = SIZE_MAX);
+packed_lm_header_t read_packed_LM_header(const char *filename);
+std::vector<uint64_t> read_packed_LM_offsets(const char *filename);
+uint64_t read_packed_LM_block(std::ifstream & ifs, uint64_t offset, uint32_t num_pmts, packed_lm_block_t & block, std::vector<uint8_t> & packed);
+bool is_packed_LM_file(const char *filename);
+void pack_bits(std::vector<uint8_t> & output, const int16_t *input, std::size_t num_values, int bits);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void write_packed_LM_values(const std::vector<int16_t> & LM_values, const int16_t LM_header[9], int num_pmts, const char *filename, uint32_t block_size) {
+  std::vector<int16_t> block_values;
+  std::vector<uint64_t> offsets;
+  std::vector<uint8_t> packed;
+  packed_lm_header_t header;
+  packed_lm_block_t block;
+  std::size_t event_index, last_event;
+  std::size_t num_events;
+  std::ofstream ofs;
+  uint64_t offset;
+  int16_t max_value;
+  std::size_t n;
+  
+  if((block_size == 0) || (num_pmts <= 0)) {
+    throw std::runtime_error("The block size and the number of PMTs must be positive!");
+  }
+  ofs.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!ofs) {
+    throw std::runtime_error("Cannot create packed LM file!");
+  }
+  num_events = LM_values.size() / std::size_t(num_pmts);
+  std::memset(& header, 0, sizeof(header));
+  std::memcpy(header.magic, "PLM1", 4);
+  header.num_pmts = uint32_t(num_pmts);
+  header.block_size = block_size;
+  header.num_blocks = uint32_t((num_events + block_size - 1) / block_size);
+  header.num_events = num_events;
+  std::memcpy(header.LM_header, LM_header, sizeof(header.LM_header));
+  ofs.write(reinterpret_cast<const char *>(& header), sizeof(header));
+  offset = sizeof(header);
+  for(event_index = 0; event_index < num_events; event_index += block_size) {
+    last_event = std::min(event_index + block_size, num_events);
+    block_values.assign(LM_values.begin() + std::ptrdiff_t(event_index * std::size_t(num_pmts)), LM_values.begin() + std::ptrdiff_t(last_event * std::size_t(num_pmts)));
+    max_value = 0;
+    for(n = 0; n < block_values.size(); ++n) {
+      block_values[n] = std::max(int16_t(0), block_values[n]);
+      max_value = std::max(max_value, block_values[n]);
+    }
+    block.num_events = uint32_t(last_event - event_index);
+    block.bits = 1;
+    while((max_value >> block.bits) != 0) {
+      ++block.bits;
+    }
+    packed.clear();
+    pack_bits(packed, block_values.data(), block_values.size(), int(block.bits));
+    block.num_bytes = packed.size();
+    while((packed.size() % 8) != 0) {
+      packed.push_back(0);
+    }
+    offsets.push_back(offset);
+    ofs.write(reinterpret_cast<const char *>(& block), sizeof(block));
+    ofs.write(reinterpret_cast<const char *>(packed.data()), std::streamsize(packed.size()));
+    offset += sizeof(block) + packed.size();
+  }
+  header.index_offset = offset;
+  ofs.write(reinterpret_cast<const char *>(offsets.data()), std::streamsize(offsets.size() * sizeof(uint64_t)));
+  ofs.seekp(0);
+  ofs.write(reinterpret_cast<const char *>(& header), sizeof(header));
+  ofs.close();
+  if(!ofs) {
+    throw std::runtime_error("Cannot write packed LM file!");
+  }
+  return;
+}
+
+
+// Same contract as get_LM_values(). The blocks inside [first_event,
+// last_event) are unpacked in place into the result, the partial blocks at
+// both ends through a staging buffer.
+std::vector<int16_t> get_packed_LM_values(const char *filename, int num_pmts, std::size_t first_event, std::size_t last_event) {
+  const cpu_kernels_t & cpu_kernels = get_cpu_kernels();
+  std::vector<int16_t> LM_values, block_values;
+  std::vector<uint64_t> offsets;
+  std::vector<uint8_t> packed;
+  packed_lm_header_t header;
+  packed_lm_block_t block;
+  std::size_t block_first, block_begin, block_end;
+  std::ifstream ifs;
+  std::size_t b;
+  
+  ifs.open(filename, std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open input LM file!");
+  }
+  ifs.read(reinterpret_cast<char *>(& header), sizeof(header));
+  if(!ifs || (std::memcmp(header.magic, "PLM1", 4) != 0)) {
+    throw std::runtime_error("Not a packed LM file!");
+  }
+  if(header.num_pmts != uint32_t(num_pmts)) {
+    throw std::runtime_error("The packed LM file has " + std::to_string(header.num_pmts) + " PMTs instead of " + std::to_string(num_pmts) + "!");
+  }
+  offsets.resize(header.num_blocks);
+  ifs.seekg(std::streamoff(header.index_offset));
+  ifs.read(reinterpret_cast<char *>(offsets.data()), std::streamsize(offsets.size() * sizeof(uint64_t)));
+  if(!ifs) {
+    throw std::runtime_error("Truncated packed LM file!");
+  }
+  last_event = std::min(last_event, std::size_t(header.num_events));
+  first_event = std::min(first_event, last_event);
+  LM_values.resize((last_event - first_event) * std::size_t(num_pmts));
+  for(b = first_event / header.block_size; (b < offsets.size()) && ((b * header.block_size) < last_event); ++b) {
+    read_packed_LM_block(ifs, offsets[b], header.num_pmts, block, packed);
+    block_first = b * header.block_size;
+    block_begin = std::max(first_event, block_first);
+    block_end = std::min(last_event, block_first + block.num_events);
+    if((block_begin == block_first) && (block_end == (block_first + block.num_events))) {
+      cpu_kernels.unpack_bits(LM_values.data() + (block_begin - first_event) * std::size_t(num_pmts), packed.data(), std::size_t(block.num_events) * std::size_t(num_pmts), int(block.bits));
+    } else {
+      block_values.resize(std::size_t(block.num_events) * std::size_t(num_pmts));
+      cpu_kernels.unpack_bits(block_values.data(), packed.data(), block_values.size(), int(block.bits));
+      std::copy(block_values.begin() + std::ptrdiff_t((block_begin - block_first) * std::size_t(num_pmts)), block_values.begin() + std::ptrdiff_t((block_end - block_first) * std::size_t(num_pmts)), LM_values.begin() + std::ptrdiff_t((block_begin - first_event) * std::size_t(num_pmts)));
+    }
+  }
+  return(LM_values);
+}
+
+
+packed_lm_header_t read_packed_LM_header(const char *filename) {
+  packed_lm_header_t header;
+  std::ifstream ifs;
+  
+  ifs.open(filename, std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open input LM file!");
+  }
+  ifs.read(reinterpret_cast<char *>(& header), sizeof(header));
+  if(!ifs || (std::memcmp(header.magic, "PLM1", 4) != 0)) {
+    throw std::runtime_error("Not a packed LM file!");
+  }
+  return(header);
+}
+
+
+// Offsets of the blocks, from the index at the end of the file.
+std::vector<uint64_t> read_packed_LM_offsets(const char *filename) {
+  std::vector<uint64_t> offsets;
+  packed_lm_header_t header;
+  std::ifstream ifs;
+  
+  header = read_packed_LM_header(filename);
+  ifs.open(filename, std::ifstream::in | std::ifstream::binary);
+  offsets.resize(header.num_blocks);
+  ifs.seekg(std::streamoff(header.index_offset));
+  ifs.read(reinterpret_cast<char *>(offsets.data()), std::streamsize(offsets.size() * sizeof(uint64_t)));
+  if(!ifs) {
+    throw std::runtime_error("Truncated packed LM file!");
+  }
+  return(offsets);
+}
+
+
+// Reads the header and the packed data of the block at offset into packed,
+// padded for the unpacking kernels. Returns the offset of the next block,
+// as the blocks are stored one after the other.
+uint64_t read_packed_LM_block(std::ifstream & ifs, uint64_t offset, uint32_t num_pmts, packed_lm_block_t & block, std::vector<uint8_t> & packed) {
+  ifs.seekg(std::streamoff(offset));
+  ifs.read(reinterpret_cast<char *>(& block), sizeof(block));
+  if(!ifs || (block.bits == 0) || (block.bits > 16) || (block.num_bytes < ((uint64_t(block.num_events) * num_pmts * block.bits + 7) / 8))) {
+    throw std::runtime_error("Corrupted packed LM file!");
+  }
+  packed.resize(std::size_t(block.num_bytes) + packed_lm_padding);
+  std::fill(packed.end() - std::ptrdiff_t(packed_lm_padding), packed.end(), uint8_t(0));
+  ifs.read(reinterpret_cast<char *>(packed.data()), std::streamsize(block.num_bytes));
+  if(!ifs) {
+    throw std::runtime_error("Truncated packed LM file!");
+  }
+  return(offset + sizeof(block) + ((block.num_bytes + 7) / 8) * 8);
+}
+
+
+bool is_packed_LM_file(const char *filename) {
+  std::ifstream ifs;
+  char magic[4];
+  
+  ifs.open(filename, std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open input LM file!");
+  }
+  ifs.read(magic, sizeof(magic));
+  return(ifs && (std::memcmp(magic, "PLM1", 4) == 0));
+}
+
+
+// Appends the values, which must fit in bits bits, least significant bit
+// first.
+void pack_bits(std::vector<uint8_t> & output, const int16_t *input, std::size_t num_values, int bits) {
+  uint64_t acc;
+  std::size_t n;
+  int num_acc;
+  
+  acc = 0;
+  num_acc = 0;
+  for(n = 0; n < num_values; ++n) {
+    acc |= uint64_t(uint16_t(input[n])) << num_acc;
+    num_acc += bits;
+    while(num_acc >= 8) {
+      output.push_back(uint8_t(acc & 0xFF));
+      acc >>= 8;
+      num_acc -= 8;
+    }
+  }
+  if(num_acc > 0) {
+    output.push_back(uint8_t(acc & 0xFF));
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _PACKED_LM_H
@@ -0,0 +1,541 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "cpu_dispatch.h"
+#include "packed_lm.h"
+#include "estimator.h"
+#include "image.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Bounded queue for any number of producers and consumers without locks,
+// after D. Vyukov: each cell carries a sequence number which tells a
+// producer that the cell is free and a consumer that it is filled, so that
+// a push or a pop takes one compare-and-swap of its position. The
+// positions sit on cache lines of their own. The capacity is rounded up to
+// a power of two.
+template<class _T> class mpmc_queue_t {
+  public:
+    mpmc_queue_t(std::size_t min_capacity);
+    bool try_push(const _T & value);
+    bool try_pop(_T & value);
+    std::size_t get_size() const;
+    
+  private:
+    struct cell_t {
+      std::atomic<std::size_t> seq;
+      _T value;
+    };
+    std::unique_ptr<cell_t[]> cells;
+    std::size_t mask;
+    char padding_0[64];
+    std::atomic<std::size_t> enqueue_pos;
+    char padding_1[64];
+    std::atomic<std::size_t> dequeue_pos;
+    char padding_2[64];
+};
+
+
+struct pipeline_stage_stats_t {
+  std::size_t num_chunks;
+  double busy_time;
+  double input_stall_time;
+  double output_stall_time;
+  double input_occupancy;
+};
+
+
+// Estimates a list-mode file in three stages that overlap: a reader thread
+// fills chunks of PIPELINE_CHUNK_SIZE events, workers estimate them and a
+// writer thread writes the estimates in event order and bins the image.
+// The stages pass pointers to the chunks through lock-free queues, and the
+// writer hands written chunks back to the reader through a free list, so
+// that the buffers of the PIPELINE_NUM_CHUNKS chunks are allocated once.
+// A stage that finds its input queue empty yields for PIPELINE_SPIN_COUNT
+// tries, then sleeps PIPELINE_SLEEP_USEC between tries; the time it spends
+// so is its stall time, and the stage with the most busy time per thread
+// is the bottleneck.
+class pipeline_t {
+  public:
+    pipeline_t(const std::string & my_LM_filename, std::size_t my_first_event, std::size_t last_event, const estimator_t & my_estimator, const std::string & my_output_filename, image_t *my_image);
+    std::size_t run(unsigned int num_threads);
+    void print_stats(std::ostream & os) const;
+    
+  private:
+    struct chunk_t {
+      uint64_t seq;
+      std::size_t num_events;
+      std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+      std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+    };
+    void read_chunks();
+    void estimate_chunks(std::size_t worker_index);
+    void write_chunks();
+    bool push(mpmc_queue_t<chunk_t *> & queue, chunk_t *chunk, double & stall_time);
+    bool pop(mpmc_queue_t<chunk_t *> & queue, chunk_t *& chunk, pipeline_stage_stats_t & stats);
+    void set_error();
+    const estimator_t & estimator;
+    std::string LM_filename;
+    std::string output_filename;
+    image_t *image;
+    std::size_t first_event, num_events;
+    uint64_t num_chunks;
+    bool is_packed;
+    std::vector<chunk_t> chunks;
+    std::unique_ptr<mpmc_queue_t<chunk_t *>> free_queue;
+    std::unique_ptr<mpmc_queue_t<chunk_t *>> input_queue;
+    std::unique_ptr<mpmc_queue_t<chunk_t *>> output_queue;
+    pipeline_stage_stats_t reader_stats;
+    std::vector<pipeline_stage_stats_t> worker_stats;
+    pipeline_stage_stats_t writer_stats;
+    std::atomic<bool> failed;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    double elapsed_time;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+template<class _T> mpmc_queue_t<_T>::mpmc_queue_t(std::size_t min_capacity) : mask(1), enqueue_pos(0), dequeue_pos(0) {
+  std::size_t i;
+  
+  while(mask < min_capacity) {
+    mask *= 2;
+  }
+  cells.reset(new cell_t[mask]);
+  for(i = 0; i < mask; ++i) {
+    cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+  --mask;
+}
+
+
+// A cell is free for position pos when its sequence number is pos, and a
+// lower one means that the queue is full.
+template<class _T> bool mpmc_queue_t<_T>::try_push(const _T & value) {
+  std::size_t pos, seq;
+  cell_t *cell;
+  
+  pos = enqueue_pos.load(std::memory_order_relaxed);
+  while(true) {
+    cell = & cells[pos & mask];
+    seq = cell->seq.load(std::memory_order_acquire);
+    if(seq == pos) {
+      if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if(int64_t(seq - pos) < 0) {
+      return(false);
+    } else {
+      pos = enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  cell->value = value;
+  cell->seq.store(pos + 1, std::memory_order_release);
+  return(true);
+}
+
+
+// A cell is filled for position pos when its sequence number is pos + 1,
+// and a lower one means that the queue is empty.
+template<class _T> bool mpmc_queue_t<_T>::try_pop(_T & value) {
+  std::size_t pos, seq;
+  cell_t *cell;
+  
+  pos = dequeue_pos.load(std::memory_order_relaxed);
+  while(true) {
+    cell = & cells[pos & mask];
+    seq = cell->seq.load(std::memory_order_acquire);
+    if(seq == pos + 1) {
+      if(dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if(int64_t(seq - (pos + 1)) < 0) {
+      return(false);
+    } else {
+      pos = dequeue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  value = cell->value;
+  cell->seq.store(pos + mask + 1, std::memory_order_release);
+  return(true);
+}
+
+
+// Only a snapshot while other threads push and pop.
+template<class _T> std::size_t mpmc_queue_t<_T>::get_size() const {
+  std::size_t head, tail;
+  
+  tail = dequeue_pos.load(std::memory_order_relaxed);
+  head = enqueue_pos.load(std::memory_order_relaxed);
+  return((head > tail) ? (head - tail) : 0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// The events are counted from the header as get_LM_values() does. The
+// estimates are written to output_filename, in the format of
+// write_estim_events(), unless it is empty.
+pipeline_t::pipeline_t(const std::string & my_LM_filename, std::size_t my_first_event, std::size_t last_event, const estimator_t & my_estimator, const std::string & my_output_filename, image_t *my_image) : estimator(my_estimator), LM_filename(my_LM_filename), output_filename(my_output_filename), image(my_image), failed(false), elapsed_time(0.0) {
+  std::ifstream LM_file;
+  int16_t LM_header[9];
+  std::size_t total_events;
+  int i;
+  
+  is_packed = is_packed_LM_file(LM_filename.c_str());
+  if(is_packed) {
+    total_events = std::size_t(read_packed_LM_header(LM_filename.c_str()).num_events);
+  } else {
+    LM_file.open(LM_filename.c_str(), std::ifstream::in | std::ifstream::binary);
+    if(!LM_file) {
+      throw std::runtime_error("Cannot open input LM file!");
+    }
+    LM_file.read(reinterpret_cast<char *>(LM_header), sizeof(LM_header));
+    for(i = 0; i < 9; ++i) {
+      LM_header[i] = __builtin_bswap16(LM_header[i]);
+    }
+    total_events = std::size_t(LM_header[3] * 1000 + LM_header[4]);
+  }
+  last_event = std::min(last_event, total_events);
+  first_event = std::min(my_first_event, last_event);
+  num_events = last_event - first_event;
+  num_chunks = (num_events + PIPELINE_CHUNK_SIZE - 1) / PIPELINE_CHUNK_SIZE;
+}
+
+
+// Runs the reader, num_threads workers (all the cores for 0) and the
+// writer, and returns the number of events estimated. The first error of
+// any stage stops the others and is rethrown.
+std::size_t pipeline_t::run(unsigned int num_threads) {
+  std::chrono::time_point<std::chrono::steady_clock> start;
+  const pipeline_stage_stats_t no_stats = {0, 0.0, 0.0, 0.0, 0.0};
+  std::vector<std::thread> workers;
+  std::thread reader, writer;
+  std::size_t n;
+  
+  if(num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  chunks.resize(std::max(std::size_t(PIPELINE_NUM_CHUNKS), 2 * std::size_t(num_threads) + 2));
+  free_queue.reset(new mpmc_queue_t<chunk_t *>(chunks.size()));
+  input_queue.reset(new mpmc_queue_t<chunk_t *>(chunks.size() + num_threads));
+  output_queue.reset(new mpmc_queue_t<chunk_t *>(chunks.size()));
+  for(n = 0; n < chunks.size(); ++n) {
+    chunks[n].PMT_data.resize(PIPELINE_CHUNK_SIZE);
+    chunks[n].estim_event.resize(PIPELINE_CHUNK_SIZE);
+    free_queue->try_push(& chunks[n]);
+  }
+  reader_stats = writer_stats = no_stats;
+  worker_stats.assign(num_threads, no_stats);
+  start = std::chrono::steady_clock::now();
+  reader = std::thread(& pipeline_t::read_chunks, this);
+  writer = std::thread(& pipeline_t::write_chunks, this);
+  for(n = 0; n < num_threads; ++n) {
+    workers.push_back(std::thread(& pipeline_t::estimate_chunks, this, n));
+  }
+  for(n = 0; n < workers.size(); ++n) {
+    workers[n].join();
+  }
+  reader.join();
+  writer.join();
+  elapsed_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if(error) {
+    std::rethrow_exception(error);
+  }
+  return(num_events);
+}
+
+
+void pipeline_t::print_stats(std::ostream & os) const {
+  pipeline_stage_stats_t workers;
+  double num_workers;
+  std::string bottleneck;
+  std::size_t n;
+  
+  workers = {0, 0.0, 0.0, 0.0, 0.0};
+  for(n = 0; n < worker_stats.size(); ++n) {
+    workers.num_chunks += worker_stats[n].num_chunks;
+    workers.busy_time += worker_stats[n].busy_time;
+    workers.input_stall_time += worker_stats[n].input_stall_time;
+    workers.output_stall_time += worker_stats[n].output_stall_time;
+    workers.input_occupancy += worker_stats[n].input_occupancy;
+  }
+  num_workers = double(worker_stats.size());
+  os << "Pipeline of " << chunks.size() << " chunks of " << PIPELINE_CHUNK_SIZE << " events on " << worker_stats.size() << " workers: " << num_events << " events in " << elapsed_time << " s (" << double(num_events) / elapsed_time << " events/s)." << std::endl;
+  os << "Reader: " << reader_stats.num_chunks << " chunks, busy " << reader_stats.busy_time << " s, waiting for free chunks " << reader_stats.input_stall_time << " s, free list occupancy " << reader_stats.input_occupancy / double(std::max(reader_stats.num_chunks, std::size_t(1))) << "." << std::endl;
+  os << "Workers: " << workers.num_chunks << " chunks, busy " << workers.busy_time / num_workers << " s, waiting for events " << workers.input_stall_time / num_workers << " s per worker, input queue occupancy " << workers.input_occupancy / double(std::max(workers.num_chunks, std::size_t(1))) << "." << std::endl;
+  os << "Writer: " << writer_stats.num_chunks << " chunks, busy " << writer_stats.busy_time << " s, waiting for estimates " << writer_stats.input_stall_time << " s, output queue occupancy " << writer_stats.input_occupancy / double(std::max(writer_stats.num_chunks, std::size_t(1))) << "." << std::endl;
+  if((reader_stats.busy_time >= workers.busy_time / num_workers) && (reader_stats.busy_time >= writer_stats.busy_time)) {
+    bottleneck = "reader";
+  } else if(workers.busy_time / num_workers >= writer_stats.busy_time) {
+    bottleneck = "workers";
+  } else {
+    bottleneck = "writer";
+  }
+  os << "Bottleneck: " << bottleneck << "." << std::endl;
+  return;
+}
+
+
+// Reads the chunks in order from one stream, and then sends each worker a
+// null chunk to stop it. The header and the block offsets of a packed file
+// are read once, and each of its blocks is decoded once into block_values,
+// from which the chunks it spans are filled.
+void pipeline_t::read_chunks() {
+  std::chrono::time_point<std::chrono::steady_clock> start;
+  std::vector<int16_t> LM_values, block_values;
+  std::size_t block_index, block_first;
+  packed_lm_header_t packed_header;
+  std::vector<uint64_t> offsets;
+  std::vector<uint8_t> packed;
+  packed_lm_block_t block;
+  std::ifstream LM_file;
+  std::size_t chunk_first_event, chunk_end;
+  std::size_t event_index, num_copied;
+  chunk_t *chunk;
+  uint64_t seq;
+  std::size_t n;
+  
+  std::memset(& packed_header, 0, sizeof(packed_header));
+  block_index = block_first = 0;
+  block.num_events = 0;
+  try {
+    if(is_packed) {
+      packed_header = read_packed_LM_header(LM_filename.c_str());
+      if(packed_header.num_pmts != NUM_PMTS) {
+        throw std::runtime_error("The packed LM file has " + std::to_string(packed_header.num_pmts) + " PMTs instead of " + std::to_string(NUM_PMTS) + "!");
+      }
+      offsets = read_packed_LM_offsets(LM_filename.c_str());
+      block_index = first_event / packed_header.block_size;
+      block_first = block_index * packed_header.block_size;
+    }
+    LM_file.open(LM_filename.c_str(), std::ifstream::in | std::ifstream::binary);
+    if(!LM_file) {
+      throw std::runtime_error("Cannot open input LM file!");
+    }
+    if(!is_packed) {
+      LM_file.seekg(std::streamoff((9 + first_event * NUM_PMTS) * sizeof(int16_t)));
+    }
+    for(seq = 0; seq < num_chunks; ++seq) {
+      if(!pop(*free_queue, chunk, reader_stats)) {
+        break;
+      }
+      start = std::chrono::steady_clock::now();
+      chunk_first_event = first_event + std::size_t(seq) * PIPELINE_CHUNK_SIZE;
+      chunk->seq = seq;
+      chunk->num_events = std::min(std::size_t(PIPELINE_CHUNK_SIZE), first_event + num_events - chunk_first_event);
+      if(is_packed) {
+        chunk_end = chunk_first_event + chunk->num_events;
+        LM_values.resize(chunk->num_events * NUM_PMTS);
+        for(event_index = chunk_first_event; event_index < chunk_end; event_index += num_copied) {
+          while(event_index >= (block_first + block.num_events)) {
+            if(block_index >= offsets.size()) {
+              throw std::runtime_error("Truncated input LM file!");
+            }
+            block_first = block_index * packed_header.block_size;
+            read_packed_LM_block(LM_file, offsets[block_index++], NUM_PMTS, block, packed);
+            block_values.resize(std::size_t(block.num_events) * NUM_PMTS);
+            get_cpu_kernels().unpack_bits(block_values.data(), packed.data(), block_values.size(), int(block.bits));
+          }
+          num_copied = std::min(block_first + block.num_events, chunk_end) - event_index;
+          std::copy(block_values.begin() + std::ptrdiff_t((event_index - block_first) * NUM_PMTS), block_values.begin() + std::ptrdiff_t((event_index - block_first + num_copied) * NUM_PMTS), LM_values.begin() + std::ptrdiff_t((event_index - chunk_first_event) * NUM_PMTS));
+        }
+      } else {
+        LM_values.resize(chunk->num_events * NUM_PMTS);
+        LM_file.read(reinterpret_cast<char *>(LM_values.data()), std::streamsize(LM_values.size() * sizeof(LM_values[0])));
+        if(!LM_file) {
+          LM_values.clear();
+        }
+        get_cpu_kernels().bswap_clamp(LM_values.data(), LM_values.data(), LM_values.size());
+      }
+      if(LM_values.size() != chunk->num_events * NUM_PMTS) {
+        throw std::runtime_error("Truncated input LM file!");
+      }
+      for(event_index = 0; event_index < chunk->num_events; ++event_index) {
+        std::memcpy(chunk->PMT_data[event_index].val, & LM_values[event_index * NUM_PMTS], NUM_PMTS * sizeof(LM_values[0]));
+      }
+      reader_stats.busy_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      ++reader_stats.num_chunks;
+      push(*input_queue, chunk, reader_stats.output_stall_time);
+    }
+  } catch(...) {
+    set_error();
+  }
+  for(n = 0; n < worker_stats.size(); ++n) {
+    push(*input_queue, nullptr, reader_stats.output_stall_time);
+  }
+  return;
+}
+
+
+void pipeline_t::estimate_chunks(std::size_t worker_index) {
+  std::chrono::time_point<std::chrono::steady_clock> start;
+  pipeline_stage_stats_t & stats = worker_stats[worker_index];
+  chunk_t *chunk;
+  
+  while(pop(*input_queue, chunk, stats) && (chunk != nullptr)) {
+    start = std::chrono::steady_clock::now();
+    estimator.estimate_batch(chunk->PMT_data.data(), chunk->estim_event.data(), chunk->num_events);
+    stats.busy_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ++stats.num_chunks;
+    if(!push(*output_queue, chunk, stats.output_stall_time)) {
+      break;
+    }
+  }
+  return;
+}
+
+
+// Chunks that arrive ahead of their turn wait in pending, at the slot of
+// their sequence number; at most one per slot can be in flight.
+void pipeline_t::write_chunks() {
+  std::chrono::time_point<std::chrono::steady_clock> start;
+  std::vector<chunk_t *> pending(chunks.size(), nullptr);
+  std::size_t event_index;
+  std::ofstream ofs;
+  uint32_t num_records;
+  chunk_t *chunk;
+  uint64_t next_seq;
+  uint32_t valid;
+  
+  try {
+    if(!output_filename.empty()) {
+      ofs.open(output_filename.c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+      if(!ofs) {
+        throw std::runtime_error("Cannot create ML estimates file!");
+      }
+      num_records = uint32_t(num_events);
+      ofs.write(reinterpret_cast<const char *>(& num_records), sizeof(num_records));
+    }
+    next_seq = 0;
+    while(next_seq < num_chunks) {
+      if(!pop(*output_queue, chunk, writer_stats)) {
+        return;
+      }
+      pending[chunk->seq % pending.size()] = chunk;
+      while((next_seq < num_chunks) && (pending[next_seq % pending.size()] != nullptr)) {
+        chunk = pending[next_seq % pending.size()];
+        pending[next_seq % pending.size()] = nullptr;
+        start = std::chrono::steady_clock::now();
+        for(event_index = 0; event_index < chunk->num_events; ++event_index) {
+          const estim_event_t & estim_event = chunk->estim_event[event_index];
+          if(ofs.is_open()) {
+            valid = estim_event.valid ? 1 : 0;
+            ofs.write(reinterpret_cast<const char *>(& valid), sizeof(valid));
+            ofs.write(reinterpret_cast<const char *>(& estim_event.x_pos), sizeof(estim_event.x_pos));
+            ofs.write(reinterpret_cast<const char *>(& estim_event.y_pos), sizeof(estim_event.y_pos));
+            ofs.write(reinterpret_cast<const char *>(& estim_event.log_like), sizeof(estim_event.log_like));
+          }
+          if(image != nullptr) {
+            image->add(estim_event);
+          }
+        }
+        writer_stats.busy_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ++writer_stats.num_chunks;
+        ++next_seq;
+        push(*free_queue, chunk, writer_stats.output_stall_time);
+      }
+    }
+    if(ofs.is_open()) {
+      ofs.close();
+      if(!ofs) {
+        throw std::runtime_error("Cannot write ML estimates file!");
+      }
+    }
+  } catch(...) {
+    set_error();
+  }
+  return;
+}
+
+
+// Waits for room in the queue, unless another stage has failed.
+bool pipeline_t::push(mpmc_queue_t<chunk_t *> & queue, chunk_t *chunk, double & stall_time) {
+  std::chrono::time_point<std::chrono::steady_clock> start;
+  unsigned int num_tries;
+  
+  if(queue.try_push(chunk)) {
+    return(true);
+  }
+  start = std::chrono::steady_clock::now();
+  num_tries = 0;
+  while(!queue.try_push(chunk)) {
+    if(failed.load(std::memory_order_relaxed)) {
+      return(false);
+    }
+    if(++num_tries < PIPELINE_SPIN_COUNT) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(PIPELINE_SLEEP_USEC));
+    }
+  }
+  stall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return(true);
+}
+
+
+// Waits for a chunk, unless another stage has failed, and samples the
+// occupancy of the queue as found.
+bool pipeline_t::pop(mpmc_queue_t<chunk_t *> & queue, chunk_t *& chunk, pipeline_stage_stats_t & stats) {
+  std::chrono::time_point<std::chrono::steady_clock> start;
+  unsigned int num_tries;
+  
+  stats.input_occupancy += double(queue.get_size());
+  if(queue.try_pop(chunk)) {
+    return(true);
+  }
+  start = std::chrono::steady_clock::now();
+  num_tries = 0;
+  while(!queue.try_pop(chunk)) {
+    if(failed.load(std::memory_order_relaxed)) {
+      return(false);
+    }
+    if(++num_tries < PIPELINE_SPIN_COUNT) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(PIPELINE_SLEEP_USEC));
+    }
+  }
+  stats.input_stall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return(true);
+}
+
+
+// Keeps the first exception and makes every stage give up its waits.
+void pipeline_t::set_error() {
+  std::lock_guard<std::mutex> guard(error_mutex);
+  if(!error) {
+    error = std::current_exception();
+  }
+  failed.store(true, std::memory_order_relaxed);
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _PIPELINE_H
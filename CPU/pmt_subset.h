@@ -0,0 +1,415 @@
+#ifndef _PMT_SUBSET_H
+#define _PMT_SUBSET_H
+
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cmath>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "estim_core.hpp"
+#include "camera.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Tables of the nearest-PMT approximation of the log-likelihood. The field
+// of view is split into PMT_SUBSET_GRID_SIZE x PMT_SUBSET_GRID_SIZE tiles.
+// In every tile, the PMTs whose MDRF exceeds mdrf_floor somewhere in the
+// tile are significant and always evaluated; the MDRF of any other PMT is
+// replaced by its mean over the tile (mean_mdrf), and the sum of those
+// means is kept as an aggregate (rest_mdrf). Over the samples of the tiles
+// where it is replaced, the log of the MDRF of a PMT is within log_err of
+// the log of its mean, and the replaced MDRFs of a tile add up to within
+// max_mdrf_err of the aggregate.
+// The floor is the largest one for which max_mdrf_err stays below half of
+// the error bound; the other half is left for the data of the PMTs that
+// are not evaluated (see subset_engine_t).
+struct pmt_subset_t {
+  int num_pmts;
+  float error_bound;
+  float mdrf_floor;
+  float max_mdrf_err;
+  std::vector<float> log_err;
+  std::vector<uint64_t> sig_mask;
+  std::vector<float> rest_mdrf;
+  std::vector<float> mean_mdrf;
+  std::vector<float> log_mean_mdrf;
+  std::vector<float> gain;
+};
+
+
+// Engine of estim_core.hpp for one event. The strong PMTs of the event are
+// always evaluated; the others are added with the tables of pmt_subset_t,
+// so that the cost of a grid point depends on the number of significant
+// PMTs around it and not on the size of the array. A PMT left out moves
+// the log-likelihood by at most its signal times its log_err, and the
+// strong PMTs are those with the largest such errors, as few as possible
+// under the condition that the log-likelihood stays within error_bound of
+// the exact one. eval_mdrf() records the tile used by the get_log_like()
+// that follows.
+class subset_engine_t : public spline_arith_t<float> {
+  public:
+    enum {
+      max_num_pmts = MAX_NUM_PMTS
+    };
+    subset_engine_t(const camera_calibr_t & my_camera_calibr, const pmt_subset_t & my_pmt_subset, const int16_t *values);
+    int get_num_pmts() const;
+    float get_camera_size() const;
+    void get_data(value_t data[MAX_NUM_PMTS], const int16_t *values) const;
+    void eval_mdrf(value_t output[MAX_NUM_PMTS], const coord_t & x, const coord_t & y) const;
+    value_t get_log_like(const value_t data[MAX_NUM_PMTS], const value_t mdrf[MAX_NUM_PMTS]) const;
+    value_t get_thresh(const coord_t & x, const coord_t & y) const;
+    int get_num_strong() const;
+    
+  private:
+    const camera_calibr_t & camera_calibr;
+    const pmt_subset_t & pmt_subset;
+    uint64_t strong_mask;
+    uint64_t weak_mask;
+    mutable int tile;
+};
+
+
+// The subset only pays when it leaves out enough PMTs to make up for its
+// generic splines, so the first PMT_SUBSET_PROBE_EVENTS events are timed
+// with it and with the engine of get_camera_model(), and all the events
+// are estimated with the subset only if it is the faster of the two.
+class subset_camera_model_t : public camera_model_t {
+  public:
+    subset_camera_model_t(const camera_calibr_t & my_camera_calibr, float error_bound);
+    std::string get_variant() const;
+    std::vector<estim_event_t, aligned_allocator<estim_event_t>> estimate(const std::vector<int16_t> & LM_values, bool verbose) const;
+    
+  private:
+    const camera_calibr_t & camera_calibr;
+    pmt_subset_t pmt_subset;
+    std::unique_ptr<camera_model_t> fallback_model;
+    void estimate_subset(std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const std::vector<int16_t> & LM_values, unsigned int first_event, unsigned int last_event, double & num_strong) const;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+pmt_subset_t get_pmt_subset(const camera_calibr_t & camera_calibr, float error_bound);
+void set_pmt_subset_floor(pmt_subset_t & pmt_subset, const std::vector<float> & samples, float mdrf_floor);
+inline int get_pmt_subset_tile(float x, float y);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+subset_engine_t::subset_engine_t(const camera_calibr_t & my_camera_calibr, const pmt_subset_t & my_pmt_subset, const int16_t *values) : camera_calibr(my_camera_calibr), pmt_subset(my_pmt_subset), strong_mask(0), weak_mask(0), tile(0) {
+  float data_err[MAX_NUM_PMTS];
+  float data[MAX_NUM_PMTS];
+  int order[MAX_NUM_PMTS];
+  float rest_err;
+  int pmt, i;
+  
+  get_data(data, values);
+  rest_err = float(0);
+  for(pmt = 0; pmt < pmt_subset.num_pmts; ++pmt) {
+    order[pmt] = pmt;
+    data_err[pmt] = std::fabs(data[pmt]) * pmt_subset.log_err[pmt];
+    rest_err += data_err[pmt];
+  }
+  std::sort(order, order + pmt_subset.num_pmts, [& data_err](int a, int b) {return(data_err[a] > data_err[b]);});
+  // Largest errors first, until the data left out cannot move the
+  // log-likelihood by more than the half of the bound it is given.
+  for(i = 0; (i < pmt_subset.num_pmts) && (rest_err > (pmt_subset.error_bound / 2.00f)); ++i) {
+    strong_mask |= uint64_t(1) << order[i];
+    rest_err -= data_err[order[i]];
+  }
+  for(; i < pmt_subset.num_pmts; ++i) {
+    if(data[order[i]] != float(0)) {
+      weak_mask |= uint64_t(1) << order[i];
+    }
+  }
+}
+
+
+int subset_engine_t::get_num_pmts() const {
+  return(pmt_subset.num_pmts);
+}
+
+
+float subset_engine_t::get_camera_size() const {
+  return(float(camera_calibr.camera_desc.num_sampl) * camera_calibr.camera_desc.sampl_pitch);
+}
+
+
+void subset_engine_t::get_data(value_t data[MAX_NUM_PMTS], const int16_t *values) const {
+  int pmt;
+  
+  for(pmt = 0; pmt < pmt_subset.num_pmts; ++pmt) {
+    data[pmt] = values[pmt] / pmt_subset.gain[pmt];
+  }
+  return;
+}
+
+
+// Only the PMTs that are significant in the tile or strong in the event
+// are evaluated; the other entries of output are left untouched.
+void subset_engine_t::eval_mdrf(value_t output[MAX_NUM_PMTS], const coord_t & x, const coord_t & y) const {
+  uint64_t mask;
+  int pmt;
+  
+  tile = get_pmt_subset_tile(x, y);
+  mask = pmt_subset.sig_mask[tile] | strong_mask;
+  while(mask != 0) {
+    pmt = __builtin_ctzll(mask);
+    output[pmt] = camera_calibr.mdrf[pmt](x, y);
+    mask &= mask - 1;
+  }
+  return;
+}
+
+
+float subset_engine_t::get_log_like(const value_t data[MAX_NUM_PMTS], const value_t mdrf[MAX_NUM_PMTS]) const {
+  const float *log_mean_mdrf;
+  const float *mean_mdrf;
+  uint64_t mask;
+  float log_like;
+  int pmt;
+  
+  mean_mdrf = & pmt_subset.mean_mdrf[std::size_t(tile) * std::size_t(pmt_subset.num_pmts)];
+  log_mean_mdrf = & pmt_subset.log_mean_mdrf[std::size_t(tile) * std::size_t(pmt_subset.num_pmts)];
+  log_like = -pmt_subset.rest_mdrf[tile];
+  mask = pmt_subset.sig_mask[tile] | strong_mask;
+  while(mask != 0) {
+    pmt = __builtin_ctzll(mask);
+    if((data[pmt] != float(0)) || (mdrf[pmt] != float(0))) {
+      log_like += data[pmt] * std::log(mdrf[pmt]) - mdrf[pmt];
+    }
+    mask &= mask - 1;
+  }
+  // The strong PMTs that are not significant in the tile are in the
+  // aggregate, with their mean MDRF.
+  mask = strong_mask & ~pmt_subset.sig_mask[tile];
+  while(mask != 0) {
+    pmt = __builtin_ctzll(mask);
+    log_like += mean_mdrf[pmt];
+    mask &= mask - 1;
+  }
+  mask = weak_mask & ~pmt_subset.sig_mask[tile];
+  while(mask != 0) {
+    pmt = __builtin_ctzll(mask);
+    log_like += data[pmt] * log_mean_mdrf[pmt];
+    mask &= mask - 1;
+  }
+  return(log_like);
+}
+
+
+float subset_engine_t::get_thresh(const coord_t & x, const coord_t & y) const {
+  return(camera_calibr.thresh(x, y));
+}
+
+
+int subset_engine_t::get_num_strong() const {
+  return(__builtin_popcountll(strong_mask));
+}
+
+
+subset_camera_model_t::subset_camera_model_t(const camera_calibr_t & my_camera_calibr, float error_bound) : camera_calibr(my_camera_calibr), pmt_subset(get_pmt_subset(my_camera_calibr, error_bound)), fallback_model(get_camera_model(my_camera_calibr)) {
+}
+
+
+std::string subset_camera_model_t::get_variant() const {
+  return("PMT subset (bound " + std::to_string(pmt_subset.error_bound) + ", MDRF floor " + std::to_string(pmt_subset.mdrf_floor) + ") or " + fallback_model->get_variant());
+}
+
+
+std::vector<estim_event_t, aligned_allocator<estim_event_t>> subset_camera_model_t::estimate(const std::vector<int16_t> & LM_values, bool verbose) const {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event(LM_values.size() / std::size_t(pmt_subset.num_pmts));
+  std::chrono::time_point<std::chrono::steady_clock> start, probe_end, end;
+  std::chrono::duration<double> subset_time, fallback_time;
+  std::vector<int16_t> probe_values;
+  unsigned int num_events, num_probe;
+  double num_strong, num_sig;
+  std::size_t tile;
+  
+  num_events = (unsigned int) estim_event.size();
+  num_probe = std::min(num_events, (unsigned int) PMT_SUBSET_PROBE_EVENTS);
+  probe_values.assign(LM_values.begin(), LM_values.begin() + std::ptrdiff_t(std::size_t(num_probe) * std::size_t(pmt_subset.num_pmts)));
+  start = std::chrono::steady_clock::now();
+  fallback_model->estimate(probe_values, false);
+  end = std::chrono::steady_clock::now();
+  fallback_time = end - start;
+  num_strong = 0.0;
+  start = std::chrono::steady_clock::now();
+  estimate_subset(estim_event, LM_values, 0, num_probe, num_strong);
+  probe_end = std::chrono::steady_clock::now();
+  subset_time = probe_end - start;
+  if((num_probe > 0) && (fallback_time <= subset_time)) {
+    if(verbose) {
+      std::cout << "PMT subset slower than the " << fallback_model->get_variant() << " engine on " << num_probe << " events (" << subset_time.count() << " s against " << fallback_time.count() << " s), falling back to it." << std::endl;
+    }
+    return(fallback_model->estimate(LM_values, verbose));
+  }
+  if(verbose) {
+    std::cout << "Number of events: " << num_events << "." << std::endl;
+  }
+  estimate_subset(estim_event, LM_values, num_probe, num_events, num_strong);
+  end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> diff = end - start;
+  if(verbose) {
+    std::cout << "Elapsed time: " << diff.count() << " s (" << double(num_events) / diff.count() << " events/s)." << std::endl;
+    if(num_probe > 0) {
+      std::cout << "Speedup over the " << fallback_model->get_variant() << " engine on " << num_probe << " events: " << fallback_time.count() / subset_time.count() << "." << std::endl;
+    }
+    num_sig = 0.0;
+    for(tile = 0; tile < pmt_subset.sig_mask.size(); ++tile) {
+      num_sig += double(__builtin_popcountll(pmt_subset.sig_mask[tile]));
+    }
+    std::cout << "PMTs evaluated: " << num_sig / double(pmt_subset.sig_mask.size()) << " significant per tile, " << ((num_events > 0) ? (num_strong / double(num_events)) : 0.0) << " strong per event on average." << std::endl;
+  }
+  return(estim_event);
+}
+
+
+void subset_camera_model_t::estimate_subset(std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const std::vector<int16_t> & LM_values, unsigned int first_event, unsigned int last_event, double & num_strong) const {
+  unsigned int event_index;
+  const int16_t *values;
+  
+  for(event_index = first_event; event_index < last_event; ++event_index) {
+    values = & LM_values[std::size_t(event_index) * std::size_t(pmt_subset.num_pmts)];
+    subset_engine_t engine(camera_calibr, pmt_subset, values);
+    estimate_core<subset_engine_t, SIZE_CONTR_GRID>(estim_event[event_index], values, NUM_CONTR_GRID_ITER, CONTR_FACTOR, engine);
+    num_strong += double(engine.get_num_strong());
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Samples the MDRFs at the centers of PMT_SUBSET_TILE_SAMPL x
+// PMT_SUBSET_TILE_SAMPL points per tile, then halves the floor from the
+// largest sample until the aggregate of every tile is accurate enough.
+pmt_subset_t get_pmt_subset(const camera_calibr_t & camera_calibr, float error_bound) {
+  const int num_sampl = PMT_SUBSET_GRID_SIZE * PMT_SUBSET_TILE_SAMPL;
+  std::vector<float> samples;
+  pmt_subset_t pmt_subset;
+  std::size_t index;
+  int i_x, i_y, pmt;
+  float max_mdrf;
+  float x, y;
+  int iter;
+  
+  if(camera_calibr.camera_desc.num_pmts > 64) {
+    throw std::runtime_error("The PMT subset supports up to 64 PMTs!");
+  }
+  if(!(error_bound > float(0))) {
+    throw std::runtime_error("The error bound of the PMT subset must be positive!");
+  }
+  pmt_subset.num_pmts = camera_calibr.camera_desc.num_pmts;
+  pmt_subset.error_bound = error_bound;
+  pmt_subset.gain = camera_calibr.gain;
+  samples.resize(std::size_t(pmt_subset.num_pmts) * std::size_t(num_sampl * num_sampl));
+  max_mdrf = float(0);
+  for(pmt = 0; pmt < pmt_subset.num_pmts; ++pmt) {
+    for(i_y = 0; i_y < num_sampl; ++i_y) {
+      y = (float(i_y) + 0.50f) / float(num_sampl);
+      for(i_x = 0; i_x < num_sampl; ++i_x) {
+        x = (float(i_x) + 0.50f) / float(num_sampl);
+        index = std::size_t(pmt * num_sampl + i_y) * std::size_t(num_sampl) + std::size_t(i_x);
+        samples[index] = camera_calibr.mdrf[pmt](x, y);
+        max_mdrf = std::max(max_mdrf, samples[index]);
+      }
+    }
+  }
+  set_pmt_subset_floor(pmt_subset, samples, max_mdrf);
+  for(iter = 0; (iter < 32) && (pmt_subset.max_mdrf_err > (error_bound / 2.00f)); ++iter) {
+    set_pmt_subset_floor(pmt_subset, samples, pmt_subset.mdrf_floor / 2.00f);
+  }
+  if(pmt_subset.max_mdrf_err > (error_bound / 2.00f)) {
+    set_pmt_subset_floor(pmt_subset, samples, -HUGE_VALF);
+  }
+  return(pmt_subset);
+}
+
+
+void set_pmt_subset_floor(pmt_subset_t & pmt_subset, const std::vector<float> & samples, float mdrf_floor) {
+  const int num_sampl = PMT_SUBSET_GRID_SIZE * PMT_SUBSET_TILE_SAMPL;
+  const int num_tiles = PMT_SUBSET_GRID_SIZE * PMT_SUBSET_GRID_SIZE;
+  float max_sample, mean, log_err, mdrf_err;
+  float tile_mdrf_err;
+  int tile_x, tile_y, tile;
+  std::size_t index;
+  int i_x, i_y, pmt;
+  float sample;
+  
+  pmt_subset.mdrf_floor = mdrf_floor;
+  pmt_subset.max_mdrf_err = float(0);
+  pmt_subset.log_err.assign(std::size_t(pmt_subset.num_pmts), float(0));
+  pmt_subset.sig_mask.assign(num_tiles, 0);
+  pmt_subset.rest_mdrf.assign(num_tiles, float(0));
+  pmt_subset.mean_mdrf.assign(std::size_t(num_tiles) * std::size_t(pmt_subset.num_pmts), float(0));
+  pmt_subset.log_mean_mdrf.assign(std::size_t(num_tiles) * std::size_t(pmt_subset.num_pmts), float(0));
+  for(tile_y = 0; tile_y < PMT_SUBSET_GRID_SIZE; ++tile_y) {
+    for(tile_x = 0; tile_x < PMT_SUBSET_GRID_SIZE; ++tile_x) {
+      tile = MAP_2D(PMT_SUBSET_GRID_SIZE, PMT_SUBSET_GRID_SIZE, tile_x, tile_y);
+      tile_mdrf_err = float(0);
+      for(pmt = 0; pmt < pmt_subset.num_pmts; ++pmt) {
+        max_sample = -HUGE_VALF;
+        mean = float(0);
+        for(i_y = tile_y * PMT_SUBSET_TILE_SAMPL; i_y < ((tile_y + 1) * PMT_SUBSET_TILE_SAMPL); ++i_y) {
+          for(i_x = tile_x * PMT_SUBSET_TILE_SAMPL; i_x < ((tile_x + 1) * PMT_SUBSET_TILE_SAMPL); ++i_x) {
+            sample = samples[std::size_t(pmt * num_sampl + i_y) * std::size_t(num_sampl) + std::size_t(i_x)];
+            max_sample = std::max(max_sample, sample);
+            mean += sample;
+          }
+        }
+        // The replaced MDRFs are kept strictly positive, so that their
+        // log is defined.
+        mean = std::max(mean / float(PMT_SUBSET_TILE_SAMPL * PMT_SUBSET_TILE_SAMPL), PMT_SUBSET_MIN_MDRF);
+        if(max_sample >= mdrf_floor) {
+          pmt_subset.sig_mask[tile] |= uint64_t(1) << pmt;
+          continue;
+        }
+        index = std::size_t(tile) * std::size_t(pmt_subset.num_pmts) + std::size_t(pmt);
+        pmt_subset.mean_mdrf[index] = mean;
+        pmt_subset.log_mean_mdrf[index] = std::log(mean);
+        pmt_subset.rest_mdrf[tile] += mean;
+        log_err = float(0);
+        mdrf_err = float(0);
+        for(i_y = tile_y * PMT_SUBSET_TILE_SAMPL; i_y < ((tile_y + 1) * PMT_SUBSET_TILE_SAMPL); ++i_y) {
+          for(i_x = tile_x * PMT_SUBSET_TILE_SAMPL; i_x < ((tile_x + 1) * PMT_SUBSET_TILE_SAMPL); ++i_x) {
+            sample = std::max(samples[std::size_t(pmt * num_sampl + i_y) * std::size_t(num_sampl) + std::size_t(i_x)], PMT_SUBSET_MIN_MDRF);
+            log_err = std::max(log_err, std::fabs(std::log(sample) - std::log(mean)));
+            mdrf_err = std::max(mdrf_err, std::fabs(sample - mean));
+          }
+        }
+        pmt_subset.log_err[pmt] = std::max(pmt_subset.log_err[pmt], log_err);
+        tile_mdrf_err += mdrf_err;
+      }
+      pmt_subset.max_mdrf_err = std::max(pmt_subset.max_mdrf_err, tile_mdrf_err);
+    }
+  }
+  return;
+}
+
+
+inline int get_pmt_subset_tile(float x, float y) {
+  int tile_x, tile_y;
+  
+  tile_x = std::min(PMT_SUBSET_GRID_SIZE - 1, std::max(0, int(x * float(PMT_SUBSET_GRID_SIZE))));
+  tile_y = std::min(PMT_SUBSET_GRID_SIZE - 1, std::max(0, int(y * float(PMT_SUBSET_GRID_SIZE))));
+  return(MAP_2D(PMT_SUBSET_GRID_SIZE, PMT_SUBSET_GRID_SIZE, tile_x, tile_y));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _PMT_SUBSET_H
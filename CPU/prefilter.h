@@ -0,0 +1,200 @@
+#ifndef _PREFILTER_H
+#define _PREFILTER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <array>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Energy window and region of interest applied before the ML search. An
+// event is first located by its Anger centroid, computed with the centers
+// of mass of the MDRFs as PMT positions, and its energy is the summed
+// gain-corrected signal. Both the light collected and the compression of
+// the centroid vary over the field of view, so the calibration points are
+// binned by the centroid of their expected signal: each bin holds their
+// mean summed MDRF (the local photopeak) and their mean position, which
+// linearizes the centroid for the ROI test.
+struct prefilter_t {
+  float photopeak[PREFILTER_GRID_SIZE][PREFILTER_GRID_SIZE];
+  float lin_x[PREFILTER_GRID_SIZE][PREFILTER_GRID_SIZE];
+  float lin_y[PREFILTER_GRID_SIZE][PREFILTER_GRID_SIZE];
+  float inv_gain[NUM_PMTS];
+  float pmt_x[NUM_PMTS];
+  float pmt_y[NUM_PMTS];
+  bool use_energy_window;
+  float energy_min, energy_max;
+  bool use_roi;
+  float roi_min_x, roi_max_x;
+  float roi_min_y, roi_max_y;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+prefilter_t get_prefilter(const calibr_funct_t & calibr_funct, const estim_options_t & estim_options) {
+  std::vector<std::array<float, NUM_PMTS + 1>> sum_values(NUM_SAMPL * NUM_SAMPL);
+  std::vector<std::array<float, 2>> pos_values(NUM_SAMPL * NUM_SAMPL);
+  int count[PREFILTER_GRID_SIZE][PREFILTER_GRID_SIZE];
+  std::vector<float> all_sums;
+  float weight[NUM_PMTS];
+  float sum, cx, cy;
+  prefilter_t prefilter;
+  int nx, ny, n, pmt;
+  int bin_x, bin_y;
+  
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    prefilter.inv_gain[pmt] = float(1) / calibr_funct.gain[pmt];
+    prefilter.pmt_x[pmt] = prefilter.pmt_y[pmt] = weight[pmt] = float(0);
+  }
+  for(nx = 0; nx < NUM_SAMPL; ++nx) {
+    for(ny = 0; ny < NUM_SAMPL; ++ny) {
+      n = MAP_2D(NUM_SAMPL, NUM_SAMPL, nx, ny);
+      pos_values[n][0] = (float(nx) + 0.50f) / float(NUM_SAMPL);
+      pos_values[n][1] = (float(ny) + 0.50f) / float(NUM_SAMPL);
+      sum = float(0);
+      for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+        sum_values[n][pmt] = std::max(float(0), calibr_funct.mdrf[pmt](pos_values[n][0], pos_values[n][1]));
+        prefilter.pmt_x[pmt] += sum_values[n][pmt] * pos_values[n][0];
+        prefilter.pmt_y[pmt] += sum_values[n][pmt] * pos_values[n][1];
+        weight[pmt] += sum_values[n][pmt];
+        sum += sum_values[n][pmt];
+      }
+      sum_values[n][NUM_PMTS] = sum;
+      all_sums.push_back(sum);
+    }
+  }
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    if(weight[pmt] > float(0)) {
+      prefilter.pmt_x[pmt] /= weight[pmt];
+      prefilter.pmt_y[pmt] /= weight[pmt];
+    } else {
+      prefilter.pmt_x[pmt] = prefilter.pmt_y[pmt] = float(1) / float(2);
+    }
+  }
+  for(bin_x = 0; bin_x < PREFILTER_GRID_SIZE; ++bin_x) {
+    for(bin_y = 0; bin_y < PREFILTER_GRID_SIZE; ++bin_y) {
+      prefilter.photopeak[bin_x][bin_y] = float(0);
+      prefilter.lin_x[bin_x][bin_y] = float(0);
+      prefilter.lin_y[bin_x][bin_y] = float(0);
+      count[bin_x][bin_y] = 0;
+    }
+  }
+  for(n = 0; n < (NUM_SAMPL * NUM_SAMPL); ++n) {
+    sum = sum_values[n][NUM_PMTS];
+    if(sum > float(0)) {
+      cx = cy = float(0);
+      for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+        cx += sum_values[n][pmt] * prefilter.pmt_x[pmt];
+        cy += sum_values[n][pmt] * prefilter.pmt_y[pmt];
+      }
+      bin_x = std::min(PREFILTER_GRID_SIZE - 1, std::max(0, int(cx / sum * float(PREFILTER_GRID_SIZE))));
+      bin_y = std::min(PREFILTER_GRID_SIZE - 1, std::max(0, int(cy / sum * float(PREFILTER_GRID_SIZE))));
+      prefilter.photopeak[bin_x][bin_y] += sum;
+      prefilter.lin_x[bin_x][bin_y] += pos_values[n][0];
+      prefilter.lin_y[bin_x][bin_y] += pos_values[n][1];
+      ++count[bin_x][bin_y];
+    }
+  }
+  std::nth_element(all_sums.begin(), all_sums.begin() + all_sums.size() / 2, all_sums.end());
+  for(bin_x = 0; bin_x < PREFILTER_GRID_SIZE; ++bin_x) {
+    for(bin_y = 0; bin_y < PREFILTER_GRID_SIZE; ++bin_y) {
+      if(count[bin_x][bin_y] > 0) {
+        prefilter.photopeak[bin_x][bin_y] /= float(count[bin_x][bin_y]);
+        prefilter.lin_x[bin_x][bin_y] /= float(count[bin_x][bin_y]);
+        prefilter.lin_y[bin_x][bin_y] /= float(count[bin_x][bin_y]);
+      } else {
+        prefilter.photopeak[bin_x][bin_y] = all_sums[all_sums.size() / 2];
+        prefilter.lin_x[bin_x][bin_y] = (float(bin_x) + 0.50f) / float(PREFILTER_GRID_SIZE);
+        prefilter.lin_y[bin_x][bin_y] = (float(bin_y) + 0.50f) / float(PREFILTER_GRID_SIZE);
+      }
+    }
+  }
+  prefilter.use_energy_window = estim_options.use_energy_window;
+  prefilter.energy_min = estim_options.energy_window_min;
+  prefilter.energy_max = estim_options.energy_window_max;
+  prefilter.use_roi = estim_options.use_roi;
+  prefilter.roi_min_x = (estim_options.roi_min_x - CAMERA_MIN_POS) / (CAMERA_MAX_POS - CAMERA_MIN_POS);
+  prefilter.roi_max_x = (estim_options.roi_max_x - CAMERA_MIN_POS) / (CAMERA_MAX_POS - CAMERA_MIN_POS);
+  prefilter.roi_min_y = (estim_options.roi_min_y - CAMERA_MIN_POS) / (CAMERA_MAX_POS - CAMERA_MIN_POS);
+  prefilter.roi_max_y = (estim_options.roi_max_y - CAMERA_MIN_POS) / (CAMERA_MAX_POS - CAMERA_MIN_POS);
+  return(prefilter);
+}
+
+
+// Computes the energy of an event, in units of the local photopeak, and
+// its linearized centroid. The inner loop has a fixed trip count over the
+// PMTs and no branches, so that the compiler can vectorize it.
+float get_event_energy(float & centroid_x, float & centroid_y, const PMT_data_t & PMT_data, const prefilter_t & prefilter) {
+  float energy, sum_x, sum_y, value;
+  int bin_x, bin_y;
+  int pmt;
+  
+  energy = sum_x = sum_y = float(0);
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    value = float(PMT_data.val[pmt]) * prefilter.inv_gain[pmt];
+    energy += value;
+    sum_x += value * prefilter.pmt_x[pmt];
+    sum_y += value * prefilter.pmt_y[pmt];
+  }
+  energy = std::max(energy, float(1e-12f));
+  bin_x = std::min(PREFILTER_GRID_SIZE - 1, std::max(0, int(sum_x / energy * float(PREFILTER_GRID_SIZE))));
+  bin_y = std::min(PREFILTER_GRID_SIZE - 1, std::max(0, int(sum_y / energy * float(PREFILTER_GRID_SIZE))));
+  centroid_x = prefilter.lin_x[bin_x][bin_y];
+  centroid_y = prefilter.lin_y[bin_x][bin_y];
+  return(energy / prefilter.photopeak[bin_x][bin_y]);
+}
+
+
+// Tests the energy and the linearized centroid of an event against the
+// energy window and the ROI.
+bool prefilter_event(float & centroid_x, float & centroid_y, const PMT_data_t & PMT_data, const prefilter_t & prefilter) {
+  float energy;
+  bool inside;
+  
+  energy = get_event_energy(centroid_x, centroid_y, PMT_data, prefilter);
+  inside = true;
+  if(prefilter.use_energy_window) {
+    inside = inside && (energy >= prefilter.energy_min) && (energy <= prefilter.energy_max);
+  }
+  if(prefilter.use_roi) {
+    inside = inside && (centroid_x >= prefilter.roi_min_x) && (centroid_x <= prefilter.roi_max_x);
+    inside = inside && (centroid_y >= prefilter.roi_min_y) && (centroid_y <= prefilter.roi_max_y);
+  }
+  return(inside);
+}
+
+
+// Runs prefilter_event() on every event and clears accept[n] for the
+// events outside the energy window or the ROI.
+unsigned int prefilter_events(std::vector<uint8_t> & accept, std::vector<float> & centroid_x, std::vector<float> & centroid_y, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, const prefilter_t & prefilter) {
+  unsigned int num_rejected;
+  unsigned int event_index;
+  unsigned int num_events;
+  bool inside;
+  
+  num_events = (unsigned int) PMT_data.size();
+  accept.resize(num_events);
+  centroid_x.resize(num_events);
+  centroid_y.resize(num_events);
+  num_rejected = 0;
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    inside = prefilter_event(centroid_x[event_index], centroid_y[event_index], PMT_data[event_index], prefilter);
+    accept[event_index] = inside ? 1 : 0;
+    num_rejected += inside ? 0 : 1;
+  }
+  return(num_rejected);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _PREFILTER_H
@@ -0,0 +1,193 @@
+#ifndef _RESULT_CACHE_H
+#define _RESULT_CACHE_H
+
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cmath>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "cpu_dispatch.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Persistent cache of the estimates of a list-mode file. The validity of
+// an estimate only depends on the threshold spline through
+// log_like > thresh(x, y), so the cache is keyed by a hash of everything
+// else the positions and log-likelihoods depend on: the events, the MDRFs
+// and gains, the estimation settings and the CPU kernels. A rerun with only
+// a new threshold file then reads the cached estimates and recomputes their
+// validity in one pass with rethreshold_events(), without any search.
+//
+// The cache file holds the key, the number of events and the records of
+// estim_events_CPU.dat.
+uint64_t hash_bytes(uint64_t hash, const void *data, std::size_t size);
+uint64_t get_result_cache_key(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, const calibr_data_t & calibr_data, const estim_options_t & estim_options);
+std::string get_result_cache_filename(const std::string & dirname, uint64_t key);
+bool read_result_cache(std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const std::string & filename, uint64_t key, std::size_t num_events);
+void write_result_cache(const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const std::string & filename, uint64_t key);
+std::size_t rethreshold_events(std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const calibr_funct_t & calibr_funct);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// FNV-1a, continued from hash.
+uint64_t hash_bytes(uint64_t hash, const void *data, std::size_t size) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  std::size_t i;
+  
+  for(i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= UINT64_C(0x00000100000001B3);
+  }
+  return(hash);
+}
+
+
+// The threshold, the event cache and the spatial binning are left out:
+// the first is what the cache lets change and the others do not change the
+// estimates.
+uint64_t get_result_cache_key(const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, const calibr_data_t & calibr_data, const estim_options_t & estim_options) {
+  std::ostringstream oss;
+  std::string settings;
+  std::size_t n;
+  uint64_t hash;
+  
+  hash = UINT64_C(0xCBF29CE484222325);
+  for(n = 0; n < PMT_data.size(); ++n) {
+    hash = hash_bytes(hash, PMT_data[n].val, sizeof(PMT_data[n].val));
+  }
+  hash = hash_bytes(hash, calibr_data.mdrf, sizeof(calibr_data.mdrf));
+  hash = hash_bytes(hash, calibr_data.gain, sizeof(calibr_data.gain));
+  oss << std::setprecision(9);
+  oss << RESULT_CACHE_VERSION << ";" << int(estim_options.engine) << ";" << int(estim_options.mode) << ";" << estim_options.nn_grid_size << ";";
+  if(estim_options.use_energy_window) {
+    oss << estim_options.energy_window_min << "," << estim_options.energy_window_max;
+  }
+  oss << ";";
+  if(estim_options.use_roi) {
+    oss << estim_options.roi_min_x << "," << estim_options.roi_max_x << "," << estim_options.roi_min_y << "," << estim_options.roi_max_y;
+  }
+  oss << ";";
+  for(n = 0; n < estim_options.search_schedule.size(); ++n) {
+    oss << estim_options.search_schedule[n].grid_size << "x" << estim_options.search_schedule[n].contr_factor << ",";
+  }
+  oss << ";" << get_cpu_kernels().name;
+  settings = oss.str();
+  hash = hash_bytes(hash, settings.data(), settings.size());
+  return(hash);
+}
+
+
+std::string get_result_cache_filename(const std::string & dirname, uint64_t key) {
+  std::ostringstream oss;
+  
+  oss << dirname << "/estim_" << std::hex << std::setw(16) << std::setfill('0') << key << ".cache";
+  return(oss.str());
+}
+
+
+// Returns false when there is no cache file for the key.
+bool read_result_cache(std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const std::string & filename, uint64_t key, std::size_t num_events) {
+  uint32_t file_num_events;
+  uint32_t event_index;
+  uint64_t file_key;
+  std::ifstream ifs;
+  uint32_t valid;
+  float values[3];
+  
+  ifs.open(filename.c_str(), std::ifstream::in | std::ifstream::binary);
+  if(!ifs) {
+    return(false);
+  }
+  ifs.read(reinterpret_cast<char *>(& file_key), sizeof(file_key));
+  ifs.read(reinterpret_cast<char *>(& file_num_events), sizeof(file_num_events));
+  if(!ifs || (file_key != key) || (file_num_events != num_events)) {
+    throw std::runtime_error("Corrupted result cache file " + filename);
+  }
+  estim_event.resize(num_events);
+  for(event_index = 0; event_index < file_num_events; ++event_index) {
+    ifs.read(reinterpret_cast<char *>(& valid), sizeof(valid));
+    ifs.read(reinterpret_cast<char *>(values), sizeof(values));
+    estim_event[event_index].valid = valid;
+    estim_event[event_index].x_pos = values[0];
+    estim_event[event_index].y_pos = values[1];
+    estim_event[event_index].log_like = values[2];
+  }
+  if(!ifs) {
+    throw std::runtime_error("Truncated result cache file " + filename);
+  }
+  return(true);
+}
+
+
+// Written under a temporary name and renamed, so that an interrupted run
+// never leaves a partial cache file behind.
+void write_result_cache(const std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const std::string & filename, uint64_t key) {
+  uint32_t event_index, num_events;
+  std::string tmp_filename;
+  std::ofstream ofs;
+  uint32_t valid;
+  float values[3];
+  
+  tmp_filename = filename + ".tmp";
+  ofs.open(tmp_filename.c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!ofs) {
+    throw std::runtime_error("Cannot create result cache file " + filename);
+  }
+  num_events = (uint32_t) estim_event.size();
+  ofs.write(reinterpret_cast<const char *>(& key), sizeof(key));
+  ofs.write(reinterpret_cast<const char *>(& num_events), sizeof(num_events));
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    valid = estim_event[event_index].valid ? 1 : 0;
+    values[0] = estim_event[event_index].x_pos;
+    values[1] = estim_event[event_index].y_pos;
+    values[2] = estim_event[event_index].log_like;
+    ofs.write(reinterpret_cast<const char *>(& valid), sizeof(valid));
+    ofs.write(reinterpret_cast<const char *>(values), sizeof(values));
+  }
+  ofs.close();
+  if(!ofs || (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)) {
+    throw std::runtime_error("Cannot write result cache file " + filename);
+  }
+  return;
+}
+
+
+// Recomputes the validity of every estimate with the threshold spline of
+// calibr_funct and returns the number of valid events. Estimates on the
+// border of the field of view and events rejected by the prefilter
+// (log_like of -inf) stay invalid, as in contr_grid_event(). Runs the same
+// way on fresh and cached estimates, so both give the same flags.
+std::size_t rethreshold_events(std::vector<estim_event_t, aligned_allocator<estim_event_t>> & estim_event, const calibr_funct_t & calibr_funct) {
+  std::size_t event_index;
+  std::size_t num_valid;
+  float pos_x, pos_y;
+  bool inside;
+  
+  num_valid = 0;
+  for(event_index = 0; event_index < estim_event.size(); ++event_index) {
+    estim_event_t & event = estim_event[event_index];
+    pos_x = (event.x_pos - CAMERA_MIN_POS) / (CAMERA_MAX_POS - CAMERA_MIN_POS);
+    pos_y = (event.y_pos - CAMERA_MIN_POS) / (CAMERA_MAX_POS - CAMERA_MIN_POS);
+    inside = (float(0) < pos_x) && (pos_x < float(1)) && (float(0) < pos_y) && (pos_y < float(1)) && std::isfinite(event.log_like);
+    event.valid = inside && (event.log_like > calibr_funct.thresh(pos_x, pos_y));
+    num_valid += event.valid ? 1 : 0;
+  }
+  return(num_valid);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _RESULT_CACHE_H
@@ -0,0 +1,152 @@
+#ifndef _SEARCH_SCHEDULE_H
+#define _SEARCH_SCHEDULE_H
+
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include "my_defines.h"
+#include "my_types.h"
+#include "estim_core.hpp"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+template<int _N> void contr_grid_stage(float & current_x, float & current_y, float & max_log_like, float step, int grid_size, const float tmp_data[NUM_PMTS], const calibr_funct_t & calibr_funct);
+void contr_grid_stage_generic(float & current_x, float & current_y, float & max_log_like, float step, int grid_size, const float tmp_data[NUM_PMTS], const calibr_funct_t & calibr_funct);
+contr_grid_stage_t get_contr_grid_stage(int grid_size);
+std::vector<search_stage_t> get_default_search_schedule();
+std::vector<search_stage_t> parse_search_schedule(const std::string & spec);
+std::string format_search_schedule(const std::vector<search_stage_t> & search_schedule);
+std::vector<float> get_search_steps(const std::vector<search_stage_t> & search_schedule);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// One iteration of the float engine on a _N x _N grid, see
+// contr_grid_core(). The grid size is a template parameter so that the
+// loops are fully unrolled.
+template<int _N> void contr_grid_stage(float & current_x, float & current_y, float & max_log_like, float step, int grid_size, const float tmp_data[NUM_PMTS], const calibr_funct_t & calibr_funct) {
+  spline_engine_t<float> engine(calibr_funct);
+  
+  contr_grid_core<spline_engine_t<float>, _N>(current_x, current_y, max_log_like, step, grid_size, tmp_data, engine);
+  return;
+}
+
+
+// Same as contr_grid_stage<_N>() for grid sizes without a specialization.
+void contr_grid_stage_generic(float & current_x, float & current_y, float & max_log_like, float step, int grid_size, const float tmp_data[NUM_PMTS], const calibr_funct_t & calibr_funct) {
+  spline_engine_t<float> engine(calibr_funct);
+  
+  contr_grid_core<spline_engine_t<float>, 0>(current_x, current_y, max_log_like, step, grid_size, tmp_data, engine);
+  return;
+}
+
+
+contr_grid_stage_t get_contr_grid_stage(int grid_size) {
+  switch(grid_size) {
+    case 2:	return(contr_grid_stage<2>);
+    case 3:	return(contr_grid_stage<3>);
+    case 4:	return(contr_grid_stage<4>);
+    case 5:	return(contr_grid_stage<5>);
+    case 6:	return(contr_grid_stage<6>);
+    case 7:	return(contr_grid_stage<7>);
+    case 8:	return(contr_grid_stage<8>);
+    default:	return(contr_grid_stage_generic);
+  }
+}
+
+
+std::vector<search_stage_t> get_default_search_schedule() {
+  std::vector<search_stage_t> search_schedule;
+  search_stage_t stage;
+  int iter;
+  
+  stage.grid_size = SIZE_CONTR_GRID;
+  stage.contr_factor = CONTR_FACTOR;
+  stage.kernel = get_contr_grid_stage(stage.grid_size);
+  for(iter = 0; iter < NUM_CONTR_GRID_ITER; ++iter) {
+    search_schedule.push_back(stage);
+  }
+  return(search_schedule);
+}
+
+
+// Parses a schedule given as a comma-separated list of stages of the form
+// SIZExFACTOR[*REPEAT], e.g. "10x2.5,3x1.6*12" for one 10 x 10 grid followed
+// by twelve 3 x 3 refinements. The kernel of each stage is chosen here, once.
+std::vector<search_stage_t> parse_search_schedule(const std::string & spec) {
+  std::vector<search_stage_t> search_schedule;
+  std::string token, size_str, factor_str;
+  std::size_t x_pos, star_pos;
+  std::istringstream iss(spec);
+  search_stage_t stage;
+  int repeat, n;
+  
+  while(std::getline(iss, token, ',')) {
+    x_pos = token.find('x');
+    star_pos = token.find('*');
+    if((x_pos == std::string::npos) || ((star_pos != std::string::npos) && (star_pos < x_pos))) {
+      throw std::runtime_error("Invalid search stage " + token);
+    }
+    size_str = token.substr(0, x_pos);
+    factor_str = token.substr(x_pos + 1, (star_pos == std::string::npos) ? std::string::npos : (star_pos - x_pos - 1));
+    stage.grid_size = std::stoi(size_str);
+    stage.contr_factor = std::stof(factor_str);
+    repeat = (star_pos == std::string::npos) ? 1 : std::stoi(token.substr(star_pos + 1));
+    if((stage.grid_size < 2) || (stage.grid_size > MAX_SIZE_CONTR_GRID) || !(stage.contr_factor > float(1)) || (repeat < 1)) {
+      throw std::runtime_error("Invalid search stage " + token);
+    }
+    stage.kernel = get_contr_grid_stage(stage.grid_size);
+    for(n = 0; n < repeat; ++n) {
+      search_schedule.push_back(stage);
+    }
+  }
+  if(search_schedule.empty()) {
+    throw std::runtime_error("Empty search schedule!");
+  }
+  return(search_schedule);
+}
+
+
+std::string format_search_schedule(const std::vector<search_stage_t> & search_schedule) {
+  std::ostringstream oss;
+  std::size_t n, repeat;
+  
+  for(n = 0; n < search_schedule.size(); n += repeat) {
+    repeat = 1;
+    while(((n + repeat) < search_schedule.size()) && (search_schedule[n + repeat].grid_size == search_schedule[n].grid_size) && (search_schedule[n + repeat].contr_factor == search_schedule[n].contr_factor)) {
+      ++repeat;
+    }
+    oss << ((n > 0) ? "," : "") << search_schedule[n].grid_size << "x" << search_schedule[n].contr_factor;
+    if(repeat > 1) {
+      oss << "*" << repeat;
+    }
+  }
+  return(oss.str());
+}
+
+
+// Returns the grid spacing used by each stage of the schedule. The first
+// grid spans the whole field of view.
+std::vector<float> get_search_steps(const std::vector<search_stage_t> & search_schedule) {
+  std::vector<float> steps(search_schedule.size());
+  std::size_t n;
+  float step;
+  
+  step = search_schedule.empty() ? float(1) : ((float(1) - float(0)) / float(search_schedule[0].grid_size));
+  for(n = 0; n < search_schedule.size(); ++n) {
+    steps[n] = step;
+    step /= search_schedule[n].contr_factor;
+  }
+  return(steps);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _SEARCH_SCHEDULE_H
@@ -0,0 +1,282 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "estimator.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Calibration, list-mode input and output of one head of a multi-head
+// system.
+struct session_head_t {
+  std::string name;
+  std::string mdrf_filename;
+  std::string thresh_filename;
+  std::string gain_filename;
+  std::string events_filename;
+  std::string output_filename;
+};
+
+
+// Estimates the list-mode streams of several heads in one process, on one
+// pool of worker threads. Every head has its own estimator_t built from its
+// own calibration. The events of all heads are cut into chunks of
+// SESSION_CHUNK_SIZE events, which are interleaved in proportion to the
+// number of events of each head and claimed by the workers through a single
+// atomic counter. The heads therefore progress at the same relative rate
+// and the cores are shared according to their count rates, with no thread
+// ever idle while a chunk is left.
+class session_t {
+  public:
+    session_t(const std::vector<session_head_t> & heads, const estim_options_t & my_estim_options);
+    void run(unsigned int num_threads);
+    void write_outputs() const;
+    void print_stats(std::ostream & os) const;
+    
+  private:
+    struct head_state_t {
+      session_head_t head;
+      std::unique_ptr<estimator_t> estimator;
+      std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+      std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+      std::atomic<uint64_t> busy_nsec;
+      std::atomic<uint64_t> finish_nsec;
+      std::atomic<std::size_t> num_valid;
+      std::atomic<std::size_t> chunks_left;
+    };
+    struct chunk_t {
+      unsigned int head_index;
+      std::size_t first_event;
+      std::size_t num_events;
+    };
+    void work();
+    estim_options_t estim_options;
+    std::vector<std::unique_ptr<head_state_t>> head_states;
+    std::vector<chunk_t> chunks;
+    std::atomic<std::size_t> next_chunk;
+    std::chrono::time_point<std::chrono::steady_clock> start;
+    unsigned int num_workers;
+    double elapsed_time;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+std::vector<session_head_t> read_session(const std::string & filename);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Loads and fits the calibration and reads the events of every head.
+session_t::session_t(const std::vector<session_head_t> & heads, const estim_options_t & my_estim_options) : estim_options(my_estim_options), next_chunk(0), num_workers(0), elapsed_time(0.0) {
+  std::vector<std::pair<double, chunk_t>> order;
+  calibr_funct_t calibr_funct;
+  calibr_data_t calibr_data;
+  std::size_t num_chunks;
+  std::size_t n;
+  chunk_t chunk;
+  unsigned int h;
+  
+  estim_options.verbose = false;
+  for(h = 0; h < heads.size(); ++h) {
+    std::unique_ptr<head_state_t> head_state(new head_state_t);
+    head_state->head = heads[h];
+    calibr_data = get_calibration_data(heads[h].mdrf_filename.c_str(), heads[h].thresh_filename.c_str(), heads[h].gain_filename.c_str());
+    calibr_funct = get_calibration_funct(calibr_data);
+    head_state->estimator.reset(new estimator_t(calibr_funct, estim_options));
+    head_state->PMT_data = get_PMT_data(heads[h].events_filename.c_str());
+    head_state->estim_event.resize(head_state->PMT_data.size());
+    num_chunks = (head_state->PMT_data.size() + SESSION_CHUNK_SIZE - 1) / SESSION_CHUNK_SIZE;
+    head_state->busy_nsec = 0;
+    head_state->finish_nsec = 0;
+    head_state->num_valid = 0;
+    head_state->chunks_left = num_chunks;
+    for(n = 0; n < num_chunks; ++n) {
+      chunk.head_index = h;
+      chunk.first_event = n * SESSION_CHUNK_SIZE;
+      chunk.num_events = std::min(std::size_t(SESSION_CHUNK_SIZE), head_state->PMT_data.size() - chunk.first_event);
+      order.push_back(std::make_pair((double(n) + 0.5) / double(num_chunks), chunk));
+    }
+    head_states.push_back(std::move(head_state));
+  }
+  std::stable_sort(order.begin(), order.end(), [](const std::pair<double, chunk_t> & a, const std::pair<double, chunk_t> & b) {return(a.first < b.first);});
+  for(n = 0; n < order.size(); ++n) {
+    chunks.push_back(order[n].second);
+  }
+}
+
+
+// Runs all heads to completion on num_threads workers (all the cores for
+// 0), the calling thread being one of them.
+void session_t::run(unsigned int num_threads) {
+  std::vector<std::thread> workers;
+  unsigned int i;
+  
+  if(num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  num_workers = num_threads;
+  next_chunk = 0;
+  start = std::chrono::steady_clock::now();
+  for(i = 1; i < num_threads; ++i) {
+    workers.push_back(std::thread(& session_t::work, this));
+  }
+  work();
+  for(i = 0; i < workers.size(); ++i) {
+    workers[i].join();
+  }
+  elapsed_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return;
+}
+
+
+void session_t::write_outputs() const {
+  std::size_t h;
+  
+  for(h = 0; h < head_states.size(); ++h) {
+    write_estim_events(head_states[h]->estim_event, head_states[h]->head.output_filename.c_str());
+  }
+  return;
+}
+
+
+// Per head: the CPU time spent on its events, summed over the workers, and
+// the time at which its last chunk was done.
+void session_t::print_stats(std::ostream & os) const {
+  std::size_t num_events, total_events;
+  double busy_time, finish_time;
+  std::size_t h;
+  
+  total_events = 0;
+  os << "Session of " << head_states.size() << " heads on " << num_workers << " workers." << std::endl;
+  for(h = 0; h < head_states.size(); ++h) {
+    const head_state_t & head_state = *head_states[h];
+    num_events = head_state.PMT_data.size();
+    busy_time = double(head_state.busy_nsec) * 1e-9;
+    finish_time = double(head_state.finish_nsec) * 1e-9;
+    total_events += num_events;
+    os << head_state.head.name << ": " << num_events << " events, " << head_state.num_valid << " valid, CPU time " << busy_time << " s (" << get_event_rate(num_events, busy_time) << " events/s per core), done after " << finish_time << " s." << std::endl;
+  }
+  os << "Elapsed time: " << elapsed_time << " s (" << get_event_rate(total_events, elapsed_time) << " events/s)." << std::endl;
+  return;
+}
+
+
+void session_t::work() {
+  std::chrono::time_point<std::chrono::steady_clock> chunk_start, chunk_end;
+  std::size_t chunk_index;
+  std::size_t num_valid;
+  std::size_t n;
+  
+  while((chunk_index = next_chunk++) < chunks.size()) {
+    const chunk_t & chunk = chunks[chunk_index];
+    head_state_t & head_state = *head_states[chunk.head_index];
+    chunk_start = std::chrono::steady_clock::now();
+    head_state.estimator->estimate_batch(& head_state.PMT_data[chunk.first_event], & head_state.estim_event[chunk.first_event], chunk.num_events);
+    chunk_end = std::chrono::steady_clock::now();
+    num_valid = 0;
+    for(n = chunk.first_event; n < (chunk.first_event + chunk.num_events); ++n) {
+      num_valid += head_state.estim_event[n].valid ? 1 : 0;
+    }
+    head_state.num_valid += num_valid;
+    head_state.busy_nsec += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(chunk_end - chunk_start).count());
+    if(--head_state.chunks_left == 0) {
+      head_state.finish_nsec = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(chunk_end - start).count());
+    }
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Reads a session description with one head per line, given as
+// space-separated key=value pairs with the keys name, mdrf, thresh, gain,
+// events and output. Empty lines and lines starting with '#' are ignored,
+// and relative file names are taken from the directory of the description.
+std::vector<session_head_t> read_session(const std::string & filename) {
+  std::vector<session_head_t> heads;
+  std::string line, field, key, value, dir;
+  session_head_t head;
+  std::size_t pos;
+  std::ifstream ifs;
+  
+  pos = filename.find_last_of('/');
+  dir = (pos == std::string::npos) ? std::string() : filename.substr(0, pos + 1);
+  ifs.open(filename.c_str(), std::ifstream::in);
+  if(!ifs) {
+    throw std::runtime_error("Cannot open session description " + filename);
+  }
+  while(std::getline(ifs, line)) {
+    line.erase(0, line.find_first_not_of(" \t"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if(line.empty() || (line[0] == '#')) {
+      continue;
+    }
+    head = session_head_t();
+    std::istringstream iss(line);
+    while(iss >> field) {
+      pos = field.find('=');
+      if(pos == std::string::npos) {
+        throw std::runtime_error("Expected key=value in session description: " + field);
+      }
+      key = field.substr(0, pos);
+      value = field.substr(pos + 1);
+      if(key == "name") {
+        head.name = value;
+        continue;
+      }
+      value = ((!value.empty() && (value[0] == '/')) ? std::string() : dir) + value;
+      if(key == "mdrf") {
+        head.mdrf_filename = value;
+      } else if(key == "thresh") {
+        head.thresh_filename = value;
+      } else if(key == "gain") {
+        head.gain_filename = value;
+      } else if(key == "events") {
+        head.events_filename = value;
+      } else if(key == "output") {
+        head.output_filename = value;
+      } else {
+        throw std::runtime_error("Unknown session description key " + key);
+      }
+    }
+    if(head.mdrf_filename.empty() || head.thresh_filename.empty() || head.gain_filename.empty() || head.events_filename.empty() || head.output_filename.empty()) {
+      throw std::runtime_error("Incomplete head in session description: " + line);
+    }
+    if(head.name.empty()) {
+      head.name = "head" + std::to_string(heads.size());
+    }
+    heads.push_back(head);
+  }
+  ifs.close();
+  if(heads.empty()) {
+    throw std::runtime_error("No head in session description " + filename);
+  }
+  return(heads);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _SESSION_H
@@ -0,0 +1,145 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "shm_ring.h"
+
+// To compile: g++ -std=c++11 -pedantic-errors -O2 -Wall -Wdouble-promotion -Wparentheses -Wconversion shm_client.cpp -o shm_client -pthread
+//
+// Acquisition and viewer sides of the shared-memory transport of
+// shm_ring.h, for testing "main --shm=NAME". A producer thread writes the
+// events of a list-mode file into the event ring in batches, at a given
+// rate or as fast as the ring takes them, then closes it; the main thread
+// reads the estimates back, writes them to OUTPUT and prints the latency
+// from the write of each batch to the arrival of its last estimate. With
+// --no-viewer, only the acquisition side runs, as for an estimator started
+// with --shm-output=drop or none.
+//
+//   ./main --shm=test &
+//   ./shm_client --batch=16 --rate=2000 test ../data/ResPhantom022516-0mm_00.dat ../data/estim_events_shm.dat
+//
+// Usage: ./shm_client [--batch=N] [--rate=EVENTS_PER_S] NAME INPUT OUTPUT
+//        ./shm_client [--batch=N] [--rate=EVENTS_PER_S] --no-viewer NAME INPUT
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void produce(shm_ring_t<PMT_data_t> & input, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, std::size_t batch_size, double rate, std::vector<int64_t> & write_nsec);
+int64_t get_nsec();
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char **argv) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> estim_event;
+  std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> PMT_data;
+  std::vector<int64_t> write_nsec;
+  std::vector<double> latency;
+  std::vector<std::string> args;
+  const estim_event_t *records;
+  std::size_t num_records, batch_size;
+  int64_t start_nsec;
+  std::thread producer;
+  double rate, elapsed;
+  std::string arg;
+  bool viewer;
+  int i;
+  
+  batch_size = SHM_BATCH_SIZE;
+  rate = 0;
+  viewer = true;
+  for(i = 1; i < argc; ++i) {
+    arg = argv[i];
+    if(arg.compare(0, 8, "--batch=") == 0) {
+      batch_size = std::max(std::size_t(1), std::size_t(std::stoul(arg.substr(8))));
+    } else if(arg.compare(0, 7, "--rate=") == 0) {
+      rate = std::stod(arg.substr(7));
+    } else if(arg == "--no-viewer") {
+      viewer = false;
+    } else if(arg.compare(0, 2, "--") == 0) {
+      throw std::runtime_error("Unknown option " + arg);
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if(args.size() != (viewer ? 3U : 2U)) {
+    std::cerr << "Usage: " << argv[0] << " [--batch=N] [--rate=EVENTS_PER_S] NAME INPUT OUTPUT" << std::endl;
+    std::cerr << "       " << argv[0] << " [--batch=N] [--rate=EVENTS_PER_S] --no-viewer NAME INPUT" << std::endl;
+    return(1);
+  }
+  PMT_data = get_PMT_data(args[1].c_str());
+  shm_ring_t<PMT_data_t> input(get_shm_ring_name(args[0], "events"));
+  if(!viewer) {
+    start_nsec = get_nsec();
+    write_nsec.resize((PMT_data.size() + batch_size - 1) / batch_size);
+    produce(input, PMT_data, batch_size, rate, write_nsec);
+    elapsed = double(get_nsec() - start_nsec) * 1e-9;
+    std::cout << "Sent " << PMT_data.size() << " events in " << elapsed << " s (" << (double(PMT_data.size()) / elapsed) << " events/s)." << std::endl;
+    return(0);
+  }
+  shm_ring_t<estim_event_t> output(get_shm_ring_name(args[0], "estimates"));
+  write_nsec.resize((PMT_data.size() + batch_size - 1) / batch_size);
+  estim_event.reserve(PMT_data.size());
+  start_nsec = get_nsec();
+  producer = std::thread(produce, std::ref(input), std::cref(PMT_data), batch_size, rate, std::ref(write_nsec));
+  while((num_records = output.acquire(records, batch_size)) > 0) {
+    estim_event.insert(estim_event.end(), records, records + num_records);
+    output.release(num_records);
+    while(((latency.size() + 1) * batch_size <= estim_event.size()) || ((estim_event.size() == PMT_data.size()) && (latency.size() < write_nsec.size()))) {
+      latency.push_back(double(get_nsec() - write_nsec[latency.size()]) * 1e-3);
+    }
+  }
+  elapsed = double(get_nsec() - start_nsec) * 1e-9;
+  producer.join();
+  write_estim_events(estim_event, args[2].c_str());
+  std::cout << "Received " << estim_event.size() << " of " << PMT_data.size() << " estimates in " << elapsed << " s (" << (double(estim_event.size()) / elapsed) << " events/s)." << std::endl;
+  if(!latency.empty()) {
+    std::sort(latency.begin(), latency.end());
+    std::cout << "Batch latency: median " << latency[latency.size() / 2] << " us, 99th percentile " << latency[(latency.size() * 99) / 100] << " us, max " << latency.back() << " us." << std::endl;
+  }
+  return(0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Writes the batches, each at its time in the given rate if any, and
+// stamps them just before they are committed.
+void produce(shm_ring_t<PMT_data_t> & input, const std::vector<PMT_data_t, aligned_allocator<PMT_data_t>> & PMT_data, std::size_t batch_size, double rate, std::vector<int64_t> & write_nsec) {
+  std::size_t batch_index, first_event, num_events;
+  int64_t start_nsec, due_nsec;
+  
+  start_nsec = get_nsec();
+  for(batch_index = 0; batch_index < write_nsec.size(); ++batch_index) {
+    first_event = batch_index * batch_size;
+    num_events = std::min(batch_size, PMT_data.size() - first_event);
+    if(rate > 0) {
+      due_nsec = start_nsec + int64_t(double(first_event) / rate * 1e9);
+      while(get_nsec() < due_nsec) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(due_nsec - get_nsec()));
+      }
+    }
+    write_nsec[batch_index] = get_nsec();
+    if(input.write(PMT_data.data() + first_event, num_events) != num_events) {
+      break;
+    }
+  }
+  input.close();
+  return;
+}
+
+
+int64_t get_nsec() {
+  return(int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()));
+}
@@ -0,0 +1,402 @@
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#include <stdexcept>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <type_traits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "my_defines.h"
+#include "my_types.h"
+#include "my_utils.h"
+#include "estimator.h"
+#include "image.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Single-producer single-consumer ring of records in POSIX shared memory,
+// for processes of the same host. The producer owns head and the consumer
+// owns tail, both counting records since the creation of the ring, so that
+// neither index is ever written by both sides and no lock is needed. Both
+// sides work in place: reserve() hands the producer a free span of the
+// ring to fill and commit() publishes it, acquire() hands the consumer a
+// span of published records and release() gives it back.
+//
+// A side that finds the ring full or empty spins for SHM_SPIN_COUNT checks,
+// then sleeps on a futex in the shared mapping. The other side bumps the
+// sequence word of that futex after each commit or release, and only makes
+// the wake-up system call when a waiter has announced itself, so that a
+// busy ring costs no system call. The sleeps time out every
+// SHM_WAIT_TIMEOUT_MSEC to notice a peer that died without closing.
+//
+// The creator of a ring unlinks its name when destroyed; the mappings of
+// the other processes stay valid until they unmap them.
+struct shm_ring_header_t {
+  char magic[4];
+  uint32_t record_size;
+  uint64_t capacity;
+  alignas(64) std::atomic<uint64_t> head;
+  std::atomic<uint32_t> head_seq;
+  std::atomic<uint32_t> consumer_waiting;
+  alignas(64) std::atomic<uint64_t> tail;
+  std::atomic<uint32_t> tail_seq;
+  std::atomic<uint32_t> producer_waiting;
+  alignas(64) std::atomic<uint32_t> closed;
+};
+
+
+template<class _T> class shm_ring_t {
+  public:
+    shm_ring_t(const std::string & my_name, std::size_t capacity);
+    shm_ring_t(const std::string & my_name);
+    ~shm_ring_t();
+    std::size_t reserve(_T *& records, std::size_t max_records, bool block = true);
+    void commit(std::size_t num_records);
+    std::size_t write(const _T *records, std::size_t num_records);
+    std::size_t acquire(const _T *& records, std::size_t max_records);
+    void release(std::size_t num_records);
+    void close();
+    const std::string & get_name() const;
+    
+  private:
+    void map(std::size_t size);
+    void wait(std::atomic<uint32_t> & seq, uint32_t value, std::atomic<uint32_t> & waiting);
+    void notify(std::atomic<uint32_t> & seq, std::atomic<uint32_t> & waiting);
+    std::string name;
+    bool owner;
+    int fd;
+    void *mapping;
+    std::size_t mapping_size;
+    shm_ring_header_t *header;
+    _T *ring;
+    uint64_t mask;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+std::string get_shm_ring_name(const std::string & name, const std::string & stream);
+std::size_t run_shm_estimator(const estimator_t & estimator, shm_ring_t<PMT_data_t> & input, shm_ring_t<estim_event_t> *output, bool drop, image_t *image, std::size_t & num_dropped);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Creates the ring, with a capacity rounded up to a power of two. A stale
+// ring of the same name, left by a process that died, is replaced.
+template<class _T> shm_ring_t<_T>::shm_ring_t(const std::string & my_name, std::size_t capacity) : name(my_name), owner(true), fd(-1), mapping(nullptr), mapping_size(0) {
+  std::size_t num_records;
+  
+  static_assert(std::is_trivially_copyable<_T>::value, "Ring records must be trivially copyable");
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The ring indices must be lock-free");
+  num_records = 1;
+  while(num_records < capacity) {
+    num_records *= 2;
+  }
+  fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if((fd < 0) && (errno == EEXIST)) {
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  }
+  if(fd < 0) {
+    throw std::runtime_error("Cannot create shared memory " + name + ": " + std::strerror(errno));
+  }
+  map(sizeof(shm_ring_header_t) + num_records * sizeof(_T));
+  header = new(mapping) shm_ring_header_t;
+  header->record_size = uint32_t(sizeof(_T));
+  header->capacity = num_records;
+  header->head.store(0);
+  header->head_seq.store(0);
+  header->consumer_waiting.store(0);
+  header->tail.store(0);
+  header->tail_seq.store(0);
+  header->producer_waiting.store(0);
+  header->closed.store(0);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(header->magic, "SHR1", 4);
+  ring = reinterpret_cast<_T *>(header + 1);
+  mask = num_records - 1;
+}
+
+
+// Opens a ring created by another process, waiting for it for up to
+// SHM_OPEN_TIMEOUT_MSEC.
+template<class _T> shm_ring_t<_T>::shm_ring_t(const std::string & my_name) : name(my_name), owner(false), fd(-1), mapping(nullptr), mapping_size(0) {
+  std::chrono::time_point<std::chrono::steady_clock> deadline;
+  struct stat st;
+  
+  deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_OPEN_TIMEOUT_MSEC);
+  while(true) {
+    fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if((fd >= 0) && (fstat(fd, & st) == 0) && (std::size_t(st.st_size) > sizeof(shm_ring_header_t))) {
+      map(std::size_t(st.st_size));
+      header = reinterpret_cast<shm_ring_header_t *>(mapping);
+      if(std::memcmp(header->magic, "SHR1", 4) == 0) {
+        break;
+      }
+      munmap(mapping, mapping_size);
+      mapping = nullptr;
+    }
+    if(fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    if(std::chrono::steady_clock::now() > deadline) {
+      throw std::runtime_error("Cannot open shared memory " + name);
+    }
+    usleep(1000);
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if((header->record_size != sizeof(_T)) || (mapping_size < (sizeof(shm_ring_header_t) + header->capacity * sizeof(_T)))) {
+    throw std::runtime_error("Shared memory " + name + " does not hold a ring of these records!");
+  }
+  ring = reinterpret_cast<_T *>(header + 1);
+  mask = header->capacity - 1;
+}
+
+
+template<class _T> shm_ring_t<_T>::~shm_ring_t() {
+  if(mapping != nullptr) {
+    munmap(mapping, mapping_size);
+  }
+  if(fd >= 0) {
+    ::close(fd);
+  }
+  if(owner) {
+    shm_unlink(name.c_str());
+  }
+}
+
+
+// Waits for free records and returns the number of them, at most
+// max_records, that follow each other in the ring from records on. Returns
+// 0 if the ring was closed, or at once if it is full and block is not set.
+template<class _T> std::size_t shm_ring_t<_T>::reserve(_T *& records, std::size_t max_records, bool block) {
+  uint64_t head, tail;
+  uint32_t seq;
+  int spin;
+  
+  head = header->head.load(std::memory_order_relaxed);
+  for(spin = 0; ; ++spin) {
+    seq = header->tail_seq.load();
+    tail = header->tail.load(std::memory_order_acquire);
+    if(((head - tail) < header->capacity) || header->closed.load()) {
+      break;
+    }
+    if(!block) {
+      return(0);
+    }
+    if(spin >= SHM_SPIN_COUNT) {
+      wait(header->tail_seq, seq, header->producer_waiting);
+    }
+  }
+  if(header->closed.load()) {
+    return(0);
+  }
+  records = ring + (head & mask);
+  return(std::size_t(std::min(uint64_t(max_records), std::min(header->capacity - (head - tail), header->capacity - (head & mask)))));
+}
+
+
+template<class _T> void shm_ring_t<_T>::commit(std::size_t num_records) {
+  header->head.store(header->head.load(std::memory_order_relaxed) + num_records, std::memory_order_release);
+  notify(header->head_seq, header->consumer_waiting);
+  return;
+}
+
+
+// Copies the records into the ring, waiting for room as needed, and
+// returns the number written, less than num_records if the ring was
+// closed.
+template<class _T> std::size_t shm_ring_t<_T>::write(const _T *records, std::size_t num_records) {
+  std::size_t num_written, num_free;
+  _T *free_records;
+  
+  num_written = 0;
+  while(num_written < num_records) {
+    num_free = reserve(free_records, num_records - num_written);
+    if(num_free == 0) {
+      break;
+    }
+    std::memcpy(static_cast<void *>(free_records), records + num_written, num_free * sizeof(_T));
+    commit(num_free);
+    num_written += num_free;
+  }
+  return(num_written);
+}
+
+
+// Waits for published records and returns the number of them, at most
+// max_records, that follow each other in the ring from records on. Returns
+// 0 once the ring is closed and every record has been consumed.
+template<class _T> std::size_t shm_ring_t<_T>::acquire(const _T *& records, std::size_t max_records) {
+  uint64_t head, tail;
+  uint32_t seq;
+  int spin;
+  
+  tail = header->tail.load(std::memory_order_relaxed);
+  for(spin = 0; ; ++spin) {
+    seq = header->head_seq.load();
+    head = header->head.load(std::memory_order_acquire);
+    if(head != tail) {
+      break;
+    }
+    if(header->closed.load()) {
+      if(header->head.load(std::memory_order_acquire) == tail) {
+        return(0);
+      }
+      continue;
+    }
+    if(spin >= SHM_SPIN_COUNT) {
+      wait(header->head_seq, seq, header->consumer_waiting);
+    }
+  }
+  records = ring + (tail & mask);
+  return(std::size_t(std::min(uint64_t(max_records), std::min(head - tail, header->capacity - (tail & mask)))));
+}
+
+
+template<class _T> void shm_ring_t<_T>::release(std::size_t num_records) {
+  header->tail.store(header->tail.load(std::memory_order_relaxed) + num_records, std::memory_order_release);
+  notify(header->tail_seq, header->producer_waiting);
+  return;
+}
+
+
+// Ends the stream: the consumer gets the records already committed, then
+// 0, and a producer waiting for room gives up.
+template<class _T> void shm_ring_t<_T>::close() {
+  header->closed.store(1);
+  header->head_seq.fetch_add(1);
+  header->tail_seq.fetch_add(1);
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(& header->head_seq), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(& header->tail_seq), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+  return;
+}
+
+
+template<class _T> const std::string & shm_ring_t<_T>::get_name() const {
+  return(name);
+}
+
+
+template<class _T> void shm_ring_t<_T>::map(std::size_t size) {
+  if(owner && (ftruncate(fd, off_t(size)) != 0)) {
+    throw std::runtime_error("Cannot size shared memory " + name + ": " + std::strerror(errno));
+  }
+  mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(mapping == MAP_FAILED) {
+    mapping = nullptr;
+    throw std::runtime_error("Cannot map shared memory " + name + ": " + std::strerror(errno));
+  }
+  mapping_size = size;
+  return;
+}
+
+
+// Sleeps unless seq has moved on from value since the caller found the
+// ring full or empty. The waiter flag is raised before the futex checks
+// seq, so that a notify() after the check sees it.
+template<class _T> void shm_ring_t<_T>::wait(std::atomic<uint32_t> & seq, uint32_t value, std::atomic<uint32_t> & waiting) {
+  struct timespec timeout;
+  
+  timeout.tv_sec = SHM_WAIT_TIMEOUT_MSEC / 1000;
+  timeout.tv_nsec = (SHM_WAIT_TIMEOUT_MSEC % 1000) * 1000000L;
+  waiting.store(1);
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(& seq), FUTEX_WAIT, value, & timeout, nullptr, 0);
+  return;
+}
+
+
+template<class _T> void shm_ring_t<_T>::notify(std::atomic<uint32_t> & seq, std::atomic<uint32_t> & waiting) {
+  seq.fetch_add(1);
+  if(waiting.exchange(0) != 0) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(& seq), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// The rings of a transport NAME are /NAME_events, written by the
+// acquisition, and /NAME_estimates, read by the viewers.
+std::string get_shm_ring_name(const std::string & name, const std::string & stream) {
+  return("/" + name + "_" + stream);
+}
+
+
+// Estimates the events of the input ring in place, straight into the
+// output ring, in batches of at most SHM_BATCH_SIZE events so that every
+// estimate is published within a batch of its event. The valid events are
+// also binned into image, if any. Closes the output ring once the input
+// ring is closed and drained, and returns the number of events.
+//
+// By default the estimator waits for room in the output ring, so that a
+// viewer gets every estimate but, if none reads them, the acquisition
+// stalls once the ring is full. With drop, the estimates that find the
+// output ring full, or closed by its viewer, are only binned into the
+// image and counted in num_dropped. Without an output ring (output is
+// nullptr), the estimates only go to the image.
+std::size_t run_shm_estimator(const estimator_t & estimator, shm_ring_t<PMT_data_t> & input, shm_ring_t<estim_event_t> *output, bool drop, image_t *image, std::size_t & num_dropped) {
+  std::vector<estim_event_t, aligned_allocator<estim_event_t>> scratch(SHM_BATCH_SIZE);
+  std::size_t num_events, num_input, num_output, done, n;
+  const PMT_data_t *PMT_data;
+  estim_event_t *estim_event;
+  bool published;
+  
+  num_events = 0;
+  num_dropped = 0;
+  while((num_input = input.acquire(PMT_data, SHM_BATCH_SIZE)) > 0) {
+    for(done = 0; done < num_input; done += num_output) {
+      num_output = (output != nullptr) ? output->reserve(estim_event, num_input - done, !drop) : 0;
+      if((num_output == 0) && (output != nullptr) && !drop) {
+        throw std::runtime_error("Output ring " + output->get_name() + " closed by its consumer!");
+      }
+      published = num_output > 0;
+      if(!published) {
+        estim_event = scratch.data();
+        num_output = num_input - done;
+        num_dropped += (output != nullptr) ? num_output : 0;
+      }
+      estimator.estimate_batch(PMT_data + done, estim_event, num_output);
+      if(image != nullptr) {
+        for(n = 0; n < num_output; ++n) {
+          image->add(estim_event[n]);
+        }
+      }
+      if(published) {
+        output->commit(num_output);
+      }
+    }
+    input.release(num_input);
+    num_events += num_input;
+  }
+  if(output != nullptr) {
+    output->close();
+  }
+  return(num_events);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _SHM_RING_H
@@ -0,0 +1,115 @@
+#ifndef _SIMD_ENGINE_H
+#define _SIMD_ENGINE_H
+
+#include <cstdint>
+#include "spline.hpp"
+#include "my_defines.h"
+#include "my_types.h"
+#include "estim_core.hpp"
+#include "cpu_dispatch.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Spline coefficients of all the MDRFs with the PMT index last, padded with
+// zeros to SIMD_PMT_STRIDE, as expected by the kernels of cpu_dispatch.h.
+struct simd_calibr_t {
+  float mdrf_coefs[MY + KY][MX + KX][SIMD_PMT_STRIDE];
+};
+
+
+// Float engine running the MDRF evaluation and the likelihood on the kernels
+// selected at startup. The MDRFs are bit-identical to those of the scalar
+// splines; the log is the approximation of log_approx(), so the estimates
+// may differ from those of the float engine in the last bits, but they are
+// the same for every instruction set.
+class simd_engine_t : public spline_engine_t<float> {
+  public:
+    simd_engine_t(const calibr_funct_t & my_calibr_funct, const simd_calibr_t & my_simd_calibr);
+    void eval_mdrf(value_t output[SIMD_PMT_STRIDE], const coord_t & x, const coord_t & y) const;
+    value_t get_log_like(const value_t data[SIMD_PMT_STRIDE], const value_t mdrf[SIMD_PMT_STRIDE]) const;
+    
+  private:
+    const simd_calibr_t & simd_calibr;
+    const cpu_kernels_t & cpu_kernels;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+simd_calibr_t get_simd_calibr(const calibr_funct_t & calibr_funct);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+simd_engine_t::simd_engine_t(const calibr_funct_t & my_calibr_funct, const simd_calibr_t & my_simd_calibr) : spline_engine_t<float>(my_calibr_funct), simd_calibr(my_simd_calibr), cpu_kernels(get_cpu_kernels()) {
+}
+
+
+void simd_engine_t::eval_mdrf(value_t output[SIMD_PMT_STRIDE], const coord_t & x, const coord_t & y) const {
+  float weight[MX][MY];
+  float basis_x[MX];
+  float basis_y[MY];
+  int ell_x, ell_y;
+  int i_x, i_y;
+  int pmt;
+  
+  ell_x = find_span<float, MX, KX>(x);
+  ell_y = find_span<float, MY, KY>(y);
+  if((ell_x < 0) || (ell_y < 0)) {
+    for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+      output[pmt] = float(0);
+    }
+    return;
+  }
+  evaluate_basis<float, MX, KX>(basis_x, x, ell_x);
+  evaluate_basis<float, MY, KY>(basis_y, y, ell_y);
+  for(i_x = 0; i_x < MX; ++i_x) {
+    for(i_y = 0; i_y < MY; ++i_y) {
+      weight[i_x][i_y] = basis_x[i_x] * basis_y[i_y];
+    }
+  }
+  cpu_kernels.eval_spline(output, & simd_calibr.mdrf_coefs[ell_y][ell_x][0], weight);
+  return;
+}
+
+
+float simd_engine_t::get_log_like(const value_t data[SIMD_PMT_STRIDE], const value_t mdrf[SIMD_PMT_STRIDE]) const {
+  return(cpu_kernels.get_log_like(data, mdrf));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+simd_calibr_t get_simd_calibr(const calibr_funct_t & calibr_funct) {
+  float tmp_spline_coefs[MY + KY][MX + KX];
+  simd_calibr_t simd_calibr;
+  int i_x, i_y, pmt;
+  
+  for(i_y = 0; i_y < (MY + KY); ++i_y) {
+    for(i_x = 0; i_x < (MX + KX); ++i_x) {
+      for(pmt = 0; pmt < SIMD_PMT_STRIDE; ++pmt) {
+        simd_calibr.mdrf_coefs[i_y][i_x][pmt] = float(0);
+      }
+    }
+  }
+  for(pmt = 0; pmt < NUM_PMTS; ++pmt) {
+    calibr_funct.mdrf[pmt].get_coefs(tmp_spline_coefs);
+    for(i_y = 0; i_y < (MY + KY); ++i_y) {
+      for(i_x = 0; i_x < (MX + KX); ++i_x) {
+        simd_calibr.mdrf_coefs[i_y][i_x][pmt] = tmp_spline_coefs[i_y][i_x];
+      }
+    }
+  }
+  return(simd_calibr);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _SIMD_ENGINE_H
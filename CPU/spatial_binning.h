@@ -0,0 +1,52 @@
+#ifndef _SPATIAL_BINNING_H
+#define _SPATIAL_BINNING_H
+
+#include <algorithm>
+#include <vector>
+#include "my_defines.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Counting sort of the event indices by the tile that contains their coarse
+// position (in [0, 1] x [0, 1]). Tiles are visited row by row, alternating
+// the direction of consecutive rows, so that neighboring tiles in the
+// output order are also neighbors on the detector.
+void get_binned_order(std::vector<unsigned int> & order, const std::vector<float> & pos_x, const std::vector<float> & pos_y, int num_tiles_x, int num_tiles_y) {
+  std::vector<unsigned int> tile, offset;
+  unsigned int event_index;
+  unsigned int num_events;
+  int tile_x, tile_y;
+  unsigned int sum;
+  int n;
+  
+  num_events = (unsigned int) pos_x.size();
+  tile.resize(num_events);
+  offset.assign(num_tiles_x * num_tiles_y + 1, 0);
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    tile_x = std::min(num_tiles_x - 1, std::max(0, int(pos_x[event_index] * float(num_tiles_x))));
+    tile_y = std::min(num_tiles_y - 1, std::max(0, int(pos_y[event_index] * float(num_tiles_y))));
+    if(tile_y & 1) {
+      tile_x = num_tiles_x - 1 - tile_x;
+    }
+    tile[event_index] = (unsigned int) MAP_2D(num_tiles_x, num_tiles_y, tile_x, tile_y);
+    ++offset[tile[event_index] + 1];
+  }
+  sum = 0;
+  for(n = 0; n <= (num_tiles_x * num_tiles_y); ++n) {
+    sum += offset[n];
+    offset[n] = sum;
+  }
+  order.resize(num_events);
+  for(event_index = 0; event_index < num_events; ++event_index) {
+    order[offset[tile[event_index]]++] = event_index;
+  }
+  return;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif // _SPATIAL_BINNING_H